@@ -0,0 +1,360 @@
+/*
+ * libscclone - The service control commands of scclone as a typed C++ API
+ *
+ * Build main-scclone.cpp with SCCLONE_LIBRARY defined to leave out the command line
+ * entry point, link it into your program and include this header:
+ *
+ *   g++ -std=c++17 -DSCCLONE_LIBRARY -c main-scclone.cpp
+ *   cl /std:c++17 /EHsc /DSCCLONE_LIBRARY /c main-scclone.cpp
+ *
+ * Every function is safe to call from any thread, including several calls for the
+ * same service at once (the SCM serializes those). Nothing is written to std::cout
+ * or std::cerr; failures come back as a Result with the Windows error code and the
+ * step that failed. Changes are recorded in the audit journal as they are for the
+ * command line (SCCLONE_AUDIT). A journal that cannot be written does not fail the
+ * call; Create and Configure add it to their warnings.
+ *
+ * The ...Async variants queue the call on a small pool of library threads and return
+ * at once. The completion callback runs on one of those threads; it may call back
+ * into the library, but should not block for long. Calls still running when the
+ * process exits are abandoned, so wait for the callbacks you need before leaving main.
+ */
+
+#ifndef LIBSCCLONE_H
+#define LIBSCCLONE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <functional>
+#include <optional>
+
+namespace scclone {
+
+/**
+ * The step of an operation that failed
+ */
+enum class Stage : unsigned char {
+    None,           // Operation succeeded
+    Arguments,      // Invalid or missing parameters
+    OpenManager,    // OpenSCManager
+    OpenService,    // OpenService
+    QueryStatus,    // QueryServiceStatusEx
+    QueryConfig,    // QueryServiceConfig / QueryServiceConfig2
+    Create,         // CreateService
+    Start,          // StartService
+    Control,        // ControlService
+    Wait,           // Waiting for the target state
+    Probe,          // Waiting for a readiness probe
+    Delete,         // DeleteService
+    ChangeConfig,   // ChangeServiceConfig
+    ChangeConfig2,  // ChangeServiceConfig2
+    Verify          // Checking service binaries against an allowlist
+};
+
+/**
+ * Outcome of an operation: Windows error code, failing stage and elapsed time
+ * Cheap to copy and compare; FormatResult turns a failure into text
+ */
+struct Result {
+    uint32_t error = 0;                 // ERROR_SUCCESS or the Windows error code of the failure
+    Stage stage = Stage::None;          // Where the operation failed
+    unsigned long long elapsedMs = 0;   // Time from the start of the operation to its outcome
+
+    bool ok() const { return error == 0; }
+};
+
+/**
+ * Service states, with the SCM's SERVICE_* values
+ */
+enum class State : uint32_t {
+    Unknown = 0,
+    Stopped = 1,
+    StartPending = 2,
+    StopPending = 3,
+    Running = 4,
+    ContinuePending = 5,
+    PausePending = 6,
+    Paused = 7
+};
+
+/**
+ * Start types, with the SCM's SERVICE_*_START values
+ */
+enum class StartType : uint32_t {
+    Boot = 0,
+    System = 1,
+    Auto = 2,
+    Demand = 3,
+    Disabled = 4
+};
+
+/**
+ * Error control levels, with the SCM's SERVICE_ERROR_* values
+ */
+enum class ErrorControl : uint32_t {
+    Ignore = 0,
+    Normal = 1,
+    Severe = 2,
+    Critical = 3
+};
+
+/**
+ * Service type flags, with the SCM's SERVICE_* values; combine with |
+ */
+namespace ServiceType {
+constexpr uint32_t KernelDriver = 0x001;
+constexpr uint32_t FileSystemDriver = 0x002;
+constexpr uint32_t RecognizerDriver = 0x008;
+constexpr uint32_t OwnProcess = 0x010;
+constexpr uint32_t ShareProcess = 0x020;
+constexpr uint32_t Interactive = 0x100;
+}
+
+/**
+ * What Query returns: the service's status and main configuration
+ */
+struct QueryResult : Result {
+    std::wstring displayName;
+    std::wstring binaryPath;
+    uint32_t serviceType = 0;           // ServiceType flags
+    StartType startType = StartType::Demand;
+    State state = State::Unknown;
+    uint32_t processId = 0;             // 0 when the service is not running
+    int restartsLastHour = -1;          // From the restart monitor's history; -1 if not asked for or it has none
+    bool restartsSaturated = false;     // The history holds only part of the hour, so the count is a minimum
+};
+
+/**
+ * A service to create
+ */
+struct ServiceDefinition {
+    std::wstring name;                  // Required
+    std::wstring binaryPath;            // Required
+    std::wstring displayName;           // Defaults to the name
+    uint32_t serviceType = ServiceType::OwnProcess;
+    StartType startType = StartType::Demand;
+    bool delayedAutoStart = false;      // With StartType::Auto
+    ErrorControl errorControl = ErrorControl::Normal;
+    std::wstring loadOrderGroup;
+    bool requestTag = false;            // Ask the SCM for a tag within the load order group
+    std::vector<std::wstring> dependencies; // Service names, or group names prefixed with '+'
+    std::wstring account;               // Empty for LocalSystem
+    std::wstring password;
+    std::wstring description;
+};
+
+/**
+ * What Create returns
+ * A service whose description or delayed start could not be set is still created;
+ * warnings says what was left out.
+ */
+struct CreateResult : Result {
+    uint32_t tagId = 0;                 // Set when requestTag was given
+    std::vector<std::string> warnings;
+};
+
+/**
+ * Changes to a service's configuration; settings left empty are not changed
+ */
+struct ServiceConfigChange {
+    std::optional<std::wstring> displayName;
+    std::optional<uint32_t> serviceType;
+    std::optional<StartType> startType;
+    std::optional<bool> delayedAutoStart;   // Turn delayed start on or off (use with StartType::Auto)
+    std::optional<ErrorControl> errorControl;
+    std::optional<std::wstring> binaryPath;
+    std::optional<std::wstring> loadOrderGroup;
+    std::optional<std::vector<std::wstring>> dependencies;
+    std::optional<std::wstring> account;
+    std::optional<std::wstring> password;
+    std::optional<std::wstring> description;
+};
+
+/**
+ * What Configure returns; warnings as for CreateResult
+ */
+struct ConfigResult : Result {
+    std::vector<std::string> warnings;
+};
+
+/**
+ * How Start waits for a service
+ */
+struct StartOptions {
+    std::vector<std::wstring> arguments;    // Passed to the service's ServiceMain
+    std::wstring probe;                     // Readiness probe: tcp:<port>, file:<path> or pipe:<name>; empty for none
+    uint32_t timeoutMs = 30000;             // Time allowed to become ready
+};
+
+/**
+ * What Start and Stop return
+ */
+struct StateChangeResult : Result {
+    State state = State::Unknown;       // Last state seen
+    bool requested = false;             // The start request or stop control was accepted
+    bool alreadyInState = false;        // Nothing to do (Stop on a stopped service)
+    unsigned long long timeToStateMs = 0;   // From the request to RUNNING or STOPPED
+    unsigned long long timeToReadyMs = 0;   // From the request to ready: RUNNING and, with a probe, the probe passing
+};
+
+/**
+ * A service and the state to wait for
+ */
+struct WaitTarget {
+    std::wstring serviceName;
+    State state = State::Running;
+};
+
+/**
+ * What Wait returns for each service
+ * A service that was still on its way when another one failed has error
+ * ERROR_OPERATION_ABORTED; one that missed the deadline has ERROR_SERVICE_REQUEST_TIMEOUT.
+ */
+struct WaitResult : Result {
+    std::wstring serviceName;
+    State target = State::Running;
+    State state = State::Unknown;       // Last state seen
+    unsigned long long timeToStateMs = 0;   // From the start of the wait to the poll that saw the target state
+};
+
+/**
+ * Failure actions, with the SCM's SC_ACTION_* values
+ */
+enum class FailureAction : uint32_t {
+    None = 0,
+    Restart = 1,
+    Reboot = 2,
+    RunCommand = 3
+};
+
+/**
+ * One step of a failure policy: what to do on the Nth failure, and after how long
+ */
+struct FailureStep {
+    FailureAction action = FailureAction::None;
+    uint32_t delayMs = 0;
+};
+
+/**
+ * A failure policy; settings left empty are not changed
+ */
+struct FailureSettings {
+    std::optional<std::vector<FailureStep>> actions;    // An empty list clears the actions
+    uint32_t resetPeriodSeconds = 86400;                // Goes with actions
+    std::optional<std::wstring> command;                // Run by FailureAction::RunCommand
+    std::optional<std::wstring> rebootMessage;
+    std::optional<bool> nonCrashFailures;               // Also act when a service stops with an error
+};
+
+/**
+ * What SetFailureActions returns for each service
+ */
+struct FailureActionsResult : Result {
+    std::wstring serviceName;
+    std::vector<std::string> changes;   // "setting: old -> new"; empty if the service already had the policy
+};
+
+/**
+ * Formats a failed result as one line
+ *
+ * @param result The result
+ * @return "Failed to <stage>: <message> (error N, after X ms)"
+ */
+std::string FormatResult(const Result& result);
+
+/**
+ * Reads a service's status and configuration
+ *
+ * @param serviceName Name of the service
+ * @param withRestartHistory Also fill restartsLastHour, which reads the monitor's whole history file
+ * @return The service's details, or the failure
+ */
+QueryResult Query(const std::wstring& serviceName, bool withRestartHistory = false);
+
+/**
+ * Creates a service
+ *
+ * @param definition The service to create
+ * @return The tag ID and warnings, or the failure
+ */
+CreateResult Create(const ServiceDefinition& definition);
+
+/**
+ * Changes a service's configuration
+ *
+ * @param serviceName Name of the service
+ * @param change The settings to change
+ * @return Warnings, or the failure
+ */
+ConfigResult Configure(const std::wstring& serviceName, const ServiceConfigChange& change);
+
+/**
+ * Starts a service and waits for it to become ready
+ *
+ * @param serviceName Name of the service
+ * @param options Arguments, readiness probe and timeout
+ * @return Time to RUNNING (and to ready), or the failure
+ */
+StateChangeResult Start(const std::wstring& serviceName, const StartOptions& options = StartOptions());
+
+/**
+ * Stops a service and waits for it to reach STOPPED
+ *
+ * @param serviceName Name of the service
+ * @param timeoutMs Time allowed to stop
+ * @return Time to STOPPED, or the failure
+ */
+StateChangeResult Stop(const std::wstring& serviceName, uint32_t timeoutMs = 30000);
+
+/**
+ * Marks a service for deletion
+ *
+ * @param serviceName Name of the service
+ * @return Success, or the failure
+ */
+Result Delete(const std::wstring& serviceName);
+
+/**
+ * Applies a failure policy to a set of services in parallel
+ * Only settings that differ are changed, and every change is read back and checked.
+ *
+ * @param serviceNames Names of the services
+ * @param settings The policy to apply
+ * @param concurrency Maximum number of services configured at once (0 for the default)
+ * @return One result per service, in the order given
+ */
+std::vector<FailureActionsResult> SetFailureActions(const std::vector<std::wstring>& serviceNames,
+    const FailureSettings& settings, size_t concurrency = 0);
+
+/**
+ * Waits, without sending any control, until every service is in its target state
+ * All services are polled from one thread on a shared timer wheel, each at a rate
+ * that follows its wait hint. The wait ends as soon as every target holds, any
+ * service fails (it cannot be queried, or drops to STOPPED after it was seen
+ * running or pending while another state is wanted), or the timeout passes.
+ *
+ * @param targets The services and their target states
+ * @param timeoutMs Deadline for the whole wait
+ * @return One result per target, in the order given
+ */
+std::vector<WaitResult> Wait(const std::vector<WaitTarget>& targets, uint32_t timeoutMs = 30000);
+
+void QueryAsync(const std::wstring& serviceName, std::function<void(const QueryResult&)> done,
+    bool withRestartHistory = false);
+void CreateAsync(const ServiceDefinition& definition, std::function<void(const CreateResult&)> done);
+void ConfigureAsync(const std::wstring& serviceName, const ServiceConfigChange& change,
+    std::function<void(const ConfigResult&)> done);
+void StartAsync(const std::wstring& serviceName, const StartOptions& options,
+    std::function<void(const StateChangeResult&)> done);
+void StopAsync(const std::wstring& serviceName, uint32_t timeoutMs, std::function<void(const StateChangeResult&)> done);
+void DeleteAsync(const std::wstring& serviceName, std::function<void(const Result&)> done);
+void WaitAsync(const std::vector<WaitTarget>& targets, uint32_t timeoutMs,
+    std::function<void(const std::vector<WaitResult>&)> done);
+void SetFailureActionsAsync(const std::vector<std::wstring>& serviceNames, const FailureSettings& settings,
+    size_t concurrency, std::function<void(const std::vector<FailureActionsResult>&)> done);
+
+} // namespace scclone
+
+#endif // LIBSCCLONE_H
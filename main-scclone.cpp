@@ -22,11 +22,304 @@ scclone.exe create /servicename TestService /binpath "C:\Users\User\Desktop\test
 */
 
 
+#ifdef _WIN32
+#include <winsock2.h>   // Sockets for TCP readiness probes (must come before windows.h)
 #include <windows.h>    // Windows API functions and data types
+#define PSAPI_VERSION 2 // GetProcessMemoryInfo from kernel32, no psapi.lib needed
+#include <psapi.h>      // Working set for the top command
+#include <tlhelp32.h>   // Thread counts for the top command
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h> // Sockets for TCP readiness probes
+#include <sys/stat.h>   // stat() for file/socket readiness probes
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>     // /proc/<pid>/fd for the top command
+#include <pwd.h>        // Caller name for the audit journal
+#include <sys/mman.h>   // Shared status cache
+#include <termios.h>    // Reading a password without echo
+#include <locale.h>     // UTF-8 locale for the bench convert baseline
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#include <cerrno>
+#endif
 #include <iostream>     // For input/output stream operations
 #include <string>       // For string handling
 #include <vector>       // For dynamic arrays
 #include <map>          // For key-value storage
+#include <algorithm>    // For std::remove
+#include <thread>       // For running readiness probes alongside the state wait
+#include <atomic>       // For sharing probe results between threads
+#include <mutex>        // For the probe/state-wait condition variable
+#include <condition_variable>
+#include <chrono>
+#include <cwchar>       // For WCHAR_MAX
+#include <cwctype>      // For towlower when matching service names
+#include <memory>       // For sharing metrics snapshots between threads, owning backends
+#include <set>          // For service name selections
+#include <functional>   // For the recursive boot schedule walk
+#include <climits>      // For ULLONG_MAX
+#include <cstdio>       // For history, snapshot and latency files
+#include <ctime>        // For monitor timestamps
+#include <random>       // For the stress operation mix
+#include <sstream>      // For discarding command output in simulations
+#include <deque>        // For the library's queue of async calls
+#include <optional>     // For the library's optional settings
+
+#include "libscclone.h" // The typed API the commands are built on
+
+// C++20 coroutines, when the compiler has them, run bulk service operations on an event loop
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <deque>
+#include <queue>
+#define SCCLONE_HAVE_COROUTINES
+#endif
+#endif
+
+// SSE2 is baseline on x64; used for the ASCII fast path in wide/UTF-8 conversion
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SCCLONE_HAVE_SSE2
+#endif
+
+// Socket handles differ between Winsock and POSIX
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+#define CloseSocket closesocket
+#else
+typedef int SocketHandle;
+#define INVALID_SOCKET (-1)
+#define CloseSocket close
+#endif
+
+//=============================================================================
+// Portability layer - Outside Windows there is no SCM, so scclone runs against the
+// simulated SCM only. These are the Win32 types, constants and helpers it needs.
+//=============================================================================
+
+#ifndef _WIN32
+#include <cstdint>
+#include <cstring>
+
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef BYTE* LPBYTE;
+typedef DWORD* LPDWORD;
+typedef void* LPVOID;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef unsigned long long ULONGLONG;
+typedef struct SC_HANDLE__* SC_HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define ZeroMemory(p, n) memset((p), 0, (n))
+
+// Error codes (same values as winerror.h)
+#define ERROR_SUCCESS                    0
+#define ERROR_FILE_NOT_FOUND             2
+#define ERROR_WRITE_FAULT                29
+#define ERROR_ACCESS_DENIED              5
+#define ERROR_INVALID_HANDLE             6
+#define ERROR_INVALID_DATA               13
+#define ERROR_NOT_SUPPORTED              50
+#define ERROR_INVALID_PARAMETER          87
+#define ERROR_SEM_TIMEOUT                121
+#define ERROR_INSUFFICIENT_BUFFER        122
+#define ERROR_INVALID_NAME               123
+#define ERROR_INVALID_LEVEL              124
+#define ERROR_ALREADY_EXISTS             183
+#define ERROR_PIPE_BUSY                  231
+#define ERROR_MORE_DATA                  234
+#define ERROR_OPERATION_ABORTED          995
+#define WAIT_TIMEOUT                     258
+#define ERROR_DEPENDENT_SERVICES_RUNNING 1051
+#define ERROR_INVALID_SERVICE_CONTROL    1052
+#define ERROR_SERVICE_REQUEST_TIMEOUT    1053
+#define ERROR_SERVICE_DATABASE_LOCKED    1055
+#define ERROR_SERVICE_ALREADY_RUNNING    1056
+#define ERROR_INVALID_SERVICE_ACCOUNT    1057
+#define ERROR_SERVICE_DISABLED           1058
+#define ERROR_CIRCULAR_DEPENDENCY        1059
+#define ERROR_SERVICE_DOES_NOT_EXIST     1060
+#define ERROR_SERVICE_CANNOT_ACCEPT_CTRL 1061
+#define ERROR_SERVICE_NOT_ACTIVE         1062
+#define ERROR_SERVICE_SPECIFIC_ERROR     1066
+#define ERROR_PROCESS_ABORTED            1067
+#define ERROR_SERVICE_DEPENDENCY_FAIL    1068
+#define ERROR_SERVICE_MARKED_FOR_DELETE  1072
+#define ERROR_SERVICE_EXISTS             1073
+#define ERROR_SERVICE_DEPENDENCY_DELETED 1075
+#define ERROR_DUPLICATE_SERVICE_NAME     1078
+#define ERROR_TIMEOUT                    1460
+#define ERROR_RPC_SERVER_UNAVAILABLE     1722
+
+// Access rights
+#define DELETE                          0x00010000
+#define SC_MANAGER_CONNECT              0x0001
+#define SC_MANAGER_CREATE_SERVICE       0x0002
+#define SC_MANAGER_ENUMERATE_SERVICE    0x0004
+#define SC_MANAGER_ALL_ACCESS           0xF003F
+#define SERVICE_QUERY_CONFIG            0x0001
+#define SERVICE_CHANGE_CONFIG           0x0002
+#define SERVICE_QUERY_STATUS            0x0004
+#define SERVICE_ENUMERATE_DEPENDENTS    0x0008
+#define SERVICE_START                   0x0010
+#define SERVICE_STOP                    0x0020
+#define SERVICE_PAUSE_CONTINUE          0x0040
+#define SERVICE_INTERROGATE             0x0080
+#define SERVICE_USER_DEFINED_CONTROL    0x0100
+#define SERVICE_ALL_ACCESS              0xF01FF
+
+// Service types, start types and error control
+#define SERVICE_KERNEL_DRIVER           0x00000001
+#define SERVICE_FILE_SYSTEM_DRIVER      0x00000002
+#define SERVICE_RECOGNIZER_DRIVER       0x00000008
+#define SERVICE_WIN32_OWN_PROCESS       0x00000010
+#define SERVICE_WIN32_SHARE_PROCESS     0x00000020
+#define SERVICE_WIN32                   0x00000030
+#define SERVICE_INTERACTIVE_PROCESS     0x00000100
+#define SERVICE_BOOT_START              0
+#define SERVICE_SYSTEM_START            1
+#define SERVICE_AUTO_START              2
+#define SERVICE_DEMAND_START            3
+#define SERVICE_DISABLED                4
+#define SERVICE_ERROR_IGNORE            0
+#define SERVICE_ERROR_NORMAL            1
+#define SERVICE_ERROR_SEVERE            2
+#define SERVICE_ERROR_CRITICAL          3
+#define SERVICE_NO_CHANGE               0xFFFFFFFF
+
+// States, controls and accepted controls
+#define SERVICE_STOPPED                 1
+#define SERVICE_START_PENDING           2
+#define SERVICE_STOP_PENDING            3
+#define SERVICE_RUNNING                 4
+#define SERVICE_CONTINUE_PENDING        5
+#define SERVICE_PAUSE_PENDING           6
+#define SERVICE_PAUSED                  7
+#define SERVICE_ACTIVE                  1
+#define SERVICE_INACTIVE                2
+#define SERVICE_STATE_ALL               3
+#define SERVICE_CONTROL_STOP            1
+#define SERVICE_CONTROL_PAUSE           2
+#define SERVICE_CONTROL_CONTINUE        3
+#define SERVICE_CONTROL_INTERROGATE     4
+#define SERVICE_CONTROL_PARAMCHANGE     6
+#define SERVICE_ACCEPT_STOP             0x0001
+#define SERVICE_ACCEPT_PAUSE_CONTINUE   0x0002
+#define SERVICE_ACCEPT_SHUTDOWN         0x0004
+#define SERVICE_ACCEPT_PARAMCHANGE      0x0008
+#define SERVICE_ACCEPT_PRESHUTDOWN      0x0100
+
+// ChangeServiceConfig2 / QueryServiceConfig2 levels and failure actions
+#define SERVICE_CONFIG_DESCRIPTION              1
+#define SERVICE_CONFIG_FAILURE_ACTIONS          2
+#define SERVICE_CONFIG_DELAYED_AUTO_START_INFO  3
+#define SERVICE_CONFIG_FAILURE_ACTIONS_FLAG     4
+#define SERVICE_CONFIG_PRESHUTDOWN_INFO         7
+#define SERVICE_CONFIG_TRIGGER_INFO             8
+#define SC_ACTION_NONE                  0
+#define SC_ACTION_RESTART               1
+#define SC_ACTION_REBOOT                2
+#define SC_ACTION_RUN_COMMAND           3
+
+// Trigger-start types, actions and data types
+#define SERVICE_TRIGGER_TYPE_DEVICE_INTERFACE_ARRIVAL       1
+#define SERVICE_TRIGGER_TYPE_IP_ADDRESS_AVAILABILITY        2
+#define SERVICE_TRIGGER_TYPE_DOMAIN_JOIN                    3
+#define SERVICE_TRIGGER_TYPE_FIREWALL_PORT_EVENT            4
+#define SERVICE_TRIGGER_TYPE_GROUP_POLICY                   5
+#define SERVICE_TRIGGER_TYPE_NETWORK_ENDPOINT               6
+#define SERVICE_TRIGGER_TYPE_CUSTOM_SYSTEM_STATE_CHANGE     7
+#define SERVICE_TRIGGER_TYPE_CUSTOM                         20
+#define SERVICE_TRIGGER_ACTION_SERVICE_START                1
+#define SERVICE_TRIGGER_ACTION_SERVICE_STOP                 2
+#define SERVICE_TRIGGER_DATA_TYPE_BINARY                    1
+#define SERVICE_TRIGGER_DATA_TYPE_STRING                    2
+#define SERVICE_TRIGGER_DATA_TYPE_LEVEL                     3
+#define SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ANY               4
+#define SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ALL               5
+
+typedef enum { SC_STATUS_PROCESS_INFO = 0 } SC_STATUS_TYPE;
+typedef enum { SC_ENUM_PROCESS_INFO = 0 } SC_ENUM_TYPE;
+
+typedef struct {
+    DWORD dwServiceType, dwCurrentState, dwControlsAccepted, dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode, dwCheckPoint, dwWaitHint;
+} SERVICE_STATUS, *LPSERVICE_STATUS;
+
+typedef struct {
+    DWORD dwServiceType, dwCurrentState, dwControlsAccepted, dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode, dwCheckPoint, dwWaitHint, dwProcessId, dwServiceFlags;
+} SERVICE_STATUS_PROCESS, *LPSERVICE_STATUS_PROCESS;
+
+typedef struct {
+    DWORD dwServiceType, dwStartType, dwErrorControl;
+    LPWSTR lpBinaryPathName, lpLoadOrderGroup;
+    DWORD dwTagId;
+    LPWSTR lpDependencies, lpServiceStartName, lpDisplayName;
+} QUERY_SERVICE_CONFIGW, *LPQUERY_SERVICE_CONFIGW;
+
+typedef struct { LPWSTR lpDescription; } SERVICE_DESCRIPTIONW, *LPSERVICE_DESCRIPTIONW;
+typedef DWORD SC_ACTION_TYPE;
+typedef struct { SC_ACTION_TYPE Type; DWORD Delay; } SC_ACTION;
+typedef struct {
+    DWORD dwResetPeriod;
+    LPWSTR lpRebootMsg, lpCommand;
+    DWORD cActions;
+    SC_ACTION* lpsaActions;
+} SERVICE_FAILURE_ACTIONSW, *LPSERVICE_FAILURE_ACTIONSW;
+typedef struct { BOOL fFailureActionsOnNonCrashFailures; } SERVICE_FAILURE_ACTIONS_FLAG;
+typedef struct { BOOL fDelayedAutostart; } SERVICE_DELAYED_AUTO_START_INFO;
+typedef struct { DWORD dwPreshutdownTimeout; } SERVICE_PRESHUTDOWN_INFO;
+typedef struct {
+    uint32_t Data1;
+    unsigned short Data2, Data3;
+    unsigned char Data4[8];
+} GUID;
+typedef struct {
+    DWORD dwDataType;
+    DWORD cbData;
+    BYTE* pData;
+} SERVICE_TRIGGER_SPECIFIC_DATA_ITEM, *PSERVICE_TRIGGER_SPECIFIC_DATA_ITEM;
+typedef struct {
+    DWORD dwTriggerType, dwAction;
+    GUID* pTriggerSubtype;
+    DWORD cDataItems;
+    PSERVICE_TRIGGER_SPECIFIC_DATA_ITEM pDataItems;
+} SERVICE_TRIGGER, *PSERVICE_TRIGGER;
+typedef struct {
+    DWORD cTriggers;
+    PSERVICE_TRIGGER pTriggers;
+    BYTE* pReserved;
+} SERVICE_TRIGGER_INFO, *PSERVICE_TRIGGER_INFO;
+typedef struct {
+    LPWSTR lpServiceName, lpDisplayName;
+    SERVICE_STATUS_PROCESS ServiceStatusProcess;
+} ENUM_SERVICE_STATUS_PROCESSW, *LPENUM_SERVICE_STATUS_PROCESSW;
+
+// Per-thread last error, as on Windows
+static thread_local DWORD g_lastError = 0;
+inline DWORD GetLastError() { return g_lastError; }
+inline void SetLastError(DWORD error) { g_lastError = error; }
+
+inline ULONGLONG GetTickCount64() {
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline void Sleep(DWORD milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+inline DWORD GetCurrentProcessId() { return (DWORD)getpid(); }
+#endif
 
 
 
@@ -42,70 +335,315 @@ void PrintUsage() {
     std::cout << "SC Clone - Service Controller utility\n";
     std::cout << "Usage: scclone <command> [options]\n\n";
     std::cout << "Supported commands:\n";
-    std::cout << "  query         - Queries service status\n";
-    std::cout << "  create        - Creates a service\n";
+    std::cout << "  query         - Queries service status (all services if no name is given) [/cached [/max-age <sec>]]\n";
+    std::cout << "  create        - Creates a service, or N services from a template with {i} [/template N] [/parallel N]\n";
     std::cout << "  qdescription  - Queries service description\n";
-    std::cout << "  start         - Starts a service\n";
-    std::cout << "  stop          - Stops a service\n";
-    std::cout << "  delete        - Deletes a service\n";
+    std::cout << "  start         - Starts a service [args...] [/probe tcp:<port>|file:<path>|pipe:<name>] [/timeout <sec>]\n";
+    std::cout << "  stop          - Stops a service, or several services / patterns at once [/timeout <sec>]\n";
+    std::cout << "  pause         - Pauses services or patterns [/wait] [/timeout <sec>] [/parallel N]\n";
+    std::cout << "  continue      - Continues paused services or patterns [/wait] [/timeout <sec>] [/parallel N]\n";
+    std::cout << "  interrogate   - Asks services to report their current status [/parallel N]\n";
+    std::cout << "  control       - Sends paramchange or a custom code (128-255) to services: control <code> <service...>\n";
+    std::cout << "  delete        - Deletes a service, or several services / patterns at once [/parallel N]\n";
     std::cout << "  config        - Modifies service configuration\n";
-    std::cout << "  failure       - Sets service failure actions\n";
+    std::cout << "  failure       - Sets failure actions on services or patterns (svc*) [/reset] [/actions] [/command] [/reboot] [/flag]\n";
+    std::cout << "  qtriggerinfo  - Shows trigger-start configuration of services or patterns (all with triggers if none given) [/all]\n";
+    std::cout << "  triggerinfo   - Sets triggers: triggerinfo <service...> start/networkon start/namedpipe/<name> ...|delete [/start demand]\n";
+    std::cout << "  trigger-report - Memory and startup saved by moving idle auto-start services to trigger start [/interval <sec>] [/cpu <pct>]\n";
+    std::cout << "  qpreshutdown  - Shows preshutdown timeouts of services or patterns (running services that accept it if none given) [/all]\n";
+    std::cout << "  preshutdown   - Sets the preshutdown timeout: preshutdown <service...> /timeout <sec> [/parallel N]\n";
+    std::cout << "  shutdown-plan - Stops running services in dependency order and times each stop [/exclude a,b] [/deadline <sec>] [/run]\n";
+    std::cout << "  wait          - Waits for services to reach states without controlling them: wait <svc[=state]...> [/state] [/timeout <sec>]\n";
+    std::cout << "  verify-binaries - SHA-256 of service executables, diffed against an allowlist [/allowlist <file>] [/write-allowlist <file>]\n";
+    std::cout << "  rotate-account - New password for every service run as an account, then restarts: rotate-account <account> [/password-file]\n";
+    std::cout << "  snapshot      - Exports every service's configuration as a snapshot file: snapshot <file>\n";
+    std::cout << "  analyze-boot  - Auto-start critical path and start type advice [/config <snapshot>] [/latencies <file>] [/default <ms>]\n";
+    std::cout << "  metrics       - Prints service health in Prometheus format [service...] [/serve <port>] [/interval <sec>]\n";
+    std::cout << "  monitor       - Watches for restarts and crash loops [service...] [/interval <sec>] [/window <sec>] [/threshold N]\n";
+    std::cout << "  simulate      - Runs a plan of commands against a snapshot and predicts the outcome: simulate <snapshot> <plan>\n";
+    std::cout << "  audit         - Shows the journal of service changes made by scclone [/service] [/op] [/failed] [/last N] [/json]\n";
+    std::cout << "  stress        - Loads the SCM with a query/config/start/stop mix and reports latency percentiles [/mix] [/rate] [/duration]\n";
+    std::cout << "  cache         - Keeps a shared memory status table for 'query /cached' [/file] [/interval <sec>] [/slots N]\n";
+    std::cout << "  top           - Per-process CPU, memory, handles and threads of services [/interval <sec>] [/sort cpu|mem] [/json]\n";
+    std::cout << "  bench convert - Benchmarks UTF-8 output conversion on the service list [/iterations N]\n";
+    std::cout << "  bench ops     - Benchmarks bulk start/query/stop on a simulated SCM [/services N] [/start-ms] [/stop-ms] [/loops K]\n";
+    std::cout << "\nCommands that take services also take /where <expression> to select them, e.g.\n";
+    std::cout << "  scclone stop /where state=running and start=demand and binpath~\"D:\\apps\\*\"\n";
+}
+
+/**
+ * Appends a wide string to a UTF-8 buffer
+ * Service names, paths and display names are almost always ASCII, so runs of ASCII
+ * are narrowed 16 code units at a time with SSE2 and only the remainder starting at
+ * the first non-ASCII unit goes through the full UTF-8 conversion.
+ *
+ * @param out Buffer to append to
+ * @param wstr Pointer to the wide characters
+ * @param length Number of wide characters
+ */
+void AppendWideAsUtf8(std::string& out, const wchar_t* wstr, size_t length) {
+    size_t base = out.size();
+    out.resize(base + length); // ASCII output is exactly one byte per unit
+    char* dest = &out[base];
+    size_t i = 0;
+
+#ifdef SCCLONE_HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+#if WCHAR_MAX <= 0xFFFF
+    // UTF-16: 2 x 8 units per iteration, ASCII if no unit has bits above 0x7F
+    const __m128i highMask = _mm_set1_epi16((short)0xFF80);
+    for (; i + 16 <= length; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(wstr + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(wstr + i + 8));
+        __m128i high = _mm_and_si128(_mm_or_si128(lo, hi), highMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF) break;
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+    }
+#else
+    // UTF-32: 4 x 4 units per iteration
+    const __m128i highMask = _mm_set1_epi32((int)0xFFFFFF80);
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(wstr + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(wstr + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(wstr + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(wstr + i + 12));
+        __m128i high = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), highMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(high, zero)) != 0xFFFF) break;
+        __m128i ab = _mm_packs_epi32(a, b);
+        __m128i cd = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(ab, cd));
+    }
+#endif
+#endif
+
+    // Scalar ASCII tail (or the block where a non-ASCII unit was found)
+    for (; i < length && (unsigned)wstr[i] < 0x80; i++) {
+        dest[i] = (char)wstr[i];
+    }
+    if (i == length) return;
+
+    // Non-ASCII remainder: fall back to the full conversion
+    out.resize(base + i);
+    const wchar_t* rest = wstr + i;
+    int restLength = (int)(length - i);
+#ifdef _WIN32
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, rest, restLength, NULL, 0, NULL, NULL);
+    size_t offset = out.size();
+    out.resize(offset + size_needed);
+    WideCharToMultiByte(CP_UTF8, 0, rest, restLength, &out[offset], size_needed, NULL, NULL);
+#else
+    for (int k = 0; k < restLength; k++) {
+        unsigned long cp = (unsigned long)rest[k];
+        if (cp < 0x80) {
+            out.push_back((char)cp);
+        }
+        else if (cp < 0x800) {
+            out.push_back((char)(0xC0 | (cp >> 6)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000) {
+            out.push_back((char)(0xE0 | (cp >> 12)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+        else {
+            out.push_back((char)(0xF0 | (cp >> 18)));
+            out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+    }
+#endif
 }
 
 /**
- * Converts a standard string to a wide string
- * This is necessary for many Windows API functions that require wide strings (UTF-16)
+ * Converts a standard (UTF-8) string to a wide string
+ * Used at the input boundary; everything inside the program is wide
  *
  * @param str The string to convert
  * @return The equivalent wide string
  */
 std::wstring StringToWString(const std::string& str) {
     if (str.empty()) return std::wstring();
+
+    // ASCII fast path: widen byte by byte without a sizing pass
+    size_t i = 0;
+    std::wstring wstr(str.size(), 0);
+    for (; i < str.size() && (unsigned char)str[i] < 0x80; i++) {
+        wstr[i] = (wchar_t)str[i];
+    }
+    if (i == str.size()) return wstr;
+    wstr.resize(i);
+
+#ifdef _WIN32
     // Calculate the required buffer size
-    int size_needed = MultiByteToWideChar(CP_UTF8, 0, &str[0], (int)str.size(), NULL, 0);
-    std::wstring wstr(size_needed, 0);
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, &str[i], (int)(str.size() - i), NULL, 0);
+    wstr.resize(i + size_needed);
     // Perform the actual conversion
-    MultiByteToWideChar(CP_UTF8, 0, &str[0], (int)str.size(), &wstr[0], size_needed);
+    MultiByteToWideChar(CP_UTF8, 0, &str[i], (int)(str.size() - i), &wstr[i], size_needed);
+#else
+    while (i < str.size()) {
+        unsigned char c = (unsigned char)str[i];
+        int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        unsigned long cp = extra ? (c & (0x3F >> extra)) : c;
+        for (int k = 1; k <= extra && i + k < str.size(); k++) {
+            cp = (cp << 6) | ((unsigned char)str[i + k] & 0x3F);
+        }
+        wstr.push_back((wchar_t)cp);
+        i += extra + 1;
+    }
+#endif
     return wstr;
 }
 
 /**
- * Converts a wide string to a standard string
- * Used to convert Windows API wide string results back to standard strings
+ * Converts a wide string to a standard (UTF-8) string
+ * Used at the output boundary
  *
  * @param wstr The wide string to convert
  * @return The equivalent standard string
  */
 std::string WStringToString(const std::wstring& wstr) {
+    std::string str;
+    AppendWideAsUtf8(str, wstr.data(), wstr.size());
+    return str;
+}
+
+#ifndef _WIN32
+/**
+ * Returns a UTF-8 locale for the C library's converters, or 0 if the system has none
+ * Created once; the process locale is left alone
+ */
+locale_t SystemUtf8Locale() {
+    static locale_t locale = [] {
+        locale_t found = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+        if (!found) found = newlocale(LC_CTYPE_MASK, "en_US.UTF-8", (locale_t)0);
+        return found;
+    }();
+    return locale;
+}
+#endif
+
+/**
+ * Returns true if the system has a wide-to-UTF-8 converter for WStringToStringFull
+ * Always true on Windows; elsewhere a UTF-8 locale must be installed
+ */
+bool HaveSystemUtf8Converter() {
+#ifdef _WIN32
+    return true;
+#else
+    return SystemUtf8Locale() != (locale_t)0;
+#endif
+}
+
+/**
+ * Converts a wide string to UTF-8 with the system converter's two passes:
+ * WideCharToMultiByte on Windows, wcsrtombs in a UTF-8 locale elsewhere
+ * Kept as the baseline for "bench convert"; check HaveSystemUtf8Converter first
+ *
+ * @param wstr The wide string to convert
+ * @return The equivalent standard string
+ */
+std::string WStringToStringFull(const std::wstring& wstr) {
     if (wstr.empty()) return std::string();
+#ifdef _WIN32
     // Calculate the required buffer size
     int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), NULL, 0, NULL, NULL);
     std::string str(size_needed, 0);
     // Perform the actual conversion
     WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), &str[0], size_needed, NULL, NULL);
     return str;
+#else
+    locale_t previous = uselocale(SystemUtf8Locale());
+    // Calculate the required buffer size
+    const wchar_t* source = wstr.c_str();
+    mbstate_t state = {};
+    size_t size_needed = wcsrtombs(NULL, &source, 0, &state);
+    std::string str;
+    if (size_needed != (size_t)-1) {
+        // Perform the actual conversion
+        str.resize(size_needed);
+        source = wstr.c_str();
+        state = mbstate_t();
+        wcsrtombs(&str[0], &source, size_needed, &state);
+    }
+    uselocale(previous);
+    // Characters the converter rejects (lone surrogates) take the scalar path
+    return size_needed != (size_t)-1 ? str : WStringToString(wstr);
+#endif
+}
+
+/**
+ * Lowercases a service name; the SCM treats service names case-insensitively
+ *
+ * @param name The service name
+ * @return Lowercase copy of the name
+ */
+std::wstring ToLowerServiceName(const std::wstring& name) {
+    std::wstring lower = name;
+    for (auto& c : lower) c = (wchar_t)towlower(c);
+    return lower;
 }
 
 /**
- * Gets a human-readable error message for the last Windows API error
- * Used to provide meaningful error messages when API calls fail
+ * Gets a human-readable error message for a Windows error code
+ * Only called when a result is actually rendered, so callers that just classify
+ * failures never pay for FormatMessage and its allocation
  *
+ * @param error The Windows error code
  * @return String containing the error message
  */
-std::string GetLastErrorAsString() {
-    DWORD error = GetLastError();
+std::string FormatErrorMessage(DWORD error) {
     if (error == 0) return "No error";
 
+#ifndef _WIN32
+    // No system message table outside Windows; cover the codes the SCM returns
+    switch (error) {
+    case ERROR_FILE_NOT_FOUND: return "The system cannot find the file specified.";
+    case ERROR_ACCESS_DENIED: return "Access is denied.";
+    case ERROR_WRITE_FAULT: return "The system cannot write to the specified device.";
+    case ERROR_INVALID_HANDLE: return "The handle is invalid.";
+    case ERROR_INVALID_DATA: return "The data is invalid.";
+    case ERROR_INVALID_PARAMETER: return "The parameter is incorrect.";
+    case ERROR_INSUFFICIENT_BUFFER: return "The data area passed to a system call is too small.";
+    case ERROR_OPERATION_ABORTED: return "The I/O operation has been aborted because of either a thread exit or an application request.";
+    case ERROR_INVALID_NAME: return "The filename, directory name, or volume label syntax is incorrect.";
+    case ERROR_DEPENDENT_SERVICES_RUNNING: return "A stop control has been sent to a service that other running services are dependent on.";
+    case ERROR_INVALID_SERVICE_CONTROL: return "The requested control is not valid for this service.";
+    case ERROR_SERVICE_REQUEST_TIMEOUT: return "The service did not respond to the start or control request in a timely fashion.";
+    case ERROR_SERVICE_DATABASE_LOCKED: return "The service database is locked.";
+    case ERROR_SERVICE_ALREADY_RUNNING: return "An instance of the service is already running.";
+    case ERROR_SERVICE_DISABLED: return "The service cannot be started, either because it is disabled or because it has no enabled devices associated with it.";
+    case ERROR_CIRCULAR_DEPENDENCY: return "Circular service dependency was specified.";
+    case ERROR_SERVICE_DOES_NOT_EXIST: return "The specified service does not exist as an installed service.";
+    case ERROR_SERVICE_CANNOT_ACCEPT_CTRL: return "The service cannot accept control messages at this time.";
+    case ERROR_SERVICE_NOT_ACTIVE: return "The service has not been started.";
+    case ERROR_PROCESS_ABORTED: return "The process terminated unexpectedly.";
+    case ERROR_SERVICE_DEPENDENCY_FAIL: return "The dependency service or group failed to start.";
+    case ERROR_SERVICE_MARKED_FOR_DELETE: return "The specified service has been marked for deletion.";
+    case ERROR_SERVICE_EXISTS: return "The specified service already exists.";
+    case ERROR_DUPLICATE_SERVICE_NAME: return "The name is already in use as either a service name or a service display name.";
+    case ERROR_TIMEOUT: return "This operation returned because the timeout period expired.";
+    default: return "Error " + std::to_string(error);
+    }
+#else
     LPSTR messageBuffer = nullptr;
     // Format the error message
     size_t size = FormatMessageA(
         FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
         NULL, error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
+    if (!messageBuffer) return "Unknown error";
 
     std::string message(messageBuffer, size);
     // Free the buffer allocated by FormatMessage
     LocalFree(messageBuffer);
+
+    // Drop the trailing CR/LF FormatMessage appends
+    while (!message.empty() && (message.back() == '\n' || message.back() == '\r' || message.back() == ' ')) {
+        message.pop_back();
+    }
     return message;
+#endif
 }
 
 /**
@@ -117,18 +655,20 @@ std::string GetLastErrorAsString() {
  * @param startIdx Index to start parsing from
  * @return Map of parameter names to values
  */
-std::map<std::string, std::string> ParseArgs(int argc, char* argv[], int startIdx) {
-    std::map<std::string, std::string> args;
+std::map<std::wstring, std::wstring> ParseArgs(int argc, wchar_t* argv[], int startIdx) {
+    std::map<std::wstring, std::wstring> args;
 
     for (int i = startIdx; i < argc; i++) {
-        std::string arg = argv[i];
-        if (arg[0] == '/') {
+        std::wstring arg = argv[i];
+        if (arg[0] == L'/') {
             // Extract parameter name
-            std::string name = arg.substr(1);
-            std::string value;
+            std::wstring name = arg.substr(1);
+            std::wstring value;
 
-            // Check if the next argument is a value (not starting with /)
-            if (i + 1 < argc && argv[i + 1][0] != '/') {
+            // Check if the next argument is a value (not starting with /). Parameter names
+            // never contain a second '/', so "/tmp/file" is still taken as a value
+            std::wstring next = i + 1 < argc ? argv[i + 1] : L"";
+            if (i + 1 < argc && (next[0] != L'/' || next.find(L'/', 1) != std::wstring::npos)) {
                 value = argv[i + 1];
                 i++; // Skip the value in the next iteration
             }
@@ -140,6 +680,210 @@ std::map<std::string, std::string> ParseArgs(int argc, char* argv[], int startId
     return args;
 }
 
+// Virtual time for the simulate command (see ClockNow)
+std::atomic<bool> g_virtualClock(false);
+thread_local ULONGLONG t_virtualNow = 0;
+
+/**
+ * Milliseconds on the clock every command times and waits with
+ * Normally GetTickCount64. Under the simulate command time is virtual: each thread
+ * has its own clock that only moves when it waits, so a plan with minutes of
+ * start and stop latency runs in milliseconds.
+ */
+ULONGLONG ClockNow() {
+    return g_virtualClock ? t_virtualNow : GetTickCount64();
+}
+
+/**
+ * Waits on the command clock: sleeps in real time, or advances the thread's virtual clock
+ */
+void ClockSleep(DWORD milliseconds) {
+    if (g_virtualClock) t_virtualNow += milliseconds;
+    else Sleep(milliseconds);
+}
+
+/**
+ * Switches the process to virtual time, starting the calling thread's clock at startMs
+ * Call before any worker threads start
+ */
+void UseVirtualClock(ULONGLONG startMs) {
+    g_virtualClock = true;
+    t_virtualNow = startMs;
+}
+
+/**
+ * Runs fn(0) .. fn(count - 1) on up to `concurrency` worker threads
+ * Workers pull the next index from a shared counter, so slow items (a service
+ * that takes seconds to answer) do not hold up the rest of the batch
+ *
+ * @param count Number of items
+ * @param concurrency Maximum number of threads (at least 1)
+ * @param fn Called once per index, possibly from several threads at once
+ */
+template <typename Fn>
+void ParallelFor(size_t count, size_t concurrency, Fn fn) {
+    size_t workers = (std::min)((std::max)(concurrency, (size_t)1), count);
+    if (g_virtualClock && workers > 1) {
+        // Virtual time: run the items in turn, each on the worker lane that frees up
+        // first, so the elapsed time is what `workers` threads would take
+        std::vector<ULONGLONG> lanes(workers, t_virtualNow);
+        for (size_t i = 0; i < count; i++) {
+            auto lane = std::min_element(lanes.begin(), lanes.end());
+            t_virtualNow = *lane;
+            fn(i);
+            *lane = t_virtualNow;
+        }
+        t_virtualNow = *std::max_element(lanes.begin(), lanes.end());
+        return;
+    }
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) fn(i);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+/**
+ * Runs fn(i) for every item once its prerequisites have finished, on up to
+ * `concurrency` worker threads, starting each item as soon as it is ready
+ * An item whose prerequisite failed is not run and counts as failed itself.
+ *
+ * @param prerequisites For each item, the items that must finish first
+ * @param concurrency Maximum number of threads (at least 1)
+ * @param fn Called once per runnable index, possibly from several threads at once; returns false on failure
+ * @return For each item, whether it was run
+ */
+template <typename Fn>
+std::vector<bool> ParallelForOrdered(const std::vector<std::vector<size_t>>& prerequisites, size_t concurrency, Fn fn) {
+    size_t count = prerequisites.size();
+    std::vector<bool> ran(count, false);
+    std::vector<std::vector<size_t>> unlocks(count);
+    std::vector<size_t> waiting(count);
+    for (size_t i = 0; i < count; i++) {
+        waiting[i] = prerequisites[i].size();
+        for (size_t before : prerequisites[i]) unlocks[before].push_back(i);
+    }
+    std::vector<bool> blocked(count, false);
+    std::vector<ULONGLONG> readyAt(count, t_virtualNow);
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < count; i++) {
+        if (!waiting[i]) ready.push_back(i);
+    }
+
+    // Marks an item finished and queues the items it was the last prerequisite of
+    std::function<void(size_t, bool, ULONGLONG)> finish = [&](size_t i, bool ok, ULONGLONG at) {
+        for (size_t next : unlocks[i]) {
+            if (!ok) blocked[next] = true;
+            readyAt[next] = (std::max)(readyAt[next], at);
+            if (--waiting[next]) continue;
+            if (blocked[next]) finish(next, false, at);
+            else ready.push_back(next);
+        }
+    };
+
+    size_t workers = (std::max)(concurrency, (size_t)1);
+    if (g_virtualClock) {
+        // Virtual time: run the ready item that can start first on the lane that frees up first
+        std::vector<ULONGLONG> lanes((std::min)(workers, (std::max)(count, (size_t)1)), t_virtualNow);
+        ULONGLONG end = t_virtualNow;
+        while (!ready.empty()) {
+            auto lane = std::min_element(lanes.begin(), lanes.end());
+            auto pick = std::min_element(ready.begin(), ready.end(), [&](size_t a, size_t b) { return readyAt[a] < readyAt[b]; });
+            size_t i = *pick;
+            ready.erase(pick);
+            t_virtualNow = (std::max)(*lane, readyAt[i]);
+            bool ok = fn(i);
+            ran[i] = true;
+            *lane = t_virtualNow;
+            end = (std::max)(end, t_virtualNow);
+            finish(i, ok, t_virtualNow);
+        }
+        t_virtualNow = end;
+        return ran;
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t running = 0;
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < (std::min)(workers, count); w++) {
+        threads.emplace_back([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                changed.wait(lock, [&] { return !ready.empty() || running == 0; });
+                if (ready.empty()) return;
+                size_t i = ready.front();
+                ready.erase(ready.begin());
+                running++;
+                lock.unlock();
+                bool ok = fn(i);
+                lock.lock();
+                ran[i] = true;
+                running--;
+                finish(i, ok, 0);
+                changed.notify_all();
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return ran;
+}
+
+/**
+ * Default worker count for commands that touch many services at once
+ * SCM calls mostly wait on RPC, so this is well above the core count
+ */
+size_t DefaultServiceConcurrency() {
+    return (std::max)((size_t)std::thread::hardware_concurrency() * 4, (size_t)16);
+}
+
+/**
+ * Matches a service name against a pattern with * and ? wildcards, ignoring case
+ *
+ * @param pattern The pattern
+ * @param name The service name
+ * @return true if the name matches
+ */
+bool MatchServicePattern(const std::wstring& pattern, const std::wstring& name) {
+    size_t p = 0, n = 0;
+    size_t starP = std::wstring::npos, starN = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == L'?' || towlower(pattern[p]) == towlower(name[n]))) {
+            p++;
+            n++;
+        }
+        else if (p < pattern.size() && pattern[p] == L'*') {
+            starP = p++;
+            starN = n;
+        }
+        else if (starP != std::wstring::npos) {
+            // Let the last * swallow one more character and retry
+            p = starP + 1;
+            n = ++starN;
+        }
+        else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == L'*') p++;
+    return p == pattern.size();
+}
+
+/**
+ * Returns true if a service argument is a wildcard pattern rather than a plain name
+ */
+bool IsServicePattern(const std::wstring& value) {
+    return value.find_first_of(L"*?") != std::wstring::npos;
+}
+
 /**
  * Converts a service state code to a human-readable string
  *
@@ -199,988 +943,11143 @@ std::string GetServiceStartTypeString(DWORD startType) {
     }
 }
 
-//=============================================================================
-// Command implementations - These implement the actual service control commands
-//=============================================================================
-
 /**
- * Queries and displays detailed information about a Windows service
- * Similar to "sc query <service>"
+ * Formats a wall-clock time as local "YYYY-MM-DD HH:MM:SS"
  *
- * @param serviceName Name of the service to query
- * @return true if successful, false otherwise
+ * @param timeMs Milliseconds since the Unix epoch
+ * @return The formatted time
  */
-bool QueryService(const std::string& serviceName) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
-    }
-
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_QUERY_STATUS | SERVICE_QUERY_CONFIG);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
-    }
-
-    // Get service status information
-    SERVICE_STATUS_PROCESS status;
-    DWORD bytesNeeded;
-    if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
-        std::cerr << "Failed to query service status: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
-    }
+std::string FormatWallClock(unsigned long long timeMs) {
+    time_t seconds = (time_t)(timeMs / 1000);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    return text;
+}
 
-    // Get service config - first call to get required buffer size
-    DWORD bytesNeeded2 = 0;
-    BOOL result = QueryServiceConfig(service, NULL, 0, &bytesNeeded2);
-    // This call is expected to fail with ERROR_INSUFFICIENT_BUFFER
-    if (!result && GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-        std::cerr << "Failed to determine buffer size for service config: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+/**
+ * Formats an action list the way it is given on the command line (delays in seconds)
+ *
+ * @param actions The actions
+ * @return e.g. "restart/60/none/0", or "none" for an empty list
+ */
+std::string FormatFailureActions(const std::vector<SC_ACTION>& actions) {
+    if (actions.empty()) return "none";
+    std::string text;
+    for (const auto& action : actions) {
+        if (!text.empty()) text += "/";
+        switch (action.Type) {
+        case SC_ACTION_RESTART: text += "restart"; break;
+        case SC_ACTION_REBOOT: text += "reboot"; break;
+        case SC_ACTION_RUN_COMMAND: text += "run"; break;
+        default: text += "none"; break;
+        }
+        text += "/" + std::to_string(action.Delay / 1000);
     }
-    std::vector<BYTE> buffer(bytesNeeded2);
-    LPQUERY_SERVICE_CONFIG config = (LPQUERY_SERVICE_CONFIG)buffer.data();
+    return text;
+}
 
-    // Call QueryServiceConfig again to fill the buffer with data
-    // Added to fix issue where 'TYPE' kept showing up as UNKNOWN, issue was that I didn't call this again after previous expected fail
-    if (!QueryServiceConfig(service, config, bytesNeeded2, &bytesNeeded2)) {
-        std::cerr << "Failed to query service config: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+/**
+ * Appends a string as a quoted, escaped JSON string
+ *
+ * @param out Buffer to append to
+ * @param value The string
+ */
+void AppendJsonString(std::string& out, const std::wstring& value) {
+    std::string utf8;
+    AppendWideAsUtf8(utf8, value.data(), value.size());
+    out += '"';
+    for (char c : utf8) {
+        if (c == '"') out += "\\\"";
+        else if (c == '\\') out += "\\\\";
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+            out += escaped;
+        }
+        else out += c;
     }
+    out += '"';
+}
 
-    // Convert the wide string pointers to regular strings
-    //config->lpBinaryPathName is a wide string pointer (LPWSTR) which can't be printed to a stream expecting narrow characters
-    //Windows API is using unicode even though I'm calling ANSI functions
-    //So to fix, have to convert wide strings to regular strings
-    std::string displayName = "(none)";
-    if (config->lpDisplayName) {
-        displayName = WStringToString(std::wstring(config->lpDisplayName));
-    }
+//=============================================================================
+// Command results - Compact, allocation-free outcome of every command
+//=============================================================================
 
-    std::string binaryPath = "(none)";
-    if (config->lpBinaryPathName) {
-        binaryPath = WStringToString(std::wstring(config->lpBinaryPathName));
-    }
+// The step of a command that failed, and a command's outcome, are the library's
+// (libscclone.h); results are cheap to copy and compare, and text is produced only
+// by RenderCommandResult
+typedef scclone::Stage ScmStage;
+typedef scclone::Result CommandResult;
 
+/**
+ * Builds a successful result
+ *
+ * @param startTime ClockNow() value taken when the command started
+ * @return Result with no error
+ */
+CommandResult CommandSuccess(ULONGLONG startTime) {
+    CommandResult result;
+    result.elapsedMs = ClockNow() - startTime;
+    return result;
+}
 
-    // Display service information
-    std::cout << "DISPLAY_NAME: " << displayName << std::endl;
-    std::cout << "TYPE        : " << GetServiceTypeString(config->dwServiceType) << std::endl;
-    std::cout << "START_TYPE  : " << GetServiceStartTypeString(config->dwStartType) << std::endl;
-    std::cout << "STATE       : " << GetServiceStateString(status.dwCurrentState) << std::endl;
-    std::cout << "PID         : " << status.dwProcessId << std::endl;
-    std::cout << "BINARY_PATH : " << binaryPath << std::endl;
+/**
+ * Builds a failed result with an explicit error code
+ *
+ * @param stage The step that failed
+ * @param error The Windows error code describing the failure
+ * @param startTime ClockNow() value taken when the command started
+ * @return Result describing the failure
+ */
+CommandResult CommandFailure(ScmStage stage, DWORD error, ULONGLONG startTime) {
+    CommandResult result;
+    result.error = error ? error : ERROR_INVALID_DATA; // Never report failure as success
+    result.stage = stage;
+    result.elapsedMs = ClockNow() - startTime;
+    return result;
+}
 
+/**
+ * Builds a failed result from GetLastError()
+ * Must be called before any cleanup call that could overwrite the last error
+ *
+ * @param stage The step that failed
+ * @param startTime ClockNow() value taken when the command started
+ * @return Result describing the failure
+ */
+CommandResult CommandFailure(ScmStage stage, ULONGLONG startTime) {
+    return CommandFailure(stage, GetLastError(), startTime);
+}
 
+/**
+ * Describes what the command was doing at a given stage, for error messages
+ *
+ * @param stage The failing stage
+ * @return Phrase such as "open service"
+ */
+const char* GetScmStageString(ScmStage stage) {
+    switch (stage) {
+    case ScmStage::Arguments: return "parse arguments";
+    case ScmStage::OpenManager: return "open service control manager";
+    case ScmStage::OpenService: return "open service";
+    case ScmStage::QueryStatus: return "query service status";
+    case ScmStage::QueryConfig: return "query service config";
+    case ScmStage::Create: return "create service";
+    case ScmStage::Start: return "start service";
+    case ScmStage::Control: return "send control to service";
+    case ScmStage::Wait: return "wait for service state";
+    case ScmStage::Probe: return "wait for readiness probe";
+    case ScmStage::Delete: return "delete service";
+    case ScmStage::ChangeConfig: return "configure service";
+    case ScmStage::ChangeConfig2: return "set extended service configuration";
+    case ScmStage::Verify: return "verify service binaries";
+    default: return "complete command";
+    }
+}
 
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
-    return true;
+/**
+ * Maps an error code to the process exit status for that class of failure
+ * These values are stable so scripts can branch on them:
+ *   0 success, 1 other failure, 2 invalid arguments, 3 access denied,
+ *   4 service does not exist, 5 service in the wrong state, 6 timed out,
+ *   7 service already exists or is marked for delete, 8 SCM busy (retryable)
+ *
+ * @param error The Windows error code
+ * @return Process exit status
+ */
+int GetExitStatusForError(DWORD error) {
+    switch (error) {
+    case ERROR_SUCCESS:
+        return 0;
+    case ERROR_INVALID_PARAMETER:
+    case ERROR_INVALID_NAME:
+    case ERROR_INVALID_SERVICE_ACCOUNT:
+        return 2;
+    case ERROR_ACCESS_DENIED:
+        return 3;
+    case ERROR_SERVICE_DOES_NOT_EXIST:
+        return 4;
+    case ERROR_SERVICE_ALREADY_RUNNING:
+    case ERROR_SERVICE_NOT_ACTIVE:
+    case ERROR_SERVICE_CANNOT_ACCEPT_CTRL:
+    case ERROR_DEPENDENT_SERVICES_RUNNING:
+    case ERROR_SERVICE_DISABLED:
+        return 5;
+    case ERROR_SERVICE_REQUEST_TIMEOUT:
+    case ERROR_TIMEOUT:
+    case WAIT_TIMEOUT:
+        return 6;
+    case ERROR_SERVICE_EXISTS:
+    case ERROR_DUPLICATE_SERVICE_NAME:
+    case ERROR_SERVICE_MARKED_FOR_DELETE:
+        return 7;
+    case ERROR_SERVICE_DATABASE_LOCKED:
+    case ERROR_RPC_SERVER_UNAVAILABLE:
+        return 8;
+    default:
+        return 1;
+    }
 }
 
 /**
- * Creates a new Windows service
- * Similar to "sc create <service> ..."
+ * Checks whether a failure is transient, so batch callers can retry it
  *
- * @param args Map of parameters for the new service
- * @return true if successful, false otherwise
+ * @param result The command result
+ * @return true if the same command may succeed if simply retried
  */
-bool CreateService(const std::map<std::string, std::string>& args) {
-    // Check for required parameters
-    if (args.find("servicename") == args.end() || args.find("binpath") == args.end()) {
-        std::cerr << "ERROR: Missing required parameters. Required: /servicename and /binpath" << std::endl;
+bool IsRetryableResult(const CommandResult& result) {
+    switch (result.error) {
+    case ERROR_SERVICE_DATABASE_LOCKED:
+    case ERROR_SERVICE_CANNOT_ACCEPT_CTRL:
+    case ERROR_SERVICE_REQUEST_TIMEOUT:
+    case ERROR_RPC_SERVER_UNAVAILABLE:
+    case ERROR_PIPE_BUSY:
+        return true;
+    default:
         return false;
     }
+}
 
-    std::string serviceName = args.at("servicename");
-    std::string binPath = args.at("binpath");
-    std::string displayName = args.count("displayname") ? args.at("displayname") : serviceName;
-
-    // Determine start type (default is demand start)
-    DWORD startType = SERVICE_DEMAND_START; // Default
-    if (args.count("start")) {
-        std::string start = args.at("start");
-        if (start == "boot") startType = SERVICE_BOOT_START;
-        else if (start == "system") startType = SERVICE_SYSTEM_START;
-        else if (start == "auto") startType = SERVICE_AUTO_START;
-        else if (start == "demand") startType = SERVICE_DEMAND_START;
-        else if (start == "disabled") startType = SERVICE_DISABLED;
-        else if (start == "delayed-auto") startType = SERVICE_AUTO_START; // We'll handle delayed-auto separately
-    }
-
-    // Determine service type (default is own process)
-    DWORD serviceType = SERVICE_WIN32_OWN_PROCESS; // Default
-    if (args.count("type")) {
-        std::string type = args.at("type");
-        if (type == "own") serviceType = SERVICE_WIN32_OWN_PROCESS;
-        else if (type == "share") serviceType = SERVICE_WIN32_SHARE_PROCESS;
-        else if (type == "kernel") serviceType = SERVICE_KERNEL_DRIVER;
-        else if (type == "filesys") serviceType = SERVICE_FILE_SYSTEM_DRIVER;
-        else if (type == "rec") serviceType = SERVICE_FILE_SYSTEM_DRIVER | SERVICE_RECOGNIZER_DRIVER;
-        else if (type == "interact type=own") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_OWN_PROCESS;
-        else if (type == "interact type=share") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_SHARE_PROCESS;
-        else if (type == "interact") {
-            std::cerr << "ERROR: 'interact' type must be used with 'own' or 'share' (e.g., type=interact type=own)" << std::endl;
-            return false;
-        }
-    }
+/**
+ * Formats a failed result as one line, e.g. for per-service reports in bulk commands
+ *
+ * @param result The command result
+ * @return "Failed to <stage>: <message> (error N, after X ms)"
+ */
+std::string FormatCommandFailure(const CommandResult& result) {
+    return std::string("Failed to ") + GetScmStageString(result.stage) + ": " + FormatErrorMessage(result.error) +
+        " (error " + std::to_string(result.error) + ", after " + std::to_string(result.elapsedMs) + " ms)";
+}
 
-    // Determine error control (default is normal)
-    DWORD errorControl = SERVICE_ERROR_NORMAL; // Default
-    if (args.count("error")) {
-        std::string error = args.at("error");
-        if (error == "normal") errorControl = SERVICE_ERROR_NORMAL;
-        else if (error == "severe") errorControl = SERVICE_ERROR_SEVERE;
-        else if (error == "critical") errorControl = SERVICE_ERROR_CRITICAL;
-        else if (error == "ignore") errorControl = SERVICE_ERROR_IGNORE;
+/**
+ * Prints a failed result to std::cerr, formatting the message only now
+ *
+ * @param result The command result
+ * @return The process exit status for the result
+ */
+int RenderCommandResult(const CommandResult& result) {
+    if (!result.ok()) {
+        std::cerr << FormatCommandFailure(result) << std::endl;
     }
+    return GetExitStatusForError(result.error);
+}
 
-    // Get load ordering group if provided
-    LPSTR loadOrderGroup = NULL;
-    std::string groupStr;
-    if (args.count("group")) {
-        groupStr = args.at("group");
-        loadOrderGroup = const_cast<LPSTR>(groupStr.c_str());
-    }
+//=============================================================================
+// Readiness probes - Used by the start command to decide when a service is
+// actually accepting work, not just reporting SERVICE_RUNNING
+//=============================================================================
 
-    // Determine if a tag should be obtained
-    LPDWORD tagId = NULL;
-    DWORD tag = 0;
-    if (args.count("tag") && args.at("tag") == "yes") {
-        tagId = &tag;
-    }
-
-    // Process dependencies
-    LPSTR dependencies = NULL;
-    std::string dependStr;
-    if (args.count("depend")) {
-        // Convert forward slashes to null characters and add double null at end
-        dependStr = args.at("depend");
-        size_t pos = 0;
-        while ((pos = dependStr.find('/', pos)) != std::string::npos) {
-            dependStr.replace(pos, 1, 1, '\0');
-            pos++;
-        }
-        dependStr.push_back('\0'); // Add terminating null
-        dependencies = const_cast<LPSTR>(dependStr.c_str());
-    }
+/**
+ * Describes an optional readiness probe given with /probe on the start command
+ *   tcp:<port>   - a TCP connect to 127.0.0.1:<port> succeeds
+ *   file:<path>  - the file exists
+ *   pipe:<name>  - the named pipe (Windows) or Unix socket path (Linux) exists
+ */
+struct ReadinessProbe {
+    enum Kind { None, Tcp, File, Pipe };
+    Kind kind = None;
+    std::wstring target;    // File path or pipe/socket path
+    unsigned short port = 0; // Loopback port for Tcp probes
+};
+
+/**
+ * Parses a probe specification such as "tcp:8080" or "file:C:\ready.flag"
+ *
+ * @param spec The value given with /probe
+ * @param probe Receives the parsed probe
+ * @return true if the specification was valid, false otherwise
+ */
+bool ParseReadinessProbe(const std::wstring& spec, ReadinessProbe& probe) {
+    size_t colon = spec.find(L':');
+    if (colon == std::wstring::npos || colon + 1 >= spec.size()) return false;
 
-    // Get account name and password
-    LPSTR accountName = NULL;
-    LPSTR password = NULL;
-    std::string accountStr;
-    std::string passwordStr;
+    std::wstring kind = spec.substr(0, colon);
+    std::wstring target = spec.substr(colon + 1);
 
-    if (args.count("obj")) {
-        accountStr = args.at("obj");
-        accountName = const_cast<LPSTR>(accountStr.c_str());
+    if (kind == L"tcp") {
+        try {
+            int port = std::stoi(target);
+            if (port <= 0 || port > 65535) return false;
+            probe.kind = ReadinessProbe::Tcp;
+            probe.port = static_cast<unsigned short>(port);
+        }
+        catch (const std::exception&) {
+            return false;
+        }
     }
-
-    if (args.count("password")) {
-        passwordStr = args.at("password");
-        password = const_cast<LPSTR>(passwordStr.c_str());
+    else if (kind == L"file") {
+        probe.kind = ReadinessProbe::File;
+        probe.target = target;
     }
-
-    // Open the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
+    else if (kind == L"pipe") {
+        probe.kind = ReadinessProbe::Pipe;
+#ifdef _WIN32
+        // Accept a bare pipe name as well as the full \\.\pipe\name form
+        probe.target = (target.rfind(L"\\\\", 0) == 0) ? target : L"\\\\.\\pipe\\" + target;
+#else
+        probe.target = target;
+#endif
+    }
+    else {
         return false;
     }
+    return true;
+}
 
-    // Create the service
-    SC_HANDLE service = CreateServiceA(
-        scManager,                       // SCM handle
-        serviceName.c_str(),             // Service name
-        displayName.c_str(),             // Display name
-        SERVICE_ALL_ACCESS,              // Desired access
-        serviceType,                     // Service type
-        startType,                       // Start type
-        errorControl,                    // Error control
-        binPath.c_str(),                 // Binary path
-        loadOrderGroup,                  // Load ordering group
-        tagId,                           // Tag ID
-        dependencies,                    // Dependencies
-        accountName,                     // Account name
-        password                         // Password
-    );
+/**
+ * Initializes the socket library once per process (no-op outside Windows)
+ */
+void EnsureSocketsInitialized() {
+#ifdef _WIN32
+    static bool initialized = [] {
+        WSADATA wsaData;
+        return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+    }();
+    (void)initialized;
+#endif
+}
 
-    if (!service) {
-        std::cerr << "Failed to create service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
-    }
+/**
+ * Bounds how long a blocking recv or send on a socket may wait, so a peer that
+ * connects and then goes quiet cannot hold the caller forever
+ *
+ * @param sock Connected socket
+ * @param timeoutMs Longest wait for a single recv or send
+ */
+void SetSocketTimeouts(SocketHandle sock, int timeoutMs) {
+#ifdef _WIN32
+    DWORD timeout = (DWORD)timeoutMs;
+#else
+    timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
 
-    std::cout << "Service created successfully: " << serviceName << std::endl;
+/**
+ * Attempts a single TCP connection to 127.0.0.1:port, giving up after timeoutMs
+ *
+ * @param port Loopback port to connect to
+ * @param timeoutMs Maximum time to wait for the connection
+ * @return true if something accepted the connection
+ */
+bool ProbeTcpPort(unsigned short port, int timeoutMs) {
+    EnsureSocketsInitialized();
 
-    // Set description if provided
-    if (args.count("description")) {
-        SERVICE_DESCRIPTIONA desc = { 0 };
-        desc.lpDescription = const_cast<LPSTR>(args.at("description").c_str());
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-        // Use ChangeServiceConfig2 to set the description
-        if (!ChangeServiceConfig2A(service, SERVICE_CONFIG_DESCRIPTION, &desc)) {
-            std::cerr << "Warning: Failed to set service description: " << GetLastErrorAsString() << std::endl;
+#ifdef _WIN32
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return false;
+
+    // Non-blocking connect so a filtered port can't stall the probe
+    u_long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+    bool connected = false;
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+        connected = true;
+    }
+    else if (WSAGetLastError() == WSAEWOULDBLOCK) {
+        fd_set writeSet;
+        fd_set errorSet;
+        FD_ZERO(&writeSet);
+        FD_ZERO(&errorSet);
+        FD_SET(sock, &writeSet);
+        FD_SET(sock, &errorSet);
+        timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+        if (select(0, NULL, &writeSet, &errorSet, &tv) > 0 && FD_ISSET(sock, &writeSet)) {
+            connected = true;
         }
     }
-
-    // Set delayed auto-start if specified
-    if (args.count("start") && args.at("start") == "delayed-auto") {
-        SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { TRUE };
-        if (!ChangeServiceConfig2A(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, &delayedInfo)) {
-            std::cerr << "Warning: Failed to set delayed auto-start: " << GetLastErrorAsString() << std::endl;
+    closesocket(sock);
+    return connected;
+#else
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return false;
+
+    // Non-blocking connect so a filtered port can't stall the probe
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    bool connected = false;
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+        connected = true;
+    }
+    else if (errno == EINPROGRESS) {
+        pollfd pfd = { sock, POLLOUT, 0 };
+        if (poll(&pfd, 1, timeoutMs) > 0) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len);
+            connected = (error == 0);
         }
     }
+    close(sock);
+    return connected;
+#endif
+}
 
-    // If tag was requested, display it
-    if (tagId) {
-        std::cout << "Tag ID: " << tag << std::endl;
+/**
+ * Checks a readiness probe once
+ *
+ * @param probe The probe to check
+ * @return true if the probe condition currently holds
+ */
+bool CheckReadinessProbe(const ReadinessProbe& probe) {
+    switch (probe.kind) {
+    case ReadinessProbe::Tcp:
+        return ProbeTcpPort(probe.port, 200);
+    case ReadinessProbe::File:
+#ifdef _WIN32
+        return GetFileAttributesW(probe.target.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    {
+        struct stat st;
+        return stat(WStringToString(probe.target).c_str(), &st) == 0;
+    }
+#endif
+    case ReadinessProbe::Pipe:
+#ifdef _WIN32
+        // A busy pipe times out rather than failing, which still means it exists
+        if (WaitNamedPipeW(probe.target.c_str(), 1)) return true;
+        return GetLastError() == ERROR_SEM_TIMEOUT;
+#else
+    {
+        struct stat st;
+        return stat(WStringToString(probe.target).c_str(), &st) == 0 && (S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode));
+    }
+#endif
+    default:
+        return true;
     }
-
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
-    return true;
 }
 
 /**
- * Queries and displays the description of a Windows service
- * Similar to "sc qdescription <service>"
+ * Converts a readiness probe back to its /probe form for display
  *
- * @param serviceName Name of the service to query
- * @return true if successful, false otherwise
+ * @param probe The probe to describe
+ * @return String such as "tcp:8080"
  */
-bool QueryServiceDescription(const std::string& serviceName) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
+std::string GetReadinessProbeString(const ReadinessProbe& probe) {
+    switch (probe.kind) {
+    case ReadinessProbe::Tcp: return "tcp:" + std::to_string(probe.port);
+    case ReadinessProbe::File: return "file:" + WStringToString(probe.target);
+    case ReadinessProbe::Pipe: return "pipe:" + WStringToString(probe.target);
+    default: return "(none)";
     }
+}
 
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_QUERY_CONFIG);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
-    }
+//=============================================================================
+// Service triggers - Trigger-start configuration, converted between the
+// SERVICE_TRIGGER_INFO layout and the text form of sc.exe's triggerinfo command
+// (start/networkon, start/namedpipe/<name>, start/device/<guid>/<hwid>, ...)
+//=============================================================================
 
-    // Query service description - first call to get required buffer size
-    DWORD bytesNeeded = 0;
-    SERVICE_DESCRIPTIONA minimalBuffer = { 0 };
-    BOOL result = QueryServiceConfig2A(service, SERVICE_CONFIG_DESCRIPTION,
-        (LPBYTE)&minimalBuffer, sizeof(SERVICE_DESCRIPTIONA), &bytesNeeded);
-    // This call is still expected to fail if more space is needed
-    if (!result && GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-        std::cerr << "Failed to query service description: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
-    }
+// Windows 8 additions that older SDK and MinGW headers lack
+#ifndef SERVICE_TRIGGER_TYPE_CUSTOM_SYSTEM_STATE_CHANGE
+#define SERVICE_TRIGGER_TYPE_CUSTOM_SYSTEM_STATE_CHANGE     7
+#endif
+#ifndef SERVICE_TRIGGER_DATA_TYPE_LEVEL
+#define SERVICE_TRIGGER_DATA_TYPE_LEVEL                     3
+#define SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ANY               4
+#define SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ALL               5
+#endif
 
-    // Allocate buffer and get the description data
-    std::vector<BYTE> buffer(bytesNeeded);
-    LPSERVICE_DESCRIPTIONA desc = (LPSERVICE_DESCRIPTIONA)buffer.data();
+/**
+ * One trigger-specific data item (hardware ID, pipe name, port, custom payload, ...)
+ */
+struct ServiceTriggerData {
+    DWORD dataType = SERVICE_TRIGGER_DATA_TYPE_STRING;
+    std::vector<BYTE> bytes;            // Strings include their terminator, as the SCM stores them
+};
 
-    if (!QueryServiceConfig2A(service, SERVICE_CONFIG_DESCRIPTION, buffer.data(), bytesNeeded, &bytesNeeded)) {
-        std::cerr << "Failed to query service description: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
-    }
+/**
+ * One trigger: an event that starts or stops the service
+ */
+struct ServiceTrigger {
+    DWORD triggerType = 0;
+    DWORD action = SERVICE_TRIGGER_ACTION_SERVICE_START;
+    GUID subtype = GUID();
+    std::vector<ServiceTriggerData> data;
+};
 
-    // Display the service description
-    std::cout << "SERVICE_NAME: " << serviceName << std::endl;
-    std::cout << "DESCRIPTION: " << (desc->lpDescription ? desc->lpDescription : "(no description)") << std::endl;
+/**
+ * An event with a fixed subtype, by its sc.exe name
+ */
+struct TriggerEventName {
+    const wchar_t* name;
+    DWORD triggerType;
+    const wchar_t* subtype;
+    DWORD dataType;                     // Type of the arguments after the name (0 = takes none)
+};
+
+const TriggerEventName TriggerEvents[] = {
+    { L"networkon", SERVICE_TRIGGER_TYPE_IP_ADDRESS_AVAILABILITY, L"4f27f2de-14e2-430b-a549-7cd48cbc8245", 0 },
+    { L"networkoff", SERVICE_TRIGGER_TYPE_IP_ADDRESS_AVAILABILITY, L"cc4ba62a-162e-4648-847a-b6bdf993e335", 0 },
+    { L"domainjoin", SERVICE_TRIGGER_TYPE_DOMAIN_JOIN, L"1ce20aba-9851-4421-9430-1ddeb766e809", 0 },
+    { L"domainleave", SERVICE_TRIGGER_TYPE_DOMAIN_JOIN, L"ddaf516e-58c2-4866-9574-c3b615d42ea1", 0 },
+    { L"portopen", SERVICE_TRIGGER_TYPE_FIREWALL_PORT_EVENT, L"b7569e07-8421-4ee0-ad10-86915afdad09", SERVICE_TRIGGER_DATA_TYPE_STRING },
+    { L"portclose", SERVICE_TRIGGER_TYPE_FIREWALL_PORT_EVENT, L"a144ed38-8e12-4de4-9d96-e64740b1a524", SERVICE_TRIGGER_DATA_TYPE_STRING },
+    { L"machinepolicy", SERVICE_TRIGGER_TYPE_GROUP_POLICY, L"659fcae6-5bdb-4da9-b1ff-ca2a178d46e0", 0 },
+    { L"userpolicy", SERVICE_TRIGGER_TYPE_GROUP_POLICY, L"54fb46c8-f089-464c-b1fd-59d1b62c3b50", 0 },
+    { L"namedpipe", SERVICE_TRIGGER_TYPE_NETWORK_ENDPOINT, L"1f81d131-3fac-4537-9e0c-7e7b0c2f4b55", SERVICE_TRIGGER_DATA_TYPE_STRING },
+    { L"rpc", SERVICE_TRIGGER_TYPE_NETWORK_ENDPOINT, L"bc90d167-9470-4139-a9ba-be0bbbf5b74d", SERVICE_TRIGGER_DATA_TYPE_STRING },
+};
+const int TriggerEventCount = sizeof(TriggerEvents) / sizeof(TriggerEvents[0]);
 
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
+/**
+ * Parses a GUID written as 8-4-4-4-12 hex digits, with or without braces
+ *
+ * @param text The GUID text
+ * @param guid Receives the GUID
+ * @return true if the text was a valid GUID
+ */
+bool ParseGuid(const std::wstring& text, GUID& guid) {
+    std::wstring hex = text;
+    if (hex.size() == 38 && hex.front() == L'{' && hex.back() == L'}') hex = hex.substr(1, 36);
+    if (hex.size() != 36 || hex[8] != L'-' || hex[13] != L'-' || hex[18] != L'-' || hex[23] != L'-') return false;
+    hex.erase(std::remove(hex.begin(), hex.end(), L'-'), hex.end());
+
+    unsigned char bytes[16];
+    for (int i = 0; i < 16; i++) {
+        int value = 0;
+        for (int n = 0; n < 2; n++) {
+            wchar_t c = hex[i * 2 + n];
+            int digit = c >= L'0' && c <= L'9' ? c - L'0' : c >= L'a' && c <= L'f' ? c - L'a' + 10
+                : c >= L'A' && c <= L'F' ? c - L'A' + 10 : -1;
+            if (digit < 0) return false;
+            value = value * 16 + digit;
+        }
+        bytes[i] = (unsigned char)value;
+    }
+    guid.Data1 = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    guid.Data2 = (unsigned short)((bytes[4] << 8) | bytes[5]);
+    guid.Data3 = (unsigned short)((bytes[6] << 8) | bytes[7]);
+    memcpy(guid.Data4, bytes + 8, 8);
     return true;
 }
 
 /**
- * Starts a Windows service and waits for it to reach running state
- * Similar to "sc start <service>"
+ * Formats a GUID as lowercase 8-4-4-4-12 hex digits
+ */
+std::string FormatGuid(const GUID& guid) {
+    char text[40];
+    snprintf(text, sizeof(text), "%08lx-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x", (unsigned long)guid.Data1,
+        guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+        guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+    return text;
+}
+
+/**
+ * Parses one trigger in sc.exe triggerinfo form: <start|stop>/<event>[/<argument>...]
+ * Events: networkon, networkoff, domainjoin, domainleave, machinepolicy, userpolicy,
+ * portopen/<port;protocol;...>, portclose/..., namedpipe/<name>, rpc/<interface uuid>,
+ * device/<interface class guid>[/<hardware id>...], custom/<provider guid>[/<hex data>...],
+ * strcustom/<provider guid>[/<string>...], systemstate/<state guid>[/<hex data>...].
+ * Binary arguments may also be level:<n>, keywordany:<hex> or keywordall:<hex>.
  *
- * @param serviceName Name of the service to start
- * @return true if successful, false otherwise
+ * @param spec The trigger text
+ * @param trigger Receives the trigger
+ * @param error Receives the reason on failure
+ * @return true if the trigger was valid
  */
-bool StartService(const std::string& serviceName) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
+bool ParseServiceTrigger(const std::wstring& spec, ServiceTrigger& trigger, std::string& error) {
+    std::vector<std::wstring> parts;
+    size_t start = 0;
+    while (true) {
+        size_t slash = spec.find(L'/', start);
+        parts.push_back(spec.substr(start, slash == std::wstring::npos ? std::wstring::npos : slash - start));
+        if (slash == std::wstring::npos) break;
+        start = slash + 1;
     }
-
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_START);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
+    if (parts.size() < 2) {
+        error = "Trigger '" + WStringToString(spec) + "' must be start/<event> or stop/<event>";
         return false;
     }
 
-    // Attempt to start the service
-    if (!StartServiceA(service, 0, NULL)) {
-        std::cerr << "Failed to start service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
+    trigger = ServiceTrigger();
+    std::wstring action = ToLowerServiceName(parts[0]);
+    std::wstring event = ToLowerServiceName(parts[1]);
+    if (action == L"start") trigger.action = SERVICE_TRIGGER_ACTION_SERVICE_START;
+    else if (action == L"stop") trigger.action = SERVICE_TRIGGER_ACTION_SERVICE_STOP;
+    else {
+        error = "Trigger action must be start or stop, not '" + WStringToString(parts[0]) + "'";
         return false;
     }
 
-    std::cout << "Service start pending... " << std::endl;
-
-    // Wait for service to start
-    SERVICE_STATUS_PROCESS status;
-    DWORD bytesNeeded;
-    ULONGLONG startTime = GetTickCount64();
-    DWORD waitTime = 30000; // 30 seconds timeout
-
-    // Poll the service status until it's running or times out
-    while (true) {
-        if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
-            std::cerr << "Failed to query service status: " << GetLastErrorAsString() << std::endl;
-            CloseServiceHandle(service);
-            CloseServiceHandle(scManager);
+    size_t firstArgument = 2;
+    DWORD dataType = 0;
+    const TriggerEventName* known = nullptr;
+    for (int i = 0; i < TriggerEventCount && !known; i++) {
+        if (event == TriggerEvents[i].name) known = &TriggerEvents[i];
+    }
+    if (known) {
+        trigger.triggerType = known->triggerType;
+        ParseGuid(known->subtype, trigger.subtype);
+        dataType = known->dataType;
+        if (dataType && parts.size() < 3) {
+            error = "Trigger event '" + WStringToString(event) + "' needs an argument";
+            return false;
+        }
+    }
+    else {
+        // Events whose subtype is given: device class, ETW provider, system state or a raw type number
+        if (event == L"device") trigger.triggerType = SERVICE_TRIGGER_TYPE_DEVICE_INTERFACE_ARRIVAL;
+        else if (event == L"custom" || event == L"strcustom") trigger.triggerType = SERVICE_TRIGGER_TYPE_CUSTOM;
+        else if (event == L"systemstate") trigger.triggerType = SERVICE_TRIGGER_TYPE_CUSTOM_SYSTEM_STATE_CHANGE;
+        else if (event.compare(0, 4, L"type") == 0) {
+            // A raw type number; it must be all digits and fit in a DWORD
+            const wchar_t* digits = event.c_str() + 4;
+            wchar_t* end = nullptr;
+            errno = 0;
+            unsigned long long value = wcstoull(digits, &end, 10);
+            if (!iswdigit(digits[0]) || *end != L'\0' || errno == ERANGE || value > 0xFFFFFFFFull) {
+                error = "Trigger event '" + WStringToString(parts[1]) + "' must be type<n> with n from 0 to 4294967295";
+                return false;
+            }
+            trigger.triggerType = (DWORD)value;
+        }
+        else {
+            error = "Unknown trigger event '" + WStringToString(parts[1]) + "'";
+            return false;
+        }
+        if (parts.size() < 3 || !ParseGuid(parts[2], trigger.subtype)) {
+            error = "Trigger event '" + WStringToString(event) + "' needs a GUID, e.g. " + WStringToString(event) +
+                "/{4d36e96e-e325-11ce-bfc1-08002be10318}";
             return false;
         }
+        dataType = event == L"device" || event == L"strcustom" ? SERVICE_TRIGGER_DATA_TYPE_STRING : SERVICE_TRIGGER_DATA_TYPE_BINARY;
+        firstArgument = 3;
+    }
+    if (!dataType && parts.size() > firstArgument) {
+        error = "Trigger event '" + WStringToString(event) + "' takes no arguments";
+        return false;
+    }
 
-        // Check if service has reached the running state
-        if (status.dwCurrentState == SERVICE_RUNNING) {
-            std::cout << "Service started successfully." << std::endl;
-            break;
+    for (size_t i = firstArgument; i < parts.size(); i++) {
+        const std::wstring& argument = parts[i];
+        ServiceTriggerData item;
+        item.dataType = dataType;
+        if (dataType == SERVICE_TRIGGER_DATA_TYPE_STRING) {
+            const BYTE* text = (const BYTE*)argument.c_str();
+            item.bytes.assign(text, text + (argument.size() + 1) * sizeof(wchar_t));
+            trigger.data.push_back(item);
+            continue;
         }
 
-        // Check for timeout
-        if (GetTickCount64() - startTime > waitTime) {
-            std::cerr << "Service start timed out." << std::endl;
-            CloseServiceHandle(service);
-            CloseServiceHandle(scManager);
+        // Binary payloads: hex bytes, or a typed level/keyword filter for ETW events
+        std::wstring hex = argument;
+        size_t colon = argument.find(L':');
+        if (colon != std::wstring::npos) {
+            std::wstring kind = ToLowerServiceName(argument.substr(0, colon));
+            try {
+                unsigned long long value = std::stoull(argument.substr(colon + 1), nullptr, kind == L"level" ? 10 : 16);
+                if (kind == L"level") item.dataType = SERVICE_TRIGGER_DATA_TYPE_LEVEL;
+                else if (kind == L"keywordany") item.dataType = SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ANY;
+                else if (kind == L"keywordall") item.dataType = SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ALL;
+                else throw std::invalid_argument("kind");
+                int size = item.dataType == SERVICE_TRIGGER_DATA_TYPE_LEVEL ? 1 : 8;
+                for (int b = 0; b < size; b++) item.bytes.push_back((BYTE)(value >> (8 * b)));
+            }
+            catch (const std::exception&) {
+                error = "Invalid trigger data '" + WStringToString(argument) + "'";
+                return false;
+            }
+            trigger.data.push_back(item);
+            continue;
+        }
+        if (hex.compare(0, 2, L"0x") == 0) hex = hex.substr(2);
+        if (hex.empty() || hex.size() % 2 || hex.find_first_not_of(L"0123456789abcdefABCDEF") != std::wstring::npos) {
+            error = "Trigger data '" + WStringToString(argument) + "' must be hex bytes";
             return false;
         }
-
-        // Wait a short time before checking again
-        Sleep(250);
+        for (size_t b = 0; b < hex.size(); b += 2) item.bytes.push_back((BYTE)std::stoul(hex.substr(b, 2), nullptr, 16));
+        trigger.data.push_back(item);
     }
-
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
     return true;
 }
 
 /**
- * Stops a Windows service and waits for it to reach stopped state
- * Similar to "sc stop <service>"
+ * Formats a trigger in the form ParseServiceTrigger reads
  *
- * @param serviceName Name of the service to stop
- * @return true if successful, false otherwise
+ * @param trigger The trigger
+ * @return Text such as "start/namedpipe/MyPipe"
  */
-bool StopService(const std::string& serviceName) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
-    }
-
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_STOP | SERVICE_QUERY_STATUS);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
-    }
-
-    // Get current service status
-    SERVICE_STATUS_PROCESS status;
-    DWORD bytesNeeded;
-
-    if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
-        std::cerr << "Failed to query service status: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
-    }
-
-    // Check if service is already stopped
-    if (status.dwCurrentState == SERVICE_STOPPED) {
-        std::cout << "Service is already stopped." << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return true;
+std::string FormatServiceTrigger(const ServiceTrigger& trigger) {
+    std::string out = trigger.action == SERVICE_TRIGGER_ACTION_SERVICE_STOP ? "stop/" : "start/";
+    std::string subtype = FormatGuid(trigger.subtype);
+
+    const TriggerEventName* known = nullptr;
+    for (int i = 0; i < TriggerEventCount && !known; i++) {
+        if (TriggerEvents[i].triggerType == trigger.triggerType && subtype == WStringToString(TriggerEvents[i].subtype)) {
+            known = &TriggerEvents[i];
+        }
     }
-
-    // Send stop control code to the service
-    SERVICE_STATUS svcStatus;
-    if (!ControlService(service, SERVICE_CONTROL_STOP, &svcStatus)) {
-        std::cerr << "Failed to stop service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+    bool allStrings = !trigger.data.empty();
+    for (const auto& item : trigger.data) allStrings = allStrings && item.dataType == SERVICE_TRIGGER_DATA_TYPE_STRING;
+    if (known) out += WStringToString(known->name);
+    else {
+        switch (trigger.triggerType) {
+        case SERVICE_TRIGGER_TYPE_DEVICE_INTERFACE_ARRIVAL: out += "device"; break;
+        case SERVICE_TRIGGER_TYPE_CUSTOM: out += allStrings ? "strcustom" : "custom"; break;
+        case SERVICE_TRIGGER_TYPE_CUSTOM_SYSTEM_STATE_CHANGE: out += "systemstate"; break;
+        default: out += "type" + std::to_string(trigger.triggerType); break;
+        }
+        out += "/" + subtype;
     }
 
-    std::cout << "Service stop pending... " << std::endl;
-
-    // Wait for service to stop
-    ULONGLONG startTime = GetTickCount64();
-    DWORD waitTime = 30000; // 30 seconds timeout
-
-    // Poll the service status until it's stopped or times out
-    while (true) {
-        if (!QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
-            std::cerr << "Failed to query service status: " << GetLastErrorAsString() << std::endl;
-            CloseServiceHandle(service);
-            CloseServiceHandle(scManager);
-            return false;
+    for (const auto& item : trigger.data) {
+        out += "/";
+        if (item.dataType == SERVICE_TRIGGER_DATA_TYPE_STRING) {
+            std::wstring text(item.bytes.size() / sizeof(wchar_t), L'\0');
+            if (!text.empty()) memcpy(&text[0], item.bytes.data(), text.size() * sizeof(wchar_t));
+            out += WStringToString(text.substr(0, text.find(L'\0')));
+            continue;
         }
-
-        // Check if service has reached the stopped state
-        if (status.dwCurrentState == SERVICE_STOPPED) {
-            std::cout << "Service stopped successfully." << std::endl;
-            break;
+        unsigned long long value = 0;
+        for (size_t b = 0; b < item.bytes.size() && b < 8; b++) value |= (unsigned long long)item.bytes[b] << (8 * b);
+        char number[32];
+        if (item.dataType == SERVICE_TRIGGER_DATA_TYPE_LEVEL) {
+            out += "level:" + std::to_string(value);
+            continue;
         }
-
-        // Check for timeout
-        if (GetTickCount64() - startTime > waitTime) {
-            std::cerr << "Service stop timed out." << std::endl;
-            CloseServiceHandle(service);
-            CloseServiceHandle(scManager);
-            return false;
+        if (item.dataType == SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ANY || item.dataType == SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ALL) {
+            snprintf(number, sizeof(number), "%llx", value);
+            out += (item.dataType == SERVICE_TRIGGER_DATA_TYPE_KEYWORD_ANY ? "keywordany:" : "keywordall:") + std::string(number);
+            continue;
+        }
+        for (BYTE b : item.bytes) {
+            snprintf(number, sizeof(number), "%02x", b);
+            out += number;
         }
-
-        // Wait a short time before checking again
-        Sleep(250);
     }
+    return out;
+}
 
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
-    return true;
+/**
+ * Formats a service's triggers as one line, for journals and summaries
+ */
+std::string FormatServiceTriggers(const std::vector<ServiceTrigger>& triggers) {
+    std::string out;
+    for (const auto& trigger : triggers) out += (out.empty() ? "" : " ") + FormatServiceTrigger(trigger);
+    return out;
 }
 
 /**
- * Deletes a Windows service
- * Similar to "sc delete <service>"
+ * Lays triggers out as a SERVICE_TRIGGER_INFO with everything it points to in one
+ * buffer, as QueryServiceConfig2 returns it and ChangeServiceConfig2 takes it
  *
- * @param serviceName Name of the service to delete
- * @return true if successful, false otherwise
+ * @param triggers The triggers
+ * @param buffer Buffer to fill (may be NULL to only get the size)
+ * @param size Size of the buffer in bytes
+ * @return Bytes needed; the buffer is only written if it is at least this large
  */
-bool DeleteService(const std::string& serviceName) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
-    }
-
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), DELETE);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
+size_t PackServiceTriggers(const std::vector<ServiceTrigger>& triggers, BYTE* buffer, size_t size) {
+    auto align = [](size_t offset) { return (offset + 7) & ~(size_t)7; };
+    size_t itemCount = 0, dataBytes = 0;
+    for (const auto& trigger : triggers) {
+        itemCount += trigger.data.size();
+        for (const auto& item : trigger.data) dataBytes += item.bytes.size();
     }
-
-    // Delete the service
-    // Note: We use ::DeleteService to avoid confusion with our function name
-    if (!::DeleteService(service)) {
-        std::cerr << "Failed to delete service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+    size_t triggersAt = align(sizeof(SERVICE_TRIGGER_INFO));
+    size_t guidsAt = align(triggersAt + triggers.size() * sizeof(SERVICE_TRIGGER));
+    size_t itemsAt = align(guidsAt + triggers.size() * sizeof(GUID));
+    size_t bytesAt = itemsAt + itemCount * sizeof(SERVICE_TRIGGER_SPECIFIC_DATA_ITEM);
+    size_t needed = bytesAt + dataBytes;
+    if (!buffer || size < needed) return needed;
+
+    memset(buffer, 0, needed);
+    SERVICE_TRIGGER_INFO* info = (SERVICE_TRIGGER_INFO*)buffer;
+    SERVICE_TRIGGER* packed = (SERVICE_TRIGGER*)(buffer + triggersAt);
+    GUID* guids = (GUID*)(buffer + guidsAt);
+    SERVICE_TRIGGER_SPECIFIC_DATA_ITEM* items = (SERVICE_TRIGGER_SPECIFIC_DATA_ITEM*)(buffer + itemsAt);
+    BYTE* bytes = buffer + bytesAt;
+    info->cTriggers = (DWORD)triggers.size();
+    info->pTriggers = triggers.empty() ? NULL : packed;
+    for (size_t t = 0; t < triggers.size(); t++) {
+        guids[t] = triggers[t].subtype;
+        packed[t].dwTriggerType = triggers[t].triggerType;
+        packed[t].dwAction = triggers[t].action;
+        packed[t].pTriggerSubtype = &guids[t];
+        packed[t].cDataItems = (DWORD)triggers[t].data.size();
+        packed[t].pDataItems = triggers[t].data.empty() ? NULL : items;
+        for (const auto& item : triggers[t].data) {
+            items->dwDataType = item.dataType;
+            items->cbData = (DWORD)item.bytes.size();
+            items->pData = bytes;
+            if (!item.bytes.empty()) memcpy(bytes, item.bytes.data(), item.bytes.size());
+            bytes += item.bytes.size();
+            items++;
+        }
     }
-
-    std::cout << "Service deleted successfully: " << serviceName << std::endl;
-
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
-    return true;
+    return needed;
 }
 
 /**
- * Modifies the configuration of a Windows service
- * Similar to "sc config <service> ..."
+ * Copies triggers out of a SERVICE_TRIGGER_INFO
  *
- * @param serviceName Name of the service to configure
- * @param args Map of configuration parameters to modify
- * @return true if successful, false otherwise
+ * @param info The trigger info (may be NULL)
+ * @param triggers Receives the triggers
  */
-bool ConfigService(const std::string& serviceName, const std::map<std::string, std::string>& args) {
-    // Open a handle to the service control manager
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
+void UnpackServiceTriggers(const SERVICE_TRIGGER_INFO* info, std::vector<ServiceTrigger>& triggers) {
+    triggers.clear();
+    if (!info || !info->pTriggers) return;
+    for (DWORD t = 0; t < info->cTriggers; t++) {
+        const SERVICE_TRIGGER& source = info->pTriggers[t];
+        ServiceTrigger trigger;
+        trigger.triggerType = source.dwTriggerType;
+        trigger.action = source.dwAction;
+        if (source.pTriggerSubtype) trigger.subtype = *source.pTriggerSubtype;
+        for (DWORD d = 0; source.pDataItems && d < source.cDataItems; d++) {
+            ServiceTriggerData item;
+            item.dataType = source.pDataItems[d].dwDataType;
+            if (source.pDataItems[d].pData) {
+                item.bytes.assign(source.pDataItems[d].pData, source.pDataItems[d].pData + source.pDataItems[d].cbData);
+            }
+            trigger.data.push_back(item);
+        }
+        triggers.push_back(trigger);
     }
+}
 
-    // Open a handle to the specified service
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_CHANGE_CONFIG);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
-    }
+//=============================================================================
+// SCM backend - Every service control manager call goes through Scm(), which is
+// either the real Win32 API or the in-process simulated SCM below
+//=============================================================================
 
-    // Prepare config parameters (default is no change)
-    LPSTR displayName = NULL;
-    DWORD serviceType = SERVICE_NO_CHANGE;
-    DWORD startType = SERVICE_NO_CHANGE;
-    DWORD errorControl = SERVICE_NO_CHANGE;
-    LPSTR binaryPathName = NULL;
-    LPSTR loadOrderGroup = NULL;
-    LPSTR dependencies = NULL;
-    LPSTR serviceAccount = NULL;
-    LPSTR password = NULL;
-    std::string groupStr;
-    std::string dependStr;
-    std::string accountStr;
-    std::string passwordStr;
-
-    // Set displayName if provided
-    if (args.count("displayname")) {
-        displayName = const_cast<LPSTR>(args.at("displayname").c_str());
-    }
-
-    // Set service type if provided
-    if (args.count("type")) {
-        std::string type = args.at("type");
-        if (type == "own") serviceType = SERVICE_WIN32_OWN_PROCESS;
-        else if (type == "share") serviceType = SERVICE_WIN32_SHARE_PROCESS;
-        else if (type == "kernel") serviceType = SERVICE_KERNEL_DRIVER;
-        else if (type == "filesys") serviceType = SERVICE_FILE_SYSTEM_DRIVER;
-        else if (type == "rec") serviceType = SERVICE_FILE_SYSTEM_DRIVER | SERVICE_RECOGNIZER_DRIVER;
-        else if (type == "interact type=own") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_OWN_PROCESS;
-        else if (type == "interact type=share") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_SHARE_PROCESS;
-
-
-    }
-
-    // Set startType if provided
-    if (args.count("start")) {
-        std::string start = args.at("start");
-        if (start == "boot") startType = SERVICE_BOOT_START;
-        else if (start == "system") startType = SERVICE_SYSTEM_START;
-        else if (start == "auto") startType = SERVICE_AUTO_START;
-        else if (start == "demand") startType = SERVICE_DEMAND_START;
-        else if (start == "disabled") startType = SERVICE_DISABLED;
-        // We'll handle delayed-auto separately after ChangeServiceConfig
-    }
-
-    // Set error control if provided
-    if (args.count("error")) {
-        std::string error = args.at("error");
-        if (error == "normal") errorControl = SERVICE_ERROR_NORMAL;
-        else if (error == "severe") errorControl = SERVICE_ERROR_SEVERE;
-        else if (error == "critical") errorControl = SERVICE_ERROR_CRITICAL;
-        else if (error == "ignore") errorControl = SERVICE_ERROR_IGNORE;
-    }
-
-    // Set binaryPathName if provided
-    if (args.count("binpath")) {
-        binaryPathName = const_cast<LPSTR>(args.at("binpath").c_str());
-    }
-
-    // Set load ordering group if provided
-    if (args.count("group")) {
-        groupStr = args.at("group");
-        loadOrderGroup = const_cast<LPSTR>(groupStr.c_str());
-    }
-
-    // Process dependencies if provided
-    if (args.count("depend")) {
-        // Convert forward slashes to null characters and add double null at end
-        dependStr = args.at("depend");
-        size_t pos = 0;
-        while ((pos = dependStr.find('/', pos)) != std::string::npos) {
-            dependStr.replace(pos, 1, 1, '\0');
-            pos++;
-        }
-        dependStr.push_back('\0'); // Add terminating null
-        dependencies = const_cast<LPSTR>(dependStr.c_str());
+/**
+ * The subset of the Win32 service control manager API that scclone uses
+ * Methods have the same names, parameters and GetLastError() behaviour as the
+ * Win32 functions, so command code reads the same against either backend
+ */
+class ScmBackend {
+public:
+    virtual ~ScmBackend() {}
+
+    virtual SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) = 0;
+    virtual SC_HANDLE OpenServiceW(SC_HANDLE scManager, LPCWSTR serviceName, DWORD desiredAccess) = 0;
+    virtual BOOL CloseServiceHandle(SC_HANDLE handle) = 0;
+    virtual BOOL QueryServiceStatusEx(SC_HANDLE service, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL QueryServiceConfigW(SC_HANDLE service, LPQUERY_SERVICE_CONFIGW config,
+        DWORD bufferSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL QueryServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL ChangeServiceConfigW(SC_HANDLE service, DWORD serviceType, DWORD startType, DWORD errorControl,
+        LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies,
+        LPCWSTR serviceStartName, LPCWSTR password, LPCWSTR displayName) = 0;
+    virtual BOOL ChangeServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPVOID info) = 0;
+    virtual SC_HANDLE CreateServiceW(SC_HANDLE scManager, LPCWSTR serviceName, LPCWSTR displayName,
+        DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl, LPCWSTR binaryPathName,
+        LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) = 0;
+    virtual BOOL DeleteService(SC_HANDLE service) = 0;
+    virtual BOOL StartServiceW(SC_HANDLE service, DWORD numArgs, LPCWSTR* args) = 0;
+    virtual BOOL ControlService(SC_HANDLE service, DWORD control, LPSERVICE_STATUS status) = 0;
+    virtual BOOL EnumServicesStatusExW(SC_HANDLE scManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+        DWORD serviceState, LPBYTE buffer, DWORD bufferSize, LPDWORD bytesNeeded, LPDWORD servicesReturned,
+        LPDWORD resumeHandle, LPCWSTR groupName) = 0;
+};
+
+#ifdef _WIN32
+/**
+ * Backend that forwards straight to the Win32 API
+ */
+class Win32ScmBackend : public ScmBackend {
+public:
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) override {
+        return ::OpenSCManagerW(machineName, databaseName, desiredAccess);
     }
-
-    // Set account name if provided
-    if (args.count("obj")) {
-        accountStr = args.at("obj");
-        serviceAccount = const_cast<LPSTR>(accountStr.c_str());
+    SC_HANDLE OpenServiceW(SC_HANDLE scManager, LPCWSTR serviceName, DWORD desiredAccess) override {
+        return ::OpenServiceW(scManager, serviceName, desiredAccess);
     }
-
-    // Set password if provided
-    if (args.count("password")) {
-        passwordStr = args.at("password");
-        password = const_cast<LPSTR>(passwordStr.c_str());
+    BOOL CloseServiceHandle(SC_HANDLE handle) override {
+        return ::CloseServiceHandle(handle);
     }
-
-
-    // Debug output for service type
-    std::cout << "Debug - Service Type (numeric value): " << serviceType << std::endl;
-    std::cout << "Debug - Service Type (flags): ";
-    if (serviceType == SERVICE_NO_CHANGE) std::cout << "SERVICE_NO_CHANGE";
-    else {
-        if (serviceType & SERVICE_KERNEL_DRIVER) std::cout << "SERVICE_KERNEL_DRIVER ";
-        if (serviceType & SERVICE_FILE_SYSTEM_DRIVER) std::cout << "SERVICE_FILE_SYSTEM_DRIVER ";
-        if (serviceType & SERVICE_WIN32_OWN_PROCESS) std::cout << "SERVICE_WIN32_OWN_PROCESS ";
-        if (serviceType & SERVICE_WIN32_SHARE_PROCESS) std::cout << "SERVICE_WIN32_SHARE_PROCESS ";
-        if (serviceType & SERVICE_INTERACTIVE_PROCESS) std::cout << "SERVICE_INTERACTIVE_PROCESS ";
-    }
-    std::cout << std::endl;
-
-    // Also print the raw type string for debugging
-    std::cout << "Debug - Type string from args: '" << args.at("type") << "'" << std::endl;
-
-
-    // Call ChangeServiceConfig to apply changes
-    if (!ChangeServiceConfigA(
-        service,            // Service handle
-        serviceType,        // Service type
-        startType,          // Start type
-        errorControl,       // Error control
-        binaryPathName,     // Binary path
-        loadOrderGroup,     // Load ordering group
-        NULL,               // Tag ID (not changing - can't be changed after creation)
-        dependencies,       // Dependencies
-        serviceAccount,     // Account name
-        password,           // Password
-        displayName         // Display name
-    )) {
-        std::cerr << "Failed to configure service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+    BOOL QueryServiceStatusEx(SC_HANDLE service, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceStatusEx(service, infoLevel, buffer, bufferSize, bytesNeeded);
     }
-
-    // Set description if provided
-    if (args.count("description")) {
-        SERVICE_DESCRIPTIONA desc = { 0 };
-        desc.lpDescription = const_cast<LPSTR>(args.at("description").c_str());
-        if (!ChangeServiceConfig2A(service, SERVICE_CONFIG_DESCRIPTION, &desc)) {
-            std::cerr << "Warning: Failed to set service description: " << GetLastErrorAsString() << std::endl;
-        }
+    BOOL QueryServiceConfigW(SC_HANDLE service, LPQUERY_SERVICE_CONFIGW config,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceConfigW(service, config, bufferSize, bytesNeeded);
     }
-
-    // Set delayed auto-start if specified
-    if (args.count("start") && args.at("start") == "delayed-auto") {
-        SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { TRUE };
-        if (!ChangeServiceConfig2A(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, &delayedInfo)) {
-            std::cerr << "Warning: Failed to set delayed auto-start: " << GetLastErrorAsString() << std::endl;
-        }
+    BOOL QueryServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceConfig2W(service, infoLevel, buffer, bufferSize, bytesNeeded);
     }
-
-    std::cout << "Service configuration updated successfully." << std::endl;
-
-    // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
-    return true;
-}
+    BOOL ChangeServiceConfigW(SC_HANDLE service, DWORD serviceType, DWORD startType, DWORD errorControl,
+        LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies,
+        LPCWSTR serviceStartName, LPCWSTR password, LPCWSTR displayName) override {
+        return ::ChangeServiceConfigW(service, serviceType, startType, errorControl, binaryPathName,
+            loadOrderGroup, tagId, dependencies, serviceStartName, password, displayName);
+    }
+    BOOL ChangeServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPVOID info) override {
+        return ::ChangeServiceConfig2W(service, infoLevel, info);
+    }
+    SC_HANDLE CreateServiceW(SC_HANDLE scManager, LPCWSTR serviceName, LPCWSTR displayName,
+        DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl, LPCWSTR binaryPathName,
+        LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) override {
+        return ::CreateServiceW(scManager, serviceName, displayName, desiredAccess, serviceType, startType,
+            errorControl, binaryPathName, loadOrderGroup, tagId, dependencies, serviceStartName, password);
+    }
+    BOOL DeleteService(SC_HANDLE service) override {
+        return ::DeleteService(service);
+    }
+    BOOL StartServiceW(SC_HANDLE service, DWORD numArgs, LPCWSTR* args) override {
+        return ::StartServiceW(service, numArgs, args);
+    }
+    BOOL ControlService(SC_HANDLE service, DWORD control, LPSERVICE_STATUS status) override {
+        return ::ControlService(service, control, status);
+    }
+    BOOL EnumServicesStatusExW(SC_HANDLE scManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+        DWORD serviceState, LPBYTE buffer, DWORD bufferSize, LPDWORD bytesNeeded, LPDWORD servicesReturned,
+        LPDWORD resumeHandle, LPCWSTR groupName) override {
+        return ::EnumServicesStatusExW(scManager, infoLevel, serviceType, serviceState, buffer, bufferSize,
+            bytesNeeded, servicesReturned, resumeHandle, groupName);
+    }
+};
+#endif
 
 /**
- * Sets the failure actions for a Windows service
- * Similar to "sc failure <service> ..."
- *
- * @param serviceName Name of the service to configure
- * @param args Map of failure action parameters
- * @return true if successful, false otherwise
+ * One service in the simulated SCM: its configuration plus a small state machine
+ * driven by configured start/stop latencies and an optional crash schedule
  */
+struct SimService {
+    // Configuration (as CreateService/ChangeServiceConfig would set it)
+    std::wstring name;
+    std::wstring displayName;
+    std::wstring binaryPath;
+    std::wstring loadOrderGroup;
+    std::vector<std::wstring> dependencies;
+    std::wstring account = L"LocalSystem";
+    std::wstring description;
+    DWORD serviceType = SERVICE_WIN32_OWN_PROCESS;
+    DWORD startType = SERVICE_DEMAND_START;
+    DWORD errorControl = SERVICE_ERROR_NORMAL;
+    DWORD tagId = 0;
+    bool delayedAutoStart = false;
+    DWORD resetPeriod = 0;                  // Seconds without failure before the failure count resets
+    std::wstring rebootMsg;
+    std::wstring failureCommand;
+    std::vector<SC_ACTION> failureActions;
+    bool failureActionsOnNonCrash = false;
+    std::vector<ServiceTrigger> triggers;
+    DWORD preshutdownTimeoutMs = 180000;    // The SCM's default
+
+    // Behaviour
+    DWORD startLatencyMs = 0;               // START_PENDING -> RUNNING
+    DWORD stopLatencyMs = 0;                // STOP_PENDING -> STOPPED
+    DWORD pauseLatencyMs = 0;               // PAUSE_PENDING -> PAUSED and CONTINUE_PENDING -> RUNNING
+    DWORD controlsAccepted = SERVICE_ACCEPT_STOP;
+    DWORD crashAfterMs = 0;                 // Crash this long after reaching RUNNING (0 = never)
+
+    // Runtime state
+    DWORD state = SERVICE_STOPPED;
+    DWORD pid = 0;
+    DWORD exitCode = 0;
+    ULONGLONG transitionAt = 0;             // When the current pending state completes
+    ULONGLONG runningSince = 0;
+    ULONGLONG restartAt = 0;                // Restart scheduled by a failure action (0 = none)
+    ULONGLONG lastFailureAt = 0;
+    DWORD failureCount = 0;
+    int openHandles = 0;
+    bool markedForDelete = false;
+};
 
-bool SetServiceFailureActions(const std::string& serviceName, const std::map<std::string, std::string>& args) {
-    // Open a handle to the service control manager with full access
-    SC_HANDLE scManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!scManager) {
-        std::cerr << "Failed to open service control manager: " << GetLastErrorAsString() << std::endl;
-        return false;
+/**
+ * In-process service control manager for testing and what-if runs
+ * Follows the Win32 contracts the commands rely on (buffer sizing, ERROR_MORE_DATA
+ * paging, error codes for wrong states) and advances each service's state machine
+ * lazily whenever the service is looked at.
+ */
+class SimulatedScm : public ScmBackend {
+public:
+    /**
+     * Adds or replaces a service in the database
+     */
+    void AddService(const SimService& service) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService copy = service;
+        if (copy.state == SERVICE_RUNNING) {
+            if (!copy.pid) copy.pid = AllocatePid();
+            copy.runningSince = ClockNow();
+        }
+        // PIDs given by a snapshot are never handed out again
+        nextPid_ = (std::max)(nextPid_, copy.pid - copy.pid % 4);
+        services_[Key(copy.name)] = copy;
     }
 
-    std::cout << "Attempting to configure service: '" << serviceName << "'" << std::endl;
+    /**
+     * Returns a copy of a service's model, including the behaviour a snapshot gave it
+     * (latencies, accepted controls, crash schedule) that the SCM API does not expose
+     */
+    bool GetServiceModel(const std::wstring& serviceName, SimService& service) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = services_.find(Key(serviceName));
+        if (it == services_.end()) return false;
+        service = it->second;
+        return true;
+    }
 
-    // Open a handle to the specified service with full access
-    SC_HANDLE service = OpenServiceA(scManager, serviceName.c_str(), SERVICE_ALL_ACCESS);
-    if (!service) {
-        std::cerr << "Failed to open service: " << GetLastErrorAsString() << std::endl;
-        CloseServiceHandle(scManager);
-        return false;
+    /**
+     * Returns a service's configured start latency (START_PENDING -> RUNNING)
+     * Not part of the SCM API; lets analyses use the latencies recorded in a snapshot
+     */
+    bool GetStartLatency(const std::wstring& serviceName, DWORD& latencyMs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = services_.find(Key(serviceName));
+        if (it == services_.end()) return false;
+        latencyMs = it->second.startLatencyMs;
+        return true;
     }
 
-    // Initialize service failure actions structure with zeros
-    SERVICE_FAILURE_ACTIONSA failureActions;
-    ZeroMemory(&failureActions, sizeof(SERVICE_FAILURE_ACTIONSA));
+    SC_HANDLE OpenSCManagerW(LPCWSTR, LPCWSTR, DWORD) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return NewHandle(true, L"");
+    }
 
-    // ---------------- Parse Reset Period ----------------
-    // Get and process reset period (default to 1 day/86400 seconds if not specified)
-    int resetPeriod = 86400; // Default 1 day in seconds
-    if (args.count("reset")) {
-        try {
-            std::string resetValue = args.at("reset");
-            // Clean up the value (remove quotes, trim whitespace)
-            resetValue.erase(std::remove(resetValue.begin(), resetValue.end(), '"'), resetValue.end());
-            resetValue.erase(std::remove(resetValue.begin(), resetValue.end(), ' '), resetValue.end());
+    SC_HANDLE OpenServiceW(SC_HANDLE scManager, LPCWSTR serviceName, DWORD) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!IsManager(scManager)) return FailHandle(ERROR_INVALID_HANDLE);
+        if (!serviceName) return FailHandle(ERROR_INVALID_NAME);
+        auto it = services_.find(Key(serviceName));
+        if (it == services_.end()) return FailHandle(ERROR_SERVICE_DOES_NOT_EXIST);
+        return NewHandle(false, it->first);
+    }
 
-            resetPeriod = std::stoi(resetValue);
-            std::cout << "Setting reset period to: " << resetPeriod << " seconds" << std::endl;
-        }
-        catch (const std::exception& e) {
-            std::cerr << "Invalid reset period value, using default (86400): " << e.what() << std::endl;
+    BOOL CloseServiceHandle(SC_HANDLE handle) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = handles_.find(handle);
+        if (it == handles_.end()) return Fail(ERROR_INVALID_HANDLE);
+        std::wstring key = it->second.serviceKey;
+        handles_.erase(it);
+        delete reinterpret_cast<char*>(handle);
+
+        auto svc = services_.find(key);
+        if (svc != services_.end()) {
+            svc->second.openHandles--;
+            RemoveIfDeleted(svc);
         }
+        return TRUE;
     }
-    failureActions.dwResetPeriod = resetPeriod;
-
-    // ---------------- Process Command and Reboot Message ----------------
-    // These strings must remain in scope for the duration of the API call
-    std::string command;
-    std::string rebootMsg;
 
-    // Set reboot message if provided
-    if (args.count("reboot")) {
-        rebootMsg = args.at("reboot");
-        failureActions.lpRebootMsg = const_cast<LPSTR>(rebootMsg.c_str());
-        std::cout << "Setting reboot message: '" << rebootMsg << "'" << std::endl;
+    BOOL QueryServiceStatusEx(SC_HANDLE service, SC_STATUS_TYPE, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        *bytesNeeded = sizeof(SERVICE_STATUS_PROCESS);
+        if (!buffer || bufferSize < sizeof(SERVICE_STATUS_PROCESS)) return Fail(ERROR_INSUFFICIENT_BUFFER);
+        FillStatus(*svc, *(LPSERVICE_STATUS_PROCESS)buffer);
+        return TRUE;
     }
 
-    // Set command to run on failure if provided
-    if (args.count("command")) {
-        command = args.at("command");
-        failureActions.lpCommand = const_cast<LPSTR>(command.c_str());
-        std::cout << "Setting command: '" << command << "'" << std::endl;
+    BOOL QueryServiceConfigW(SC_HANDLE service, LPQUERY_SERVICE_CONFIGW config,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+
+        std::wstring dependencies = JoinMultiString(svc->dependencies);
+        size_t needed = sizeof(QUERY_SERVICE_CONFIGW) + sizeof(wchar_t) * (svc->binaryPath.size() + 1 +
+            svc->loadOrderGroup.size() + 1 + dependencies.size() + 1 + svc->account.size() + 1 +
+            svc->displayName.size() + 1);
+        *bytesNeeded = (DWORD)needed;
+        if (!config || bufferSize < needed) return Fail(ERROR_INSUFFICIENT_BUFFER);
+
+        wchar_t* cursor = (wchar_t*)(config + 1);
+        config->dwServiceType = svc->serviceType;
+        config->dwStartType = svc->startType;
+        config->dwErrorControl = svc->errorControl;
+        config->dwTagId = svc->tagId;
+        config->lpBinaryPathName = PackString(cursor, svc->binaryPath);
+        config->lpLoadOrderGroup = PackString(cursor, svc->loadOrderGroup);
+        config->lpDependencies = PackString(cursor, dependencies);
+        config->lpServiceStartName = PackString(cursor, svc->account);
+        config->lpDisplayName = PackString(cursor, svc->displayName);
+        return TRUE;
     }
 
-    // ---------------- Process Actions ----------------
-    // Container for our actions (will be copied to a fixed array for the API)
-    std::vector<SC_ACTION> actionsVector;
+    BOOL QueryServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPBYTE buffer,
+        DWORD bufferSize, LPDWORD bytesNeeded) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+
+        switch (infoLevel) {
+        case SERVICE_CONFIG_DESCRIPTION: {
+            size_t needed = sizeof(SERVICE_DESCRIPTIONW) +
+                (svc->description.empty() ? 0 : sizeof(wchar_t) * (svc->description.size() + 1));
+            *bytesNeeded = (DWORD)needed;
+            if (!buffer || bufferSize < needed) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            LPSERVICE_DESCRIPTIONW desc = (LPSERVICE_DESCRIPTIONW)buffer;
+            wchar_t* cursor = (wchar_t*)(desc + 1);
+            desc->lpDescription = svc->description.empty() ? NULL : PackString(cursor, svc->description);
+            return TRUE;
+        }
+        case SERVICE_CONFIG_FAILURE_ACTIONS: {
+            size_t needed = sizeof(SERVICE_FAILURE_ACTIONSW) + sizeof(SC_ACTION) * svc->failureActions.size() +
+                (svc->rebootMsg.empty() ? 0 : sizeof(wchar_t) * (svc->rebootMsg.size() + 1)) +
+                (svc->failureCommand.empty() ? 0 : sizeof(wchar_t) * (svc->failureCommand.size() + 1));
+            *bytesNeeded = (DWORD)needed;
+            if (!buffer || bufferSize < needed) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            LPSERVICE_FAILURE_ACTIONSW actions = (LPSERVICE_FAILURE_ACTIONSW)buffer;
+            SC_ACTION* actionArray = (SC_ACTION*)(actions + 1);
+            wchar_t* cursor = (wchar_t*)(actionArray + svc->failureActions.size());
+            actions->dwResetPeriod = svc->resetPeriod;
+            actions->cActions = (DWORD)svc->failureActions.size();
+            actions->lpsaActions = svc->failureActions.empty() ? NULL : actionArray;
+            for (size_t i = 0; i < svc->failureActions.size(); i++) actionArray[i] = svc->failureActions[i];
+            actions->lpRebootMsg = svc->rebootMsg.empty() ? NULL : PackString(cursor, svc->rebootMsg);
+            actions->lpCommand = svc->failureCommand.empty() ? NULL : PackString(cursor, svc->failureCommand);
+            return TRUE;
+        }
+        case SERVICE_CONFIG_DELAYED_AUTO_START_INFO: {
+            *bytesNeeded = sizeof(SERVICE_DELAYED_AUTO_START_INFO);
+            if (!buffer || bufferSize < sizeof(SERVICE_DELAYED_AUTO_START_INFO)) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            ((SERVICE_DELAYED_AUTO_START_INFO*)buffer)->fDelayedAutostart = svc->delayedAutoStart;
+            return TRUE;
+        }
+        case SERVICE_CONFIG_FAILURE_ACTIONS_FLAG: {
+            *bytesNeeded = sizeof(SERVICE_FAILURE_ACTIONS_FLAG);
+            if (!buffer || bufferSize < sizeof(SERVICE_FAILURE_ACTIONS_FLAG)) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            ((SERVICE_FAILURE_ACTIONS_FLAG*)buffer)->fFailureActionsOnNonCrashFailures = svc->failureActionsOnNonCrash;
+            return TRUE;
+        }
+        case SERVICE_CONFIG_PRESHUTDOWN_INFO: {
+            *bytesNeeded = sizeof(SERVICE_PRESHUTDOWN_INFO);
+            if (!buffer || bufferSize < sizeof(SERVICE_PRESHUTDOWN_INFO)) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            ((SERVICE_PRESHUTDOWN_INFO*)buffer)->dwPreshutdownTimeout = svc->preshutdownTimeoutMs;
+            return TRUE;
+        }
+        case SERVICE_CONFIG_TRIGGER_INFO: {
+            size_t needed = PackServiceTriggers(svc->triggers, NULL, 0);
+            *bytesNeeded = (DWORD)needed;
+            if (!buffer || bufferSize < needed) return Fail(ERROR_INSUFFICIENT_BUFFER);
+            PackServiceTriggers(svc->triggers, buffer, bufferSize);
+            return TRUE;
+        }
+        default:
+            return Fail(ERROR_INVALID_LEVEL);
+        }
+    }
 
-    if (args.count("actions")) {
-        std::string actionsStr = args.at("actions");
-        std::cout << "Parsing actions string: '" << actionsStr << "'" << std::endl;
+    BOOL ChangeServiceConfigW(SC_HANDLE service, DWORD serviceType, DWORD startType, DWORD errorControl,
+        LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies,
+        LPCWSTR serviceStartName, LPCWSTR, LPCWSTR displayName) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        if (svc->markedForDelete) return Fail(ERROR_SERVICE_MARKED_FOR_DELETE);
+
+        if (serviceType != SERVICE_NO_CHANGE) svc->serviceType = serviceType;
+        if (startType != SERVICE_NO_CHANGE) svc->startType = startType;
+        if (errorControl != SERVICE_NO_CHANGE) svc->errorControl = errorControl;
+        if (binaryPathName) svc->binaryPath = binaryPathName;
+        if (loadOrderGroup) svc->loadOrderGroup = loadOrderGroup;
+        if (tagId) *tagId = svc->tagId;
+        if (dependencies) svc->dependencies = SplitMultiString(dependencies);
+        if (serviceStartName) svc->account = serviceStartName;
+        if (displayName) svc->displayName = displayName;
+        return TRUE;
+    }
 
-        // Remove quotes
-        actionsStr.erase(std::remove(actionsStr.begin(), actionsStr.end(), '"'), actionsStr.end());
+    BOOL ChangeServiceConfig2W(SC_HANDLE service, DWORD infoLevel, LPVOID info) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        if (!info) return Fail(ERROR_INVALID_PARAMETER);
+
+        switch (infoLevel) {
+        case SERVICE_CONFIG_DESCRIPTION: {
+            LPSERVICE_DESCRIPTIONW desc = (LPSERVICE_DESCRIPTIONW)info;
+            if (desc->lpDescription) svc->description = desc->lpDescription;
+            return TRUE;
+        }
+        case SERVICE_CONFIG_FAILURE_ACTIONS: {
+            // NULL members mean "no change", as in the Win32 API
+            LPSERVICE_FAILURE_ACTIONSW actions = (LPSERVICE_FAILURE_ACTIONSW)info;
+            if (actions->lpsaActions) {
+                svc->resetPeriod = actions->dwResetPeriod;
+                svc->failureActions.assign(actions->lpsaActions, actions->lpsaActions + actions->cActions);
+            }
+            if (actions->lpRebootMsg) svc->rebootMsg = actions->lpRebootMsg;
+            if (actions->lpCommand) svc->failureCommand = actions->lpCommand;
+            return TRUE;
+        }
+        case SERVICE_CONFIG_DELAYED_AUTO_START_INFO:
+            svc->delayedAutoStart = ((SERVICE_DELAYED_AUTO_START_INFO*)info)->fDelayedAutostart != FALSE;
+            return TRUE;
+        case SERVICE_CONFIG_FAILURE_ACTIONS_FLAG:
+            svc->failureActionsOnNonCrash = ((SERVICE_FAILURE_ACTIONS_FLAG*)info)->fFailureActionsOnNonCrashFailures != FALSE;
+            return TRUE;
+        case SERVICE_CONFIG_PRESHUTDOWN_INFO:
+            svc->preshutdownTimeoutMs = ((SERVICE_PRESHUTDOWN_INFO*)info)->dwPreshutdownTimeout;
+            return TRUE;
+        case SERVICE_CONFIG_TRIGGER_INFO: {
+            // cTriggers == 0 deletes every trigger; otherwise the list replaces the old one
+            const SERVICE_TRIGGER_INFO* triggerInfo = (const SERVICE_TRIGGER_INFO*)info;
+            if (triggerInfo->cTriggers && !triggerInfo->pTriggers) return Fail(ERROR_INVALID_PARAMETER);
+            for (DWORD t = 0; t < triggerInfo->cTriggers; t++) {
+                const SERVICE_TRIGGER& trigger = triggerInfo->pTriggers[t];
+                if (!trigger.pTriggerSubtype || (trigger.cDataItems && !trigger.pDataItems) ||
+                    (trigger.dwAction != SERVICE_TRIGGER_ACTION_SERVICE_START && trigger.dwAction != SERVICE_TRIGGER_ACTION_SERVICE_STOP)) {
+                    return Fail(ERROR_INVALID_PARAMETER);
+                }
+            }
+            UnpackServiceTriggers(triggerInfo, svc->triggers);
+            return TRUE;
+        }
+        default:
+            return Fail(ERROR_INVALID_LEVEL);
+        }
+    }
 
-        // Split into action/delay pairs
-        std::vector<std::string> pairs;
-        size_t pos = 0;
-        std::string delimiter = "/";
+    SC_HANDLE CreateServiceW(SC_HANDLE scManager, LPCWSTR serviceName, LPCWSTR displayName,
+        DWORD, DWORD serviceType, DWORD startType, DWORD errorControl, LPCWSTR binaryPathName,
+        LPCWSTR loadOrderGroup, LPDWORD tagId, LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!IsManager(scManager)) return FailHandle(ERROR_INVALID_HANDLE);
 
-        while ((pos = actionsStr.find(delimiter)) != std::string::npos) {
-            std::string token = actionsStr.substr(0, pos);
-            token.erase(0, token.find_first_not_of(" \t"));
-            token.erase(token.find_last_not_of(" \t") + 1);
-            pairs.push_back(token);
-            actionsStr.erase(0, pos + delimiter.length());
+        std::wstring name = serviceName ? serviceName : L"";
+        if (name.empty() || name.size() > 256 || name.find_first_of(L"/\\") != std::wstring::npos) {
+            return FailHandle(ERROR_INVALID_NAME);
         }
-
-        // Add the last part
-        if (!actionsStr.empty()) {
-            actionsStr.erase(0, actionsStr.find_first_not_of(" \t"));
-            actionsStr.erase(actionsStr.find_last_not_of(" \t") + 1);
-            pairs.push_back(actionsStr);
+        auto existing = services_.find(Key(name));
+        if (existing != services_.end()) {
+            return FailHandle(existing->second.markedForDelete ? ERROR_SERVICE_MARKED_FOR_DELETE : ERROR_SERVICE_EXISTS);
+        }
+        if (!binaryPathName || !*binaryPathName) return FailHandle(ERROR_INVALID_PARAMETER);
+
+        SimService svc;
+        svc.name = name;
+        svc.displayName = (displayName && *displayName) ? displayName : name;
+        svc.serviceType = serviceType;
+        svc.startType = startType;
+        svc.errorControl = errorControl;
+        svc.binaryPath = binaryPathName;
+        if (loadOrderGroup) svc.loadOrderGroup = loadOrderGroup;
+        if (dependencies) svc.dependencies = SplitMultiString(dependencies);
+        if (serviceStartName && *serviceStartName) svc.account = serviceStartName;
+        if (tagId) {
+            // Tags are unique within a load order group
+            DWORD maxTag = 0;
+            for (const auto& entry : services_) {
+                if (Key(entry.second.loadOrderGroup) == Key(svc.loadOrderGroup)) maxTag = (std::max)(maxTag, entry.second.tagId);
+            }
+            svc.tagId = *tagId = maxTag + 1;
         }
+        std::wstring key = Key(name);
+        services_[key] = svc;
+        return NewHandle(false, key);
+    }
 
-        // Process pairs for action type and delay
-        for (size_t i = 0; i < pairs.size() - 1; i += 2) {
-            SC_ACTION action;
-            ZeroMemory(&action, sizeof(SC_ACTION));
+    BOOL DeleteService(SC_HANDLE service) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        if (svc->markedForDelete) return Fail(ERROR_SERVICE_MARKED_FOR_DELETE);
+        // Like the real SCM, the entry goes away once it is stopped and the last handle is closed
+        svc->markedForDelete = true;
+        return TRUE;
+    }
 
-            // Process action type
-            std::string actionType = pairs[i];
-            if (actionType == "run") action.Type = SC_ACTION_RUN_COMMAND;
-            else if (actionType == "restart") action.Type = SC_ACTION_RESTART;
-            else if (actionType == "reboot") action.Type = SC_ACTION_REBOOT;
-            else if (actionType == "none") action.Type = SC_ACTION_NONE;
-            else {
-                std::cerr << "Invalid action type: " << actionType << ", using 'none'" << std::endl;
-                action.Type = SC_ACTION_NONE;
-            }
+    BOOL StartServiceW(SC_HANDLE service, DWORD, LPCWSTR*) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        std::vector<std::wstring> visiting;
+        ULONGLONG readyAt = 0;
+        DWORD error = StartLocked(*svc, ClockNow(), visiting, readyAt);
+        return error ? Fail(error) : TRUE;
+    }
 
-            // Process delay
-            if (i + 1 < pairs.size()) {
-                try {
-                    action.Delay = std::stoi(pairs[i + 1]) * 1000; // Convert seconds to milliseconds
-                    std::cout << "Adding action: Type=" << action.Type
-                        << ", Delay=" << action.Delay / 1000 << " seconds" << std::endl;
-                }
-                catch (const std::exception& e) {
-                    std::cerr << "Invalid delay value: " << e.what() << ", using 0" << std::endl;
-                    action.Delay = 0;
+    BOOL ControlService(SC_HANDLE service, DWORD control, LPSERVICE_STATUS status) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SimService* svc = Lookup(service);
+        if (!svc) return Fail(ERROR_INVALID_HANDLE);
+        ULONGLONG now = ClockNow();
+
+        // Every control needs a live service that is not in the middle of a transition
+        if (svc->state == SERVICE_STOPPED) return Fail(ERROR_SERVICE_NOT_ACTIVE);
+        bool settled = svc->state == SERVICE_RUNNING || svc->state == SERVICE_PAUSED;
+        if (!settled && control != SERVICE_CONTROL_INTERROGATE) return Fail(ERROR_SERVICE_CANNOT_ACCEPT_CTRL);
+
+        switch (control) {
+        case SERVICE_CONTROL_STOP:
+            if (!(svc->controlsAccepted & SERVICE_ACCEPT_STOP)) return Fail(ERROR_INVALID_SERVICE_CONTROL);
+            for (auto& entry : services_) {
+                Advance(entry.second, now);
+                if (entry.second.state != SERVICE_STOPPED && DependsOn(entry.second, svc->name)) {
+                    return Fail(ERROR_DEPENDENT_SERVICES_RUNNING);
                 }
             }
+            svc->state = SERVICE_STOP_PENDING;
+            svc->transitionAt = now + svc->stopLatencyMs;
+            svc->restartAt = 0;
+            svc->exitCode = 0;
+            Advance(*svc, now);
+            break;
+        case SERVICE_CONTROL_PAUSE:
+            if (!(svc->controlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE)) return Fail(ERROR_INVALID_SERVICE_CONTROL);
+            if (svc->state == SERVICE_RUNNING) {
+                svc->state = SERVICE_PAUSE_PENDING;
+                svc->transitionAt = now + svc->pauseLatencyMs;
+                Advance(*svc, now);
+            }
+            break;
+        case SERVICE_CONTROL_CONTINUE:
+            if (!(svc->controlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE)) return Fail(ERROR_INVALID_SERVICE_CONTROL);
+            if (svc->state == SERVICE_PAUSED) {
+                svc->state = SERVICE_CONTINUE_PENDING;
+                svc->transitionAt = now + svc->pauseLatencyMs;
+                Advance(*svc, now);
+            }
+            break;
+        case SERVICE_CONTROL_INTERROGATE:
+            break;
+        case SERVICE_CONTROL_PARAMCHANGE:
+            if (!(svc->controlsAccepted & SERVICE_ACCEPT_PARAMCHANGE)) return Fail(ERROR_INVALID_SERVICE_CONTROL);
+            break;
+        default:
+            // User-defined codes are always passed to the service's handler
+            if (control < 128 || control > 255) return Fail(ERROR_INVALID_SERVICE_CONTROL);
+            break;
+        }
 
-            actionsVector.push_back(action);
+        if (status) {
+            SERVICE_STATUS_PROCESS full;
+            FillStatus(*svc, full);
+            memcpy(status, &full, sizeof(SERVICE_STATUS));
         }
+        return TRUE;
     }
 
-    // ---------------- Create fixed array for the API call ----------------
-    SC_ACTION* actionsArray = nullptr;
-
-    if (!actionsVector.empty()) {
-        // Allocate the fixed array
-        actionsArray = new SC_ACTION[actionsVector.size()];
-
-        // Copy the actions
-        for (size_t i = 0; i < actionsVector.size(); i++) {
-            actionsArray[i] = actionsVector[i];
+    BOOL EnumServicesStatusExW(SC_HANDLE scManager, SC_ENUM_TYPE, DWORD serviceType,
+        DWORD serviceState, LPBYTE buffer, DWORD bufferSize, LPDWORD bytesNeeded, LPDWORD servicesReturned,
+        LPDWORD resumeHandle, LPCWSTR) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!IsManager(scManager)) return Fail(ERROR_INVALID_HANDLE);
+        ULONGLONG now = ClockNow();
+
+        // Collect matching services in name order
+        std::vector<SimService*> matches;
+        for (auto& entry : services_) {
+            SimService& svc = entry.second;
+            Advance(svc, now);
+            if (!(svc.serviceType & serviceType)) continue;
+            bool active = svc.state != SERVICE_STOPPED;
+            if (serviceState == SERVICE_ACTIVE && !active) continue;
+            if (serviceState == SERVICE_INACTIVE && active) continue;
+            matches.push_back(&svc);
         }
 
-        // Set up the failure actions structure
-        failureActions.cActions = static_cast<DWORD>(actionsVector.size());
-        failureActions.lpsaActions = actionsArray;
+        // Fill as many entries as fit, starting at the resume point
+        size_t index = resumeHandle ? *resumeHandle : 0;
+        size_t used = 0;
+        size_t first = index;
+        for (; index < matches.size(); index++) {
+            size_t entrySize = EnumEntrySize(*matches[index]);
+            if (used + entrySize > bufferSize) break;
+            used += entrySize;
+        }
+        size_t count = index - first;
+
+        // Structs go at the front of the buffer and strings are packed from the back
+        LPENUM_SERVICE_STATUS_PROCESSW entries = (LPENUM_SERVICE_STATUS_PROCESSW)buffer;
+        wchar_t* cursor = (wchar_t*)(buffer + sizeof(ENUM_SERVICE_STATUS_PROCESSW) * count);
+        for (size_t i = 0; i < count; i++) {
+            SimService& svc = *matches[first + i];
+            entries[i].lpServiceName = PackString(cursor, svc.name);
+            entries[i].lpDisplayName = PackString(cursor, svc.displayName);
+            FillStatus(svc, entries[i].ServiceStatusProcess);
+        }
+        *servicesReturned = (DWORD)count;
+
+        if (index < matches.size()) {
+            size_t remaining = 0;
+            for (size_t i = index; i < matches.size(); i++) remaining += EnumEntrySize(*matches[i]);
+            *bytesNeeded = (DWORD)remaining;
+            if (resumeHandle) *resumeHandle = (DWORD)index;
+            return Fail(ERROR_MORE_DATA);
+        }
+        *bytesNeeded = 0;
+        if (resumeHandle) *resumeHandle = 0;
+        return TRUE;
     }
-    else {
-        std::cout << "No actions specified or properly parsed" << std::endl;
-        failureActions.cActions = 0;
-        failureActions.lpsaActions = nullptr;
+
+private:
+    struct SimHandle {
+        bool isManager;
+        std::wstring serviceKey;
+    };
+
+    std::mutex mutex_;
+    std::map<std::wstring, SimService> services_;   // Keyed by lowercase name
+    std::map<SC_HANDLE, SimHandle> handles_;
+    DWORD nextPid_ = 4000;
+
+    static std::wstring Key(const std::wstring& name) {
+        return ToLowerServiceName(name);
     }
 
-    // ---------------- Make the API call ----------------
-    BOOL result = ChangeServiceConfig2A(service, SERVICE_CONFIG_FAILURE_ACTIONS, &failureActions);
+    static BOOL Fail(DWORD error) {
+        SetLastError(error);
+        return FALSE;
+    }
 
-    // Clean up the actions array
-    if (actionsArray) {
-        delete[] actionsArray;
+    static SC_HANDLE FailHandle(DWORD error) {
+        SetLastError(error);
+        return NULL;
     }
 
-    if (!result) {
-        DWORD error = GetLastError();
-        std::cerr << "Failed to set service failure actions. Error code: " << error
-            << " - " << GetLastErrorAsString() << std::endl;
+    DWORD AllocatePid() {
+        nextPid_ += 4;
+        return nextPid_;
+    }
 
-        CloseServiceHandle(service);
-        CloseServiceHandle(scManager);
-        return false;
+    SC_HANDLE NewHandle(bool isManager, const std::wstring& serviceKey) {
+        // Each handle is a unique heap address; the map says what it refers to
+        SC_HANDLE handle = reinterpret_cast<SC_HANDLE>(new char);
+        handles_[handle] = SimHandle{ isManager, serviceKey };
+        if (!isManager) services_[serviceKey].openHandles++;
+        return handle;
     }
 
-    // Verify the config was actually applied
-    SERVICE_FAILURE_ACTIONSA verifyActions;
-    ZeroMemory(&verifyActions, sizeof(verifyActions));
-    DWORD bytesNeeded = 0;
+    bool IsManager(SC_HANDLE handle) {
+        auto it = handles_.find(handle);
+        return it != handles_.end() && it->second.isManager;
+    }
 
-    if (!QueryServiceConfig2A(service, SERVICE_CONFIG_FAILURE_ACTIONS,
-        reinterpret_cast<LPBYTE>(&verifyActions),
-        sizeof(verifyActions), &bytesNeeded)) {
-        std::cerr << "Warning: Failed to verify configuration: " << GetLastErrorAsString() << std::endl;
+    SimService* Lookup(SC_HANDLE handle) {
+        auto it = handles_.find(handle);
+        if (it == handles_.end() || it->second.isManager) return nullptr;
+        auto svc = services_.find(it->second.serviceKey);
+        if (svc == services_.end()) return nullptr;
+        Advance(svc->second, ClockNow());
+        return &svc->second;
     }
-    else {
-        std::cout << "Configuration verified:" << std::endl;
-        std::cout << "  Reset Period: " << verifyActions.dwResetPeriod << " seconds" << std::endl;
-        if (verifyActions.cActions > 0 && verifyActions.lpsaActions != nullptr) {
-            for (DWORD i = 0; i < verifyActions.cActions; i++) {
-                std::cout << "  Action " << i << ": Type=" << verifyActions.lpsaActions[i].Type
-                    << ", Delay=" << verifyActions.lpsaActions[i].Delay << "ms" << std::endl;
-            }
+
+    void RemoveIfDeleted(std::map<std::wstring, SimService>::iterator svc) {
+        if (svc->second.markedForDelete && svc->second.openHandles <= 0 && svc->second.state == SERVICE_STOPPED) {
+            services_.erase(svc);
         }
     }
 
-    std::cout << "Service failure actions configured successfully." << std::endl;
+    static LPWSTR PackString(wchar_t*& cursor, const std::wstring& value) {
+        LPWSTR start = cursor;
+        memcpy(cursor, value.c_str(), sizeof(wchar_t) * (value.size() + 1));
+        cursor += value.size() + 1;
+        return start;
+    }
+
+    static std::wstring JoinMultiString(const std::vector<std::wstring>& values) {
+        // "a\0b\0" - PackString adds the final terminator
+        std::wstring joined;
+        for (const auto& value : values) {
+            joined += value;
+            joined.push_back(L'\0');
+        }
+        return joined;
+    }
+
+    static std::vector<std::wstring> SplitMultiString(LPCWSTR values) {
+        std::vector<std::wstring> result;
+        while (values && *values) {
+            result.push_back(values);
+            values += result.back().size() + 1;
+        }
+        return result;
+    }
+
+    static size_t EnumEntrySize(const SimService& svc) {
+        return sizeof(ENUM_SERVICE_STATUS_PROCESSW) + sizeof(wchar_t) * (svc.name.size() + 1 + svc.displayName.size() + 1);
+    }
+
+    static bool DependsOn(const SimService& svc, const std::wstring& name) {
+        for (const auto& dep : svc.dependencies) {
+            if (Key(dep) == Key(name)) return true;
+        }
+        return false;
+    }
+
+    void FillStatus(const SimService& svc, SERVICE_STATUS_PROCESS& status) {
+        ZeroMemory(&status, sizeof(status));
+        status.dwServiceType = svc.serviceType;
+        status.dwCurrentState = svc.state;
+        status.dwControlsAccepted = (svc.state == SERVICE_RUNNING || svc.state == SERVICE_PAUSED) ? svc.controlsAccepted : 0;
+        status.dwWin32ExitCode = svc.exitCode;
+        status.dwProcessId = svc.pid;
+        if (svc.state == SERVICE_START_PENDING) status.dwWaitHint = svc.startLatencyMs;
+        if (svc.state == SERVICE_STOP_PENDING) status.dwWaitHint = svc.stopLatencyMs;
+        if (svc.state == SERVICE_PAUSE_PENDING || svc.state == SERVICE_CONTINUE_PENDING) status.dwWaitHint = svc.pauseLatencyMs;
+    }
+
+    /**
+     * Starts a service and, first, any stopped dependencies (as the SCM does)
+     * readyAt receives the time the service will reach RUNNING
+     */
+    DWORD StartLocked(SimService& svc, ULONGLONG now, std::vector<std::wstring>& visiting, ULONGLONG& readyAt) {
+        if (svc.markedForDelete) return ERROR_SERVICE_MARKED_FOR_DELETE;
+        if (std::find(visiting.begin(), visiting.end(), Key(svc.name)) != visiting.end()) return ERROR_CIRCULAR_DEPENDENCY;
+        if (svc.state == SERVICE_RUNNING || svc.state == SERVICE_START_PENDING) {
+            readyAt = svc.state == SERVICE_RUNNING ? now : svc.transitionAt;
+            return visiting.empty() ? ERROR_SERVICE_ALREADY_RUNNING : ERROR_SUCCESS;
+        }
+        if (svc.state != SERVICE_STOPPED) return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+        if (svc.startType == SERVICE_DISABLED) return visiting.empty() ? ERROR_SERVICE_DISABLED : ERROR_SERVICE_DEPENDENCY_FAIL;
+
+        // Dependencies must be running before this service's own start begins
+        visiting.push_back(Key(svc.name));
+        ULONGLONG dependenciesReady = now;
+        for (const auto& depName : svc.dependencies) {
+            if (!depName.empty() && depName[0] == L'+') {
+                // Group dependency (SC_GROUP_IDENTIFIER): met once any member of the group runs
+                ULONGLONG groupReady = 0;
+                for (auto& member : services_) {
+                    if (Key(member.second.loadOrderGroup) != Key(depName.substr(1))) continue;
+                    Advance(member.second, now);
+                    ULONGLONG memberReady = now;
+                    if (StartLocked(member.second, now, visiting, memberReady) == ERROR_SUCCESS) {
+                        groupReady = groupReady ? (std::min)(groupReady, memberReady) : memberReady;
+                    }
+                }
+                if (!groupReady) {
+                    visiting.pop_back();
+                    return ERROR_SERVICE_DEPENDENCY_FAIL;
+                }
+                dependenciesReady = (std::max)(dependenciesReady, groupReady);
+                continue;
+            }
+            auto dep = services_.find(Key(depName));
+            if (dep == services_.end()) {
+                visiting.pop_back();
+                return ERROR_SERVICE_DEPENDENCY_DELETED;
+            }
+            Advance(dep->second, now);
+            ULONGLONG depReady = now;
+            DWORD error = StartLocked(dep->second, now, visiting, depReady);
+            if (error) {
+                visiting.pop_back();
+                return visiting.empty() ? ERROR_SERVICE_DEPENDENCY_FAIL : error;
+            }
+            dependenciesReady = (std::max)(dependenciesReady, depReady);
+        }
+        visiting.pop_back();
+
+        svc.state = SERVICE_START_PENDING;
+        svc.transitionAt = dependenciesReady + svc.startLatencyMs;
+        svc.restartAt = 0;
+        svc.exitCode = 0;
+        readyAt = svc.transitionAt;
+        Advance(svc, now);
+        return ERROR_SUCCESS;
+    }
+
+    /**
+     * Handles a crash: applies the failure action for this failure count
+     */
+    void Crash(SimService& svc, ULONGLONG at) {
+        svc.state = SERVICE_STOPPED;
+        svc.pid = 0;
+        svc.exitCode = ERROR_PROCESS_ABORTED;
+
+        // The failure count resets after resetPeriod seconds without failures
+        if (svc.resetPeriod && svc.lastFailureAt && at - svc.lastFailureAt > (ULONGLONG)svc.resetPeriod * 1000) {
+            svc.failureCount = 0;
+        }
+        svc.failureCount++;
+        svc.lastFailureAt = at;
+
+        if (!svc.failureActions.empty()) {
+            size_t index = (std::min)((size_t)svc.failureCount - 1, svc.failureActions.size() - 1);
+            const SC_ACTION& action = svc.failureActions[index];
+            if (action.Type == SC_ACTION_RESTART) svc.restartAt = at + action.Delay;
+        }
+    }
+
+    /**
+     * Moves a service's state machine forward to the given time
+     */
+    void Advance(SimService& svc, ULONGLONG now) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            switch (svc.state) {
+            case SERVICE_START_PENDING:
+                if (now >= svc.transitionAt) {
+                    svc.state = SERVICE_RUNNING;
+                    svc.pid = AllocatePid();
+                    svc.runningSince = svc.transitionAt;
+                    changed = true;
+                }
+                break;
+            case SERVICE_STOP_PENDING:
+                if (now >= svc.transitionAt) {
+                    svc.state = SERVICE_STOPPED;
+                    svc.pid = 0;
+                    changed = true;
+                }
+                break;
+            case SERVICE_PAUSE_PENDING:
+                if (now >= svc.transitionAt) {
+                    svc.state = SERVICE_PAUSED;
+                    changed = true;
+                }
+                break;
+            case SERVICE_CONTINUE_PENDING:
+                if (now >= svc.transitionAt) {
+                    svc.state = SERVICE_RUNNING;
+                    changed = true;
+                }
+                break;
+            case SERVICE_RUNNING:
+                if (svc.crashAfterMs && now >= svc.runningSince + svc.crashAfterMs) {
+                    Crash(svc, svc.runningSince + svc.crashAfterMs);
+                    changed = true;
+                }
+                break;
+            case SERVICE_STOPPED:
+                if (svc.restartAt && now >= svc.restartAt) {
+                    svc.state = SERVICE_START_PENDING;
+                    svc.transitionAt = svc.restartAt + svc.startLatencyMs;
+                    svc.restartAt = 0;
+                    changed = true;
+                }
+                break;
+            }
+        }
+    }
+};
+
+/**
+ * Parses a service state name as used in snapshots ("running", "stopped", ...)
+ *
+ * @param name The state name
+ * @return The SERVICE_* state, or 0 if the name is not recognized
+ */
+DWORD ParseServiceStateName(const std::wstring& name) {
+    std::wstring lower = ToLowerServiceName(name);
+    if (lower == L"stopped") return SERVICE_STOPPED;
+    if (lower == L"start_pending" || lower == L"start-pending") return SERVICE_START_PENDING;
+    if (lower == L"stop_pending" || lower == L"stop-pending") return SERVICE_STOP_PENDING;
+    if (lower == L"running") return SERVICE_RUNNING;
+    if (lower == L"continue_pending" || lower == L"continue-pending") return SERVICE_CONTINUE_PENDING;
+    if (lower == L"pause_pending" || lower == L"pause-pending") return SERVICE_PAUSE_PENDING;
+    if (lower == L"paused") return SERVICE_PAUSED;
+    return 0;
+}
+
+/**
+ * Parses a failure action list in sc.exe form: action/delay_ms/action/delay_ms...
+ *
+ * @param value The action list
+ * @return The parsed actions (unknown action names become SC_ACTION_NONE)
+ */
+std::vector<SC_ACTION> ParseFailureActionList(const std::wstring& value) {
+    std::vector<SC_ACTION> actions;
+    std::vector<std::wstring> parts;
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t slash = value.find(L'/', start);
+        if (slash == std::wstring::npos) slash = value.size();
+        parts.push_back(value.substr(start, slash - start));
+        start = slash + 1;
+    }
+    for (size_t i = 0; i + 1 < parts.size(); i += 2) {
+        SC_ACTION action;
+        action.Type = SC_ACTION_NONE;
+        if (parts[i] == L"restart") action.Type = SC_ACTION_RESTART;
+        else if (parts[i] == L"reboot") action.Type = SC_ACTION_REBOOT;
+        else if (parts[i] == L"run") action.Type = SC_ACTION_RUN_COMMAND;
+        try {
+            action.Delay = (DWORD)std::stoul(parts[i + 1]);
+        }
+        catch (const std::exception&) {
+            action.Delay = 0;
+        }
+        actions.push_back(action);
+    }
+    return actions;
+}
+
+/**
+ * Opens a file by wide path with C stdio
+ *
+ * @param path The file path
+ * @param mode fopen mode, e.g. L"rb"
+ * @return The file, or NULL on failure
+ */
+FILE* OpenFileW(const std::wstring& path, const wchar_t* mode) {
+#ifdef _WIN32
+    return _wfopen(path.c_str(), mode);
+#else
+    return fopen(WStringToString(path).c_str(), WStringToString(mode).c_str());
+#endif
+}
+
+/**
+ * Reads an environment variable as a wide string
+ *
+ * @param name The variable name
+ * @return The value, or an empty string if it is not set
+ */
+std::wstring GetEnvironmentString(const wchar_t* name) {
+#ifdef _WIN32
+    const wchar_t* value = _wgetenv(name);
+    return value ? value : L"";
+#else
+    const char* value = getenv(WStringToString(name).c_str());
+    return value ? StringToWString(value) : L"";
+#endif
+}
+
+/**
+ * Returns the directory that holds scclone's own files: the restart history, audit
+ * journal and caches. On Windows this is %ProgramData%. Elsewhere it is ~/.scclone,
+ * created readable by its owner only, rather than /tmp, where another local user
+ * could plant a file or symbolic link under the expected name first.
+ *
+ * @return The directory, without a trailing separator
+ */
+std::wstring GetStateDirectory() {
+#ifdef _WIN32
+    std::wstring programData = GetEnvironmentString(L"ProgramData");
+    return programData.empty() ? std::wstring(L"C:\\ProgramData") : programData;
+#else
+    std::wstring home = GetEnvironmentString(L"HOME");
+    if (home.empty()) {
+        struct passwd* account = getpwuid(geteuid());
+        home = account && account->pw_dir ? StringToWString(account->pw_dir) : L"/";
+    }
+    std::wstring directory = home + (home.back() == L'/' ? L"" : L"/") + L".scclone";
+    mkdir(WStringToString(directory).c_str(), 0700);
+    return directory;
+#endif
+}
+
+/**
+ * Opens one of scclone's own files without following a symbolic link at the last
+ * path component, so a link planted under the name cannot redirect the access.
+ * Files are created readable by their owner only.
+ *
+ * @param path The file path
+ * @param mode "rb" to read, "ab" to append (creating the file), or "wb" to create a
+ *             file that must not exist yet, for the temporary copy of a file that is
+ *             replaced by renaming
+ * @return The file, or NULL on failure
+ */
+FILE* OpenStateFile(const std::wstring& path, const char* mode) {
+#ifdef _WIN32
+    return OpenFileW(path, StringToWString(mode).c_str());
+#else
+    int flags = O_NOFOLLOW | O_CLOEXEC;
+    if (mode[0] == 'r') flags |= O_RDONLY;
+    else if (mode[0] == 'a') flags |= O_WRONLY | O_APPEND | O_CREAT;
+    else flags |= O_WRONLY | O_CREAT | O_EXCL;
+    int fd = open(WStringToString(path).c_str(), flags, 0600);
+    if (fd < 0) return NULL;
+    FILE* file = fdopen(fd, mode);
+    if (!file) close(fd);
+    return file;
+#endif
+}
+
+/**
+ * Loads a service snapshot into a simulated SCM
+ * The snapshot is an INI-style text file with one [ServiceName] section per service:
+ *   display, binpath, group, tag, depend (a/b/c), obj, description,
+ *   type (own/share/kernel/filesys or a number), start (boot/system/auto/demand/disabled/delayed-auto),
+ *   error (normal/severe/critical/ignore), state (running/stopped/...), pid,
+ *   start_ms, stop_ms, pause_ms (state transition latencies), crash_after_ms (crash this long after starting),
+ *   accepts (controls the service takes: stop/pause/shutdown/preshutdown/paramchange, default stop),
+ *   preshutdown_ms (preshutdown timeout, default 180000),
+ *   reset (seconds), actions (restart/60000/none/0, delays in ms as in sc.exe), command, reboot,
+ *   trigger (one line per trigger, as triggerinfo takes them: start/networkon)
+ *
+ * @param path Path of the snapshot file
+ * @param scm The simulated SCM to fill
+ * @return true if the file was read, false if it could not be opened
+ */
+bool LoadSimulatedSnapshot(const std::wstring& path, SimulatedScm& scm) {
+    FILE* file = OpenFileW(path, L"rb");
+    if (!file) return false;
+
+    std::string content;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) content.append(chunk, read);
+    fclose(file);
+
+    SimService current;
+    bool inSection = false;
+    auto flush = [&] {
+        if (inSection) {
+            if (current.displayName.empty()) current.displayName = current.name;
+            scm.AddService(current);
+        }
+    };
+
+    size_t lineStart = 0;
+    while (lineStart < content.size()) {
+        size_t lineEnd = content.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = content.size();
+        std::wstring line = StringToWString(content.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+
+        // Trim whitespace and skip comments
+        line.erase(0, line.find_first_not_of(L" \t\r"));
+        line.erase(line.find_last_not_of(L" \t\r") + 1);
+        if (line.empty() || line[0] == L'#' || line[0] == L';') continue;
+
+        if (line[0] == L'[' && line.back() == L']') {
+            flush();
+            current = SimService();
+            current.name = line.substr(1, line.size() - 2);
+            inSection = true;
+            continue;
+        }
+
+        size_t equals = line.find(L'=');
+        if (!inSection || equals == std::wstring::npos) continue;
+        std::wstring key = ToLowerServiceName(line.substr(0, equals));
+        std::wstring value = line.substr(equals + 1);
+        key.erase(key.find_last_not_of(L" \t") + 1);
+        value.erase(0, value.find_first_not_of(L" \t"));
+
+        try {
+            if (key == L"display") current.displayName = value;
+            else if (key == L"binpath") current.binaryPath = value;
+            else if (key == L"group") current.loadOrderGroup = value;
+            else if (key == L"tag") current.tagId = (DWORD)std::stoul(value);
+            else if (key == L"obj") current.account = value;
+            else if (key == L"description") current.description = value;
+            else if (key == L"pid") current.pid = (DWORD)std::stoul(value);
+            else if (key == L"start_ms") current.startLatencyMs = (DWORD)std::stoul(value);
+            else if (key == L"stop_ms") current.stopLatencyMs = (DWORD)std::stoul(value);
+            else if (key == L"pause_ms") current.pauseLatencyMs = (DWORD)std::stoul(value);
+            else if (key == L"crash_after_ms") current.crashAfterMs = (DWORD)std::stoul(value);
+            else if (key == L"preshutdown_ms") current.preshutdownTimeoutMs = (DWORD)std::stoul(value);
+            else if (key == L"reset") current.resetPeriod = (DWORD)std::stoul(value);
+            else if (key == L"failure_flag") current.failureActionsOnNonCrash = value == L"true" || value == L"1";
+            else if (key == L"actions") current.failureActions = ParseFailureActionList(value);
+            else if (key == L"command") current.failureCommand = value;
+            else if (key == L"reboot") current.rebootMsg = value;
+            else if (key == L"trigger") {
+                ServiceTrigger trigger;
+                std::string error;
+                if (!ParseServiceTrigger(value, trigger, error)) throw std::invalid_argument(error);
+                current.triggers.push_back(trigger);
+            }
+            else if (key == L"state") {
+                DWORD state = ParseServiceStateName(value);
+                if (state) current.state = state;
+            }
+            else if (key == L"accepts") {
+                current.controlsAccepted = 0;
+                size_t start = 0;
+                while (start <= value.size()) {
+                    size_t end = value.find_first_of(L"/, ", start);
+                    if (end == std::wstring::npos) end = value.size();
+                    std::wstring control = value.substr(start, end - start);
+                    if (control == L"stop") current.controlsAccepted |= SERVICE_ACCEPT_STOP;
+                    else if (control == L"pause") current.controlsAccepted |= SERVICE_ACCEPT_PAUSE_CONTINUE;
+                    else if (control == L"shutdown") current.controlsAccepted |= SERVICE_ACCEPT_SHUTDOWN;
+                    else if (control == L"preshutdown") current.controlsAccepted |= SERVICE_ACCEPT_PRESHUTDOWN;
+                    else if (control == L"paramchange") current.controlsAccepted |= SERVICE_ACCEPT_PARAMCHANGE;
+                    start = end + 1;
+                }
+            }
+            else if (key == L"depend") {
+                current.dependencies.clear();
+                size_t start = 0;
+                while (start < value.size()) {
+                    size_t slash = value.find(L'/', start);
+                    if (slash == std::wstring::npos) slash = value.size();
+                    if (slash > start) current.dependencies.push_back(value.substr(start, slash - start));
+                    start = slash + 1;
+                }
+            }
+            else if (key == L"type") {
+                if (value == L"own") current.serviceType = SERVICE_WIN32_OWN_PROCESS;
+                else if (value == L"share") current.serviceType = SERVICE_WIN32_SHARE_PROCESS;
+                else if (value == L"kernel") current.serviceType = SERVICE_KERNEL_DRIVER;
+                else if (value == L"filesys") current.serviceType = SERVICE_FILE_SYSTEM_DRIVER;
+                else current.serviceType = (DWORD)std::stoul(value, nullptr, 0);
+            }
+            else if (key == L"start") {
+                current.delayedAutoStart = false;
+                if (value == L"boot") current.startType = SERVICE_BOOT_START;
+                else if (value == L"system") current.startType = SERVICE_SYSTEM_START;
+                else if (value == L"auto") current.startType = SERVICE_AUTO_START;
+                else if (value == L"demand") current.startType = SERVICE_DEMAND_START;
+                else if (value == L"disabled") current.startType = SERVICE_DISABLED;
+                else if (value == L"delayed-auto") {
+                    current.startType = SERVICE_AUTO_START;
+                    current.delayedAutoStart = true;
+                }
+            }
+            else if (key == L"error") {
+                if (value == L"normal") current.errorControl = SERVICE_ERROR_NORMAL;
+                else if (value == L"severe") current.errorControl = SERVICE_ERROR_SEVERE;
+                else if (value == L"critical") current.errorControl = SERVICE_ERROR_CRITICAL;
+                else if (value == L"ignore") current.errorControl = SERVICE_ERROR_IGNORE;
+            }
+        }
+        catch (const std::exception&) {
+            // Library builds print nothing; the value is skipped either way
+#ifndef SCCLONE_LIBRARY
+            std::cerr << "Warning: Ignoring invalid snapshot value for '" << WStringToString(key)
+                << "' in [" << WStringToString(current.name) << "]" << std::endl;
+#endif
+        }
+    }
+    flush();
+    return true;
+}
+
+/**
+ * Creates the backend for this process
+ * SCCLONE_SIM=<snapshot> selects the simulated SCM loaded from that snapshot. Outside
+ * Windows the simulated SCM is the only backend (empty unless SCCLONE_SIM is set).
+ *
+ * @return The backend; lives for the rest of the process
+ */
+ScmBackend* CreateDefaultScmBackend() {
+    std::wstring snapshot = GetEnvironmentString(L"SCCLONE_SIM");
+    if (!snapshot.empty()) {
+        SimulatedScm* sim = new SimulatedScm();
+        if (!LoadSimulatedSnapshot(snapshot, *sim)) {
+            // In a library build the calls then simply find no services
+#ifndef SCCLONE_LIBRARY
+            std::cerr << "Warning: Could not read SCCLONE_SIM snapshot '" << WStringToString(snapshot)
+                << "', using an empty simulated SCM" << std::endl;
+#endif
+        }
+        return sim;
+    }
+#ifdef _WIN32
+    return new Win32ScmBackend();
+#else
+    return new SimulatedScm();
+#endif
+}
+
+/**
+ * Holds the backend every command uses, created on first use
+ */
+ScmBackend*& ScmBackendSlot() {
+    static ScmBackend* backend = CreateDefaultScmBackend();
+    return backend;
+}
+
+/**
+ * Returns the SCM backend every command uses
+ */
+ScmBackend& Scm() {
+    return *ScmBackendSlot();
+}
+
+/**
+ * Switches every later SCM call to another backend, e.g. a snapshot given on the
+ * command line; call before any worker threads start
+ *
+ * @param backend The new backend; lives for the rest of the process
+ */
+void UseScmBackend(ScmBackend* backend) {
+    ScmBackendSlot() = backend;
+}
+
+/**
+ * Reads a service's trigger-start configuration
+ *
+ * @param service Handle opened with SERVICE_QUERY_CONFIG
+ * @param triggers Receives the triggers (empty if the service has none)
+ * @return true if the configuration was read; GetLastError() has the reason otherwise
+ */
+bool ReadServiceTriggers(SC_HANDLE service, std::vector<ServiceTrigger>& triggers) {
+    triggers.clear();
+    DWORD bytesNeeded = 0;
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_TRIGGER_INFO, NULL, 0, &bytesNeeded) &&
+        GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        return false;
+    }
+    std::vector<BYTE> buffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_TRIGGER_INFO)));
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_TRIGGER_INFO, buffer.data(), (DWORD)buffer.size(), &bytesNeeded)) {
+        return false;
+    }
+    UnpackServiceTriggers((const SERVICE_TRIGGER_INFO*)buffer.data(), triggers);
+    return true;
+}
+
+//=============================================================================
+// Restart history - Per-service ring of state events, persisted between runs so
+// that one-shot commands like "query" can report recent restarts
+//=============================================================================
+
+/**
+ * Kinds of events recorded in a service's history
+ */
+enum ServiceEventKind : unsigned char {
+    ServiceEventStarted = 1,   // Came up for the first time while being watched
+    ServiceEventStopped = 2,   // Left RUNNING for STOPPED
+    ServiceEventRestarted = 3, // Back in RUNNING after a stop, or running under a new PID
+};
+
+/**
+ * One recorded event
+ */
+struct ServiceEvent {
+    unsigned long long timeMs; // Wall clock, milliseconds since the Unix epoch
+    DWORD pid;                 // PID after the event (before it, for stops)
+    unsigned char kind;        // ServiceEventKind
+};
+
+/**
+ * Fixed-size ring of a service's most recent events
+ * Once full, the oldest event is overwritten, so memory stays constant no matter
+ * how fast a service flaps
+ */
+struct ServiceHistory {
+    static const size_t Capacity = 64;
+
+    ServiceEvent events[Capacity];
+    size_t count = 0;          // Valid events, up to Capacity
+    size_t next = 0;           // Slot the next event goes into
+
+    // Tracking state for the monitor (not persisted)
+    DWORD lastPid = 0;
+    DWORD lastState = 0;
+    DWORD lastRunningPid = 0;
+    bool seen = false;
+    bool crashLoop = false;
+
+    void Add(const ServiceEvent& event) {
+        events[next] = event;
+        next = (next + 1) % Capacity;
+        if (count < Capacity) count++;
+    }
+
+    /**
+     * Returns the i-th event, oldest first
+     */
+    const ServiceEvent& At(size_t i) const {
+        return events[(next + Capacity - count + i) % Capacity];
+    }
+
+    /**
+     * Counts events of one kind at or after a point in time
+     */
+    size_t CountSince(unsigned char kind, unsigned long long sinceMs) const {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            const ServiceEvent& event = At(i);
+            if (event.kind == kind && event.timeMs >= sinceMs) n++;
+        }
+        return n;
+    }
+
+    /**
+     * True if the ring is full and its oldest event is still inside the window,
+     * i.e. CountSince() may be missing overwritten events
+     */
+    bool SaturatedSince(unsigned long long sinceMs) const {
+        return count == Capacity && At(0).timeMs >= sinceMs;
+    }
+};
+
+/**
+ * Milliseconds since the Unix epoch
+ */
+unsigned long long WallClockMs() {
+    return (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns the restart history file path
+ * SCCLONE_HISTORY overrides the default, which is scclone-history.bin in the state
+ * directory (%ProgramData% on Windows, ~/.scclone elsewhere)
+ */
+std::wstring GetRestartHistoryPath() {
+    std::wstring path = GetEnvironmentString(L"SCCLONE_HISTORY");
+    if (!path.empty()) return path;
+#ifdef _WIN32
+    return GetStateDirectory() + L"\\scclone-history.bin";
+#else
+    return GetStateDirectory() + L"/scclone-history.bin";
+#endif
+}
+
+/**
+ * Appends an unsigned integer in little-endian byte order
+ */
+void AppendLittleEndian(std::string& out, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back((char)((value >> (8 * i)) & 0xFF));
+}
+
+/**
+ * Reads an unsigned little-endian integer, advancing pos; false if the data runs out
+ */
+bool ReadLittleEndian(const std::string& in, size_t& pos, int bytes, unsigned long long& value) {
+    if (pos + bytes > in.size()) return false;
+    value = 0;
+    for (int i = 0; i < bytes; i++) value |= (unsigned long long)(unsigned char)in[pos + i] << (8 * i);
+    pos += bytes;
+    return true;
+}
+
+/**
+ * Loads the restart history file
+ * Layout (little-endian): "SCCH", u32 version, u32 service count, then per service:
+ * u16 name length, UTF-8 name, u16 event count, and events of u64 time, u32 pid, u8 kind
+ *
+ * @param path The history file
+ * @param histories Receives the histories, keyed by lowercase service name
+ * @return true if the file was read; false if it is missing or not a history file
+ */
+bool LoadRestartHistory(const std::wstring& path, std::map<std::wstring, ServiceHistory>& histories) {
+    FILE* file = OpenStateFile(path, "rb");
+    if (!file) return false;
+    std::string data;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) data.append(chunk, read);
+    fclose(file);
+
+    size_t pos = 4;
+    unsigned long long version = 0, services = 0;
+    if (data.compare(0, 4, "SCCH") != 0 ||
+        !ReadLittleEndian(data, pos, 4, version) || version != 1 ||
+        !ReadLittleEndian(data, pos, 4, services)) {
+        return false;
+    }
+
+    for (unsigned long long s = 0; s < services; s++) {
+        unsigned long long nameLength = 0, eventCount = 0;
+        if (!ReadLittleEndian(data, pos, 2, nameLength) || pos + nameLength > data.size()) return false;
+        std::wstring name = StringToWString(data.substr(pos, (size_t)nameLength));
+        pos += (size_t)nameLength;
+        if (!ReadLittleEndian(data, pos, 2, eventCount)) return false;
+
+        ServiceHistory& history = histories[ToLowerServiceName(name)];
+        for (unsigned long long e = 0; e < eventCount; e++) {
+            unsigned long long timeMs = 0, pid = 0, kind = 0;
+            if (!ReadLittleEndian(data, pos, 8, timeMs) || !ReadLittleEndian(data, pos, 4, pid) ||
+                !ReadLittleEndian(data, pos, 1, kind)) {
+                return false;
+            }
+            history.Add(ServiceEvent{ timeMs, (DWORD)pid, (unsigned char)kind });
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes the restart history file
+ * Writes to a temporary file and renames it over the old one, so readers never
+ * see a half-written history
+ *
+ * @param path The history file
+ * @param histories Histories keyed by lowercase service name
+ * @return true if the file was replaced
+ */
+bool SaveRestartHistory(const std::wstring& path, const std::map<std::wstring, ServiceHistory>& histories) {
+    std::string data = "SCCH";
+    AppendLittleEndian(data, 1, 4);
+    size_t countOffset = data.size();
+    AppendLittleEndian(data, 0, 4);
+
+    unsigned long long services = 0;
+    for (const auto& entry : histories) {
+        const ServiceHistory& history = entry.second;
+        if (history.count == 0) continue;
+        std::string name = WStringToString(entry.first);
+        if (name.size() > 0xFFFF) continue;
+        AppendLittleEndian(data, name.size(), 2);
+        data += name;
+        AppendLittleEndian(data, history.count, 2);
+        for (size_t i = 0; i < history.count; i++) {
+            const ServiceEvent& event = history.At(i);
+            AppendLittleEndian(data, event.timeMs, 8);
+            AppendLittleEndian(data, event.pid, 4);
+            AppendLittleEndian(data, event.kind, 1);
+        }
+        services++;
+    }
+    for (int i = 0; i < 4; i++) data[countOffset + i] = (char)((services >> (8 * i)) & 0xFF);
+
+    // A temporary file left by an interrupted run is removed first; unlinking a
+    // planted link removes the link, not its target
+    std::wstring tempPath = path + L".tmp";
+#ifndef _WIN32
+    unlink(WStringToString(tempPath).c_str());
+#endif
+    FILE* file = OpenStateFile(tempPath, "wb");
+    if (!file) return false;
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = (fclose(file) == 0) && written;
+    if (!written) return false;
+
+#ifdef _WIN32
+    return MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    return rename(WStringToString(tempPath).c_str(), WStringToString(path).c_str()) == 0;
+#endif
+}
+
+/**
+ * Decides whether a service observed in two consecutive sweeps has restarted
+ * A restart is a running service whose PID changed, or one that is back in
+ * RUNNING after having been seen STOPPED or START_PENDING. Coming back from
+ * PAUSED or CONTINUE_PENDING (or an abandoned STOP_PENDING) in the same process
+ * is not a restart.
+ *
+ * @param lastPid PID seen in the previous sweep
+ * @param lastState State seen in the previous sweep
+ * @param pid PID now
+ * @param state State now
+ * @return true if this sweep observed a restart
+ */
+bool IsServiceRestart(DWORD lastPid, DWORD lastState, DWORD pid, DWORD state) {
+    if (state != SERVICE_RUNNING) return false;
+    bool pidChanged = lastPid != 0 && pid != 0 && lastPid != pid;
+    return pidChanged || lastState == SERVICE_STOPPED || lastState == SERVICE_START_PENDING;
+}
+
+
+//=============================================================================
+// Audit journal - Append-only binary log of every change scclone makes to a service:
+// what was asked for, the values before and after, who asked, when, and the result
+//=============================================================================
+
+/**
+ * Named values recorded for a service, in a fixed order
+ */
+typedef std::vector<std::pair<std::string, std::string>> AuditFields;
+
+/**
+ * One journal entry
+ */
+struct AuditRecord {
+    unsigned long long timeMs = 0;      // Wall clock time of the change
+    std::string operation;              // create, config, delete or failure
+    std::string service;
+    std::string user;                   // Account that ran scclone
+    std::string host;
+    DWORD pid = 0;                      // scclone's process ID
+    DWORD error = ERROR_SUCCESS;        // Result of the change
+    AuditFields request;                // Parameters given (passwords are never recorded)
+    AuditFields before;                 // Service configuration before (empty for create)
+    AuditFields after;                  // Service configuration after (empty for delete)
+};
+
+// Every record is framed as magic, payload length and CRC-32 of the payload, so a
+// reader can detect a torn or damaged record and resynchronize on the next magic
+const uint32_t AuditRecordMagic = 0x52414353;       // "SCAR"
+const uint32_t AuditRecordVersion = 1;
+const uint32_t AuditMaxRecordBytes = 1 << 20;
+
+/**
+ * CRC-32 (IEEE 802.3) of a buffer
+ */
+uint32_t Crc32(const char* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * Returns the audit journal path
+ * SCCLONE_AUDIT overrides the default, which is scclone-audit.log in the state
+ * directory (%ProgramData% on Windows, ~/.scclone elsewhere); SCCLONE_AUDIT=off
+ * disables the journal
+ */
+std::wstring GetAuditJournalPath() {
+    std::wstring path = GetEnvironmentString(L"SCCLONE_AUDIT");
+    if (!path.empty()) return path == L"off" ? L"" : path;
+#ifdef _WIN32
+    return GetStateDirectory() + L"\\scclone-audit.log";
+#else
+    return GetStateDirectory() + L"/scclone-audit.log";
+#endif
+}
+
+/**
+ * Appends a length-prefixed UTF-8 string
+ */
+void AppendAuditString(std::string& out, const std::string& value) {
+    AppendLittleEndian(out, value.size(), 4);
+    out += value;
+}
+
+bool ReadAuditString(const std::string& in, size_t& pos, std::string& value) {
+    unsigned long long size;
+    if (!ReadLittleEndian(in, pos, 4, size) || size > in.size() - pos) return false;
+    value.assign(in, pos, (size_t)size);
+    pos += (size_t)size;
+    return true;
+}
+
+void AppendAuditFields(std::string& out, const AuditFields& fields) {
+    AppendLittleEndian(out, fields.size(), 4);
+    for (const auto& field : fields) {
+        AppendAuditString(out, field.first);
+        AppendAuditString(out, field.second);
+    }
+}
+
+bool ReadAuditFields(const std::string& in, size_t& pos, AuditFields& fields) {
+    unsigned long long count;
+    if (!ReadLittleEndian(in, pos, 4, count) || count > in.size() - pos) return false;
+    fields.resize((size_t)count);
+    for (auto& field : fields) {
+        if (!ReadAuditString(in, pos, field.first) || !ReadAuditString(in, pos, field.second)) return false;
+    }
+    return true;
+}
+
+/**
+ * Encodes a record with its frame (magic, length, CRC-32)
+ */
+std::string EncodeAuditRecord(const AuditRecord& record) {
+    std::string payload;
+    AppendLittleEndian(payload, AuditRecordVersion, 4);
+    AppendLittleEndian(payload, record.timeMs, 8);
+    AppendLittleEndian(payload, record.pid, 4);
+    AppendLittleEndian(payload, record.error, 4);
+    AppendAuditString(payload, record.operation);
+    AppendAuditString(payload, record.service);
+    AppendAuditString(payload, record.user);
+    AppendAuditString(payload, record.host);
+    AppendAuditFields(payload, record.request);
+    AppendAuditFields(payload, record.before);
+    AppendAuditFields(payload, record.after);
+
+    std::string frame;
+    AppendLittleEndian(frame, AuditRecordMagic, 4);
+    AppendLittleEndian(frame, payload.size(), 4);
+    AppendLittleEndian(frame, Crc32(payload.data(), payload.size()), 4);
+    return frame + payload;
+}
+
+/**
+ * Decodes a record payload (the bytes after the frame)
+ */
+bool DecodeAuditRecord(const std::string& payload, AuditRecord& record) {
+    size_t pos = 0;
+    unsigned long long version, timeMs, pid, error;
+    if (!ReadLittleEndian(payload, pos, 4, version) || version != AuditRecordVersion) return false;
+    if (!ReadLittleEndian(payload, pos, 8, timeMs) || !ReadLittleEndian(payload, pos, 4, pid) ||
+        !ReadLittleEndian(payload, pos, 4, error)) {
+        return false;
+    }
+    record.timeMs = timeMs;
+    record.pid = (DWORD)pid;
+    record.error = (DWORD)error;
+    return ReadAuditString(payload, pos, record.operation) && ReadAuditString(payload, pos, record.service) &&
+        ReadAuditString(payload, pos, record.user) && ReadAuditString(payload, pos, record.host) &&
+        ReadAuditFields(payload, pos, record.request) && ReadAuditFields(payload, pos, record.before) &&
+        ReadAuditFields(payload, pos, record.after);
+}
+
+/**
+ * Appends records to the journal file with group commit
+ * A caller returns only once its record is on disk. Whoever finds no flush in
+ * progress writes and syncs everything queued so far; callers that arrive
+ * meanwhile queue behind it and are covered by the next flush, so a bulk operation
+ * over hundreds of services costs a handful of syncs instead of one per service.
+ */
+class AuditJournal {
+public:
+    explicit AuditJournal(const std::wstring& path) : path_(path) {}
+
+    ~AuditJournal() {
+#ifdef _WIN32
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+        if (fd_ >= 0) close(fd_);
+#endif
+    }
+
+    /**
+     * Appends a record and waits until it is durable
+     *
+     * @return false if the flush that carried this record could not be written;
+     *         a failed flush does not affect later ones
+     */
+    bool Append(const AuditRecord& record) {
+        std::string frame = EncodeAuditRecord(record);
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_ += frame;
+        std::shared_ptr<Batch> mine = open_;
+        while (!mine->done) {
+            if (flushing_) {
+                flushed_.wait(lock);
+                continue;
+            }
+            // Become the leader for everything queued so far
+            flushing_ = true;
+            std::string data;
+            data.swap(pending_);
+            std::shared_ptr<Batch> batch = open_;
+            open_ = std::make_shared<Batch>();
+            lock.unlock();
+            bool written = WriteAndSync(data);
+            lock.lock();
+            flushing_ = false;
+            batch->written = written;
+            batch->done = true;
+            flushed_.notify_all();
+        }
+        return mine->written;
+    }
+
+    const std::wstring& Path() const { return path_; }
+
+private:
+    /**
+     * Records queued together and written by one flush
+     */
+    struct Batch {
+        bool done = false;
+        bool written = false;
+    };
+
+    bool WriteAndSync(const std::string& batch) {
+#ifdef _WIN32
+        if (file_ == INVALID_HANDLE_VALUE) {
+            file_ = CreateFileW(path_.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file_ == INVALID_HANDLE_VALUE) return false;
+        }
+        DWORD written = 0;
+        return WriteFile(file_, batch.data(), (DWORD)batch.size(), &written, NULL) && written == batch.size() &&
+            FlushFileBuffers(file_);
+#else
+        if (fd_ < 0) {
+            // Never through a symbolic link planted under the journal's name
+            fd_ = open(WStringToString(path_).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (fd_ < 0) return false;
+        }
+        // O_APPEND keeps each batch contiguous even with several scclone processes appending
+        size_t offset = 0;
+        while (offset < batch.size()) {
+            ssize_t written = write(fd_, batch.data() + offset, batch.size() - offset);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            offset += (size_t)written;
+        }
+        return fsync(fd_) == 0;
+#endif
+    }
+
+    std::wstring path_;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+    int fd_ = -1;
+#endif
+    std::mutex mutex_;
+    std::condition_variable flushed_;
+    std::string pending_;               // Records queued for the next flush
+    std::shared_ptr<Batch> open_ = std::make_shared<Batch>();  // The batch pending_ belongs to
+    bool flushing_ = false;
+};
+
+/**
+ * Holds the process-wide journal, created on first use; nullptr when auditing is switched off
+ */
+AuditJournal*& JournalSlot() {
+    static AuditJournal* journal = [] {
+        std::wstring path = GetAuditJournalPath();
+        return path.empty() ? nullptr : new AuditJournal(path);
+    }();
+    return journal;
+}
+
+/**
+ * Returns the journal, or nullptr when auditing is switched off
+ */
+AuditJournal* Journal() {
+    return JournalSlot();
+}
+
+/**
+ * Identifies who is running scclone: user name and host name
+ */
+void GetAuditCaller(std::string& user, std::string& host) {
+#ifdef _WIN32
+    wchar_t name[256];
+    DWORD size = 256;
+    user = GetUserNameW(name, &size) ? WStringToString(name) : "unknown";
+    size = 256;
+    host = GetComputerNameW(name, &size) ? WStringToString(name) : "unknown";
+#else
+    struct passwd* account = getpwuid(geteuid());
+    user = account ? account->pw_name : std::to_string(geteuid());
+    char name[256] = { 0 };
+    host = gethostname(name, sizeof(name) - 1) == 0 ? name : "unknown";
+#endif
+}
+
+/**
+ * Groups of settings the journal can record; each costs one or two SCM queries
+ */
+enum AuditCapture : unsigned {
+    AuditConfig = 0x01,         // QueryServiceConfig: display name, type, start and error control, binpath, group, depend, account
+    AuditDescription = 0x02,
+    AuditDelayedAuto = 0x04,
+    AuditFailure = 0x08,        // Failure actions and the non-crash failure flag
+    AuditTriggers = 0x10,
+    AuditPreshutdown = 0x20
+};
+
+/**
+ * Reads the configuration the journal records for a service
+ * Only the groups an operation can change are read, so journaling a bulk change
+ * costs a query or two per service rather than one per setting, and nothing at
+ * all is read while the journal is switched off. The handle needs
+ * SERVICE_QUERY_CONFIG; settings that cannot be read are left out.
+ *
+ * @param service Open service handle
+ * @param parts AuditCapture groups to read
+ * @return The fields, in a fixed order
+ */
+AuditFields CaptureServiceAuditState(SC_HANDLE service, unsigned parts) {
+    AuditFields fields;
+    if (!Journal()) return fields;
+    DWORD bytesNeeded = 0;
+    if (parts & AuditConfig) Scm().QueryServiceConfigW(service, NULL, 0, &bytesNeeded);
+    std::vector<BYTE> buffer(bytesNeeded);
+    LPQUERY_SERVICE_CONFIGW config = (LPQUERY_SERVICE_CONFIGW)buffer.data();
+    if (bytesNeeded && Scm().QueryServiceConfigW(service, config, bytesNeeded, &bytesNeeded)) {
+        static const char* const errorControls[] = { "ignore", "normal", "severe", "critical" };
+        std::string dependencies;
+        for (LPCWSTR dep = config->lpDependencies; dep && *dep; dep += wcslen(dep) + 1) {
+            dependencies += (dependencies.empty() ? "" : "/") + WStringToString(dep);
+        }
+        fields.push_back({ "display_name", WStringToString(config->lpDisplayName ? config->lpDisplayName : L"") });
+        fields.push_back({ "type", GetServiceTypeString(config->dwServiceType) });
+        fields.push_back({ "start_type", GetServiceStartTypeString(config->dwStartType) });
+        fields.push_back({ "error_control", config->dwErrorControl < 4 ? errorControls[config->dwErrorControl] : std::to_string(config->dwErrorControl) });
+        fields.push_back({ "binpath", WStringToString(config->lpBinaryPathName ? config->lpBinaryPathName : L"") });
+        fields.push_back({ "group", WStringToString(config->lpLoadOrderGroup ? config->lpLoadOrderGroup : L"") });
+        fields.push_back({ "depend", dependencies });
+        fields.push_back({ "account", WStringToString(config->lpServiceStartName ? config->lpServiceStartName : L"") });
+    }
+    if (parts & AuditDescription) {
+        bytesNeeded = 0;
+        Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, NULL, 0, &bytesNeeded);
+        std::vector<BYTE> descBuffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_DESCRIPTIONW)));
+        if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, descBuffer.data(), (DWORD)descBuffer.size(), &bytesNeeded)) {
+            LPSERVICE_DESCRIPTIONW desc = (LPSERVICE_DESCRIPTIONW)descBuffer.data();
+            fields.push_back({ "description", WStringToString(desc->lpDescription ? desc->lpDescription : L"") });
+        }
+    }
+
+    SERVICE_DELAYED_AUTO_START_INFO delayed = { FALSE };
+    if ((parts & AuditDelayedAuto) &&
+        Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, (LPBYTE)&delayed, sizeof(delayed), &bytesNeeded)) {
+        fields.push_back({ "delayed_auto", delayed.fDelayedAutostart ? "true" : "false" });
+    }
+
+    if (parts & AuditFailure) {
+        bytesNeeded = 0;
+        Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS, NULL, 0, &bytesNeeded);
+        std::vector<BYTE> failureBuffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_FAILURE_ACTIONSW)));
+        if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS, failureBuffer.data(), (DWORD)failureBuffer.size(), &bytesNeeded)) {
+            LPSERVICE_FAILURE_ACTIONSW failure = (LPSERVICE_FAILURE_ACTIONSW)failureBuffer.data();
+            std::vector<SC_ACTION> actions;
+            if (failure->lpsaActions) actions.assign(failure->lpsaActions, failure->lpsaActions + failure->cActions);
+            fields.push_back({ "failure_reset", std::to_string(failure->dwResetPeriod) });
+            fields.push_back({ "failure_actions", FormatFailureActions(actions) });
+            fields.push_back({ "failure_command", WStringToString(failure->lpCommand ? failure->lpCommand : L"") });
+            fields.push_back({ "failure_reboot", WStringToString(failure->lpRebootMsg ? failure->lpRebootMsg : L"") });
+        }
+        SERVICE_FAILURE_ACTIONS_FLAG flag = { FALSE };
+        if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS_FLAG, (LPBYTE)&flag, sizeof(flag), &bytesNeeded)) {
+            fields.push_back({ "failure_flag", flag.fFailureActionsOnNonCrashFailures ? "true" : "false" });
+        }
+    }
+    std::vector<ServiceTrigger> triggers;
+    if ((parts & AuditTriggers) && ReadServiceTriggers(service, triggers)) {
+        fields.push_back({ "triggers", FormatServiceTriggers(triggers) });
+    }
+    SERVICE_PRESHUTDOWN_INFO preshutdown = { 0 };
+    if ((parts & AuditPreshutdown) &&
+        Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_PRESHUTDOWN_INFO, (LPBYTE)&preshutdown, sizeof(preshutdown), &bytesNeeded)) {
+        fields.push_back({ "preshutdown_timeout", std::to_string(preshutdown.dwPreshutdownTimeout) });
+    }
+    return fields;
+}
+
+/**
+ * Journals one change to a service
+ * A journal that cannot be written produces one warning per run on the command
+ * line (the library prints nothing; see NoteJournalFailure); the change itself has
+ * already been made by then and is not undone.
+ *
+ * @param operation create, config, delete, failure or triggers
+ * @param serviceName The service changed
+ * @param request Parameters given
+ * @param before Configuration before the change
+ * @param after Configuration after the change
+ * @param result Outcome of the change
+ * @return false if the journal is on but the record could not be written
+ */
+bool JournalServiceChange(const char* operation, const std::wstring& serviceName, const AuditFields& request,
+    const AuditFields& before, const AuditFields& after, const CommandResult& result) {
+    AuditJournal* journal = Journal();
+    if (!journal) return true;
+
+    static std::string user, host;
+    static std::once_flag callerOnce;
+    std::call_once(callerOnce, [] { GetAuditCaller(user, host); });
+
+    AuditRecord record;
+    record.timeMs = WallClockMs();
+    record.operation = operation;
+    record.service = WStringToString(serviceName);
+    record.user = user;
+    record.host = host;
+    record.pid = GetCurrentProcessId();
+    record.error = result.error;
+    record.request = request;
+    record.before = before;
+    record.after = after;
+
+    if (journal->Append(record)) return true;
+#ifndef SCCLONE_LIBRARY
+    static std::atomic<bool> warned(false);
+    if (!warned.exchange(true)) {
+        std::cerr << "Warning: Could not write audit journal '" << WStringToString(journal->Path()) << "'" << std::endl;
+    }
+#endif
+    return false;
+}
+
+/**
+ * Settings for the audit command
+ */
+struct AuditQuery {
+    std::wstring path;
+    std::wstring servicePattern;        // Only services matching this (empty = all)
+    std::string operation;              // Only this operation (empty = all)
+    bool failedOnly = false;
+    size_t last = 0;                    // Only the newest N matching records (0 = all)
+    bool json = false;                  // One JSON object per record
+};
+
+/**
+ * Prints journal records, checking every record's checksum
+ * Damaged records are counted and skipped by scanning for the next record
+ * marker; a record cut short at the end of the file (a write that never
+ * completed) is reported as a torn tail.
+ *
+ * @param query Path and filters
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ShowAuditJournal(const AuditQuery& query) {
+    ULONGLONG startTime = ClockNow();
+
+    FILE* file = OpenFileW(query.path, L"rb");
+    if (!file) {
+        std::cerr << "ERROR: Could not open audit journal '" << WStringToString(query.path) << "'" << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_FILE_NOT_FOUND, startTime);
+    }
+    std::string data;
+    char chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) data.append(chunk, read);
+    fclose(file);
+
+    std::vector<AuditRecord> records;
+    size_t damaged = 0;
+    bool tornTail = false;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t framePos = pos;
+        unsigned long long magic, size, crc;
+        if (!ReadLittleEndian(data, framePos, 4, magic) || !ReadLittleEndian(data, framePos, 4, size) ||
+            !ReadLittleEndian(data, framePos, 4, crc)) {
+            tornTail = true;
+            break;
+        }
+        if (magic == AuditRecordMagic && size <= AuditMaxRecordBytes && size > data.size() - framePos) {
+            tornTail = true;
+            break;
+        }
+        AuditRecord record;
+        if (magic != AuditRecordMagic || size > AuditMaxRecordBytes ||
+            Crc32(data.data() + framePos, (size_t)size) != (uint32_t)crc ||
+            !DecodeAuditRecord(data.substr(framePos, (size_t)size), record)) {
+            // Resynchronize on the next record marker
+            damaged++;
+            size_t next = pos + 1;
+            const char marker[4] = { 'S', 'C', 'A', 'R' };
+            while (next + 4 <= data.size() && memcmp(data.data() + next, marker, 4) != 0) next++;
+            pos = next + 4 <= data.size() ? next : data.size();
+            continue;
+        }
+        pos = framePos + (size_t)size;
+
+        if (!query.servicePattern.empty() && !MatchServicePattern(query.servicePattern, StringToWString(record.service))) continue;
+        if (!query.operation.empty() && record.operation != query.operation) continue;
+        if (query.failedOnly && record.error == ERROR_SUCCESS) continue;
+        records.push_back(std::move(record));
+    }
+    size_t first = query.last && records.size() > query.last ? records.size() - query.last : 0;
+
+    std::string out;
+    for (size_t i = first; i < records.size(); i++) {
+        const AuditRecord& record = records[i];
+        if (query.json) {
+            auto appendFields = [&](const char* name, const AuditFields& fields) {
+                out += std::string(",\"") + name + "\":{";
+                for (size_t f = 0; f < fields.size(); f++) {
+                    if (f) out += ",";
+                    AppendJsonString(out, StringToWString(fields[f].first));
+                    out += ":";
+                    AppendJsonString(out, StringToWString(fields[f].second));
+                }
+                out += "}";
+            };
+            out += "{\"time_ms\":" + std::to_string(record.timeMs) + ",\"operation\":";
+            AppendJsonString(out, StringToWString(record.operation));
+            out += ",\"service\":";
+            AppendJsonString(out, StringToWString(record.service));
+            out += ",\"user\":";
+            AppendJsonString(out, StringToWString(record.user));
+            out += ",\"host\":";
+            AppendJsonString(out, StringToWString(record.host));
+            out += ",\"pid\":" + std::to_string(record.pid) + ",\"error\":" + std::to_string(record.error);
+            appendFields("request", record.request);
+            appendFields("before", record.before);
+            appendFields("after", record.after);
+            out += "}\n";
+            continue;
+        }
+
+        out += FormatWallClock(record.timeMs) + "  " + record.operation + "  " + record.service + "  " +
+            (record.error == ERROR_SUCCESS ? std::string("OK") : "FAILED (error " + std::to_string(record.error) + ")") +
+            "  " + record.user + "@" + record.host + " pid " + std::to_string(record.pid) + "\n";
+        if (!record.request.empty()) {
+            out += "    request:";
+            for (const auto& field : record.request) out += " /" + field.first + " '" + field.second + "'";
+            out += "\n";
+        }
+        // Before/after as a diff; a create shows everything after, a delete everything before
+        std::map<std::string, std::string> before(record.before.begin(), record.before.end());
+        for (const auto& field : record.after) {
+            auto old = before.find(field.first);
+            if (old == before.end()) {
+                out += "    " + field.first + ": '" + field.second + "'\n";
+            }
+            else if (old->second != field.second) {
+                out += "    " + field.first + ": '" + old->second + "' -> '" + field.second + "'\n";
+            }
+        }
+        if (record.after.empty()) {
+            for (const auto& field : record.before) out += "    " + field.first + ": '" + field.second + "'\n";
+        }
+    }
+    std::cout << out;
+
+    if (!query.json) {
+        std::cout << (records.size() - first) << " record(s)";
+        if (damaged) std::cout << ", " << damaged << " damaged record(s) skipped";
+        if (tornTail) std::cout << ", incomplete record at the end of the journal";
+        std::cout << std::endl;
+    }
+    if (damaged) {
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_DATA, startTime);
+    }
+    return CommandSuccess(startTime);
+}
+
+
+//=============================================================================
+// Library API - The service operations behind the commands, with typed results and
+// no console output. Declared in libscclone.h for programs that link scclone in;
+// build with SCCLONE_LIBRARY to leave out the command line entry point.
+//=============================================================================
+
+/**
+ * Polls a service until it reaches a target state
+ * The poll interval follows the service's wait hint (a tenth of it, between 25 and
+ * 250 ms), so fast transitions are seen quickly without hammering slow services.
+ * A service that drops to STOPPED while waiting for another state has failed.
+ *
+ * @param service Service handle opened with SERVICE_QUERY_STATUS
+ * @param targetState The SERVICE_* state to wait for
+ * @param timeoutMs How long to wait
+ * @param status Receives the last status read
+ * @return Success, or the failing stage and error (ERROR_SERVICE_REQUEST_TIMEOUT on timeout)
+ */
+CommandResult WaitForServiceState(SC_HANDLE service, DWORD targetState, DWORD timeoutMs, SERVICE_STATUS_PROCESS& status) {
+    ULONGLONG startTime = ClockNow();
+    DWORD bytesNeeded;
+
+    while (true) {
+        if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+            return CommandFailure(ScmStage::QueryStatus, startTime);
+        }
+        if (status.dwCurrentState == targetState) {
+            return CommandSuccess(startTime);
+        }
+        if (status.dwCurrentState == SERVICE_STOPPED) {
+            DWORD exitCode = status.dwWin32ExitCode ? status.dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+            return CommandFailure(ScmStage::Wait, exitCode, startTime);
+        }
+
+        ULONGLONG elapsed = ClockNow() - startTime;
+        if (elapsed > timeoutMs) {
+            return CommandFailure(ScmStage::Wait, ERROR_SERVICE_REQUEST_TIMEOUT, startTime);
+        }
+        DWORD pollMs = (std::min)((std::max)(status.dwWaitHint / 10, (DWORD)25), (DWORD)250);
+        ClockSleep((DWORD)(std::min)((ULONGLONG)pollMs, timeoutMs - elapsed + 1));
+    }
+}
+
+/**
+ * A service failure policy, as set by "sc failure" and the failureflag setting
+ * Only the parts given on the command line are compared and applied
+ */
+struct FailurePolicy {
+    bool hasActions = false;            // /actions given (reset period goes with the actions)
+    DWORD resetPeriod = 0;              // Seconds without failure before the count resets
+    std::vector<SC_ACTION> actions;     // Delays in milliseconds, as the SCM stores them
+    bool hasCommand = false;
+    std::wstring command;
+    bool hasRebootMsg = false;
+    std::wstring rebootMsg;
+    bool hasFlag = false;
+    bool nonCrashFailures = false;      // Apply the actions when a service stops with an error, too
+};
+
+/**
+ * Reads a service's current failure policy
+ * The failure actions are variable length (the action array and both strings follow
+ * the struct), so the buffer is sized from the first call's bytesNeeded
+ *
+ * @param service Service handle opened with SERVICE_QUERY_CONFIG
+ * @param policy Receives the full current policy
+ * @return true on success; GetLastError() has the error otherwise
+ */
+bool ReadFailurePolicy(SC_HANDLE service, FailurePolicy& policy) {
+    DWORD bytesNeeded = 0;
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS, NULL, 0, &bytesNeeded) &&
+        GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        return false;
+    }
+    std::vector<BYTE> buffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_FAILURE_ACTIONSW)));
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS, buffer.data(), (DWORD)buffer.size(), &bytesNeeded)) {
+        return false;
+    }
+    LPSERVICE_FAILURE_ACTIONSW current = (LPSERVICE_FAILURE_ACTIONSW)buffer.data();
+    policy.hasActions = policy.hasCommand = policy.hasRebootMsg = policy.hasFlag = true;
+    policy.resetPeriod = current->dwResetPeriod;
+    policy.actions.clear();
+    if (current->lpsaActions) policy.actions.assign(current->lpsaActions, current->lpsaActions + current->cActions);
+    policy.command = current->lpCommand ? current->lpCommand : L"";
+    policy.rebootMsg = current->lpRebootMsg ? current->lpRebootMsg : L"";
+
+    SERVICE_FAILURE_ACTIONS_FLAG flag = { FALSE };
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS_FLAG, (LPBYTE)&flag, sizeof(flag), &bytesNeeded)) {
+        return false;
+    }
+    policy.nonCrashFailures = flag.fFailureActionsOnNonCrashFailures != FALSE;
+    return true;
+}
+
+/**
+ * Lists the settings where a service's current policy differs from the desired one
+ * Only the settings present in the desired policy are compared
+ *
+ * @param desired The policy being rolled out
+ * @param current The service's current policy
+ * @return One "setting: old -> new" entry per difference; empty if none
+ */
+std::vector<std::string> DiffFailurePolicy(const FailurePolicy& desired, const FailurePolicy& current) {
+    std::vector<std::string> changes;
+    if (desired.hasActions) {
+        // An empty action list leaves the reset period meaningless, so ignore it there
+        if (!desired.actions.empty() && desired.resetPeriod != current.resetPeriod) {
+            changes.push_back("reset: " + std::to_string(current.resetPeriod) + " -> " + std::to_string(desired.resetPeriod));
+        }
+        bool same = desired.actions.size() == current.actions.size();
+        for (size_t i = 0; same && i < desired.actions.size(); i++) {
+            same = desired.actions[i].Type == current.actions[i].Type && desired.actions[i].Delay == current.actions[i].Delay;
+        }
+        if (!same) {
+            changes.push_back("actions: " + FormatFailureActions(current.actions) + " -> " + FormatFailureActions(desired.actions));
+        }
+    }
+    if (desired.hasCommand && desired.command != current.command) {
+        changes.push_back("command: '" + WStringToString(current.command) + "' -> '" + WStringToString(desired.command) + "'");
+    }
+    if (desired.hasRebootMsg && desired.rebootMsg != current.rebootMsg) {
+        changes.push_back("reboot: '" + WStringToString(current.rebootMsg) + "' -> '" + WStringToString(desired.rebootMsg) + "'");
+    }
+    if (desired.hasFlag && desired.nonCrashFailures != current.nonCrashFailures) {
+        changes.push_back(std::string("flag: ") + (current.nonCrashFailures ? "true" : "false") + " -> " +
+            (desired.nonCrashFailures ? "true" : "false"));
+    }
+    return changes;
+}
+
+/**
+ * Outcome of applying a failure policy to one service
+ */
+struct FailurePolicyOutcome {
+    CommandResult result;
+    std::vector<std::string> changes;   // Empty if the service already had the policy
+};
+
+/**
+ * Applies a failure policy to one service if its current policy differs
+ * Reads the current policy, changes only what differs, then reads it back and
+ * checks that the service now matches
+ *
+ * @param scManager Open SCM handle
+ * @param serviceName Name of the service to configure
+ * @param policy The policy to apply
+ * @return The result and the list of changed settings
+ */
+FailurePolicyOutcome ApplyFailurePolicy(SC_HANDLE scManager, const std::wstring& serviceName, const FailurePolicy& policy) {
+    ULONGLONG startTime = ClockNow();
+    FailurePolicyOutcome outcome;
+
+    // Changing failure actions that include restart requires SERVICE_START as well
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(),
+        SERVICE_QUERY_CONFIG | SERVICE_CHANGE_CONFIG | SERVICE_START);
+    if (!service) {
+        outcome.result = CommandFailure(ScmStage::OpenService, startTime);
+        return outcome;
+    }
+
+    FailurePolicy current;
+    if (!ReadFailurePolicy(service, current)) {
+        outcome.result = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        return outcome;
+    }
+
+    outcome.changes = DiffFailurePolicy(policy, current);
+    if (outcome.changes.empty()) {
+        outcome.result = CommandSuccess(startTime);
+        Scm().CloseServiceHandle(service);
+        return outcome;
+    }
+
+    // Every attempted change is journaled with the policy as it was before and after
+    AuditFields request;
+    if (policy.hasActions) {
+        request.push_back({ "reset", std::to_string(policy.resetPeriod) });
+        request.push_back({ "actions", FormatFailureActions(policy.actions) });
+    }
+    if (policy.hasCommand) request.push_back({ "command", WStringToString(policy.command) });
+    if (policy.hasRebootMsg) request.push_back({ "reboot", WStringToString(policy.rebootMsg) });
+    if (policy.hasFlag) request.push_back({ "flag", policy.nonCrashFailures ? "true" : "false" });
+    AuditFields before = CaptureServiceAuditState(service, AuditFailure);
+    auto journal = [&](const CommandResult& result) {
+        JournalServiceChange("failure", serviceName, request, before, CaptureServiceAuditState(service, AuditFailure), result);
+    };
+
+    // NULL members of SERVICE_FAILURE_ACTIONS mean "leave unchanged"
+    if (policy.hasActions || policy.hasCommand || policy.hasRebootMsg) {
+        SERVICE_FAILURE_ACTIONSW failureActions;
+        ZeroMemory(&failureActions, sizeof(failureActions));
+        std::vector<SC_ACTION> actions = policy.actions;
+        SC_ACTION emptyAction = { SC_ACTION_NONE, 0 };
+        if (policy.hasActions) {
+            failureActions.dwResetPeriod = policy.resetPeriod;
+            failureActions.cActions = (DWORD)actions.size();
+            // A non-NULL array with zero actions clears them
+            failureActions.lpsaActions = actions.empty() ? &emptyAction : actions.data();
+        }
+        std::wstring command = policy.command;
+        std::wstring rebootMsg = policy.rebootMsg;
+        if (policy.hasCommand) failureActions.lpCommand = &command[0];
+        if (policy.hasRebootMsg) failureActions.lpRebootMsg = &rebootMsg[0];
+
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS, &failureActions)) {
+            outcome.result = CommandFailure(ScmStage::ChangeConfig2, startTime);
+            journal(outcome.result);
+            Scm().CloseServiceHandle(service);
+            return outcome;
+        }
+    }
+    if (policy.hasFlag) {
+        SERVICE_FAILURE_ACTIONS_FLAG flag = { policy.nonCrashFailures ? TRUE : FALSE };
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_FAILURE_ACTIONS_FLAG, &flag)) {
+            outcome.result = CommandFailure(ScmStage::ChangeConfig2, startTime);
+            journal(outcome.result);
+            Scm().CloseServiceHandle(service);
+            return outcome;
+        }
+    }
+
+    // Verify by reading the whole policy back
+    FailurePolicy applied;
+    if (!ReadFailurePolicy(service, applied)) {
+        outcome.result = CommandFailure(ScmStage::QueryConfig, startTime);
+    }
+    else if (!DiffFailurePolicy(policy, applied).empty()) {
+        outcome.result = CommandFailure(ScmStage::ChangeConfig2, ERROR_INVALID_DATA, startTime);
+    }
+    else {
+        outcome.result = CommandSuccess(startTime);
+    }
+    journal(outcome.result);
+    Scm().CloseServiceHandle(service);
+    return outcome;
+}
+
+/**
+ * Packs names into the double-null-terminated list CreateService and
+ * ChangeServiceConfig take for dependencies
+ *
+ * @param names The names (an empty list clears the dependencies)
+ * @return "a\0b\0\0"
+ */
+std::wstring BuildMultiString(const std::vector<std::wstring>& names) {
+    std::wstring packed;
+    for (const auto& name : names) {
+        packed += name;
+        packed.push_back(L'\0');
+    }
+    packed.push_back(L'\0');
+    return packed;
+}
+
+/**
+ * Joins dependency names the way /depend takes them, e.g. "Tcpip/+NetworkProvider"
+ *
+ * @param names The names
+ * @return The names separated by '/'
+ */
+std::string JoinDependencyNames(const std::vector<std::wstring>& names) {
+    std::string joined;
+    for (size_t i = 0; i < names.size(); i++) joined += (i ? "/" : "") + WStringToString(names[i]);
+    return joined;
+}
+
+/**
+ * Describes a start type for the journal, e.g. "AUTO" or "delayed-auto"
+ *
+ * @param startType The start type
+ * @param delayedAutoStart Whether delayed start is being turned on
+ * @return The description
+ */
+std::string DescribeRequestedStartType(scclone::StartType startType, bool delayedAutoStart) {
+    if (startType == scclone::StartType::Auto && delayedAutoStart) return "delayed-auto";
+    return GetServiceStartTypeString((DWORD)startType);
+}
+
+/**
+ * Describes an error control level for the journal
+ *
+ * @param errorControl The level
+ * @return "ignore", "normal", "severe" or "critical"
+ */
+std::string DescribeErrorControl(scclone::ErrorControl errorControl) {
+    static const char* errorNames[] = { "ignore", "normal", "severe", "critical" };
+    DWORD level = (DWORD)errorControl;
+    return level <= SERVICE_ERROR_CRITICAL ? errorNames[level] : std::to_string(level);
+}
+
+/**
+ * Converts a service definition into journal fields, leaving out the password
+ *
+ * @param definition The service being created
+ * @return The fields
+ */
+AuditFields AuditDefinitionFields(const scclone::ServiceDefinition& definition) {
+    AuditFields fields;
+    fields.push_back({ "servicename", WStringToString(definition.name) });
+    fields.push_back({ "binpath", WStringToString(definition.binaryPath) });
+    if (!definition.displayName.empty()) fields.push_back({ "displayname", WStringToString(definition.displayName) });
+    fields.push_back({ "type", GetServiceTypeString(definition.serviceType) });
+    fields.push_back({ "start", DescribeRequestedStartType(definition.startType, definition.delayedAutoStart) });
+    fields.push_back({ "error", DescribeErrorControl(definition.errorControl) });
+    if (!definition.loadOrderGroup.empty()) fields.push_back({ "group", WStringToString(definition.loadOrderGroup) });
+    if (definition.requestTag) fields.push_back({ "tag", "yes" });
+    if (!definition.dependencies.empty()) fields.push_back({ "depend", JoinDependencyNames(definition.dependencies) });
+    if (!definition.account.empty()) fields.push_back({ "obj", WStringToString(definition.account) });
+    if (!definition.password.empty()) fields.push_back({ "password", "(set)" });
+    if (!definition.description.empty()) fields.push_back({ "description", WStringToString(definition.description) });
+    return fields;
+}
+
+/**
+ * Converts a configuration change into journal fields, leaving out the password
+ *
+ * @param change The settings being changed
+ * @return One field per setting given
+ */
+AuditFields AuditConfigChangeFields(const scclone::ServiceConfigChange& change) {
+    AuditFields fields;
+    if (change.displayName) fields.push_back({ "displayname", WStringToString(*change.displayName) });
+    if (change.serviceType) fields.push_back({ "type", GetServiceTypeString(*change.serviceType) });
+    if (change.startType) fields.push_back({ "start", DescribeRequestedStartType(*change.startType, change.delayedAutoStart.value_or(false)) });
+    else if (change.delayedAutoStart) fields.push_back({ "delayed_auto", *change.delayedAutoStart ? "true" : "false" });
+    if (change.errorControl) fields.push_back({ "error", DescribeErrorControl(*change.errorControl) });
+    if (change.binaryPath) fields.push_back({ "binpath", WStringToString(*change.binaryPath) });
+    if (change.loadOrderGroup) fields.push_back({ "group", WStringToString(*change.loadOrderGroup) });
+    if (change.dependencies) fields.push_back({ "depend", JoinDependencyNames(*change.dependencies) });
+    if (change.account) fields.push_back({ "obj", WStringToString(*change.account) });
+    if (change.password) fields.push_back({ "password", "(set)" });
+    if (change.description) fields.push_back({ "description", WStringToString(*change.description) });
+    return fields;
+}
+
+/**
+ * Returns the AuditCapture groups a configuration change can alter
+ */
+unsigned AuditCaptureFor(const scclone::ServiceConfigChange& change) {
+    unsigned parts = 0;
+    if (change.displayName || change.serviceType || change.startType || change.errorControl || change.binaryPath ||
+        change.loadOrderGroup || change.dependencies || change.account || change.password) {
+        parts |= AuditConfig;
+    }
+    if (change.description) parts |= AuditDescription;
+    if (change.startType || change.delayedAutoStart) parts |= AuditDelayedAuto;
+    return parts;
+}
+
+/**
+ * Returns the AuditCapture groups a new service's record shows: its main
+ * configuration, plus the extra settings the definition asked for
+ */
+unsigned AuditCaptureFor(const scclone::ServiceDefinition& definition) {
+    unsigned parts = AuditConfig;
+    if (!definition.description.empty()) parts |= AuditDescription;
+    if (definition.delayedAutoStart) parts |= AuditDelayedAuto;
+    return parts;
+}
+
+/**
+ * Passes a journal failure back to a library caller as a warning
+ * The command line has already printed it (once per run), so it is only added in
+ * SCCLONE_LIBRARY builds, where nothing is printed.
+ *
+ * @param journaled What JournalServiceChange returned
+ * @param warnings The result's warnings
+ */
+void NoteJournalFailure(bool journaled, std::vector<std::string>& warnings) {
+#ifdef SCCLONE_LIBRARY
+    if (!journaled) warnings.push_back("Could not write audit journal '" + WStringToString(Journal()->Path()) + "'");
+#else
+    (void)journaled;
+    (void)warnings;
+#endif
+}
+
+/**
+ * Converts library failure settings into the policy ApplyFailurePolicy takes
+ *
+ * @param settings The settings
+ * @return The equivalent policy
+ */
+FailurePolicy ToFailurePolicy(const scclone::FailureSettings& settings) {
+    FailurePolicy policy;
+    if (settings.actions) {
+        policy.hasActions = true;
+        policy.resetPeriod = settings.resetPeriodSeconds;
+        for (const auto& step : *settings.actions) {
+            SC_ACTION action;
+            ZeroMemory(&action, sizeof(SC_ACTION));
+            action.Type = (SC_ACTION_TYPE)step.action;
+            action.Delay = step.delayMs;
+            policy.actions.push_back(action);
+        }
+    }
+    if (settings.command) {
+        policy.hasCommand = true;
+        policy.command = *settings.command;
+    }
+    if (settings.rebootMessage) {
+        policy.hasRebootMsg = true;
+        policy.rebootMsg = *settings.rebootMessage;
+    }
+    if (settings.nonCrashFailures) {
+        policy.hasFlag = true;
+        policy.nonCrashFailures = *settings.nonCrashFailures;
+    }
+    return policy;
+}
+
+/**
+ * Creates a service through an already open SCM handle
+ * Shared by the library's Create and templated bulk creation
+ *
+ * @param scManager SCM handle opened with SC_MANAGER_CREATE_SERVICE
+ * @param definition The service to create
+ * @return The tag ID and warnings, or the failure
+ */
+scclone::CreateResult CreateServiceOn(SC_HANDLE scManager, const scclone::ServiceDefinition& definition) {
+    ULONGLONG startTime = ClockNow();
+    scclone::CreateResult created;
+
+    const std::wstring& displayName = definition.displayName.empty() ? definition.name : definition.displayName;
+    std::wstring dependencies = BuildMultiString(definition.dependencies);
+    DWORD tag = 0;
+
+    SC_HANDLE service = Scm().CreateServiceW(
+        scManager,                                                  // SCM handle
+        definition.name.c_str(),                                    // Service name
+        displayName.c_str(),                                        // Display name
+        SERVICE_ALL_ACCESS,                                         // Desired access
+        definition.serviceType,                                     // Service type
+        (DWORD)definition.startType,                                // Start type
+        (DWORD)definition.errorControl,                             // Error control
+        definition.binaryPath.c_str(),                              // Binary path
+        definition.loadOrderGroup.empty() ? NULL : definition.loadOrderGroup.c_str(), // Load ordering group
+        definition.requestTag ? &tag : NULL,                        // Tag ID
+        definition.dependencies.empty() ? NULL : dependencies.c_str(), // Dependencies
+        definition.account.empty() ? NULL : definition.account.c_str(), // Account name
+        definition.password.empty() ? NULL : definition.password.c_str() // Password
+    );
+
+    if (!service) {
+        static_cast<CommandResult&>(created) = CommandFailure(ScmStage::Create, startTime);
+        NoteJournalFailure(JournalServiceChange("create", definition.name, AuditDefinitionFields(definition), AuditFields(),
+            AuditFields(), created), created.warnings);
+        return created;
+    }
+
+    // Description and delayed start are extra settings; failing to set them leaves the service in place
+    if (!definition.description.empty()) {
+        SERVICE_DESCRIPTIONW desc = { 0 };
+        desc.lpDescription = const_cast<LPWSTR>(definition.description.c_str());
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, &desc)) {
+            created.warnings.push_back("Failed to set service description: " + FormatErrorMessage(GetLastError()));
+        }
+    }
+    if (definition.startType == scclone::StartType::Auto && definition.delayedAutoStart) {
+        SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { TRUE };
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, &delayedInfo)) {
+            created.warnings.push_back("Failed to set delayed auto-start: " + FormatErrorMessage(GetLastError()));
+        }
+    }
+
+    created.tagId = tag;
+    static_cast<CommandResult&>(created) = CommandSuccess(startTime);
+    NoteJournalFailure(JournalServiceChange("create", definition.name, AuditDefinitionFields(definition), AuditFields(),
+        CaptureServiceAuditState(service, AuditCaptureFor(definition)), created), created.warnings);
+    Scm().CloseServiceHandle(service);
+    return created;
+}
+
+/**
+ * Runs the library's ...Async calls on a small pool of threads
+ * Threads are added as calls queue up, up to DefaultServiceConcurrency(), and
+ * then stay for the life of the process.
+ */
+class AsyncCallQueue {
+public:
+    /**
+     * Returns the process-wide queue, created on first use; lives for the rest of the
+     * process so calls still running at exit never touch a destroyed queue
+     */
+    static AsyncCallQueue& Instance() {
+        static AsyncCallQueue* queue = new AsyncCallQueue();
+        return *queue;
+    }
+
+    /**
+     * Queues a call to run on one of the pool's threads
+     *
+     * @param call The call
+     */
+    void Post(std::function<void()> call) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        calls_.push_back(std::move(call));
+        if (idle_ == 0 && threads_ < DefaultServiceConcurrency()) {
+            threads_++;
+            std::thread(&AsyncCallQueue::Work, this).detach();
+        }
+        else {
+            wake_.notify_one();
+        }
+    }
+
+private:
+    void Work() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            idle_++;
+            wake_.wait(lock, [&] { return !calls_.empty(); });
+            idle_--;
+            std::function<void()> call = std::move(calls_.front());
+            calls_.pop_front();
+            lock.unlock();
+            call();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> calls_;
+    size_t threads_ = 0;
+    size_t idle_ = 0;
+};
+
+// The library functions themselves; libscclone.h documents each of them
+namespace scclone {
+
+std::string FormatResult(const Result& result) {
+    return FormatCommandFailure(result);
+}
+
+QueryResult Query(const std::wstring& serviceName, bool withRestartHistory) {
+    ULONGLONG startTime = ClockNow();
+    QueryResult queried;
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        static_cast<Result&>(queried) = CommandFailure(ScmStage::OpenManager, startTime);
+        return queried;
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_QUERY_STATUS | SERVICE_QUERY_CONFIG);
+    if (!service) {
+        static_cast<Result&>(queried) = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return queried;
+    }
+
+    // Get service status information
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+        static_cast<Result&>(queried) = CommandFailure(ScmStage::QueryStatus, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return queried;
+    }
+
+    // Get service config - first call to get required buffer size
+    DWORD bytesNeeded2 = 0;
+    BOOL result = Scm().QueryServiceConfigW(service, NULL, 0, &bytesNeeded2);
+    // This call is expected to fail with ERROR_INSUFFICIENT_BUFFER
+    if (!result && GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        static_cast<Result&>(queried) = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return queried;
+    }
+    std::vector<BYTE> buffer(bytesNeeded2);
+    LPQUERY_SERVICE_CONFIGW config = (LPQUERY_SERVICE_CONFIGW)buffer.data();
+
+    // Call QueryServiceConfig again to fill the buffer with data
+    // Added to fix issue where 'TYPE' kept showing up as UNKNOWN, issue was that I didn't call this again after previous expected fail
+    if (!Scm().QueryServiceConfigW(service, config, bytesNeeded2, &bytesNeeded2)) {
+        static_cast<Result&>(queried) = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return queried;
+    }
+
+    queried.displayName = config->lpDisplayName ? config->lpDisplayName : L"";
+    queried.binaryPath = config->lpBinaryPathName ? config->lpBinaryPathName : L"";
+    queried.serviceType = config->dwServiceType;
+    queried.startType = (StartType)config->dwStartType;
+    queried.state = (State)status.dwCurrentState;
+    queried.processId = status.dwProcessId;
+
+    // Recent restarts, if asked for and a monitor has been recording this service
+    std::map<std::wstring, ServiceHistory> histories;
+    if (withRestartHistory && LoadRestartHistory(GetRestartHistoryPath(), histories)) {
+        auto history = histories.find(ToLowerServiceName(serviceName));
+        if (history != histories.end()) {
+            unsigned long long hourAgo = WallClockMs() - 3600 * 1000ULL;
+            queried.restartsLastHour = (int)history->second.CountSince(ServiceEventRestarted, hourAgo);
+            queried.restartsSaturated = history->second.SaturatedSince(hourAgo);
+        }
+    }
+
+    // Clean up resources
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    static_cast<Result&>(queried) = CommandSuccess(startTime);
+    return queried;
+}
+
+CreateResult Create(const ServiceDefinition& definition) {
+    ULONGLONG startTime = ClockNow();
+    CreateResult created;
+
+    if (definition.name.empty() || definition.binaryPath.empty()) {
+        static_cast<Result&>(created) = CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+        return created;
+    }
+
+    // Open the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_ALL_ACCESS);
+    if (!scManager) {
+        static_cast<Result&>(created) = CommandFailure(ScmStage::OpenManager, startTime);
+        return created;
+    }
+
+    created = CreateServiceOn(scManager, definition);
+    created.elapsedMs = ClockNow() - startTime;
+
+    // Clean up resources
+    Scm().CloseServiceHandle(scManager);
+    return created;
+}
+
+ConfigResult Configure(const std::wstring& serviceName, const ServiceConfigChange& change) {
+    ULONGLONG startTime = ClockNow();
+    ConfigResult configured;
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        static_cast<Result&>(configured) = CommandFailure(ScmStage::OpenManager, startTime);
+        return configured;
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_CHANGE_CONFIG | SERVICE_QUERY_CONFIG);
+    if (!service) {
+        static_cast<Result&>(configured) = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return configured;
+    }
+    unsigned auditParts = AuditCaptureFor(change);
+    AuditFields before = CaptureServiceAuditState(service, auditParts);
+    std::wstring dependencies = change.dependencies ? BuildMultiString(*change.dependencies) : L"";
+
+    // Settings that were not given are passed as SERVICE_NO_CHANGE / NULL
+    if (!Scm().ChangeServiceConfigW(
+        service,                                                            // Service handle
+        change.serviceType ? *change.serviceType : SERVICE_NO_CHANGE,       // Service type
+        change.startType ? (DWORD)*change.startType : SERVICE_NO_CHANGE,    // Start type
+        change.errorControl ? (DWORD)*change.errorControl : SERVICE_NO_CHANGE, // Error control
+        change.binaryPath ? change.binaryPath->c_str() : NULL,              // Binary path
+        change.loadOrderGroup ? change.loadOrderGroup->c_str() : NULL,      // Load ordering group
+        NULL,                                                               // Tag ID (can't be changed after creation)
+        change.dependencies ? dependencies.c_str() : NULL,                  // Dependencies
+        change.account ? change.account->c_str() : NULL,                    // Account name
+        change.password ? change.password->c_str() : NULL,                  // Password
+        change.displayName ? change.displayName->c_str() : NULL             // Display name
+    )) {
+        static_cast<Result&>(configured) = CommandFailure(ScmStage::ChangeConfig, startTime);
+        NoteJournalFailure(JournalServiceChange("config", serviceName, AuditConfigChangeFields(change), before,
+            CaptureServiceAuditState(service, auditParts), configured), configured.warnings);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return configured;
+    }
+
+    // Set description if provided
+    if (change.description) {
+        SERVICE_DESCRIPTIONW desc = { 0 };
+        desc.lpDescription = const_cast<LPWSTR>(change.description->c_str());
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, &desc)) {
+            configured.warnings.push_back("Failed to set service description: " + FormatErrorMessage(GetLastError()));
+        }
+    }
+
+    // Turn delayed auto-start on or off if specified
+    if (change.delayedAutoStart) {
+        SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { *change.delayedAutoStart ? TRUE : FALSE };
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, &delayedInfo)) {
+            configured.warnings.push_back("Failed to set delayed auto-start: " + FormatErrorMessage(GetLastError()));
+        }
+    }
+
+    static_cast<Result&>(configured) = CommandSuccess(startTime);
+    NoteJournalFailure(JournalServiceChange("config", serviceName, AuditConfigChangeFields(change), before,
+        CaptureServiceAuditState(service, auditParts), configured), configured.warnings);
+
+    // Clean up resources
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    return configured;
+}
+
+/*
+ * Without a probe the service is ready once it reports SERVICE_RUNNING. With a probe
+ * it must also pass the probe; the probe is polled on its own thread from the moment
+ * the start request is sent, so the reported time-to-ready is measured, not polled.
+ * Under the virtual clock the probe is checked inline between status polls instead,
+ * since virtual time only moves on the thread that sleeps.
+ */
+StateChangeResult Start(const std::wstring& serviceName, const StartOptions& options) {
+    ULONGLONG startTime = ClockNow();
+    StateChangeResult started;
+
+    ReadinessProbe probe;
+    if (!options.probe.empty() && !ParseReadinessProbe(options.probe, probe)) {
+        static_cast<Result&>(started) = CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+        return started;
+    }
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        static_cast<Result&>(started) = CommandFailure(ScmStage::OpenManager, startTime);
+        return started;
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_START | SERVICE_QUERY_STATUS);
+    if (!service) {
+        static_cast<Result&>(started) = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return started;
+    }
+
+    // Build the argument vector for StartService (the strings outlive the call)
+    std::vector<LPCWSTR> argPointers;
+    for (const auto& arg : options.arguments) {
+        argPointers.push_back(arg.c_str());
+    }
+
+    ULONGLONG requestTime = ClockNow();
+
+    // Attempt to start the service
+    if (!Scm().StartServiceW(service, static_cast<DWORD>(argPointers.size()),
+        argPointers.empty() ? NULL : argPointers.data())) {
+        static_cast<Result&>(started) = CommandFailure(ScmStage::Start, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return started;
+    }
+    started.requested = true;
+
+    // Run the probe concurrently with the state wait; it signals once it has passed,
+    // and this thread records the time, because virtual time is per thread
+    bool virtualTime = g_virtualClock;
+    std::mutex waitMutex;
+    std::condition_variable waitSignal;
+    std::atomic<bool> stopProbe(false);
+    std::atomic<bool> probePassed(false);
+    ULONGLONG probeReadyTime = 0;
+    std::thread probeThread;
+
+    if (probe.kind != ReadinessProbe::None && !virtualTime) {
+        probeThread = std::thread([&] {
+            while (!stopProbe) {
+                if (CheckReadinessProbe(probe)) {
+                    std::lock_guard<std::mutex> lock(waitMutex);
+                    probePassed = true;
+                    waitSignal.notify_all();
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        });
+    }
+
+    // Wait for service to start and pass its probe
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    ULONGLONG runningTime = 0;
+    bool ready = false;
+
+    // Poll the service status until it's ready, fails or times out
+    while (true) {
+        if (!runningTime) {
+            if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+                static_cast<Result&>(started) = CommandFailure(ScmStage::QueryStatus, startTime);
+                break;
+            }
+            started.state = (State)status.dwCurrentState;
+
+            // Check if service has reached the running state
+            if (status.dwCurrentState == SERVICE_RUNNING) {
+                runningTime = ClockNow();
+            }
+            // A service that falls back to stopped has failed to start
+            else if (status.dwCurrentState == SERVICE_STOPPED) {
+                DWORD exitCode = status.dwWin32ExitCode ? status.dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+                static_cast<Result&>(started) = CommandFailure(ScmStage::Wait, exitCode, startTime);
+                break;
+            }
+        }
+
+        if (probe.kind != ReadinessProbe::None && !probeReadyTime &&
+            (virtualTime ? CheckReadinessProbe(probe) : probePassed.load())) {
+            probeReadyTime = ClockNow();
+        }
+
+        // Ready once running and, if there is a probe, once the probe has passed
+        if (runningTime && (probe.kind == ReadinessProbe::None || probeReadyTime)) {
+            ready = true;
+            break;
+        }
+
+        // Check for timeout; a running service that never passed its probe is a probe failure
+        if (ClockNow() - requestTime > options.timeoutMs) {
+            static_cast<Result&>(started) = runningTime
+                ? CommandFailure(ScmStage::Probe, ERROR_TIMEOUT, startTime)
+                : CommandFailure(ScmStage::Wait, ERROR_SERVICE_REQUEST_TIMEOUT, startTime);
+            break;
+        }
+
+        // Wait a short time before checking again (woken early when the probe passes)
+        if (probe.kind == ReadinessProbe::None || virtualTime) {
+            ClockSleep(250);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(waitMutex);
+        waitSignal.wait_for(lock, std::chrono::milliseconds(250), [&] { return probePassed.load(); });
+    }
+
+    stopProbe = true;
+    if (probeThread.joinable()) probeThread.join();
+
+    if (runningTime) started.timeToStateMs = runningTime - requestTime;
+    if (ready) {
+        // The service is ready at whichever condition was satisfied last
+        started.timeToReadyMs = (std::max)(runningTime, probeReadyTime) - requestTime;
+        static_cast<Result&>(started) = CommandSuccess(startTime);
+    }
+
+    // Clean up resources
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    return started;
+}
+
+StateChangeResult Stop(const std::wstring& serviceName, uint32_t timeoutMs) {
+    ULONGLONG startTime = ClockNow();
+    StateChangeResult stopped;
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        static_cast<Result&>(stopped) = CommandFailure(ScmStage::OpenManager, startTime);
+        return stopped;
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_STOP | SERVICE_QUERY_STATUS);
+    if (!service) {
+        static_cast<Result&>(stopped) = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return stopped;
+    }
+
+    // Get current service status
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+        static_cast<Result&>(stopped) = CommandFailure(ScmStage::QueryStatus, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return stopped;
+    }
+    stopped.state = (State)status.dwCurrentState;
+
+    // Nothing to do if the service is already stopped
+    if (status.dwCurrentState == SERVICE_STOPPED) {
+        stopped.alreadyInState = true;
+        static_cast<Result&>(stopped) = CommandSuccess(startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return stopped;
+    }
+
+    // Send stop control code to the service
+    SERVICE_STATUS svcStatus;
+    ULONGLONG requestTime = ClockNow();
+    if (!Scm().ControlService(service, SERVICE_CONTROL_STOP, &svcStatus)) {
+        static_cast<Result&>(stopped) = CommandFailure(ScmStage::Control, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return stopped;
+    }
+    stopped.requested = true;
+
+    // Wait for the service to stop
+    Result waited = WaitForServiceState(service, SERVICE_STOPPED, timeoutMs, status);
+    stopped.state = (State)status.dwCurrentState;
+    if (waited.ok()) {
+        stopped.timeToStateMs = ClockNow() - requestTime;
+        waited = CommandSuccess(startTime);
+    }
+    waited.elapsedMs = ClockNow() - startTime;
+    static_cast<Result&>(stopped) = waited;
 
     // Clean up resources
-    CloseServiceHandle(service);
-    CloseServiceHandle(scManager);
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    return stopped;
+}
+
+Result Delete(const std::wstring& serviceName) {
+    ULONGLONG startTime = ClockNow();
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), DELETE | SERVICE_QUERY_CONFIG);
+    if (!service) {
+        Result failure = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return failure;
+    }
+
+    // Delete the service, journaling the configuration it had
+    AuditFields before = CaptureServiceAuditState(service, AuditConfig | AuditDescription);
+    if (!Scm().DeleteService(service)) {
+        Result failure = CommandFailure(ScmStage::Delete, startTime);
+        JournalServiceChange("delete", serviceName, AuditFields(), before, before, failure);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return failure;
+    }
+    JournalServiceChange("delete", serviceName, AuditFields(), before, AuditFields(), CommandSuccess(startTime));
+
+    // Clean up resources
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+std::vector<FailureActionsResult> SetFailureActions(const std::vector<std::wstring>& serviceNames,
+    const FailureSettings& settings, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+    std::vector<FailureActionsResult> results(serviceNames.size());
+    for (size_t i = 0; i < serviceNames.size(); i++) results[i].serviceName = serviceNames[i];
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        Result failure = CommandFailure(ScmStage::OpenManager, startTime);
+        for (auto& result : results) static_cast<Result&>(result) = failure;
+        return results;
+    }
+
+    FailurePolicy policy = ToFailurePolicy(settings);
+    ParallelFor(serviceNames.size(), concurrency ? concurrency : DefaultServiceConcurrency(), [&](size_t i) {
+        FailurePolicyOutcome outcome = ApplyFailurePolicy(scManager, serviceNames[i], policy);
+        static_cast<Result&>(results[i]) = outcome.result;
+        results[i].changes = std::move(outcome.changes);
+    });
+    Scm().CloseServiceHandle(scManager);
+    return results;
+}
+
+void QueryAsync(const std::wstring& serviceName, std::function<void(const QueryResult&)> done, bool withRestartHistory) {
+    AsyncCallQueue::Instance().Post([=] { done(Query(serviceName, withRestartHistory)); });
+}
+
+void CreateAsync(const ServiceDefinition& definition, std::function<void(const CreateResult&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Create(definition)); });
+}
+
+void ConfigureAsync(const std::wstring& serviceName, const ServiceConfigChange& change,
+    std::function<void(const ConfigResult&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Configure(serviceName, change)); });
+}
+
+void StartAsync(const std::wstring& serviceName, const StartOptions& options,
+    std::function<void(const StateChangeResult&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Start(serviceName, options)); });
+}
+
+void StopAsync(const std::wstring& serviceName, uint32_t timeoutMs, std::function<void(const StateChangeResult&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Stop(serviceName, timeoutMs)); });
+}
+
+void DeleteAsync(const std::wstring& serviceName, std::function<void(const Result&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Delete(serviceName)); });
+}
+
+void SetFailureActionsAsync(const std::vector<std::wstring>& serviceNames, const FailureSettings& settings,
+    size_t concurrency, std::function<void(const std::vector<FailureActionsResult>&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(SetFailureActions(serviceNames, settings, concurrency)); });
+}
+
+} // namespace scclone
+
+
+//=============================================================================
+// Command implementations - These implement the actual service control commands
+//=============================================================================
+
+/**
+ * Queries and displays detailed information about a Windows service
+ * Similar to "sc query <service>"
+ *
+ * @param serviceName Name of the service to query
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult QueryService(const std::wstring& serviceName) {
+    scclone::QueryResult service = scclone::Query(serviceName, true);
+    if (!service.ok()) return service;
+
+    // Display service information (converted to UTF-8 only here, at the output boundary)
+    std::cout << "DISPLAY_NAME: " << (service.displayName.empty() ? "(none)" : WStringToString(service.displayName)) << std::endl;
+    std::cout << "TYPE        : " << GetServiceTypeString(service.serviceType) << std::endl;
+    std::cout << "START_TYPE  : " << GetServiceStartTypeString((DWORD)service.startType) << std::endl;
+    std::cout << "STATE       : " << GetServiceStateString((DWORD)service.state) << std::endl;
+    std::cout << "PID         : " << service.processId << std::endl;
+    std::cout << "BINARY_PATH : " << (service.binaryPath.empty() ? "(none)" : WStringToString(service.binaryPath)) << std::endl;
+    if (service.restartsLastHour >= 0) {
+        std::cout << "RESTARTS_1H : " << service.restartsLastHour << (service.restartsSaturated ? "+" : "") << std::endl;
+    }
+    return service;
+}
+
+/**
+ * One row of a service enumeration
+ */
+struct ServiceStatusEntry {
+    std::wstring serviceName;
+    std::wstring displayName;
+    SERVICE_STATUS_PROCESS status;
+};
+
+/**
+ * Enumerates every Win32 service with its status using EnumServicesStatusExW
+ *
+ * @param entries Receives one entry per service
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult EnumerateServices(std::vector<ServiceStatusEntry>& entries) {
+    ULONGLONG startTime = ClockNow();
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_ENUMERATE_SERVICE);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    // 64 KB is enough for a typical machine in one call; grow if the SCM says otherwise
+    std::vector<BYTE> buffer(64 * 1024);
+    DWORD resumeHandle = 0;
+
+    while (true) {
+        DWORD bytesNeeded = 0;
+        DWORD count = 0;
+        BOOL done = Scm().EnumServicesStatusExW(scManager, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_STATE_ALL,
+            buffer.data(), (DWORD)buffer.size(), &bytesNeeded, &count, &resumeHandle, NULL);
+        if (!done && GetLastError() != ERROR_MORE_DATA) {
+            CommandResult failure = CommandFailure(ScmStage::QueryStatus, startTime);
+            Scm().CloseServiceHandle(scManager);
+            return failure;
+        }
+
+        // Copy this batch out before the buffer is reused
+        LPENUM_SERVICE_STATUS_PROCESSW services = (LPENUM_SERVICE_STATUS_PROCESSW)buffer.data();
+        for (DWORD i = 0; i < count; i++) {
+            ServiceStatusEntry entry;
+            entry.serviceName = services[i].lpServiceName;
+            entry.displayName = services[i].lpDisplayName ? services[i].lpDisplayName : L"";
+            entry.status = services[i].ServiceStatusProcess;
+            entries.push_back(std::move(entry));
+        }
+
+        if (done) break;
+        if (bytesNeeded > buffer.size()) buffer.resize(bytesNeeded);
+    }
+
+    Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Renders a service list in "sc query" layout into a single UTF-8 buffer
+ * This is the one place enumeration output crosses from wide to UTF-8
+ *
+ * @param entries The services to render
+ * @param out Buffer to append to
+ * @param fullConversion Use the two-pass WideCharToMultiByte conversion (for benchmarking)
+ */
+void RenderServiceList(const std::vector<ServiceStatusEntry>& entries, std::string& out, bool fullConversion = false) {
+    for (const auto& entry : entries) {
+        out += "SERVICE_NAME: ";
+        if (fullConversion) out += WStringToStringFull(entry.serviceName);
+        else AppendWideAsUtf8(out, entry.serviceName.data(), entry.serviceName.size());
+        out += "\nDISPLAY_NAME: ";
+        if (fullConversion) out += WStringToStringFull(entry.displayName);
+        else AppendWideAsUtf8(out, entry.displayName.data(), entry.displayName.size());
+        out += "\nTYPE        : ";
+        out += GetServiceTypeString(entry.status.dwServiceType);
+        out += "\nSTATE       : ";
+        out += GetServiceStateString(entry.status.dwCurrentState);
+        out += "\nPID         : ";
+        out += std::to_string(entry.status.dwProcessId);
+        out += "\n\n";
+    }
+}
+
+/**
+ * Queries and displays the status of every service
+ * Similar to "sc query" with no service name
+ *
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult QueryAllServices() {
+    std::vector<ServiceStatusEntry> entries;
+    CommandResult result = EnumerateServices(entries);
+    if (!result.ok()) return result;
+
+    // Render everything first and write it in one go
+    std::string output;
+    output.reserve(entries.size() * 160);
+    RenderServiceList(entries, output);
+    std::cout.write(output.data(), output.size());
+    std::cout.flush();
+    return result;
+}
+
+/**
+ * Expands service arguments into service names
+ * Plain names are passed through unchanged (so a missing service still fails at
+ * open time with its own error); arguments with * or ? are matched against the
+ * enumerated service list. Duplicates are dropped, keeping the first spelling.
+ *
+ * @param patterns Service names and wildcard patterns
+ * @param names Receives the resolved service names
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ResolveServices(const std::vector<std::wstring>& patterns, std::vector<std::wstring>& names) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceStatusEntry> entries;
+    bool enumerated = false;
+    std::set<std::wstring> seen;
+    for (const auto& pattern : patterns) {
+        if (!IsServicePattern(pattern)) {
+            if (seen.insert(ToLowerServiceName(pattern)).second) names.push_back(pattern);
+            continue;
+        }
+        if (!enumerated) {
+            CommandResult result = EnumerateServices(entries);
+            if (!result.ok()) return result;
+            enumerated = true;
+        }
+        for (const auto& entry : entries) {
+            if (MatchServicePattern(pattern, entry.serviceName) && seen.insert(ToLowerServiceName(entry.serviceName)).second) {
+                names.push_back(entry.serviceName);
+            }
+        }
+    }
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Benchmarks the UTF-8 output conversion on real enumeration output
+ * Renders the full service list repeatedly with the SIMD ASCII path and with the
+ * system's two-pass conversion (WideCharToMultiByte, or wcsrtombs outside Windows),
+ * and reports the time for each. Without a system converter only the SIMD path
+ * is timed.
+ *
+ * @param iterations Number of times to render the list with each converter
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult BenchmarkConversion(int iterations) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceStatusEntry> entries;
+    CommandResult result = EnumerateServices(entries);
+    if (!result.ok()) return result;
+
+    size_t bytes = 0;
+    double elapsed[2] = { 0, 0 };
+    int passes = HaveSystemUtf8Converter() ? 2 : 1;
+    for (int pass = 0; pass < passes; pass++) {
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            std::string output;
+            output.reserve(entries.size() * 160);
+            RenderServiceList(entries, output, pass == 1);
+            bytes = output.size();
+        }
+        elapsed[pass] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    std::cout << "Services rendered : " << entries.size() << " (" << bytes << " bytes per render)" << std::endl;
+    std::cout << "Iterations        : " << iterations << std::endl;
+#ifdef _WIN32
+    const char* names[2] = { "SIMD ASCII path   : ", "WideCharToMultiByte: " };
+#else
+    const char* names[2] = { "SIMD ASCII path   : ", "wcsrtombs         : " };
+#endif
+    for (int pass = 0; pass < passes; pass++) {
+        double perRender = elapsed[pass] / iterations;
+        double megabytesPerSecond = perRender > 0 ? (bytes / 1048576.0) / (perRender / 1000.0) : 0;
+        std::cout << names[pass] << perRender << " ms per render, " << megabytesPerSecond << " MB/s" << std::endl;
+    }
+    if (passes < 2) {
+        std::cout << names[1] << "unavailable (no UTF-8 locale installed)" << std::endl;
+    }
+    else if (elapsed[0] > 0) {
+        std::cout << "Speedup           : " << elapsed[1] / elapsed[0] << "x" << std::endl;
+    }
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Parses a /type value such as "own" or "interact type=own"
+ *
+ * @param name The value given with /type
+ * @param serviceType Receives the SERVICE_* type flags
+ * @param error Receives the reason the value is invalid
+ * @return true if the value is valid
+ */
+bool ParseServiceTypeName(const std::wstring& name, DWORD& serviceType, std::string& error) {
+    if (name == L"own") serviceType = SERVICE_WIN32_OWN_PROCESS;
+    else if (name == L"share") serviceType = SERVICE_WIN32_SHARE_PROCESS;
+    else if (name == L"kernel") serviceType = SERVICE_KERNEL_DRIVER;
+    else if (name == L"filesys") serviceType = SERVICE_FILE_SYSTEM_DRIVER;
+    else if (name == L"rec") serviceType = SERVICE_FILE_SYSTEM_DRIVER | SERVICE_RECOGNIZER_DRIVER;
+    else if (name == L"interact type=own") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_OWN_PROCESS;
+    else if (name == L"interact type=share") serviceType = SERVICE_INTERACTIVE_PROCESS | SERVICE_WIN32_SHARE_PROCESS;
+    else if (name == L"interact") {
+        error = "'interact' type must be used with 'own' or 'share' (e.g., type=interact type=own)";
+        return false;
+    }
+    else {
+        error = "Invalid type '" + WStringToString(name) + "' (use own, share, kernel, filesys, rec or interact)";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses a /start value; delayed-auto is auto start with the delayed flag set
+ *
+ * @param name The value given with /start
+ * @param startType Receives the start type
+ * @param delayedAutoStart Receives whether delayed start was asked for
+ * @param error Receives the reason the value is invalid
+ * @return true if the value is valid
+ */
+bool ParseStartTypeName(const std::wstring& name, scclone::StartType& startType, bool& delayedAutoStart, std::string& error) {
+    delayedAutoStart = false;
+    if (name == L"boot") startType = scclone::StartType::Boot;
+    else if (name == L"system") startType = scclone::StartType::System;
+    else if (name == L"auto") startType = scclone::StartType::Auto;
+    else if (name == L"demand") startType = scclone::StartType::Demand;
+    else if (name == L"disabled") startType = scclone::StartType::Disabled;
+    else if (name == L"delayed-auto") {
+        startType = scclone::StartType::Auto;
+        delayedAutoStart = true;
+    }
+    else {
+        error = "Invalid start type '" + WStringToString(name) + "' (use boot, system, auto, demand, disabled or delayed-auto)";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses an /error value
+ *
+ * @param name The value given with /error
+ * @param errorControl Receives the error control level
+ * @param error Receives the reason the value is invalid
+ * @return true if the value is valid
+ */
+bool ParseErrorControlName(const std::wstring& name, scclone::ErrorControl& errorControl, std::string& error) {
+    if (name == L"normal") errorControl = scclone::ErrorControl::Normal;
+    else if (name == L"severe") errorControl = scclone::ErrorControl::Severe;
+    else if (name == L"critical") errorControl = scclone::ErrorControl::Critical;
+    else if (name == L"ignore") errorControl = scclone::ErrorControl::Ignore;
+    else {
+        error = "Invalid error control '" + WStringToString(name) + "' (use normal, severe, critical or ignore)";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Splits a /depend value such as "Tcpip/+NetworkProvider" into names
+ *
+ * @param list The value given with /depend
+ * @return The names; empty if the value is empty
+ */
+std::vector<std::wstring> SplitDependencyList(const std::wstring& list) {
+    std::vector<std::wstring> names;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t slash = list.find(L'/', start);
+        if (slash == std::wstring::npos) slash = list.size();
+        if (slash > start) names.push_back(list.substr(start, slash - start));
+        start = slash + 1;
+    }
+    return names;
+}
+
+/**
+ * Reads create's parameters into a service definition
+ *   /servicename and /binpath (required), /displayname, /type, /start, /error,
+ *   /group, /tag yes, /depend a/b, /obj, /password, /description
+ *
+ * @param args Parsed command line parameters
+ * @param definition Receives the service definition
+ * @param error Receives a description of the first invalid parameter
+ * @return true if the parameters are valid
+ */
+bool ParseServiceDefinition(const std::map<std::wstring, std::wstring>& args, scclone::ServiceDefinition& definition,
+    std::string& error) {
+    if (!args.count(L"servicename") || !args.count(L"binpath")) {
+        error = "Missing required parameters. Required: /servicename and /binpath";
+        return false;
+    }
+    definition.name = args.at(L"servicename");
+    definition.binaryPath = args.at(L"binpath");
+    if (args.count(L"displayname")) definition.displayName = args.at(L"displayname");
+
+    DWORD serviceType = definition.serviceType;
+    if (args.count(L"type") && !ParseServiceTypeName(args.at(L"type"), serviceType, error)) return false;
+    definition.serviceType = serviceType;
+    if (args.count(L"start") &&
+        !ParseStartTypeName(args.at(L"start"), definition.startType, definition.delayedAutoStart, error)) return false;
+    if (args.count(L"error") && !ParseErrorControlName(args.at(L"error"), definition.errorControl, error)) return false;
+
+    if (args.count(L"group")) definition.loadOrderGroup = args.at(L"group");
+    definition.requestTag = args.count(L"tag") && args.at(L"tag") == L"yes";
+    if (args.count(L"depend")) definition.dependencies = SplitDependencyList(args.at(L"depend"));
+    if (args.count(L"obj")) definition.account = args.at(L"obj");
+    if (args.count(L"password")) definition.password = args.at(L"password");
+    if (args.count(L"description")) definition.description = args.at(L"description");
+    return true;
+}
+
+/**
+ * Creates a new Windows service
+ * Similar to "sc create <service> ..."
+ *
+ * @param args Map of parameters for the new service
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult CreateService(const std::map<std::wstring, std::wstring>& args) {
+    ULONGLONG startTime = ClockNow();
+
+    scclone::ServiceDefinition definition;
+    std::string error;
+    if (!ParseServiceDefinition(args, definition, error)) {
+        std::cerr << "ERROR: " << error << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+    }
+
+    scclone::CreateResult created = scclone::Create(definition);
+    if (!created.ok()) return created;
+
+    std::cout << "Service created successfully: " << WStringToString(definition.name) << std::endl;
+    for (const auto& warning : created.warnings) {
+        std::cerr << "Warning: " << warning << std::endl;
+    }
+    if (definition.requestTag) {
+        std::cout << "Tag ID: " << created.tagId << std::endl;
+    }
+    return created;
+}
+
+/**
+ * Queries and displays the description of a Windows service
+ * Similar to "sc qdescription <service>"
+ *
+ * @param serviceName Name of the service to query
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult QueryServiceDescription(const std::wstring& serviceName) {
+    ULONGLONG startTime = ClockNow();
+
+    // Open a handle to the service control manager
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    // Open a handle to the specified service
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_QUERY_CONFIG);
+    if (!service) {
+        CommandResult failure = CommandFailure(ScmStage::OpenService, startTime);
+        Scm().CloseServiceHandle(scManager);
+        return failure;
+    }
+
+    // Query service description - first call to get required buffer size
+    DWORD bytesNeeded = 0;
+    SERVICE_DESCRIPTIONW minimalBuffer = { 0 };
+    BOOL result = Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION,
+        (LPBYTE)&minimalBuffer, sizeof(SERVICE_DESCRIPTIONW), &bytesNeeded);
+    // This call is still expected to fail if more space is needed
+    if (!result && GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        CommandResult failure = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return failure;
+    }
+
+    // Allocate buffer and get the description data
+    std::vector<BYTE> buffer(bytesNeeded);
+    LPSERVICE_DESCRIPTIONW desc = (LPSERVICE_DESCRIPTIONW)buffer.data();
+
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, buffer.data(), bytesNeeded, &bytesNeeded)) {
+        CommandResult failure = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        Scm().CloseServiceHandle(scManager);
+        return failure;
+    }
+
+    // Display the service description
+    std::cout << "SERVICE_NAME: " << WStringToString(serviceName) << std::endl;
+    std::cout << "DESCRIPTION: " << (desc->lpDescription ? WStringToString(desc->lpDescription) : "(no description)") << std::endl;
+
+    // Clean up resources
+    Scm().CloseServiceHandle(service);
+    Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Starts a Windows service and waits for it to become ready
+ * Similar to "sc start <service> [arguments]"
+ *
+ * @param serviceName Name of the service to start
+ * @param options Arguments for the service's ServiceMain, readiness probe and timeout
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult StartService(const std::wstring& serviceName, const scclone::StartOptions& options) {
+    scclone::StateChangeResult started = scclone::Start(serviceName, options);
+    if (started.requested) {
+        std::cout << "Service start pending... " << std::endl;
+    }
+    if (!started.ok()) return started;
+
+    std::cout << "Service started successfully." << std::endl;
+    std::cout << "Time to RUNNING: " << started.timeToStateMs << " ms" << std::endl;
+    ReadinessProbe probe;
+    if (!options.probe.empty() && ParseReadinessProbe(options.probe, probe)) {
+        std::cout << "Time to ready  : " << started.timeToReadyMs << " ms (probe "
+            << GetReadinessProbeString(probe) << ")" << std::endl;
+    }
+    return started;
+}
+
+/**
+ * Stops a Windows service and waits for it to reach stopped state
+ * Similar to "sc stop <service>"
+ *
+ * @param serviceName Name of the service to stop
+ * @param timeoutMs How long to wait for the service to stop
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult StopService(const std::wstring& serviceName, DWORD timeoutMs) {
+    scclone::StateChangeResult stopped = scclone::Stop(serviceName, timeoutMs);
+    if (stopped.alreadyInState) {
+        std::cout << "Service is already stopped." << std::endl;
+        return stopped;
+    }
+    if (stopped.requested) {
+        std::cout << "Service stop pending... " << std::endl;
+    }
+    if (!stopped.ok()) return stopped;
+
+    std::cout << "Service stopped successfully." << std::endl;
+    return stopped;
+}
+
+/**
+ * A control to broadcast to a set of services
+ */
+struct ServiceControlRequest {
+    DWORD control = SERVICE_CONTROL_INTERROGATE;
+    DWORD access = SERVICE_INTERROGATE;     // Access right the control needs
+    DWORD waitState = 0;                    // State to wait for afterwards (0 = don't wait)
+    DWORD timeoutMs = 30000;
+};
+
+/**
+ * Outcome of sending a control to one service
+ */
+struct ServiceControlOutcome {
+    CommandResult result;
+    DWORD state = 0;            // State after the control (and the wait, if any)
+    ULONGLONG controlMs = 0;    // ControlService round trip
+    ULONGLONG waitMs = 0;       // Time spent waiting for the target state
+};
+
+/**
+ * Sends one control to one service and optionally waits for the resulting state
+ *
+ * @param scManager Open SCM handle
+ * @param serviceName Name of the service
+ * @param request The control, access right, wait state and timeout
+ * @return Status, latencies and result
+ */
+ServiceControlOutcome SendServiceControl(SC_HANDLE scManager, const std::wstring& serviceName,
+    const ServiceControlRequest& request) {
+    ULONGLONG startTime = ClockNow();
+    ServiceControlOutcome outcome;
+
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), request.access | SERVICE_QUERY_STATUS);
+    if (!service) {
+        outcome.result = CommandFailure(ScmStage::OpenService, startTime);
+        return outcome;
+    }
+
+    SERVICE_STATUS controlStatus;
+    ULONGLONG controlStart = ClockNow();
+    if (!Scm().ControlService(service, request.control, &controlStatus)) {
+        outcome.result = CommandFailure(ScmStage::Control, startTime);
+        Scm().CloseServiceHandle(service);
+        return outcome;
+    }
+    outcome.controlMs = ClockNow() - controlStart;
+    outcome.state = controlStatus.dwCurrentState;
+    outcome.result = CommandSuccess(startTime);
+
+    if (request.waitState && outcome.state != request.waitState) {
+        SERVICE_STATUS_PROCESS status;
+        CommandResult waited = WaitForServiceState(service, request.waitState, request.timeoutMs, status);
+        outcome.waitMs = waited.elapsedMs;
+        outcome.state = status.dwCurrentState;
+        if (!waited.ok()) {
+            waited.elapsedMs = ClockNow() - startTime;
+            outcome.result = waited;
+        }
+    }
+
+    Scm().CloseServiceHandle(service);
+    return outcome;
+}
+
+/**
+ * Sends a control to many services at once and reports each service's resulting
+ * state and latency
+ * Similar to "sc pause/continue/interrogate/control <service>" for each service
+ *
+ * @param serviceNames Names of the services
+ * @param request The control, access right, wait state and timeout
+ * @param concurrency Maximum number of controls in flight
+ * @return Success, or the first failure in service order
+ */
+CommandResult ControlServices(const std::vector<std::wstring>& serviceNames, const ServiceControlRequest& request,
+    size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    std::vector<ServiceControlOutcome> outcomes(serviceNames.size());
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        outcomes[i] = SendServiceControl(scManager, serviceNames[i], request);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    // One line per service, in the order given
+    size_t nameWidth = 12;
+    for (const auto& name : serviceNames) nameWidth = (std::max)(nameWidth, WStringToString(name).size());
+    std::string output;
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        const ServiceControlOutcome& outcome = outcomes[i];
+        std::string name = WStringToString(serviceNames[i]);
+        output += name + std::string(nameWidth + 2 - name.size(), ' ');
+        if (!outcome.result.ok()) {
+            output += FormatCommandFailure(outcome.result) + "\n";
+            if (failed++ == 0) firstFailure = outcome.result;
+            continue;
+        }
+        std::string state = GetServiceStateString(outcome.state);
+        output += state + std::string(state.size() < 18 ? 18 - state.size() : 1, ' ');
+        output += "control " + std::to_string(outcome.controlMs) + " ms";
+        if (request.waitState) output += ", wait " + std::to_string(outcome.waitMs) + " ms";
+        output += "\n";
+    }
+    std::cout << output;
+    std::cout << serviceNames.size() << " service(s), " << failed << " failed, "
+        << (ClockNow() - startTime) << " ms total" << std::endl;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Parses a control code for the control command
+ * Accepts "paramchange" or a user-defined code from 128 to 255
+ *
+ * @param value The code as given on the command line
+ * @param request Receives the control and the access right it needs
+ * @return true if the code is valid
+ */
+bool ParseControlCode(const std::wstring& value, ServiceControlRequest& request) {
+    if (ToLowerServiceName(value) == L"paramchange") {
+        request.control = SERVICE_CONTROL_PARAMCHANGE;
+        request.access = SERVICE_PAUSE_CONTINUE;
+        return true;
+    }
+    try {
+        size_t used = 0;
+        unsigned long code = std::stoul(value, &used);
+        if (used != value.size() || code < 128 || code > 255) return false;
+        request.control = (DWORD)code;
+        request.access = SERVICE_USER_DEFINED_CONTROL;
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+/**
+ * Deletes a Windows service
+ * Similar to "sc delete <service>"
+ *
+ * @param serviceName Name of the service to delete
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult DeleteService(const std::wstring& serviceName) {
+    CommandResult result = scclone::Delete(serviceName);
+    if (result.ok()) {
+        std::cout << "Service deleted successfully: " << WStringToString(serviceName) << std::endl;
+    }
+    return result;
+}
+
+/**
+ * Formats throughput and latency percentiles for a set of operations,
+ * e.g. "412 ops/s; latency p50 2.10 ms, p99 9.84 ms, max 12.30 ms"
+ *
+ * @param latenciesMs Per-operation latencies (sorted in place)
+ * @param wallMs Wall time for all of the operations
+ * @return The formatted summary
+ */
+std::string FormatLatencySummary(std::vector<double>& latenciesMs, double wallMs) {
+    std::sort(latenciesMs.begin(), latenciesMs.end());
+    auto percentile = [&](double p) {
+        if (latenciesMs.empty()) return 0.0;
+        size_t rank = (size_t)(p / 100.0 * latenciesMs.size() + 0.5);
+        return latenciesMs[(std::min)(rank ? rank - 1 : 0, latenciesMs.size() - 1)];
+    };
+    char text[160];
+    snprintf(text, sizeof(text), "%.0f ops/s; latency p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+        wallMs > 0 ? latenciesMs.size() * 1000.0 / wallMs : 0.0, percentile(50), percentile(99),
+        latenciesMs.empty() ? 0.0 : latenciesMs.back());
+    return text;
+}
+
+/**
+ * Substitutes the service index into a template value
+ * {i} becomes the index; {i:N} pads it with zeros to N digits
+ */
+std::wstring ExpandServiceTemplate(const std::wstring& text, size_t index) {
+    std::wstring out;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t open = text.find(L"{i", pos);
+        size_t close = open == std::wstring::npos ? std::wstring::npos : text.find(L'}', open);
+        if (close == std::wstring::npos) break;
+
+        std::wstring spec = text.substr(open + 2, close - open - 2);
+        size_t width = 0;
+        if (!spec.empty() && (spec[0] != L':' || spec.size() == 1 ||
+            spec.find_first_not_of(L"0123456789", 1) != std::wstring::npos)) {
+            // Not a placeholder; keep the brace and carry on after it
+            out += text.substr(pos, open + 1 - pos);
+            pos = open + 1;
+            continue;
+        }
+        if (!spec.empty()) width = (std::min)((size_t)std::stoul(spec.substr(1)), (size_t)16);
+
+        std::wstring number = std::to_wstring(index);
+        if (number.size() < width) number.insert(0, width - number.size(), L'0');
+        out += text.substr(pos, open - pos) + number;
+        pos = close + 1;
+    }
+    out += text.substr(pos);
+    return out;
+}
+
+/**
+ * Creates a batch of services from one parameter set, several at a time
+ * {i} in /servicename, /displayname, /binpath and /description is replaced with
+ * each service's index
+ *
+ * @param args Parameters as for create, plus the template placeholders
+ * @param count Number of services to create
+ * @param first Index of the first service
+ * @param concurrency Maximum number of creates in flight
+ * @return Success, or the first failure in index order
+ */
+CommandResult CreateServicesFromTemplate(const std::map<std::wstring, std::wstring>& args, size_t count, size_t first,
+    size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    scclone::ServiceDefinition definition;
+    std::string error;
+    if (!ParseServiceDefinition(args, definition, error)) {
+        std::cerr << "ERROR: " << error << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+    }
+    if (ExpandServiceTemplate(definition.name, 0) == ExpandServiceTemplate(definition.name, 1)) {
+        std::cerr << "ERROR: /servicename must contain {i} when creating from a template" << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+    }
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_ALL_ACCESS);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    std::vector<scclone::CreateResult> results(count);
+    std::vector<double> latenciesMs(count);
+    auto begin = std::chrono::steady_clock::now();
+    ParallelFor(count, concurrency, [&](size_t i) {
+        scclone::ServiceDefinition service = definition;
+        for (std::wstring* text : { &service.name, &service.displayName, &service.binaryPath, &service.description }) {
+            *text = ExpandServiceTemplate(*text, first + i);
+        }
+        auto opStart = std::chrono::steady_clock::now();
+        results[i] = CreateServiceOn(scManager, service);
+        latenciesMs[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - opStart).count();
+    });
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    Scm().CloseServiceHandle(scManager);
+
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        std::string name = WStringToString(ExpandServiceTemplate(definition.name, first + i));
+        for (const auto& warning : results[i].warnings) {
+            std::cerr << name << "  Warning: " << warning << std::endl;
+        }
+        if (results[i].ok()) continue;
+        std::cout << name << "  " << FormatCommandFailure(results[i]) << std::endl;
+        if (failed++ == 0) firstFailure = results[i];
+    }
+    std::cout << "Created " << (count - failed) << " of " << count << " service(s) in " << (ULONGLONG)wallMs
+        << " ms, " << FormatLatencySummary(latenciesMs, wallMs) << std::endl;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Deletes several services, several at a time
+ *
+ * @param serviceNames Names of the services to delete
+ * @param concurrency Maximum number of deletes in flight
+ * @return Success, or the first failure in service order
+ */
+CommandResult DeleteServices(const std::vector<std::wstring>& serviceNames, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    std::vector<CommandResult> results(serviceNames.size());
+    std::vector<double> latenciesMs(serviceNames.size());
+    auto begin = std::chrono::steady_clock::now();
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        ULONGLONG opTime = ClockNow();
+        auto opStart = std::chrono::steady_clock::now();
+        SC_HANDLE service = Scm().OpenServiceW(scManager, serviceNames[i].c_str(), DELETE | SERVICE_QUERY_CONFIG);
+        if (!service) {
+            results[i] = CommandFailure(ScmStage::OpenService, opTime);
+        }
+        else {
+            AuditFields before = CaptureServiceAuditState(service, AuditConfig | AuditDescription);
+            results[i] = Scm().DeleteService(service) ? CommandSuccess(opTime) : CommandFailure(ScmStage::Delete, opTime);
+            JournalServiceChange("delete", serviceNames[i], AuditFields(), before,
+                results[i].ok() ? AuditFields() : before, results[i]);
+            Scm().CloseServiceHandle(service);
+        }
+        latenciesMs[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - opStart).count();
+    });
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    Scm().CloseServiceHandle(scManager);
+
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        if (results[i].ok()) continue;
+        std::cout << WStringToString(serviceNames[i]) << "  " << FormatCommandFailure(results[i]) << std::endl;
+        if (failed++ == 0) firstFailure = results[i];
+    }
+    std::cout << "Deleted " << (serviceNames.size() - failed) << " of " << serviceNames.size() << " service(s) in "
+        << (ULONGLONG)wallMs << " ms, " << FormatLatencySummary(latenciesMs, wallMs) << std::endl;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Reads config's parameters into a configuration change
+ * Takes the same parameters as create, all optional; /tag is ignored as a tag
+ * cannot be changed after creation
+ *
+ * @param args Parsed command line parameters
+ * @param change Receives the settings to change
+ * @param error Receives a description of the first invalid parameter
+ * @return true if the parameters are valid
+ */
+bool ParseServiceConfigChange(const std::map<std::wstring, std::wstring>& args, scclone::ServiceConfigChange& change,
+    std::string& error) {
+    if (args.count(L"displayname")) change.displayName = args.at(L"displayname");
+    if (args.count(L"type")) {
+        DWORD serviceType = 0;
+        if (!ParseServiceTypeName(args.at(L"type"), serviceType, error)) return false;
+        change.serviceType = serviceType;
+    }
+    if (args.count(L"start")) {
+        scclone::StartType startType = scclone::StartType::Demand;
+        bool delayedAutoStart = false;
+        if (!ParseStartTypeName(args.at(L"start"), startType, delayedAutoStart, error)) return false;
+        change.startType = startType;
+        // "auto" turns delayed start off, as sc.exe does; other start types leave it alone
+        if (startType == scclone::StartType::Auto) change.delayedAutoStart = delayedAutoStart;
+    }
+    if (args.count(L"error")) {
+        scclone::ErrorControl errorControl = scclone::ErrorControl::Normal;
+        if (!ParseErrorControlName(args.at(L"error"), errorControl, error)) return false;
+        change.errorControl = errorControl;
+    }
+    if (args.count(L"binpath")) change.binaryPath = args.at(L"binpath");
+    if (args.count(L"group")) change.loadOrderGroup = args.at(L"group");
+    if (args.count(L"depend")) change.dependencies = SplitDependencyList(args.at(L"depend"));
+    if (args.count(L"obj")) change.account = args.at(L"obj");
+    if (args.count(L"password")) change.password = args.at(L"password");
+    if (args.count(L"description")) change.description = args.at(L"description");
+    return true;
+}
+
+/**
+ * Modifies the configuration of a Windows service
+ * Similar to "sc config <service> ..."
+ *
+ * @param serviceName Name of the service to configure
+ * @param args Map of configuration parameters to modify
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ConfigService(const std::wstring& serviceName, const std::map<std::wstring, std::wstring>& args) {
+    ULONGLONG startTime = ClockNow();
+
+    scclone::ServiceConfigChange change;
+    std::string error;
+    if (!ParseServiceConfigChange(args, change, error)) {
+        std::cerr << "ERROR: " << error << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_PARAMETER, startTime);
+    }
+
+    scclone::ConfigResult configured = scclone::Configure(serviceName, change);
+    if (!configured.ok()) return configured;
+
+    for (const auto& warning : configured.warnings) {
+        std::cerr << "Warning: " << warning << std::endl;
+    }
+    std::cout << "Service configuration updated successfully." << std::endl;
+    return configured;
+}
+
+/**
+ * Parses the failure command's parameters into failure settings
+ *   /reset <seconds>  /actions action/delay/...  /command <cmd>  /reboot <msg>  /flag true|false
+ * Action delays are in seconds; /reset defaults to 86400 (1 day) when /actions is given
+ *
+ * @param args Parsed command line parameters
+ * @param settings Receives the settings
+ * @param error Receives a description of the first invalid parameter
+ * @return true if the parameters are valid and at least one setting was given
+ */
+bool ParseFailureSettings(const std::map<std::wstring, std::wstring>& args, scclone::FailureSettings& settings,
+    std::string& error) {
+    settings.resetPeriodSeconds = 86400; // Default 1 day in seconds
+    if (args.count(L"reset")) {
+        try {
+            settings.resetPeriodSeconds = (DWORD)std::stoul(args.at(L"reset"));
+        }
+        catch (const std::exception&) {
+            error = "Invalid reset period: " + WStringToString(args.at(L"reset"));
+            return false;
+        }
+        if (!args.count(L"actions")) {
+            error = "/reset requires /actions";
+            return false;
+        }
+    }
+
+    if (args.count(L"actions")) {
+        settings.actions.emplace();
+        std::wstring actionsStr = args.at(L"actions");
+        actionsStr.erase(std::remove(actionsStr.begin(), actionsStr.end(), L'"'), actionsStr.end());
+
+        // Split into action/delay pairs
+        std::vector<std::wstring> parts;
+        size_t start = 0;
+        while (start <= actionsStr.size()) {
+            size_t slash = actionsStr.find(L'/', start);
+            if (slash == std::wstring::npos) slash = actionsStr.size();
+            std::wstring token = actionsStr.substr(start, slash - start);
+            token.erase(0, token.find_first_not_of(L" \t"));
+            token.erase(token.find_last_not_of(L" \t") + 1);
+            parts.push_back(token);
+            start = slash + 1;
+        }
+        if (parts.size() % 2 != 0) {
+            error = "Actions must be action/delay pairs";
+            return false;
+        }
+
+        for (size_t i = 0; i < parts.size(); i += 2) {
+            scclone::FailureStep step;
+            if (parts[i] == L"run") step.action = scclone::FailureAction::RunCommand;
+            else if (parts[i] == L"restart") step.action = scclone::FailureAction::Restart;
+            else if (parts[i] == L"reboot") step.action = scclone::FailureAction::Reboot;
+            else if (parts[i] == L"none") step.action = scclone::FailureAction::None;
+            else {
+                error = "Invalid action type: " + WStringToString(parts[i]);
+                return false;
+            }
+            try {
+                step.delayMs = (DWORD)std::stoul(parts[i + 1]) * 1000; // Convert seconds to milliseconds
+            }
+            catch (const std::exception&) {
+                error = "Invalid delay: " + WStringToString(parts[i + 1]);
+                return false;
+            }
+            settings.actions->push_back(step);
+        }
+    }
+
+    if (args.count(L"command")) settings.command = args.at(L"command");
+    if (args.count(L"reboot")) settings.rebootMessage = args.at(L"reboot");
+    if (args.count(L"flag")) {
+        std::wstring flag = ToLowerServiceName(args.at(L"flag"));
+        if (flag == L"true" || flag == L"1") settings.nonCrashFailures = true;
+        else if (flag == L"false" || flag == L"0") settings.nonCrashFailures = false;
+        else {
+            error = "Invalid flag value (use true or false): " + WStringToString(args.at(L"flag"));
+            return false;
+        }
+    }
+
+    if (!settings.actions && !settings.command && !settings.rebootMessage && !settings.nonCrashFailures) {
+        error = "Nothing to set. Use /actions, /command, /reboot or /flag";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Rolls out one failure policy to a set of services in parallel
+ * Similar to "sc failure <service> ..." for each service, but services that already
+ * have the policy are left alone and not reported
+ *
+ * @param serviceNames Names of the services to configure
+ * @param settings The policy to apply
+ * @param concurrency Maximum number of services configured at once
+ * @return Success, or the first failure in service order
+ */
+CommandResult SetServiceFailureActions(const std::vector<std::wstring>& serviceNames, const scclone::FailureSettings& settings,
+    size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<scclone::FailureActionsResult> outcomes = scclone::SetFailureActions(serviceNames, settings, concurrency);
+    if (!outcomes.empty() && outcomes[0].stage == ScmStage::OpenManager) {
+        return outcomes[0]; // Nothing was attempted
+    }
+
+    // Report in service order once everything is done
+    CommandResult firstFailure;
+    size_t changed = 0, failed = 0;
+    for (const auto& outcome : outcomes) {
+        std::string name = WStringToString(outcome.serviceName);
+        if (!outcome.ok()) {
+            std::cerr << name << ": " << FormatCommandFailure(outcome) << std::endl;
+            if (failed++ == 0) firstFailure = outcome;
+            continue;
+        }
+        if (outcome.changes.empty()) continue;
+        changed++;
+        std::cout << name << ":";
+        for (const auto& change : outcome.changes) std::cout << " " << change << ";";
+        std::cout << " verified" << std::endl;
+    }
+
+    std::cout << serviceNames.size() << " service(s): " << changed << " changed, "
+        << (serviceNames.size() - changed - failed) << " already set, " << failed << " failed ("
+        << (ClockNow() - startTime) << " ms)" << std::endl;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Snapshots and boot analysis - Whole-database configuration reads, export to the
+// snapshot format the simulated SCM loads, and the auto-start critical path
+//=============================================================================
+
+/**
+ * Configuration and status of one service, as read for whole-database commands
+ */
+struct ServiceConfigInfo {
+    std::wstring serviceName;
+    std::wstring displayName;
+    std::wstring binaryPath;
+    std::wstring loadOrderGroup;
+    std::wstring account;
+    std::wstring description;
+    std::vector<std::wstring> dependencies;     // Group dependencies keep their leading '+'
+    DWORD serviceType = 0;
+    DWORD startType = SERVICE_NO_CHANGE;        // SERVICE_NO_CHANGE if the config could not be read
+    DWORD errorControl = 0;
+    DWORD tagId = 0;
+    bool delayedAutoStart = false;
+    SERVICE_STATUS_PROCESS status;
+};
+
+/**
+ * Reads the configuration of every service, several services at a time
+ * Services whose configuration cannot be read (e.g. access denied) keep
+ * startType == SERVICE_NO_CHANGE and are otherwise still listed
+ *
+ * @param services Receives one entry per service, in enumeration order
+ * @param withDescriptions Also read descriptions (one more call per service)
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ReadServiceConfigs(std::vector<ServiceConfigInfo>& services, bool withDescriptions) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceStatusEntry> entries;
+    CommandResult result = EnumerateServices(entries);
+    if (!result.ok()) return result;
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    services.assign(entries.size(), ServiceConfigInfo());
+    ParallelFor(entries.size(), DefaultServiceConcurrency(), [&](size_t i) {
+        ServiceConfigInfo& info = services[i];
+        info.serviceName = entries[i].serviceName;
+        info.displayName = entries[i].displayName;
+        info.status = entries[i].status;
+        info.serviceType = entries[i].status.dwServiceType;
+
+        SC_HANDLE service = Scm().OpenServiceW(scManager, info.serviceName.c_str(), SERVICE_QUERY_CONFIG);
+        if (!service) return;
+
+        DWORD bytesNeeded = 0;
+        Scm().QueryServiceConfigW(service, NULL, 0, &bytesNeeded);
+        std::vector<BYTE> buffer(bytesNeeded);
+        LPQUERY_SERVICE_CONFIGW config = (LPQUERY_SERVICE_CONFIGW)buffer.data();
+        if (bytesNeeded && Scm().QueryServiceConfigW(service, config, bytesNeeded, &bytesNeeded)) {
+            info.serviceType = config->dwServiceType;
+            info.startType = config->dwStartType;
+            info.errorControl = config->dwErrorControl;
+            info.tagId = config->dwTagId;
+            if (config->lpBinaryPathName) info.binaryPath = config->lpBinaryPathName;
+            if (config->lpLoadOrderGroup) info.loadOrderGroup = config->lpLoadOrderGroup;
+            if (config->lpServiceStartName) info.account = config->lpServiceStartName;
+            for (LPCWSTR dep = config->lpDependencies; dep && *dep; dep += wcslen(dep) + 1) {
+                info.dependencies.push_back(dep);
+            }
+        }
+
+        SERVICE_DELAYED_AUTO_START_INFO delayed = { FALSE };
+        if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, (LPBYTE)&delayed, sizeof(delayed), &bytesNeeded)) {
+            info.delayedAutoStart = delayed.fDelayedAutostart != FALSE;
+        }
+
+        if (withDescriptions) {
+            bytesNeeded = 0;
+            Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, NULL, 0, &bytesNeeded);
+            std::vector<BYTE> descBuffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_DESCRIPTIONW)));
+            if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, descBuffer.data(), (DWORD)descBuffer.size(), &bytesNeeded)) {
+                LPSERVICE_DESCRIPTIONW desc = (LPSERVICE_DESCRIPTIONW)descBuffer.data();
+                if (desc->lpDescription) info.description = desc->lpDescription;
+            }
+        }
+        Scm().CloseServiceHandle(service);
+    });
+
+    Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Returns the snapshot spelling of a service state ("running", "stop_pending", ...)
+ */
+const char* GetSnapshotStateName(DWORD state) {
+    switch (state) {
+    case SERVICE_START_PENDING: return "start_pending";
+    case SERVICE_STOP_PENDING: return "stop_pending";
+    case SERVICE_RUNNING: return "running";
+    case SERVICE_CONTINUE_PENDING: return "continue_pending";
+    case SERVICE_PAUSE_PENDING: return "pause_pending";
+    case SERVICE_PAUSED: return "paused";
+    default: return "stopped";
+    }
+}
+
+/**
+ * Writes the service database as a snapshot that SCCLONE_SIM and the /config options
+ * can load (see LoadSimulatedSnapshot for the format)
+ * Latencies and crash schedules are not observable through the SCM, so they are
+ * left for the user to add, and the controls a service accepts are only known while
+ * it runs. A snapshot-backed SCM knows all of them, so exporting from one writes
+ * back every key the loader reads.
+ *
+ * @param path The snapshot file to write
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ExportSnapshot(const std::wstring& path) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, true);
+    if (!result.ok()) return result;
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    SimulatedScm* sim = dynamic_cast<SimulatedScm*>(&Scm());
+
+    // Values are single-line, so flatten any line breaks
+    auto value = [](const std::wstring& text) {
+        std::string utf8 = WStringToString(text);
+        std::replace(utf8.begin(), utf8.end(), '\r', ' ');
+        std::replace(utf8.begin(), utf8.end(), '\n', ' ');
+        return utf8;
+    };
+
+    std::string out = "# scclone snapshot\n";
+    for (const auto& info : services) {
+        out += "\n[" + value(info.serviceName) + "]\n";
+        out += "display=" + value(info.displayName) + "\n";
+        if (info.startType == SERVICE_NO_CHANGE) {
+            out += "# configuration could not be read\n";
+            out += std::string("state=") + GetSnapshotStateName(info.status.dwCurrentState) + "\n";
+            continue;
+        }
+
+        switch (info.serviceType) {
+        case SERVICE_WIN32_OWN_PROCESS: out += "type=own\n"; break;
+        case SERVICE_WIN32_SHARE_PROCESS: out += "type=share\n"; break;
+        case SERVICE_KERNEL_DRIVER: out += "type=kernel\n"; break;
+        case SERVICE_FILE_SYSTEM_DRIVER: out += "type=filesys\n"; break;
+        default: out += "type=" + std::to_string(info.serviceType) + "\n"; break;
+        }
+        static const char* startNames[] = { "boot", "system", "auto", "demand", "disabled" };
+        out += "start=";
+        out += info.startType == SERVICE_AUTO_START && info.delayedAutoStart ? "delayed-auto"
+            : info.startType <= SERVICE_DISABLED ? startNames[info.startType] : "demand";
+        out += "\n";
+        static const char* errorNames[] = { "ignore", "normal", "severe", "critical" };
+        if (info.errorControl <= SERVICE_ERROR_CRITICAL) out += std::string("error=") + errorNames[info.errorControl] + "\n";
+        out += "binpath=" + value(info.binaryPath) + "\n";
+        if (!info.loadOrderGroup.empty()) out += "group=" + value(info.loadOrderGroup) + "\n";
+        if (info.tagId) out += "tag=" + std::to_string(info.tagId) + "\n";
+        if (!info.dependencies.empty()) {
+            out += "depend=";
+            for (size_t d = 0; d < info.dependencies.size(); d++) out += (d ? "/" : "") + value(info.dependencies[d]);
+            out += "\n";
+        }
+        if (!info.account.empty()) out += "obj=" + value(info.account) + "\n";
+        if (!info.description.empty()) out += "description=" + value(info.description) + "\n";
+        out += std::string("state=") + GetSnapshotStateName(info.status.dwCurrentState) + "\n";
+        if (info.status.dwProcessId) out += "pid=" + std::to_string(info.status.dwProcessId) + "\n";
+
+        // Behaviour: from the model when there is one, else what a running service reports
+        SimService model;
+        bool modeled = sim && sim->GetServiceModel(info.serviceName, model);
+        bool active = info.status.dwCurrentState != SERVICE_STOPPED && info.status.dwCurrentState != SERVICE_STOP_PENDING;
+        if (modeled || active) {
+            DWORD accepted = modeled ? model.controlsAccepted : info.status.dwControlsAccepted;
+            static const struct { DWORD flag; const char* name; } controls[] = {
+                { SERVICE_ACCEPT_STOP, "stop" }, { SERVICE_ACCEPT_PAUSE_CONTINUE, "pause" },
+                { SERVICE_ACCEPT_SHUTDOWN, "shutdown" }, { SERVICE_ACCEPT_PRESHUTDOWN, "preshutdown" },
+                { SERVICE_ACCEPT_PARAMCHANGE, "paramchange" },
+            };
+            std::string names;
+            for (const auto& control : controls) {
+                if (accepted & control.flag) names += (names.empty() ? "" : "/") + std::string(control.name);
+            }
+            out += "accepts=" + names + "\n";
+        }
+        if (modeled) {
+            if (model.startLatencyMs) out += "start_ms=" + std::to_string(model.startLatencyMs) + "\n";
+            if (model.stopLatencyMs) out += "stop_ms=" + std::to_string(model.stopLatencyMs) + "\n";
+            if (model.pauseLatencyMs) out += "pause_ms=" + std::to_string(model.pauseLatencyMs) + "\n";
+            if (model.crashAfterMs) out += "crash_after_ms=" + std::to_string(model.crashAfterMs) + "\n";
+        }
+
+        // Failure policy, with delays in milliseconds as the SCM stores them
+        SC_HANDLE service = Scm().OpenServiceW(scManager, info.serviceName.c_str(), SERVICE_QUERY_CONFIG);
+        FailurePolicy policy;
+        if (service && ReadFailurePolicy(service, policy)) {
+            if (policy.resetPeriod || !policy.actions.empty()) out += "reset=" + std::to_string(policy.resetPeriod) + "\n";
+            if (!policy.actions.empty()) {
+                out += "actions=";
+                for (size_t a = 0; a < policy.actions.size(); a++) {
+                    const SC_ACTION& action = policy.actions[a];
+                    out += a ? "/" : "";
+                    out += action.Type == SC_ACTION_RESTART ? "restart" : action.Type == SC_ACTION_REBOOT ? "reboot"
+                        : action.Type == SC_ACTION_RUN_COMMAND ? "run" : "none";
+                    out += "/" + std::to_string(action.Delay);
+                }
+                out += "\n";
+            }
+            if (!policy.command.empty()) out += "command=" + value(policy.command) + "\n";
+            if (!policy.rebootMsg.empty()) out += "reboot=" + value(policy.rebootMsg) + "\n";
+            if (policy.nonCrashFailures) out += "failure_flag=true\n";
+        }
+        std::vector<ServiceTrigger> triggers;
+        if (service && ReadServiceTriggers(service, triggers)) {
+            for (const auto& trigger : triggers) out += "trigger=" + value(StringToWString(FormatServiceTrigger(trigger))) + "\n";
+        }
+        SERVICE_PRESHUTDOWN_INFO preshutdown = { 0 };
+        DWORD bytesNeeded = 0;
+        if (service && Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_PRESHUTDOWN_INFO, (LPBYTE)&preshutdown, sizeof(preshutdown), &bytesNeeded)
+            && preshutdown.dwPreshutdownTimeout != 180000) {
+            out += "preshutdown_ms=" + std::to_string(preshutdown.dwPreshutdownTimeout) + "\n";
+        }
+        if (service) Scm().CloseServiceHandle(service);
+    }
+    Scm().CloseServiceHandle(scManager);
+
+    FILE* file = OpenFileW(path, L"wb");
+    if (!file) {
+        return CommandFailure(ScmStage::Arguments, ERROR_ACCESS_DENIED, startTime);
+    }
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    written = (fclose(file) == 0) && written;
+    if (!written) {
+        return CommandFailure(ScmStage::Arguments, ERROR_WRITE_FAULT, startTime);
+    }
+    std::cout << "Wrote " << services.size() << " service(s) to " << WStringToString(path) << std::endl;
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Loads measured start latencies: one "ServiceName ms" per line (a comma or '='
+ * also works as the separator); blank lines and lines starting with # are skipped
+ *
+ * @param path The latency file
+ * @param latencies Receives milliseconds keyed by lowercase service name
+ * @return true if the file was read
+ */
+bool LoadLatencyFile(const std::wstring& path, std::map<std::wstring, DWORD>& latencies) {
+    FILE* file = OpenFileW(path, L"rb");
+    if (!file) return false;
+    std::string content;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) content.append(chunk, read);
+    fclose(file);
+
+    size_t lineStart = 0;
+    while (lineStart < content.size()) {
+        size_t lineEnd = content.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = content.size();
+        std::string line = content.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+        if (line.empty() || line[0] == '#') continue;
+        size_t separator = line.find_last_of(" \t,=");
+        if (separator == std::string::npos) continue;
+        std::string name = line.substr(0, separator);
+        name.erase(name.find_last_not_of(" \t,=") + 1);
+        try {
+            latencies[ToLowerServiceName(StringToWString(name))] = (DWORD)std::stoul(line.substr(separator + 1));
+        }
+        catch (const std::exception&) {
+            std::cerr << "Warning: Ignoring latency line '" << line << "'" << std::endl;
+        }
+    }
+    return true;
+}
+
+/**
+ * One service in the boot graph
+ */
+struct BootNode {
+    std::wstring serviceName;
+    std::wstring group;
+    DWORD tagId = 0;
+    DWORD latencyMs = 0;
+    bool latencyMeasured = false;   // From a latency file or snapshot rather than the default
+    bool autoStart = false;         // Auto-start (not delayed) in its own right
+    bool delayed = false;           // Delayed auto-start
+    bool running = false;
+    std::vector<size_t> dependencies;               // Service dependencies (indices)
+    std::vector<std::wstring> groupDependencies;    // Lowercase group names
+};
+
+/**
+ * Start times of the boot set under unlimited parallelism
+ */
+struct BootSchedule {
+    std::vector<bool> inBoot;           // Started during boot (auto-start or a dependency of one)
+    std::vector<ULONGLONG> startMs;
+    std::vector<ULONGLONG> finishMs;
+    std::vector<size_t> critical;       // The dependency that gated each start (SIZE_MAX if none)
+    ULONGLONG makespanMs = 0;           // Time until the last boot service is running
+    ULONGLONG totalWorkMs = 0;          // Sum of start latencies in the boot set
+    size_t cycles = 0;                  // Dependency cycles that had to be broken
+};
+
+/**
+ * Computes when every boot-set service would be running if the SCM starts each one
+ * as soon as its dependencies run
+ * A group dependency is met once the first member of the group in the boot set runs.
+ *
+ * @param nodes The boot graph
+ * @param excluded Service to leave out of the boot set (SIZE_MAX for none)
+ * @return The schedule
+ */
+BootSchedule ComputeBootSchedule(const std::vector<BootNode>& nodes, size_t excluded) {
+    BootSchedule schedule;
+    size_t count = nodes.size();
+    schedule.inBoot.assign(count, false);
+    schedule.startMs.assign(count, 0);
+    schedule.finishMs.assign(count, 0);
+    schedule.critical.assign(count, SIZE_MAX);
+
+    std::map<std::wstring, std::vector<size_t>> groups;
+    for (size_t i = 0; i < count; i++) {
+        if (!nodes[i].group.empty()) groups[nodes[i].group].push_back(i);
+    }
+
+    // The boot set: auto-start services plus everything they depend on
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < count; i++) {
+        if (nodes[i].autoStart && i != excluded) stack.push_back(i);
+    }
+    while (!stack.empty()) {
+        size_t i = stack.back();
+        stack.pop_back();
+        if (schedule.inBoot[i]) continue;
+        schedule.inBoot[i] = true;
+        for (size_t dep : nodes[i].dependencies) stack.push_back(dep);
+        for (const auto& group : nodes[i].groupDependencies) {
+            auto members = groups.find(group);
+            if (members == groups.end()) continue;
+            for (size_t member : members->second) {
+                if (nodes[member].autoStart && member != excluded) stack.push_back(member);
+            }
+        }
+    }
+
+    // Earliest finish times by depth-first search; 0 = unvisited, 1 = in progress, 2 = done
+    std::vector<int> mark(count, 0);
+    std::function<ULONGLONG(size_t)> finish = [&](size_t i) -> ULONGLONG {
+        if (mark[i] == 2) return schedule.finishMs[i];
+        if (mark[i] == 1) {
+            schedule.cycles++;  // Treat the back edge as already satisfied
+            return 0;
+        }
+        mark[i] = 1;
+        ULONGLONG start = 0;
+        for (size_t dep : nodes[i].dependencies) {
+            ULONGLONG depFinish = finish(dep);
+            if (depFinish > start || schedule.critical[i] == SIZE_MAX) {
+                if (depFinish >= start) schedule.critical[i] = dep;
+                start = (std::max)(start, depFinish);
+            }
+        }
+        for (const auto& group : nodes[i].groupDependencies) {
+            auto members = groups.find(group);
+            if (members == groups.end()) continue;
+            ULONGLONG first = ULLONG_MAX;
+            size_t firstMember = SIZE_MAX;
+            for (size_t member : members->second) {
+                if (!schedule.inBoot[member] || member == i) continue;
+                ULONGLONG memberFinish = finish(member);
+                if (memberFinish < first) {
+                    first = memberFinish;
+                    firstMember = member;
+                }
+            }
+            if (firstMember != SIZE_MAX && first >= start) {
+                start = first;
+                schedule.critical[i] = firstMember;
+            }
+        }
+        schedule.startMs[i] = start;
+        schedule.finishMs[i] = start + nodes[i].latencyMs;
+        mark[i] = 2;
+        return schedule.finishMs[i];
+    };
+
+    for (size_t i = 0; i < count; i++) {
+        if (!schedule.inBoot[i]) continue;
+        schedule.makespanMs = (std::max)(schedule.makespanMs, finish(i));
+        schedule.totalWorkMs += nodes[i].latencyMs;
+    }
+    return schedule;
+}
+
+/**
+ * Builds the boot graph from the service configuration
+ * Start latencies come from the measured list, then from a snapshot-backed SCM,
+ * then the default.
+ *
+ * @param services Configuration of every service
+ * @param measured Measured start latencies keyed by lowercase service name
+ * @param defaultLatencyMs Latency assumed for services without a measurement
+ * @param nodes Receives one node per service, in the same order
+ * @return Dependencies on services not in the list (drivers or missing services)
+ */
+size_t BuildBootGraph(const std::vector<ServiceConfigInfo>& services, const std::map<std::wstring, DWORD>& measured,
+    DWORD defaultLatencyMs, std::vector<BootNode>& nodes) {
+    // A snapshot-backed SCM knows the latencies it was given
+    SimulatedScm* sim = dynamic_cast<SimulatedScm*>(&Scm());
+
+    nodes.assign(services.size(), BootNode());
+    std::map<std::wstring, size_t> index;
+    for (size_t i = 0; i < services.size(); i++) index[ToLowerServiceName(services[i].serviceName)] = i;
+    size_t external = 0;
+    for (size_t i = 0; i < services.size(); i++) {
+        const ServiceConfigInfo& info = services[i];
+        BootNode& node = nodes[i];
+        node.serviceName = info.serviceName;
+        node.group = ToLowerServiceName(info.loadOrderGroup);
+        node.tagId = info.tagId;
+        bool autoType = info.startType == SERVICE_AUTO_START || info.startType == SERVICE_BOOT_START ||
+            info.startType == SERVICE_SYSTEM_START;
+        node.delayed = autoType && info.delayedAutoStart;
+        node.autoStart = autoType && !info.delayedAutoStart;
+        node.running = info.status.dwCurrentState == SERVICE_RUNNING;
+
+        std::wstring key = ToLowerServiceName(info.serviceName);
+        DWORD simLatency = 0;
+        if (measured.count(key)) {
+            node.latencyMs = measured.at(key);
+            node.latencyMeasured = true;
+        }
+        else if (sim && sim->GetStartLatency(info.serviceName, simLatency) && simLatency) {
+            node.latencyMs = simLatency;
+            node.latencyMeasured = true;
+        }
+        else {
+            node.latencyMs = defaultLatencyMs;
+        }
+
+        for (const auto& dep : info.dependencies) {
+            if (!dep.empty() && dep[0] == L'+') {
+                node.groupDependencies.push_back(ToLowerServiceName(dep.substr(1)));
+                continue;
+            }
+            auto target = index.find(ToLowerServiceName(dep));
+            // Drivers are loaded before the SCM starts services, so they count as met
+            if (target == index.end()) external++;
+            else node.dependencies.push_back(target->second);
+        }
+    }
+    return external;
+}
+
+/**
+ * Settings for analyze-boot
+ */
+struct BootAnalysisOptions {
+    std::wstring latencyPath;       // Optional file of measured start latencies
+    DWORD defaultLatencyMs = 1000;  // Assumed latency for services without a measurement
+    size_t top = 10;                // Recommendations to print
+};
+
+/**
+ * Builds the auto-start graph from the service configuration, computes the critical
+ * path and expected parallelism, and recommends services to move to delayed-auto or
+ * demand start
+ * Only explicit service and group dependencies constrain the schedule; load order
+ * groups and tags are reported but the SCM starts Win32 services in parallel.
+ *
+ * @param options Latency sources and output size
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult AnalyzeBoot(const BootAnalysisOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, false);
+    if (!result.ok()) return result;
+
+    std::map<std::wstring, DWORD> measured;
+    if (!options.latencyPath.empty() && !LoadLatencyFile(options.latencyPath, measured)) {
+        std::cerr << "ERROR: Could not read latency file '" << WStringToString(options.latencyPath) << "'" << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_FILE_NOT_FOUND, startTime);
+    }
+    std::vector<BootNode> nodes;
+    size_t external = BuildBootGraph(services, measured, options.defaultLatencyMs, nodes);
+
+    BootSchedule schedule = ComputeBootSchedule(nodes, SIZE_MAX);
+    size_t bootCount = 0, autoCount = 0, delayedCount = 0, assumed = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].delayed) delayedCount++;
+        if (!schedule.inBoot[i]) continue;
+        bootCount++;
+        if (nodes[i].autoStart) autoCount++;
+        if (!nodes[i].latencyMeasured) assumed++;
+    }
+
+    // Peak concurrency from the start/finish events
+    std::vector<std::pair<ULONGLONG, int>> events;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!schedule.inBoot[i] || nodes[i].latencyMs == 0) continue;
+        events.push_back(std::make_pair(schedule.startMs[i], 1));
+        events.push_back(std::make_pair(schedule.finishMs[i], -1));
+    }
+    std::sort(events.begin(), events.end());
+    int active = 0, peak = 0;
+    for (const auto& event : events) {
+        active += event.second;
+        peak = (std::max)(peak, active);
+    }
+
+    std::cout << "Boot set      : " << bootCount << " service(s) (" << autoCount << " auto-start, "
+        << (bootCount - autoCount) << " pulled in as dependencies); " << delayedCount << " delayed-auto start later" << std::endl;
+    std::cout << "Latencies     : " << (bootCount - assumed) << " measured, " << assumed << " assumed "
+        << options.defaultLatencyMs << " ms" << std::endl;
+    if (external) std::cout << "External deps : " << external << " (drivers or missing services, treated as already met)" << std::endl;
+    if (schedule.cycles) std::cout << "Warning: " << schedule.cycles << " dependency cycle(s) broken" << std::endl;
+    std::cout << "Time to ready : " << schedule.makespanMs << " ms (critical path)" << std::endl;
+    char parallelism[32];
+    snprintf(parallelism, sizeof(parallelism), "%.2f", schedule.makespanMs ? (double)schedule.totalWorkMs / schedule.makespanMs : 0.0);
+    std::cout << "Total work    : " << schedule.totalWorkMs << " ms, expected parallelism " << parallelism
+        << " (peak " << peak << " starting at once)" << std::endl;
+
+    // Walk the critical path back from the last service to come up
+    size_t last = SIZE_MAX;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (schedule.inBoot[i] && (last == SIZE_MAX || schedule.finishMs[i] > schedule.finishMs[last])) last = i;
+    }
+    std::vector<size_t> path;
+    std::vector<bool> onPath(nodes.size(), false);
+    for (size_t i = last; i != SIZE_MAX && !onPath[i]; i = schedule.critical[i]) {
+        path.push_back(i);
+        onPath[i] = true;
+    }
+    std::reverse(path.begin(), path.end());
+
+    std::cout << "\nCritical path:" << std::endl;
+    for (size_t i : path) {
+        const BootNode& node = nodes[i];
+        std::cout << "  " << schedule.startMs[i] << " ms\t+" << node.latencyMs << " ms"
+            << (node.latencyMeasured ? "" : "*") << "\t" << WStringToString(node.serviceName);
+        if (!node.group.empty()) {
+            std::cout << " (group " << WStringToString(services[i].loadOrderGroup);
+            if (node.tagId) std::cout << ", tag " << node.tagId;
+            std::cout << ")";
+        }
+        std::cout << std::endl;
+    }
+    if (assumed) std::cout << "  * assumed latency" << std::endl;
+
+    // Candidates: auto-start services nothing else in the boot set needs
+    std::vector<bool> needed(nodes.size(), false);
+    std::set<std::wstring> neededGroups;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!schedule.inBoot[i]) continue;
+        for (size_t dep : nodes[i].dependencies) needed[dep] = true;
+        for (const auto& group : nodes[i].groupDependencies) neededGroups.insert(group);
+    }
+
+    struct Recommendation {
+        size_t node;
+        ULONGLONG savedMs;
+        bool demand;
+    };
+    std::vector<Recommendation> recommendations;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].autoStart || needed[i] || neededGroups.count(nodes[i].group)) continue;
+        BootSchedule without = ComputeBootSchedule(nodes, i);
+        ULONGLONG saved = schedule.makespanMs - without.makespanMs;
+        // An auto-start service that is not running now started and exited (or failed);
+        // starting it on demand or by trigger avoids the boot-time work entirely
+        bool demand = !nodes[i].running;
+        if (saved > 0 || demand) recommendations.push_back(Recommendation{ i, saved, demand });
+    }
+    std::sort(recommendations.begin(), recommendations.end(), [&](const Recommendation& a, const Recommendation& b) {
+        if (a.savedMs != b.savedMs) return a.savedMs > b.savedMs;
+        return nodes[a.node].latencyMs > nodes[b.node].latencyMs;
+    });
+
+    std::cout << "\nRecommendations:" << std::endl;
+    if (recommendations.empty()) std::cout << "  None - every service on the critical path is needed by another boot service" << std::endl;
+    for (size_t r = 0; r < recommendations.size() && r < options.top; r++) {
+        const Recommendation& rec = recommendations[r];
+        const BootNode& node = nodes[rec.node];
+        std::cout << "  " << WStringToString(node.serviceName) << ": " << (rec.demand ? "demand" : "delayed-auto")
+            << ", time to ready -" << rec.savedMs << " ms, boot work -" << node.latencyMs << " ms"
+            << (rec.demand ? " (auto-start but not running now)" : onPath[rec.node] ? " (on the critical path, nothing depends on it)"
+                : " (nothing depends on it)") << std::endl;
+    }
+    if (recommendations.size() > options.top) {
+        std::cout << "  ... " << (recommendations.size() - options.top) << " more (use /top)" << std::endl;
+    }
+
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// What-if simulation - Runs a plan of scclone commands against a snapshot loaded
+// into the simulated SCM, in virtual time, and reports what would change
+//=============================================================================
+
+/**
+ * Splits a command line into arguments; double quotes group words and are removed
+ */
+std::vector<std::wstring> SplitCommandLine(const std::wstring& line) {
+    std::vector<std::wstring> args;
+    std::wstring current;
+    bool quoted = false;
+    bool inArg = false;
+    for (wchar_t ch : line) {
+        if (ch == L'"') {
+            quoted = !quoted;
+            inArg = true;
+        }
+        else if ((ch == L' ' || ch == L'\t') && !quoted) {
+            if (inArg) args.push_back(current);
+            current.clear();
+            inArg = false;
+        }
+        else {
+            current += ch;
+            inArg = true;
+        }
+    }
+    if (inArg) args.push_back(current);
+    return args;
+}
+
+/**
+ * Settings for the simulate command
+ */
+struct SimulationOptions {
+    std::wstring snapshotPath;
+    std::wstring planPath;
+    bool realTime = false;          // Wait out latencies for real instead of in virtual time
+    bool stopOnError = false;       // Stop at the first failing step
+    bool quiet = false;             // Hide the output of the commands themselves
+    bool allChanges = false;        // List every changed service, not just the first 40
+};
+
+/**
+ * Runs a plan against a snapshot and prints the predicted outcome
+ * Each plan line is one scclone command (without the program name), run through
+ * the normal command dispatch against an in-process simulated SCM, so the same
+ * code paths execute as on a real machine. Time is virtual unless realTime is set:
+ * start, stop and pause latencies from the snapshot and every poll interval advance
+ * the clock without sleeping, and bulk commands are timed as if their worker
+ * threads ran side by side.
+ *
+ * @param options Snapshot, plan and flags
+ * @param runCommand The command dispatcher (wmain)
+ * @return 0, or the exit status of the first failing step
+ */
+int RunSimulation(const SimulationOptions& options, int (*runCommand)(int, wchar_t**)) {
+    ULONGLONG startTime = ClockNow();
+
+    FILE* file = OpenFileW(options.planPath, L"rb");
+    if (!file) {
+        std::cerr << "ERROR: Could not read plan '" << WStringToString(options.planPath) << "'" << std::endl;
+        return RenderCommandResult(CommandFailure(ScmStage::Arguments, ERROR_FILE_NOT_FOUND, startTime));
+    }
+    std::string content;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) content.append(chunk, read);
+    fclose(file);
+
+    std::unique_ptr<SimulatedScm> sim(new SimulatedScm());
+    if (!LoadSimulatedSnapshot(options.snapshotPath, *sim)) {
+        std::cerr << "ERROR: Could not read snapshot '" << WStringToString(options.snapshotPath) << "'" << std::endl;
+        return RenderCommandResult(CommandFailure(ScmStage::Arguments, ERROR_FILE_NOT_FOUND, startTime));
+    }
+
+    // Everything from here on runs against the model, in virtual time, and is not journaled
+    if (!options.realTime) UseVirtualClock(1000000);
+    UseScmBackend(sim.release());
+    JournalSlot() = nullptr;
+
+    std::vector<ServiceConfigInfo> initial;
+    CommandResult result = ReadServiceConfigs(initial, false);
+    if (!result.ok()) return RenderCommandResult(result);
+
+    // Commands that run until stopped, or would nest, have no place in a plan
+    static const wchar_t* const excluded[] = { L"simulate", L"monitor", L"top", L"cache", L"stress", L"metrics", L"bench" };
+
+    struct StepOutcome { size_t line; std::string text; int status; ULONGLONG elapsedMs; };
+    std::vector<StepOutcome> steps;
+    auto realBegin = std::chrono::steady_clock::now();
+    ULONGLONG planStart = ClockNow();
+    size_t lineNumber = 0;
+    size_t lineStart = 0;
+    while (lineStart < content.size()) {
+        size_t lineEnd = content.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = content.size();
+        std::string line = content.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        lineNumber++;
+
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+        if (line.empty() || line[0] == '#') continue;
+
+        std::vector<std::wstring> args = SplitCommandLine(StringToWString(line));
+        if (!args.empty() && args[0].size() > 4 && ToLowerServiceName(args[0]).find(L"scclone") == 0) {
+            args.erase(args.begin());   // Allow lines copied with the program name
+        }
+        if (args.empty()) continue;
+        bool allowed = true;
+        for (const wchar_t* name : excluded) {
+            if (args[0] == name) allowed = false;
+        }
+
+        std::cout << "[" << lineNumber << "] " << line << std::endl;
+        ULONGLONG stepStart = ClockNow();
+        int status;
+        if (!allowed) {
+            std::cerr << "ERROR: '" << WStringToString(args[0]) << "' cannot be simulated" << std::endl;
+            status = GetExitStatusForError(ERROR_NOT_SUPPORTED);
+        }
+        else {
+            std::vector<wchar_t*> argv;
+            wchar_t programName[] = L"scclone";
+            argv.push_back(programName);
+            for (auto& arg : args) argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+
+            std::streambuf* original = std::cout.rdbuf();
+            std::ostringstream discarded;
+            if (options.quiet) std::cout.rdbuf(discarded.rdbuf());
+            status = runCommand((int)args.size() + 1, argv.data());
+            std::cout.rdbuf(original);
+        }
+        ULONGLONG elapsed = ClockNow() - stepStart;
+        std::cout << "    exit " << status << ", " << elapsed << " ms" << std::endl;
+        steps.push_back({ lineNumber, line, status, elapsed });
+        if (status != 0 && options.stopOnError) {
+            std::cout << "Stopping at the first failed step (/stop-on-error)" << std::endl;
+            break;
+        }
+    }
+    ULONGLONG predictedMs = ClockNow() - planStart;
+    double realMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - realBegin).count();
+
+    // Predicted final state: what differs from the snapshot
+    std::vector<ServiceConfigInfo> after;
+    result = ReadServiceConfigs(after, false);
+    if (!result.ok()) return RenderCommandResult(result);
+    std::map<std::wstring, const ServiceConfigInfo*> before;
+    for (const auto& info : initial) before[ToLowerServiceName(info.serviceName)] = &info;
+
+    std::vector<std::string> report;
+    for (const auto& info : after) {
+        std::wstring key = ToLowerServiceName(info.serviceName);
+        auto old = before.find(key);
+        std::string name = WStringToString(info.serviceName);
+        if (old == before.end()) {
+            report.push_back(name + "  (new) " + GetServiceStateString(info.status.dwCurrentState) +
+                ", start " + GetServiceStartTypeString(info.startType));
+            continue;
+        }
+        const ServiceConfigInfo& was = *old->second;
+        before.erase(old);
+        std::string changes;
+        if (was.status.dwCurrentState != info.status.dwCurrentState) {
+            changes += "  " + GetServiceStateString(was.status.dwCurrentState) + " -> " + GetServiceStateString(info.status.dwCurrentState);
+        }
+        if (was.startType != info.startType || was.delayedAutoStart != info.delayedAutoStart) {
+            changes += "  start " + GetServiceStartTypeString(was.startType) + (was.delayedAutoStart ? " (delayed)" : "") +
+                " -> " + GetServiceStartTypeString(info.startType) + (info.delayedAutoStart ? " (delayed)" : "");
+        }
+        if (was.binaryPath != info.binaryPath) changes += "  binpath changed";
+        if (was.account != info.account) changes += "  account " + WStringToString(was.account) + " -> " + WStringToString(info.account);
+        if (was.dependencies != info.dependencies) changes += "  dependencies changed";
+        if (!changes.empty()) report.push_back(name + changes);
+    }
+    for (const auto& gone : before) {
+        report.push_back(WStringToString(gone.second->serviceName) + "  (deleted)");
+    }
+
+    size_t failed = 0;
+    for (const auto& step : steps) failed += step.status != 0 ? 1 : 0;
+    char summary[200];
+    snprintf(summary, sizeof(summary), "Plan: %zu step(s), %zu failed; predicted time %.1f s (%s in %.0f ms)\n",
+        steps.size(), failed, predictedMs / 1000.0, options.realTime ? "real time" : "simulated", realMs);
+    std::cout << "\n" << summary;
+    std::cout << "Predicted changes (" << report.size() << " service(s)):" << std::endl;
+    for (size_t i = 0; i < report.size() && (options.allChanges || i < 40); i++) std::cout << "  " << report[i] << std::endl;
+    if (!options.allChanges && report.size() > 40) std::cout << "  ... " << (report.size() - 40) << " more (use /all)" << std::endl;
+    int status = 0;
+    if (failed) {
+        std::cout << "Failed steps:" << std::endl;
+        for (const auto& step : steps) {
+            if (step.status == 0) continue;
+            std::cout << "  [" << step.line << "] " << step.text << "  (exit " << step.status << ")" << std::endl;
+            if (status == 0) status = step.status;
+        }
+    }
+    return status;
+}
+
+
+//=============================================================================
+// Service operation executor - Start/stop/query many services at once. With C++20
+// coroutines each operation is a small coroutine frame on an event loop, and the
+// state waits become timers instead of sleeping threads; otherwise each operation
+// gets a worker thread.
+//=============================================================================
+
+/**
+ * Operations the executor runs
+ */
+enum class ServiceOp : unsigned char {
+    Query,      // Read the current status
+    Start,      // Start and wait for RUNNING
+    Stop,       // Stop and wait for STOPPED
+};
+
+/**
+ * Outcome of one operation on one service
+ */
+struct ServiceOpOutcome {
+    CommandResult result;
+    DWORD state = 0;            // Last state seen
+    ULONGLONG elapsedMs = 0;    // Request to final state
+};
+
+/**
+ * Opens the service and issues the request for an operation; shared by the
+ * coroutine and thread paths, which differ only in how they wait afterwards
+ *
+ * @param scManager Open SCM handle
+ * @param serviceName Name of the service
+ * @param op The operation
+ * @param service Receives the open service handle (NULL on failure)
+ * @param outcome Receives the state, or the failure
+ * @return The state to wait for, or 0 if the operation is already complete
+ */
+DWORD BeginServiceOp(SC_HANDLE scManager, const std::wstring& serviceName, ServiceOp op,
+    SC_HANDLE& service, ServiceOpOutcome& outcome) {
+    ULONGLONG startTime = ClockNow();
+    DWORD access = SERVICE_QUERY_STATUS;
+    if (op == ServiceOp::Start) access |= SERVICE_START;
+    if (op == ServiceOp::Stop) access |= SERVICE_STOP;
+
+    service = Scm().OpenServiceW(scManager, serviceName.c_str(), access);
+    if (!service) {
+        outcome.result = CommandFailure(ScmStage::OpenService, startTime);
+        return 0;
+    }
+
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+        outcome.result = CommandFailure(ScmStage::QueryStatus, startTime);
+        return 0;
+    }
+    outcome.state = status.dwCurrentState;
+    outcome.result = CommandSuccess(startTime);
+
+    // Like start and stop, a service already in the target state is not an error
+    if (op == ServiceOp::Start && status.dwCurrentState != SERVICE_RUNNING) {
+        if (!Scm().StartServiceW(service, 0, NULL)) {
+            outcome.result = CommandFailure(ScmStage::Start, startTime);
+            return 0;
+        }
+        return SERVICE_RUNNING;
+    }
+    if (op == ServiceOp::Stop && status.dwCurrentState != SERVICE_STOPPED) {
+        SERVICE_STATUS svcStatus;
+        if (!Scm().ControlService(service, SERVICE_CONTROL_STOP, &svcStatus)) {
+            outcome.result = CommandFailure(ScmStage::Control, startTime);
+            return 0;
+        }
+        return SERVICE_STOPPED;
+    }
+    return 0;
+}
+
+/**
+ * Runs one operation on the calling thread, sleeping through the wait
+ */
+ServiceOpOutcome RunServiceOp(SC_HANDLE scManager, const std::wstring& serviceName, ServiceOp op, DWORD timeoutMs) {
+    ULONGLONG startTime = ClockNow();
+    ServiceOpOutcome outcome;
+    SC_HANDLE service = NULL;
+    DWORD waitState = BeginServiceOp(scManager, serviceName, op, service, outcome);
+    if (waitState) {
+        SERVICE_STATUS_PROCESS status;
+        CommandResult waited = WaitForServiceState(service, waitState, timeoutMs, status);
+        outcome.state = status.dwCurrentState;
+        if (!waited.ok()) outcome.result = waited;
+    }
+    if (service) Scm().CloseServiceHandle(service);
+    outcome.elapsedMs = ClockNow() - startTime;
+    outcome.result.elapsedMs = outcome.elapsedMs;
+    return outcome;
+}
+
+#ifdef SCCLONE_HAVE_COROUTINES
+/**
+ * Frame memory used by executor coroutines, for the benchmark's per-operation figure
+ */
+std::atomic<size_t> g_coroutineFrameBytes(0);
+std::atomic<size_t> g_coroutineFramesLive(0);
+std::atomic<size_t> g_coroutineFramesPeak(0);
+
+/**
+ * Single-threaded event loop: a queue of coroutines ready to run and a min-heap of
+ * timers. Everything posted to a loop must come from the thread running it.
+ */
+class EventLoop {
+public:
+    /**
+     * Queues a coroutine to resume on the next turn of the loop
+     */
+    void Post(std::coroutine_handle<> handle) {
+        ready_.push_back(handle);
+    }
+
+    /**
+     * Awaitable that resumes the coroutine after a delay
+     */
+    struct DelayAwaitable {
+        EventLoop* loop;
+        DWORD delayMs;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            loop->timers_.push(Timer{ ClockNow() + delayMs, loop->nextTimerId_++, handle });
+        }
+        void await_resume() const {}
+    };
+
+    DelayAwaitable Delay(DWORD delayMs) {
+        return DelayAwaitable{ this, delayMs };
+    }
+
+    /**
+     * Awaitable that moves the coroutine onto the loop's ready queue
+     */
+    struct YieldAwaitable {
+        EventLoop* loop;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop->Post(handle); }
+        void await_resume() const {}
+    };
+
+    YieldAwaitable Yield() {
+        return YieldAwaitable{ this };
+    }
+
+    /**
+     * Runs until nothing is ready and no timers are pending
+     */
+    void Run() {
+        while (true) {
+            while (!ready_.empty()) {
+                std::coroutine_handle<> handle = ready_.front();
+                ready_.pop_front();
+                handle.resume();
+            }
+            if (timers_.empty()) break;
+
+            ULONGLONG now = ClockNow();
+            if (timers_.top().dueMs > now) {
+                ClockSleep((DWORD)(timers_.top().dueMs - now));
+                now = ClockNow();
+            }
+            while (!timers_.empty() && timers_.top().dueMs <= now) {
+                ready_.push_back(timers_.top().handle);
+                timers_.pop();
+            }
+        }
+    }
+
+private:
+    struct Timer {
+        ULONGLONG dueMs;
+        unsigned long long id;          // Keeps timers with the same due time in FIFO order
+        std::coroutine_handle<> handle;
+        bool operator>(const Timer& other) const {
+            return dueMs != other.dueMs ? dueMs > other.dueMs : id > other.id;
+        }
+    };
+
+    std::deque<std::coroutine_handle<>> ready_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    unsigned long long nextTimerId_ = 0;
+};
+
+/**
+ * Lazily started coroutine that produces a T; awaiting it runs it and resumes the
+ * awaiting coroutine when it finishes
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        T value;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+
+        // Count frame memory so the benchmark can report bytes per operation
+        static void* operator new(size_t size) {
+            g_coroutineFrameBytes += size;
+            size_t live = ++g_coroutineFramesLive;
+            size_t peak = g_coroutineFramesPeak;
+            while (live > peak && !g_coroutineFramesPeak.compare_exchange_weak(peak, live)) {}
+            return ::operator new(size);
+        }
+        static void operator delete(void* frame, size_t) {
+            --g_coroutineFramesLive;
+            ::operator delete(frame);
+        }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    Task(const Task&) = delete;
+    ~Task() { if (handle_) handle_.destroy(); }
+
+    bool await_ready() const { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return std::move(handle_.promise().value); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * Fire-and-forget coroutine used to root each operation on a loop
+ */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * Coroutine form of WaitForServiceState: the poll interval is a timer on the loop
+ */
+Task<CommandResult> WaitForServiceStateAsync(EventLoop& loop, SC_HANDLE service, DWORD targetState, DWORD timeoutMs,
+    SERVICE_STATUS_PROCESS* status) {
+    ULONGLONG startTime = ClockNow();
+    DWORD bytesNeeded;
+
+    while (true) {
+        if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)status, sizeof(*status), &bytesNeeded)) {
+            co_return CommandFailure(ScmStage::QueryStatus, startTime);
+        }
+        if (status->dwCurrentState == targetState) {
+            co_return CommandSuccess(startTime);
+        }
+        if (status->dwCurrentState == SERVICE_STOPPED) {
+            DWORD exitCode = status->dwWin32ExitCode ? status->dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+            co_return CommandFailure(ScmStage::Wait, exitCode, startTime);
+        }
+
+        ULONGLONG elapsed = ClockNow() - startTime;
+        if (elapsed > timeoutMs) {
+            co_return CommandFailure(ScmStage::Wait, ERROR_SERVICE_REQUEST_TIMEOUT, startTime);
+        }
+        DWORD pollMs = (std::min)((std::max)(status->dwWaitHint / 10, (DWORD)25), (DWORD)250);
+        co_await loop.Delay((DWORD)(std::min)((ULONGLONG)pollMs, timeoutMs - elapsed + 1));
+    }
+}
+
+/**
+ * Coroutine form of RunServiceOp
+ */
+Task<ServiceOpOutcome> RunServiceOpAsync(EventLoop& loop, SC_HANDLE scManager, const std::wstring* serviceName,
+    ServiceOp op, DWORD timeoutMs) {
+    ULONGLONG startTime = ClockNow();
+    ServiceOpOutcome outcome;
+    SC_HANDLE service = NULL;
+    DWORD waitState = BeginServiceOp(scManager, *serviceName, op, service, outcome);
+    if (waitState) {
+        SERVICE_STATUS_PROCESS status;
+        CommandResult waited = co_await WaitForServiceStateAsync(loop, service, waitState, timeoutMs, &status);
+        outcome.state = status.dwCurrentState;
+        if (!waited.ok()) outcome.result = waited;
+    }
+    if (service) Scm().CloseServiceHandle(service);
+    outcome.elapsedMs = ClockNow() - startTime;
+    outcome.result.elapsedMs = outcome.elapsedMs;
+    co_return outcome;
+}
+
+/**
+ * Roots one operation on a loop and stores its outcome
+ */
+DetachedTask SpawnServiceOp(EventLoop& loop, SC_HANDLE scManager, const std::wstring* serviceName, ServiceOp op,
+    DWORD timeoutMs, ServiceOpOutcome* outcome) {
+    co_await loop.Yield();
+    *outcome = co_await RunServiceOpAsync(loop, scManager, serviceName, op, timeoutMs);
+}
+#endif
+
+/**
+ * Runs one operation on many services at once
+ * With coroutines, operations are spread over `loops` event-loop threads; without,
+ * each operation gets its own thread
+ *
+ * @param serviceNames Names of the services
+ * @param op The operation
+ * @param timeoutMs Per-service wait timeout
+ * @param loops Event-loop threads to use (coroutine builds only)
+ * @param outcomes Receives one outcome per service, in order
+ * @return Failure only if the SCM itself could not be opened
+ */
+CommandResult RunServiceOps(const std::vector<std::wstring>& serviceNames, ServiceOp op, DWORD timeoutMs, size_t loops,
+    std::vector<ServiceOpOutcome>& outcomes) {
+    ULONGLONG startTime = ClockNow();
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    outcomes.assign(serviceNames.size(), ServiceOpOutcome());
+#ifdef SCCLONE_HAVE_COROUTINES
+    // Operation i runs on loop i % loops
+    loops = (std::max)((size_t)1, (std::min)(loops, serviceNames.size()));
+    ParallelFor(loops, loops, [&](size_t loopIndex) {
+        EventLoop loop;
+        for (size_t i = loopIndex; i < serviceNames.size(); i += loops) {
+            SpawnServiceOp(loop, scManager, &serviceNames[i], op, timeoutMs, &outcomes[i]);
+        }
+        loop.Run();
+    });
+#else
+    (void)loops;
+    ParallelFor(serviceNames.size(), serviceNames.size(), [&](size_t i) {
+        outcomes[i] = RunServiceOp(scManager, serviceNames[i], op, timeoutMs);
+    });
+#endif
+
+    Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Stops several services at once and prints each one's final state and time
+ *
+ * @param serviceNames Names of the services to stop
+ * @param timeoutMs Per-service wait timeout
+ * @return Success, or the first failure in service order
+ */
+CommandResult StopServices(const std::vector<std::wstring>& serviceNames, DWORD timeoutMs) {
+    ULONGLONG startTime = ClockNow();
+    std::vector<ServiceOpOutcome> outcomes;
+    CommandResult result = RunServiceOps(serviceNames, ServiceOp::Stop, timeoutMs, 1, outcomes);
+    if (!result.ok()) return result;
+
+    size_t nameWidth = 12;
+    for (const auto& name : serviceNames) nameWidth = (std::max)(nameWidth, WStringToString(name).size());
+    std::string output;
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        std::string name = WStringToString(serviceNames[i]);
+        output += name + std::string(nameWidth + 2 - name.size(), ' ');
+        if (!outcomes[i].result.ok()) {
+            output += FormatCommandFailure(outcomes[i].result) + "\n";
+            if (failed++ == 0) firstFailure = outcomes[i].result;
+            continue;
+        }
+        std::string state = GetServiceStateString(outcomes[i].state);
+        output += state + std::string(state.size() < 18 ? 18 - state.size() : 1, ' ') +
+            std::to_string(outcomes[i].elapsedMs) + " ms\n";
+    }
+    std::cout << output;
+    std::cout << serviceNames.size() << " service(s), " << failed << " failed, "
+        << (ClockNow() - startTime) << " ms total" << std::endl;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Benchmarks many concurrent start/stop/query operations against an in-process
+ * simulated SCM: the coroutine executor against one thread per operation
+ *
+ * @param serviceCount Number of simulated services
+ * @param startLatencyMs Simulated START_PENDING time
+ * @param stopLatencyMs Simulated STOP_PENDING time
+ * @param loops Event-loop threads for the executor
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult BenchmarkServiceOps(size_t serviceCount, DWORD startLatencyMs, DWORD stopLatencyMs, size_t loops) {
+    ULONGLONG startTime = ClockNow();
+
+    // The benchmark always runs against its own simulated database
+    SimulatedScm* sim = new SimulatedScm();
+    std::vector<std::wstring> names;
+    for (size_t i = 0; i < serviceCount; i++) {
+        SimService svc;
+        wchar_t name[32];
+        swprintf(name, 32, L"BenchSvc%05u", (unsigned)i);
+        svc.name = svc.displayName = name;
+        svc.binaryPath = L"C:\\bench.exe";
+        svc.startLatencyMs = startLatencyMs;
+        svc.stopLatencyMs = stopLatencyMs;
+        sim->AddService(svc);
+        names.push_back(name);
+    }
+    UseScmBackend(sim);
+
+    struct Phase { const char* name; ServiceOp op; };
+    const Phase phases[] = { { "start", ServiceOp::Start }, { "query", ServiceOp::Query }, { "stop", ServiceOp::Stop } };
+
+    std::cout << serviceCount << " simulated services, start " << startLatencyMs << " ms, stop " << stopLatencyMs << " ms" << std::endl;
+    for (int mode = 0; mode < 2; mode++) {
+#ifndef SCCLONE_HAVE_COROUTINES
+        if (mode == 0) {
+            std::cout << "coroutines : not available in this build (compile as C++20)" << std::endl;
+            continue;
+        }
+#endif
+        for (const Phase& phase : phases) {
+            std::vector<ServiceOpOutcome> outcomes(names.size());
+            auto begin = std::chrono::steady_clock::now();
+#ifdef SCCLONE_HAVE_COROUTINES
+            size_t framesBefore = g_coroutineFrameBytes;
+            g_coroutineFramesPeak = 0;
+#endif
+            if (mode == 0) {
+                RunServiceOps(names, phase.op, 60000, loops, outcomes);
+            }
+            else {
+                // One thread per operation, sleeping through its wait
+                SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+                ParallelFor(names.size(), names.size(), [&](size_t i) {
+                    outcomes[i] = RunServiceOp(scManager, names[i], phase.op, 60000);
+                });
+                Scm().CloseServiceHandle(scManager);
+            }
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+            size_t failed = 0;
+            for (const auto& outcome : outcomes) failed += outcome.result.ok() ? 0 : 1;
+            char line[200];
+            snprintf(line, sizeof(line), "%-10s %-5s : %9.1f ms, %9.0f ops/s, %zu failed, %zu thread(s)",
+                mode == 0 ? "coroutines" : "threads", phase.name, elapsed,
+                elapsed > 0 ? names.size() * 1000.0 / elapsed : 0.0, failed,
+                mode == 0 ? (std::min)(loops, names.size()) : names.size());
+            std::cout << line;
+#ifdef SCCLONE_HAVE_COROUTINES
+            if (mode == 0) {
+                std::cout << ", " << (g_coroutineFrameBytes - framesBefore) / (std::max)(names.size(), (size_t)1)
+                    << " frame bytes/op, peak " << g_coroutineFramesPeak << " frames live";
+            }
+#endif
+            std::cout << std::endl;
+        }
+    }
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Waiting for service states - Watches many services until each reaches its target
+// state, without sending any control, from one thread driving a shared timer wheel
+//=============================================================================
+
+/**
+ * Hashed timer wheel: a ring of slots, one per tick, each holding the items due in
+ * that tick. Scheduling and expiry cost O(1) per item however many items there are,
+ * so thousands of services can share one thread. Delays are capped at one turn of
+ * the ring, which is all the poll intervals here need.
+ */
+class TimerWheel {
+public:
+    /**
+     * @param tickMs Width of one slot
+     * @param slots Number of slots; the longest delay is tickMs * (slots - 1)
+     */
+    TimerWheel(DWORD tickMs, size_t slots) : tickMs_(tickMs), slots_(slots), cursorMs_(ClockNow()) {}
+
+    /**
+     * Schedules an item to come due after a delay, rounded up to whole ticks
+     *
+     * @param item The item (an index into the caller's table)
+     * @param delayMs The delay; 0 makes the item due at once
+     */
+    void Schedule(size_t item, DWORD delayMs) {
+        ULONGLONG ticks = 0;
+        if (delayMs) {
+            ULONGLONG dueMs = ClockNow() + delayMs;
+            ticks = dueMs > cursorMs_ ? (dueMs - cursorMs_ + tickMs_ - 1) / tickMs_ : 1;
+            ticks = (std::min)((std::max)(ticks, (ULONGLONG)1), (ULONGLONG)slots_.size() - 1);
+        }
+        slots_[(cursor_ + ticks) % slots_.size()].push_back(item);
+        pending_++;
+    }
+
+    /**
+     * Sleeps until the next tick with items due and hands them over
+     *
+     * @param deadlineMs ClockNow() time to give up at
+     * @param due Receives the items that came due
+     * @return false if nothing is scheduled or the deadline comes first
+     */
+    bool Advance(ULONGLONG deadlineMs, std::vector<size_t>& due) {
+        due.clear();
+        if (!pending_) return false;
+        size_t ticks = 0;
+        while (slots_[(cursor_ + ticks) % slots_.size()].empty()) ticks++;
+        ULONGLONG dueMs = cursorMs_ + ticks * tickMs_;
+
+        ULONGLONG now = ClockNow();
+        if (dueMs > deadlineMs) {
+            if (deadlineMs > now) ClockSleep((DWORD)(deadlineMs - now));
+            return false;
+        }
+        if (dueMs > now) ClockSleep((DWORD)(dueMs - now));
+
+        cursor_ = (cursor_ + ticks) % slots_.size();
+        cursorMs_ = dueMs;
+        due.swap(slots_[cursor_]);
+        pending_ -= due.size();
+        return true;
+    }
+
+private:
+    DWORD tickMs_;
+    std::vector<std::vector<size_t>> slots_;
+    size_t cursor_ = 0;         // Slot of the current tick
+    ULONGLONG cursorMs_;        // ClockNow() time of the current tick
+    size_t pending_ = 0;
+};
+
+/**
+ * Polls every service until it reaches its target state, any service fails, or the
+ * deadline passes. Each service is polled at a tenth of its wait hint (25 to 250 ms,
+ * as WaitForServiceState does), or every 250 ms while it sits in a steady state
+ * other than the target, e.g. stopped before anyone has started it.
+ *
+ * @param targets The services and their target states
+ * @param timeoutMs Deadline for the whole wait
+ * @param polls Receives the number of status queries made
+ * @return One result per target, in order
+ */
+std::vector<scclone::WaitResult> WaitForServiceStates(const std::vector<scclone::WaitTarget>& targets, DWORD timeoutMs,
+    size_t& polls) {
+    ULONGLONG startTime = ClockNow();
+    polls = 0;
+    std::vector<scclone::WaitResult> results(targets.size());
+    for (size_t i = 0; i < targets.size(); i++) {
+        results[i].serviceName = targets[i].serviceName;
+        results[i].target = targets[i].state;
+    }
+    if (targets.empty()) return results;
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        CommandResult failure = CommandFailure(ScmStage::OpenManager, startTime);
+        for (auto& result : results) static_cast<CommandResult&>(result) = failure;
+        return results;
+    }
+
+    // Every service is polled once straight away
+    TimerWheel wheel(25, 16);
+    std::vector<SC_HANDLE> handles(targets.size(), NULL);
+    std::vector<bool> done(targets.size(), false);
+    std::vector<bool> seenActive(targets.size(), false);
+    bool failed = false;
+    size_t waiting = targets.size();
+    for (size_t i = 0; i < targets.size() && !failed; i++) {
+        handles[i] = Scm().OpenServiceW(scManager, targets[i].serviceName.c_str(), SERVICE_QUERY_STATUS);
+        if (!handles[i]) {
+            static_cast<CommandResult&>(results[i]) = CommandFailure(ScmStage::OpenService, startTime);
+            done[i] = failed = true;
+            waiting--;
+            continue;
+        }
+        wheel.Schedule(i, 0);
+    }
+
+    ULONGLONG deadline = startTime + timeoutMs;
+    std::vector<size_t> due;
+    while (!failed && waiting && wheel.Advance(deadline, due)) {
+        for (size_t i : due) {
+            SERVICE_STATUS_PROCESS status;
+            DWORD bytesNeeded;
+            polls++;
+            if (!Scm().QueryServiceStatusEx(handles[i], SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+                static_cast<CommandResult&>(results[i]) = CommandFailure(ScmStage::QueryStatus, startTime);
+                done[i] = failed = true;
+                waiting--;
+                break;
+            }
+            DWORD state = status.dwCurrentState;
+            results[i].state = (scclone::State)state;
+            if (state == (DWORD)targets[i].state) {
+                results[i].timeToStateMs = ClockNow() - startTime;
+                static_cast<CommandResult&>(results[i]) = CommandSuccess(startTime);
+                done[i] = true;
+                waiting--;
+                continue;
+            }
+
+            // Stopped before anything happened is someone else's start still to come;
+            // stopped after being seen on the way is a failed start or a crash
+            if (state == SERVICE_STOPPED && seenActive[i]) {
+                DWORD exitCode = status.dwWin32ExitCode ? status.dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+                static_cast<CommandResult&>(results[i]) = CommandFailure(ScmStage::Wait, exitCode, startTime);
+                done[i] = failed = true;
+                waiting--;
+                break;
+            }
+            if (state != SERVICE_STOPPED) seenActive[i] = true;
+
+            bool pending = state == SERVICE_START_PENDING || state == SERVICE_STOP_PENDING ||
+                state == SERVICE_CONTINUE_PENDING || state == SERVICE_PAUSE_PENDING;
+            wheel.Schedule(i, pending ? (std::min)((std::max)(status.dwWaitHint / 10, (DWORD)25), (DWORD)250) : 250);
+        }
+    }
+
+    // Whatever is left either missed the deadline or was cut short by a failure
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (handles[i]) Scm().CloseServiceHandle(handles[i]);
+        if (done[i]) continue;
+        static_cast<CommandResult&>(results[i]) = CommandFailure(ScmStage::Wait,
+            failed ? ERROR_OPERATION_ABORTED : ERROR_SERVICE_REQUEST_TIMEOUT, startTime);
+    }
+    Scm().CloseServiceHandle(scManager);
+    return results;
+}
+
+namespace scclone {
+
+std::vector<WaitResult> Wait(const std::vector<WaitTarget>& targets, uint32_t timeoutMs) {
+    size_t polls = 0;
+    return WaitForServiceStates(targets, timeoutMs, polls);
+}
+
+void WaitAsync(const std::vector<WaitTarget>& targets, uint32_t timeoutMs,
+    std::function<void(const std::vector<WaitResult>&)> done) {
+    AsyncCallQueue::Instance().Post([=] { done(Wait(targets, timeoutMs)); });
+}
+
+} // namespace scclone
+
+/**
+ * Waits for services to reach their target states and prints each one's time to state
+ * Similar to running "sc query" in a loop until everything is up (or down), but all
+ * services are watched at once and the command returns as soon as one fails
+ *
+ * @param targets The services and their target states
+ * @param timeoutMs Deadline for the whole wait
+ * @return Success, or the first failure in service order
+ */
+CommandResult WaitForServices(const std::vector<scclone::WaitTarget>& targets, DWORD timeoutMs) {
+    ULONGLONG startTime = ClockNow();
+    size_t polls = 0;
+    std::vector<scclone::WaitResult> results = WaitForServiceStates(targets, timeoutMs, polls);
+    if (!results.empty() && results[0].stage == ScmStage::OpenManager) {
+        return results[0]; // Nothing was watched
+    }
+
+    size_t nameWidth = 12;
+    for (const auto& target : targets) nameWidth = (std::max)(nameWidth, WStringToString(target.serviceName).size());
+    std::string out;
+    char line[320];
+    snprintf(line, sizeof(line), "%-*s  %-16s %-16s %s\n", (int)nameWidth, "SERVICE", "TARGET", "STATE", "RESULT");
+    out += line;
+    CommandResult firstFailure;
+    size_t reached = 0, failed = 0, timedOut = 0, abandoned = 0;
+    for (const auto& result : results) {
+        std::string outcome;
+        if (result.ok()) {
+            reached++;
+            outcome = "reached after " + std::to_string(result.timeToStateMs) + " ms";
+        }
+        else if (result.error == ERROR_OPERATION_ABORTED) {
+            abandoned++;
+            outcome = "still waiting when the wait ended";
+        }
+        else if (result.error == ERROR_SERVICE_REQUEST_TIMEOUT && result.stage == ScmStage::Wait) {
+            timedOut++;
+            outcome = "timed out";
+        }
+        else {
+            failed++;
+            outcome = result.stage == ScmStage::Wait
+                ? "FAILED: stopped with error " + std::to_string(result.error) + " (" + FormatErrorMessage(result.error) + ")"
+                : "FAILED: " + FormatCommandFailure(result);
+        }
+        if (!result.ok() && result.error != ERROR_OPERATION_ABORTED && !firstFailure.error) firstFailure = result;
+        std::string state = result.state == scclone::State::Unknown ? "-" : GetServiceStateString((DWORD)result.state);
+        snprintf(line, sizeof(line), "%-*s  %-16s %-16s %s\n", (int)nameWidth, WStringToString(result.serviceName).c_str(),
+            GetServiceStateString((DWORD)result.target).c_str(), state.c_str(), outcome.c_str());
+        out += line;
+    }
+
+    ULONGLONG totalMs = ClockNow() - startTime;
+    snprintf(line, sizeof(line), "\n%zu of %zu service(s) reached their target state in %.1f s (%zu status queries)\n",
+        reached, results.size(), totalMs / 1000.0, polls);
+    out += line;
+    if (failed || timedOut || abandoned) {
+        out += "Failed: " + std::to_string(failed) + ", timed out: " + std::to_string(timedOut) +
+            ", still waiting: " + std::to_string(abandoned) + "\n";
+    }
+    std::cout << out;
+    return firstFailure.error ? firstFailure : CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Stress test - A configurable mix of SCM operations from many threads, with
+// latencies recorded in log-linear (HDR-style) histograms
+//=============================================================================
+
+/**
+ * Latency histogram with about 1.5% precision from 1 us to days
+ * Values below 128 us get one bucket each; above that every power of two is split
+ * into 64 buckets. Recording is a single increment, so each worker keeps its own
+ * histograms and they are merged at the end.
+ */
+class LatencyHistogram {
+public:
+    static const int SubBuckets = 64;
+    static const int Buckets = 2 * SubBuckets + 40 * SubBuckets;
+
+    LatencyHistogram() : counts_(Buckets, 0) {}
+
+    void Record(unsigned long long valueUs) {
+        counts_[IndexOf(valueUs)]++;
+        total_++;
+        sumUs_ += valueUs;
+        if (valueUs > maxUs_) maxUs_ = valueUs;
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (int i = 0; i < Buckets; i++) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sumUs_ += other.sumUs_;
+        maxUs_ = (std::max)(maxUs_, other.maxUs_);
+    }
+
+    unsigned long long Count() const { return total_; }
+    unsigned long long MaxUs() const { return maxUs_; }
+    double MeanUs() const { return total_ ? (double)sumUs_ / total_ : 0.0; }
+
+    /**
+     * Returns the value at a percentile (0-100): the upper edge of the bucket
+     * holding that rank, capped at the largest value recorded
+     */
+    unsigned long long PercentileUs(double percentile) const {
+        if (!total_) return 0;
+        unsigned long long rank = (unsigned long long)(percentile / 100.0 * total_ + 0.5);
+        if (rank == 0) rank = 1;
+        unsigned long long seen = 0;
+        for (int i = 0; i < Buckets; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return (std::min)(UpperEdgeOf(i), maxUs_);
+        }
+        return maxUs_;
+    }
+
+private:
+    static int IndexOf(unsigned long long valueUs) {
+        if (valueUs < 2 * SubBuckets) return (int)valueUs;
+        int magnitude = 0;
+        while ((valueUs >> magnitude) >= 2 * SubBuckets) magnitude++;
+        int index = 2 * SubBuckets + (magnitude - 1) * SubBuckets + (int)((valueUs >> magnitude) - SubBuckets);
+        return (std::min)(index, Buckets - 1);
+    }
+
+    static unsigned long long UpperEdgeOf(int index) {
+        if (index < 2 * SubBuckets) return (unsigned long long)index;
+        int magnitude = (index - 2 * SubBuckets) / SubBuckets + 1;
+        unsigned long long mantissa = (unsigned long long)((index - 2 * SubBuckets) % SubBuckets + SubBuckets);
+        return ((mantissa + 1) << magnitude) - 1;
+    }
+
+    std::vector<unsigned long long> counts_;
+    unsigned long long total_ = 0;
+    unsigned long long sumUs_ = 0;
+    unsigned long long maxUs_ = 0;
+};
+
+/**
+ * Operations the stress test mixes
+ */
+enum class StressOp : unsigned char {
+    Query,      // OpenService + QueryServiceStatusEx
+    Config,     // Read the description and write the same value back
+    Start,      // StartService, without waiting
+    Stop,       // ControlService(STOP), without waiting
+};
+
+const char* const StressOpNames[] = { "query", "config", "start", "stop" };
+const int StressOpCount = 4;
+
+/**
+ * Settings for the stress command
+ */
+struct StressOptions {
+    unsigned weights[StressOpCount] = { 100, 0, 0, 0 };    // Relative share of each operation
+    size_t concurrency = 16;        // Worker threads
+    double rate = 0;                // Target operations per second in total (0 = as fast as possible)
+    DWORD durationMs = 10000;
+};
+
+/**
+ * Parses an operation mix such as "query=70,config=20,start=5,stop=5"
+ *
+ * @return false if an operation name or weight is invalid, or all weights are 0
+ */
+bool ParseStressMix(const std::wstring& text, StressOptions& options) {
+    unsigned weights[StressOpCount] = { 0, 0, 0, 0 };
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(L',', pos);
+        std::wstring item = text.substr(pos, comma == std::wstring::npos ? std::wstring::npos : comma - pos);
+        size_t equals = item.find(L'=');
+        if (equals == std::wstring::npos) return false;
+        std::string name = WStringToString(ToLowerServiceName(item.substr(0, equals)));
+        int op = -1;
+        for (int i = 0; i < StressOpCount; i++) {
+            if (name == StressOpNames[i]) op = i;
+        }
+        if (op < 0) return false;
+        try {
+            weights[op] = (unsigned)std::stoul(item.substr(equals + 1));
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        if (comma == std::wstring::npos) break;
+        pos = comma + 1;
+    }
+    unsigned total = 0;
+    for (unsigned weight : weights) total += weight;
+    if (!total) return false;
+    std::copy(weights, weights + StressOpCount, options.weights);
+    return true;
+}
+
+/**
+ * Runs one stress operation against a service
+ * Start on a running service and stop on a stopped one are expected with a random
+ * mix, so they count as successes.
+ *
+ * @return ERROR_SUCCESS or the Windows error code of the failure
+ */
+DWORD RunStressOp(SC_HANDLE scManager, const std::wstring& serviceName, StressOp op) {
+    DWORD access = SERVICE_QUERY_STATUS;
+    if (op == StressOp::Config) access = SERVICE_QUERY_CONFIG | SERVICE_CHANGE_CONFIG;
+    if (op == StressOp::Start) access = SERVICE_START;
+    if (op == StressOp::Stop) access = SERVICE_STOP;
+
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), access);
+    if (!service) return GetLastError();
+
+    DWORD error = ERROR_SUCCESS;
+    switch (op) {
+    case StressOp::Query: {
+        SERVICE_STATUS_PROCESS status;
+        DWORD bytesNeeded;
+        if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+            error = GetLastError();
+        }
+        break;
+    }
+    case StressOp::Config: {
+        DWORD bytesNeeded = 0;
+        Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, NULL, 0, &bytesNeeded);
+        std::vector<BYTE> buffer((std::max)(bytesNeeded, (DWORD)sizeof(SERVICE_DESCRIPTIONW)));
+        if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, buffer.data(), (DWORD)buffer.size(), &bytesNeeded)) {
+            error = GetLastError();
+            break;
+        }
+        SERVICE_DESCRIPTIONW description = *(LPSERVICE_DESCRIPTIONW)buffer.data();
+        wchar_t empty[1] = { 0 };
+        if (!description.lpDescription) description.lpDescription = empty;
+        if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, &description)) error = GetLastError();
+        break;
+    }
+    case StressOp::Start:
+        if (!Scm().StartServiceW(service, 0, NULL) && GetLastError() != ERROR_SERVICE_ALREADY_RUNNING) error = GetLastError();
+        break;
+    case StressOp::Stop: {
+        SERVICE_STATUS status;
+        if (!Scm().ControlService(service, SERVICE_CONTROL_STOP, &status) &&
+            GetLastError() != ERROR_SERVICE_NOT_ACTIVE && GetLastError() != ERROR_SERVICE_CANNOT_ACCEPT_CTRL) {
+            error = GetLastError();
+        }
+        break;
+    }
+    }
+    Scm().CloseServiceHandle(service);
+    return error;
+}
+
+/**
+ * Results one worker collects; merged once the run is over
+ */
+struct StressWorkerStats {
+    LatencyHistogram latency[StressOpCount];
+    std::map<DWORD, unsigned long long> errors[StressOpCount];
+};
+
+/**
+ * Runs a mix of operations against services from many threads for a fixed time
+ * With a target rate, operations are scheduled at fixed intervals and latency is
+ * measured from the scheduled time, so a slow SCM shows up as queueing instead of
+ * silently lowering the request rate.
+ *
+ * @param serviceNames Services to pick from at random
+ * @param options Mix, concurrency, rate and duration
+ * @return Success, or a failure if every operation failed
+ */
+CommandResult StressServices(const std::vector<std::wstring>& serviceNames, const StressOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+
+    unsigned totalWeight = 0;
+    for (unsigned weight : options.weights) totalWeight += weight;
+    std::string mix;
+    for (int op = 0; op < StressOpCount; op++) {
+        if (options.weights[op]) mix += std::string(mix.empty() ? "" : " ") + StressOpNames[op] + "=" + std::to_string(options.weights[op]);
+    }
+    std::cout << "Stress: " << options.concurrency << " worker(s), " << options.durationMs / 1000.0 << " s, "
+        << (options.rate > 0 ? std::to_string((long long)options.rate) + " ops/s target" : std::string("closed loop"))
+        << ", mix " << mix << ", " << serviceNames.size() << " service(s)" << std::endl;
+
+    std::vector<StressWorkerStats> stats(options.concurrency);
+    std::atomic<unsigned long long> nextTicket(0);
+    auto begin = std::chrono::steady_clock::now();
+    auto end = begin + std::chrono::milliseconds(options.durationMs);
+
+    ParallelFor(options.concurrency, options.concurrency, [&](size_t worker) {
+        std::mt19937_64 random(0x5C5C0000ULL + worker);
+        StressWorkerStats& mine = stats[worker];
+        while (true) {
+            auto scheduled = std::chrono::steady_clock::now();
+            if (options.rate > 0) {
+                // Open loop: ticket k is due at begin + k / rate
+                unsigned long long ticket = nextTicket++;
+                scheduled = begin + std::chrono::microseconds((long long)(ticket * 1000000.0 / options.rate));
+                if (scheduled >= end) break;
+                std::this_thread::sleep_until(scheduled);
+            }
+            else if (scheduled >= end) {
+                break;
+            }
+
+            unsigned pick = (unsigned)(random() % totalWeight);
+            int op = 0;
+            while (pick >= options.weights[op]) pick -= options.weights[op++];
+            const std::wstring& serviceName = serviceNames[random() % serviceNames.size()];
+
+            DWORD error = RunStressOp(scManager, serviceName, (StressOp)op);
+            auto finished = std::chrono::steady_clock::now();
+            mine.latency[op].Record((unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(finished - scheduled).count());
+            if (error != ERROR_SUCCESS) mine.errors[op][error]++;
+        }
+    });
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    Scm().CloseServiceHandle(scManager);
+
+    // Merge the per-worker results
+    StressWorkerStats merged;
+    LatencyHistogram overall;
+    unsigned long long failed = 0;
+    for (const auto& workerStats : stats) {
+        for (int op = 0; op < StressOpCount; op++) {
+            merged.latency[op].Merge(workerStats.latency[op]);
+            overall.Merge(workerStats.latency[op]);
+            for (const auto& error : workerStats.errors[op]) {
+                merged.errors[op][error.first] += error.second;
+                failed += error.second;
+            }
+        }
+    }
+
+    std::string output;
+    char line[200];
+    snprintf(line, sizeof(line), "%-8s %10s %10s %8s %9s %9s %9s %9s %9s\n",
+        "op", "count", "ops/s", "errors", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    output += line;
+    auto addRow = [&](const char* name, const LatencyHistogram& histogram, unsigned long long errors) {
+        snprintf(line, sizeof(line), "%-8s %10llu %10.0f %7.2f%% %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+            histogram.Count(), wallMs > 0 ? histogram.Count() * 1000.0 / wallMs : 0.0,
+            histogram.Count() ? errors * 100.0 / histogram.Count() : 0.0,
+            histogram.PercentileUs(50) / 1000.0, histogram.PercentileUs(90) / 1000.0, histogram.PercentileUs(99) / 1000.0,
+            histogram.PercentileUs(99.9) / 1000.0, histogram.MaxUs() / 1000.0);
+        output += line;
+    };
+    for (int op = 0; op < StressOpCount; op++) {
+        if (!merged.latency[op].Count()) continue;
+        unsigned long long errors = 0;
+        for (const auto& error : merged.errors[op]) errors += error.second;
+        addRow(StressOpNames[op], merged.latency[op], errors);
+    }
+    addRow("total", overall, failed);
+
+    for (int op = 0; op < StressOpCount; op++) {
+        for (const auto& error : merged.errors[op]) {
+            output += std::string("  ") + StressOpNames[op] + ": " + std::to_string(error.second) + " x error " +
+                std::to_string(error.first) + " (" + FormatErrorMessage(error.first) + ")\n";
+        }
+    }
+    if (options.rate > 0 && overall.Count() + 1 < (unsigned long long)(options.rate * options.durationMs / 1000.0 * 0.99)) {
+        output += "Target rate was not reached; latencies include time queued behind busy workers (add workers with /concurrency)\n";
+    }
+    std::cout << output;
+
+    if (overall.Count() && failed == overall.Count()) {
+        // Nothing succeeded: fail with the first error of the first operation type
+        const ScmStage stages[StressOpCount] = { ScmStage::QueryStatus, ScmStage::ChangeConfig2, ScmStage::Start, ScmStage::Control };
+        for (int op = 0; op < StressOpCount; op++) {
+            if (!merged.errors[op].empty()) return CommandFailure(stages[op], merged.errors[op].begin()->first, startTime);
+        }
+    }
+    return CommandSuccess(startTime);
+}
+
+
+//=============================================================================
+// Metrics exporter - Service health in Prometheus text exposition format
+//=============================================================================
+
+/**
+ * Metrics for one service from a single sweep
+ */
+struct ServiceMetrics {
+    std::wstring serviceName;
+    DWORD serviceType = 0;
+    DWORD state = 0;
+    DWORD pid = 0;
+    DWORD startType = SERVICE_NO_CHANGE; // SERVICE_NO_CHANGE if the config could not be read
+    unsigned long long restarts = 0;     // Restarts observed since the exporter started
+    int restartsLastHour = -1;           // From the monitor's restart history; -1 if it has no record
+};
+
+/**
+ * State carried between sweeps: last PIDs for restart detection and cached start types
+ * Start types change rarely, so they are re-read only every few sweeps
+ */
+struct MetricsState {
+    std::map<std::wstring, DWORD> lastPid;
+    std::map<std::wstring, DWORD> lastState;
+    std::map<std::wstring, unsigned long long> restarts;
+    std::map<std::wstring, DWORD> startTypes;
+    unsigned long long sweeps = 0;
+};
+
+/**
+ * Reads the start type of a service
+ *
+ * @param scManager Open SCM handle
+ * @param serviceName Name of the service
+ * @return The start type, or SERVICE_NO_CHANGE if it could not be read
+ */
+DWORD QueryServiceStartType(SC_HANDLE scManager, const std::wstring& serviceName) {
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_QUERY_CONFIG);
+    if (!service) return SERVICE_NO_CHANGE;
+
+    DWORD startType = SERVICE_NO_CHANGE;
+    DWORD bytesNeeded = 0;
+    Scm().QueryServiceConfigW(service, NULL, 0, &bytesNeeded);
+    if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+        std::vector<BYTE> buffer(bytesNeeded);
+        LPQUERY_SERVICE_CONFIGW config = (LPQUERY_SERVICE_CONFIGW)buffer.data();
+        if (Scm().QueryServiceConfigW(service, config, bytesNeeded, &bytesNeeded)) {
+            startType = config->dwStartType;
+        }
+    }
+    Scm().CloseServiceHandle(service);
+    return startType;
+}
+
+/**
+ * Reads state, PID, start type and restart counts for all or selected services in one sweep
+ * Restarts are detected with IsServiceRestart() against the previous sweep
+ *
+ * @param state Data carried between sweeps (updated)
+ * @param selected Lowercase names to include; empty means every service
+ * @param metrics Receives one entry per service
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult CollectServiceMetrics(MetricsState& state, const std::set<std::wstring>& selected,
+    std::vector<ServiceMetrics>& metrics) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceStatusEntry> entries;
+    CommandResult result = EnumerateServices(entries);
+    if (!result.ok()) return result;
+
+    // Refresh the cached start types on the first sweep and every 10th after that
+    bool refreshConfig = (state.sweeps++ % 10) == 0;
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+
+    for (const auto& entry : entries) {
+        if (!selected.empty() && !selected.count(ToLowerServiceName(entry.serviceName))) continue;
+
+        ServiceMetrics m;
+        m.serviceName = entry.serviceName;
+        m.serviceType = entry.status.dwServiceType;
+        m.state = entry.status.dwCurrentState;
+        m.pid = entry.status.dwProcessId;
+
+        auto cached = state.startTypes.find(entry.serviceName);
+        if (scManager && (refreshConfig || cached == state.startTypes.end())) {
+            m.startType = state.startTypes[entry.serviceName] = QueryServiceStartType(scManager, entry.serviceName);
+        }
+        else if (cached != state.startTypes.end()) {
+            m.startType = cached->second;
+        }
+
+        // Restart detection against the previous sweep
+        auto previousPid = state.lastPid.find(entry.serviceName);
+        auto previousState = state.lastState.find(entry.serviceName);
+        if (previousPid != state.lastPid.end() &&
+            IsServiceRestart(previousPid->second, previousState->second, m.pid, m.state)) {
+            state.restarts[entry.serviceName]++;
+        }
+        state.lastPid[entry.serviceName] = m.pid;
+        state.lastState[entry.serviceName] = m.state;
+        m.restarts = state.restarts[entry.serviceName];
+
+        metrics.push_back(std::move(m));
+    }
+
+    if (scManager) Scm().CloseServiceHandle(scManager);
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Fills in the restarts of the last hour from the history the monitor command keeps
+ * A one-shot sweep has no earlier sweep to compare with, so this is its only
+ * source of restart counts.
+ *
+ * @param metrics The services from the sweep (updated)
+ * @return false if there is no history to read
+ */
+bool AddRecentRestarts(std::vector<ServiceMetrics>& metrics) {
+    std::map<std::wstring, ServiceHistory> histories;
+    if (!LoadRestartHistory(GetRestartHistoryPath(), histories)) return false;
+    unsigned long long hourAgo = WallClockMs() - 3600 * 1000ULL;
+    for (auto& m : metrics) {
+        auto history = histories.find(ToLowerServiceName(m.serviceName));
+        if (history != histories.end()) m.restartsLastHour = (int)history->second.CountSince(ServiceEventRestarted, hourAgo);
+    }
+    return true;
+}
+
+/**
+ * Appends a service name as an escaped Prometheus label value
+ *
+ * @param out Buffer to append to
+ * @param value The label value
+ */
+void AppendPrometheusLabel(std::string& out, const std::wstring& value) {
+    std::string utf8;
+    AppendWideAsUtf8(utf8, value.data(), value.size());
+    for (char c : utf8) {
+        if (c == '\\') out += "\\\\";
+        else if (c == '"') out += "\\\"";
+        else if (c == '\n') out += "\\n";
+        else out += c;
+    }
+}
+
+/**
+ * Renders one sweep in the Prometheus text exposition format
+ * Restarts observed across sweeps are only written by the long-running exporter;
+ * restarts from the monitor's history are written for the services it has recorded.
+ *
+ * @param metrics The services from the sweep
+ * @param sweepMs How long the sweep took
+ * @param out Buffer to append to
+ * @param observedRestarts Whether metrics carry restarts counted across sweeps
+ */
+void RenderPrometheusMetrics(const std::vector<ServiceMetrics>& metrics, ULONGLONG sweepMs, std::string& out,
+    bool observedRestarts = true) {
+    // Each family is written as a block so HELP/TYPE appear once per metric
+    struct Family { const char* name; const char* help; const char* type; };
+    const Family families[] = {
+        { "scclone_service_state", "Service state code (1 stopped, 2 start pending, 3 stop pending, 4 running, 5 continue pending, 6 pause pending, 7 paused).", "gauge" },
+        { "scclone_service_up", "1 if the service is running, 0 otherwise.", "gauge" },
+        { "scclone_service_pid", "Process ID of the service, 0 when not running.", "gauge" },
+        { "scclone_service_start_type", "Start type code (0 boot, 1 system, 2 auto, 3 demand, 4 disabled).", "gauge" },
+        { "scclone_service_restarts_total", "Restarts observed by this exporter (PID change or return to running).", "counter" },
+        { "scclone_service_restarts_last_hour", "Restarts in the last hour recorded by scclone monitor.", "gauge" },
+    };
+    bool recentRestarts = std::any_of(metrics.begin(), metrics.end(),
+        [](const ServiceMetrics& m) { return m.restartsLastHour >= 0; });
+
+    for (int f = 0; f < 6; f++) {
+        if ((f == 4 && !observedRestarts) || (f == 5 && !recentRestarts)) continue;
+        out += "# HELP "; out += families[f].name; out += ' '; out += families[f].help; out += '\n';
+        out += "# TYPE "; out += families[f].name; out += ' '; out += families[f].type; out += '\n';
+        for (const auto& m : metrics) {
+            unsigned long long value = 0;
+            switch (f) {
+            case 0: value = m.state; break;
+            case 1: value = m.state == SERVICE_RUNNING ? 1 : 0; break;
+            case 2: value = m.pid; break;
+            case 3: if (m.startType == SERVICE_NO_CHANGE) continue; value = m.startType; break;
+            case 4: value = m.restarts; break;
+            case 5: if (m.restartsLastHour < 0) continue; value = (unsigned long long)m.restartsLastHour; break;
+            }
+            out += families[f].name;
+            out += "{service=\"";
+            AppendPrometheusLabel(out, m.serviceName);
+            out += "\"} ";
+            out += std::to_string(value);
+            out += '\n';
+        }
+    }
+
+    out += "# HELP scclone_sweep_duration_seconds Time taken to read all service states.\n";
+    out += "# TYPE scclone_sweep_duration_seconds gauge\n";
+    out += "scclone_sweep_duration_seconds " + std::to_string(sweepMs / 1000.0) + "\n";
+    out += "# HELP scclone_services Number of services in the sweep.\n";
+    out += "# TYPE scclone_services gauge\n";
+    out += "scclone_services " + std::to_string(metrics.size()) + "\n";
+}
+
+/**
+ * Serves cached metrics over HTTP on 127.0.0.1:port
+ * A background thread re-sweeps the SCM every intervalMs and swaps in the rendered
+ * text; a scrape only copies the current snapshot, so scrape rate never turns into
+ * SCM load.
+ *
+ * @param selected Lowercase names to include; empty means every service
+ * @param port Loopback port to listen on
+ * @param intervalMs Snapshot refresh interval
+ * @return Result with the error code and failing stage, if any (only returns on failure)
+ */
+CommandResult ServeMetrics(const std::set<std::wstring>& selected, unsigned short port, DWORD intervalMs) {
+    ULONGLONG startTime = ClockNow();
+    EnsureSocketsInitialized();
+
+    SocketHandle listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        return CommandFailure(ScmStage::Arguments, ERROR_NOT_SUPPORTED, startTime);
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+        CloseSocket(listener);
+        std::cerr << "ERROR: Could not listen on 127.0.0.1:" << port << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_ALREADY_EXISTS, startTime);
+    }
+
+    // The snapshot is immutable once published; scrapes grab a reference under the lock
+    std::mutex snapshotMutex;
+    std::shared_ptr<const std::string> snapshot = std::make_shared<const std::string>("");
+
+    auto refresh = [&](MetricsState& state) {
+        ULONGLONG sweepStart = ClockNow();
+        std::vector<ServiceMetrics> metrics;
+        CommandResult sweep = CollectServiceMetrics(state, selected, metrics);
+        AddRecentRestarts(metrics);
+        auto text = std::make_shared<std::string>();
+        RenderPrometheusMetrics(metrics, ClockNow() - sweepStart, *text);
+        *text += "# HELP scclone_sweep_success 1 if the last sweep of the SCM succeeded.\n";
+        *text += "# TYPE scclone_sweep_success gauge\n";
+        *text += std::string("scclone_sweep_success ") + (sweep.ok() ? "1" : "0") + "\n";
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        snapshot = text;
+    };
+
+    MetricsState state;
+    refresh(state);
+    std::thread refresher([&] {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+            refresh(state);
+        }
+    });
+    refresher.detach();
+
+    std::cout << "Serving metrics on http://127.0.0.1:" << port << "/metrics (refresh every "
+        << intervalMs / 1000.0 << " s)" << std::endl;
+
+    while (true) {
+        SocketHandle client = accept(listener, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+
+        // Clients are served one at a time, so a client that connects and sends
+        // nothing, or trickles its request, gets a few seconds before it is dropped
+        // and the next scrape is accepted
+        SetSocketTimeouts(client, 2000);
+        auto requestDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        // Read the request head; only the request line matters
+        std::string request;
+        char chunk[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 &&
+            std::chrono::steady_clock::now() < requestDeadline) {
+            int received = recv(client, chunk, sizeof(chunk), 0);
+            if (received <= 0) break;
+            request.append(chunk, received);
+        }
+
+        std::shared_ptr<const std::string> body;
+        {
+            std::lock_guard<std::mutex> lock(snapshotMutex);
+            body = snapshot;
+        }
+
+        std::string response;
+        if (request.rfind("GET /metrics", 0) == 0 || request.rfind("GET / ", 0) == 0) {
+            response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(body->size()) + "\r\nConnection: close\r\n\r\n";
+            response += *body;
+        }
+        else {
+            response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            int n = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+            if (n <= 0) break;
+            sent += n;
+        }
+        CloseSocket(client);
+    }
+}
+
+
+//=============================================================================
+// Crash-loop monitor - Watches services for restarts and flags crash loops
+//=============================================================================
+
+/**
+ * Settings for the monitor command
+ */
+struct MonitorOptions {
+    DWORD intervalMs = 5000;        // Time between sweeps
+    DWORD windowSeconds = 600;      // Sliding window for the restart rate
+    DWORD threshold = 3;            // Restarts inside the window that count as a crash loop
+    DWORD durationMs = 0;           // Stop after this long (0 = run until killed)
+    std::wstring historyPath;       // Where the restart history is persisted
+};
+
+/**
+ * Watches services and records start/stop/restart events into their history rings
+ * Each sweep is one EnumServicesStatusEx pass, so cost does not grow with the number
+ * of restarts. A service whose restarts within the window reach the threshold is
+ * flagged as crash looping until its rate drops again. The history file is rewritten
+ * after any sweep that recorded an event.
+ *
+ * @param selected Lowercase names to watch; empty means every service
+ * @param options Interval, window, threshold, duration and history path
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult MonitorServices(const std::set<std::wstring>& selected, const MonitorOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    // Continue from the persisted history so rates carry over between runs
+    std::map<std::wstring, ServiceHistory> histories;
+    LoadRestartHistory(options.historyPath, histories);
+    unsigned long long windowMs = (unsigned long long)options.windowSeconds * 1000;
+
+    std::cout << "Monitoring " << (selected.empty() ? std::string("all services") : std::to_string(selected.size()) + " service(s)")
+        << " every " << options.intervalMs << " ms; crash loop = " << options.threshold
+        << " restarts in " << options.windowSeconds << " s" << std::endl;
+
+    while (true) {
+        ULONGLONG sweepStart = ClockNow();
+        std::vector<ServiceStatusEntry> entries;
+        CommandResult result = EnumerateServices(entries);
+        if (!result.ok()) return result;
+
+        unsigned long long now = WallClockMs();
+        bool recorded = false;
+        for (const auto& entry : entries) {
+            std::wstring key = ToLowerServiceName(entry.serviceName);
+            if (!selected.empty() && !selected.count(key)) continue;
+
+            ServiceHistory& history = histories[key];
+            DWORD state = entry.status.dwCurrentState;
+            DWORD pid = entry.status.dwProcessId;
+            std::string name = WStringToString(entry.serviceName);
+
+            if (history.seen) {
+                // Compare against the previous sweep; the first sweep only establishes a baseline
+                const char* label = nullptr;
+                ServiceEvent event = { now, pid, 0 };
+                if (IsServiceRestart(history.lastPid, history.lastState, pid, state)) {
+                    // Coming up for the first time since the monitor started is not a restart
+                    bool ranBefore = history.lastRunningPid != 0;
+                    event.kind = ranBefore ? ServiceEventRestarted : ServiceEventStarted;
+                    label = ranBefore ? "RESTARTED" : "STARTED";
+                }
+                else if (history.lastState == SERVICE_RUNNING && state == SERVICE_STOPPED) {
+                    event.kind = ServiceEventStopped;
+                    event.pid = history.lastPid;
+                    label = "STOPPED";
+                }
+
+                if (label) {
+                    history.Add(event);
+                    recorded = true;
+                    std::cout << FormatWallClock(now) << "  " << name << "  " << label;
+                    if (event.kind == ServiceEventStopped) {
+                        std::cout << "  pid " << event.pid << ", exit code " << entry.status.dwWin32ExitCode;
+                    }
+                    else {
+                        std::cout << "  pid " << pid;
+                    }
+                    std::cout << std::endl;
+                }
+            }
+            history.seen = true;
+            history.lastPid = pid;
+            history.lastState = state;
+            if (state == SERVICE_RUNNING) history.lastRunningPid = pid;
+
+            // Sliding-window restart rate and crash-loop flag
+            size_t restarts = history.CountSince(ServiceEventRestarted, now - windowMs);
+            bool crashLoop = restarts >= options.threshold;
+            if (crashLoop != history.crashLoop) {
+                history.crashLoop = crashLoop;
+                std::cout << FormatWallClock(now) << "  " << name << "  "
+                    << (crashLoop ? "CRASH LOOP" : "RECOVERED") << "  " << restarts
+                    << (history.SaturatedSince(now - windowMs) ? "+" : "")
+                    << " restart(s) in the last " << options.windowSeconds << " s" << std::endl;
+            }
+        }
+
+        if (recorded && !SaveRestartHistory(options.historyPath, histories)) {
+            std::cerr << "Warning: Could not write history file '" << WStringToString(options.historyPath) << "'" << std::endl;
+        }
+
+        ULONGLONG elapsed = ClockNow() - startTime;
+        if (options.durationMs && elapsed >= options.durationMs) break;
+
+        ULONGLONG sweepMs = ClockNow() - sweepStart;
+        DWORD waitMs = sweepMs >= options.intervalMs ? 0 : options.intervalMs - (DWORD)sweepMs;
+        if (options.durationMs) waitMs = (DWORD)(std::min)((ULONGLONG)waitMs, options.durationMs - elapsed);
+        ClockSleep(waitMs);
+    }
+
+    // Summary of what is still looping
+    unsigned long long now = WallClockMs();
+    for (const auto& entry : histories) {
+        if (entry.second.crashLoop) {
+            std::cout << "Crash looping: " << WStringToString(entry.first) << " ("
+                << entry.second.CountSince(ServiceEventRestarted, now - windowMs) << " restarts in the last "
+                << options.windowSeconds << " s)" << std::endl;
+        }
+    }
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Service resource usage - "top" for services, with process statistics read
+// through a backend (Win32 process APIs, or /proc outside Windows)
+//=============================================================================
+
+/**
+ * Resource usage of one process at one point in time
+ */
+struct ProcessSample {
+    bool ok = false;                    // False if the process could not be read (gone or access denied)
+    ULONGLONG cpuTimeUs = 0;            // User + kernel CPU time
+    ULONGLONG workingSetBytes = 0;
+    DWORD handles = 0;                  // Open handles (file descriptors outside Windows)
+    DWORD threads = 0;
+};
+
+/**
+ * Source of per-process statistics
+ */
+class ProcessStatsBackend {
+public:
+    virtual ~ProcessStatsBackend() {}
+
+    /**
+     * Samples a set of processes
+     *
+     * @param pids The processes to read
+     * @param samples Receives one sample per PID (ok == false for ones that could not be read)
+     */
+    virtual void Sample(const std::set<DWORD>& pids, std::map<DWORD, ProcessSample>& samples) = 0;
+};
+
+#ifdef _WIN32
+/**
+ * Reads process statistics with the Win32 process APIs
+ * Thread counts come from one Toolhelp snapshot per sample rather than one call per process
+ */
+class Win32ProcessStats : public ProcessStatsBackend {
+public:
+    void Sample(const std::set<DWORD>& pids, std::map<DWORD, ProcessSample>& samples) override {
+        std::map<DWORD, DWORD> threadCounts;
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+        if (snapshot != INVALID_HANDLE_VALUE) {
+            PROCESSENTRY32W entry;
+            entry.dwSize = sizeof(entry);
+            for (BOOL more = Process32FirstW(snapshot, &entry); more; more = Process32NextW(snapshot, &entry)) {
+                if (pids.count(entry.th32ProcessID)) threadCounts[entry.th32ProcessID] = entry.cntThreads;
+            }
+            CloseHandle(snapshot);
+        }
+
+        for (DWORD pid : pids) {
+            ProcessSample& sample = samples[pid];
+            HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+            if (!process) continue;
+
+            FILETIME created, exited, kernel, user;
+            PROCESS_MEMORY_COUNTERS memory;
+            memory.cb = sizeof(memory);
+            if (GetProcessTimes(process, &created, &exited, &kernel, &user) &&
+                GetProcessMemoryInfo(process, &memory, sizeof(memory))) {
+                // FILETIME durations are in 100 ns units
+                ULONGLONG kernel100ns = ((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+                ULONGLONG user100ns = ((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime;
+                sample.cpuTimeUs = (kernel100ns + user100ns) / 10;
+                sample.workingSetBytes = memory.WorkingSetSize;
+                GetProcessHandleCount(process, &sample.handles);
+                sample.threads = threadCounts.count(pid) ? threadCounts[pid] : 0;
+                sample.ok = true;
+            }
+            CloseHandle(process);
+        }
+    }
+};
+#else
+/**
+ * Reads process statistics from /proc
+ * Stands in for the Win32 reader when testing outside Windows; the simulated SCM's
+ * snapshot can give services real PIDs with pid=
+ */
+class ProcProcessStats : public ProcessStatsBackend {
+public:
+    void Sample(const std::set<DWORD>& pids, std::map<DWORD, ProcessSample>& samples) override {
+        static const long ticksPerSecond = sysconf(_SC_CLK_TCK);
+        static const long pageSize = sysconf(_SC_PAGESIZE);
+
+        for (DWORD pid : pids) {
+            ProcessSample& sample = samples[pid];
+            std::string base = "/proc/" + std::to_string(pid);
+            FILE* file = fopen((base + "/stat").c_str(), "rb");
+            if (!file) continue;
+            char buffer[1024];
+            size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+            fclose(file);
+            buffer[length] = '\0';
+
+            // The command name is in parentheses and may contain spaces; fields follow the last ')'
+            const char* fields = strrchr(buffer, ')');
+            if (!fields) continue;
+            std::vector<std::string> values;
+            for (const char* p = fields + 1; *p; ) {
+                while (*p == ' ') p++;
+                const char* end = p;
+                while (*end && *end != ' ') end++;
+                if (end > p) values.push_back(std::string(p, end));
+                p = end;
+            }
+            // values[0] is field 3 (state): utime 14, stime 15, num_threads 20, rss 24
+            if (values.size() < 22) continue;
+            ULONGLONG ticks = std::stoull(values[11]) + std::stoull(values[12]);
+            sample.cpuTimeUs = ticks * 1000000ULL / (ULONGLONG)ticksPerSecond;
+            sample.threads = (DWORD)std::stoul(values[17]);
+            sample.workingSetBytes = std::stoull(values[21]) * (ULONGLONG)pageSize;
+
+            DIR* fds = opendir((base + "/fd").c_str());
+            if (fds) {
+                while (struct dirent* entry = readdir(fds)) {
+                    if (entry->d_name[0] != '.') sample.handles++;
+                }
+                closedir(fds);
+            }
+            sample.ok = true;
+        }
+    }
+};
+#endif
+
+/**
+ * Returns the process statistics backend for this platform
+ */
+ProcessStatsBackend& ProcessStats() {
+#ifdef _WIN32
+    static Win32ProcessStats backend;
+#else
+    static ProcProcessStats backend;
+#endif
+    return backend;
+}
+
+/**
+ * Settings for the top command
+ */
+struct TopOptions {
+    DWORD intervalMs = 2000;
+    size_t iterations = 0;          // Refreshes before exiting (0 = until stopped)
+    size_t rows = 20;               // Processes shown in the table (0 = all); JSON always has all
+    std::wstring sortBy = L"cpu";   // cpu, mem, handles, threads or pid
+    bool json = false;              // One JSON object per refresh instead of a table
+};
+
+/**
+ * One process hosting one or more services, with its usage over the last interval
+ */
+struct ServiceProcessRow {
+    DWORD pid = 0;
+    std::vector<std::wstring> services;
+    ProcessSample sample;
+    double cpuPercent = 0;          // Of one CPU over the interval
+};
+
+/**
+ * Shows which service processes use the most CPU, memory, handles and threads
+ * Each refresh is one enumeration (service to PID) plus one sample of the hosting
+ * processes, so services sharing a svchost appear together on one row
+ *
+ * @param patterns Service names or patterns to include; empty means every service
+ * @param options Interval, refresh count, sorting and output format
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ShowServiceTop(const std::vector<std::wstring>& patterns, const TopOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    // Clearing between refreshes only makes sense on a terminal
+    bool clearScreen = false;
+    if (!options.json) {
+#ifdef _WIN32
+        HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode = 0;
+        clearScreen = GetConsoleMode(console, &mode) &&
+            SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#else
+        clearScreen = isatty(STDOUT_FILENO) != 0;
+#endif
+    }
+
+    std::map<DWORD, ProcessSample> previous;
+    ULONGLONG previousTime = 0;
+    for (size_t refresh = 0; options.iterations == 0 || refresh < options.iterations; ) {
+        std::vector<ServiceStatusEntry> entries;
+        CommandResult result = EnumerateServices(entries);
+        if (!result.ok()) return result;
+
+        // Map running services to their processes
+        std::map<DWORD, ServiceProcessRow> rows;
+        size_t serviceCount = 0;
+        for (const auto& entry : entries) {
+            DWORD pid = entry.status.dwProcessId;
+            if (entry.status.dwCurrentState == SERVICE_STOPPED || pid == 0) continue;
+            if (!patterns.empty()) {
+                bool match = false;
+                for (const auto& pattern : patterns) match = match || MatchServicePattern(pattern, entry.serviceName);
+                if (!match) continue;
+            }
+            rows[pid].pid = pid;
+            rows[pid].services.push_back(entry.serviceName);
+            serviceCount++;
+        }
+
+        std::set<DWORD> pids;
+        for (const auto& row : rows) pids.insert(row.first);
+        std::map<DWORD, ProcessSample> samples;
+        ProcessStats().Sample(pids, samples);
+        ULONGLONG now = ClockNow();
+
+        // The first pass only establishes the CPU time baseline
+        if (previousTime == 0) {
+            previous = samples;
+            previousTime = now;
+            ClockSleep((std::min)(options.intervalMs, (DWORD)1000));
+            continue;
+        }
+
+        std::vector<ServiceProcessRow> sorted;
+        ULONGLONG elapsedUs = (now - previousTime) * 1000;
+        for (auto& entry : rows) {
+            ServiceProcessRow& row = entry.second;
+            row.sample = samples[row.pid];
+            auto before = previous.find(row.pid);
+            if (row.sample.ok && before != previous.end() && before->second.ok && elapsedUs &&
+                row.sample.cpuTimeUs >= before->second.cpuTimeUs) {
+                row.cpuPercent = 100.0 * (double)(row.sample.cpuTimeUs - before->second.cpuTimeUs) / (double)elapsedUs;
+            }
+            sorted.push_back(row);
+        }
+        previous = samples;
+        previousTime = now;
+
+        std::sort(sorted.begin(), sorted.end(), [&](const ServiceProcessRow& a, const ServiceProcessRow& b) {
+            if (options.sortBy == L"mem" && a.sample.workingSetBytes != b.sample.workingSetBytes) return a.sample.workingSetBytes > b.sample.workingSetBytes;
+            if (options.sortBy == L"handles" && a.sample.handles != b.sample.handles) return a.sample.handles > b.sample.handles;
+            if (options.sortBy == L"threads" && a.sample.threads != b.sample.threads) return a.sample.threads > b.sample.threads;
+            if (options.sortBy == L"cpu" && a.cpuPercent != b.cpuPercent) return a.cpuPercent > b.cpuPercent;
+            return a.pid < b.pid;
+        });
+
+        std::string out;
+        unsigned long long wallClock = WallClockMs();
+        if (options.json) {
+            out += "{\"time\":\"" + FormatWallClock(wallClock) + "\",\"intervalMs\":" + std::to_string(options.intervalMs) +
+                ",\"processes\":[";
+            for (size_t i = 0; i < sorted.size(); i++) {
+                const ServiceProcessRow& row = sorted[i];
+                char cpu[32];
+                snprintf(cpu, sizeof(cpu), "%.1f", row.cpuPercent);
+                out += i ? ",{" : "{";
+                out += "\"pid\":" + std::to_string(row.pid);
+                if (row.sample.ok) {
+                    out += std::string(",\"cpuPercent\":") + cpu +
+                        ",\"workingSetBytes\":" + std::to_string(row.sample.workingSetBytes) +
+                        ",\"handles\":" + std::to_string(row.sample.handles) +
+                        ",\"threads\":" + std::to_string(row.sample.threads);
+                }
+                out += ",\"services\":[";
+                for (size_t s = 0; s < row.services.size(); s++) {
+                    if (s) out += ",";
+                    AppendJsonString(out, row.services[s]);
+                }
+                out += "]}";
+            }
+            out += "]}\n";
+        }
+        else {
+            if (clearScreen) out += "\x1b[H\x1b[2J";
+            out += "scclone top - " + FormatWallClock(wallClock) + " - " + std::to_string(sorted.size()) + " process(es), " +
+                std::to_string(serviceCount) + " service(s), sorted by " + WStringToString(options.sortBy) + "\n\n";
+            out += "     PID   CPU%    WORKSET  HANDLES  THREADS  SERVICES\n";
+            size_t shown = options.rows ? (std::min)(options.rows, sorted.size()) : sorted.size();
+            for (size_t i = 0; i < shown; i++) {
+                const ServiceProcessRow& row = sorted[i];
+                char line[128];
+                if (row.sample.ok) {
+                    snprintf(line, sizeof(line), "%8lu %6.1f %7.1f MB %8lu %8lu  ", (unsigned long)row.pid, row.cpuPercent,
+                        row.sample.workingSetBytes / (1024.0 * 1024.0), (unsigned long)row.sample.handles, (unsigned long)row.sample.threads);
+                }
+                else {
+                    snprintf(line, sizeof(line), "%8lu %6s %10s %8s %8s  ", (unsigned long)row.pid, "-", "-", "-", "-");
+                }
+                out += line;
+
+                // Shared processes list as many service names as fit, then a count
+                std::string names;
+                size_t listed = 0;
+                for (; listed < row.services.size(); listed++) {
+                    std::string name = WStringToString(row.services[listed]);
+                    if (listed && names.size() + name.size() > 50) break;
+                    names += (listed ? ", " : "") + name;
+                }
+                if (listed < row.services.size()) names += ", +" + std::to_string(row.services.size() - listed);
+                out += names + "\n";
+            }
+            if (shown < sorted.size()) out += "  ... " + std::to_string(sorted.size() - shown) + " more (use /rows)\n";
+        }
+        std::cout << out;
+        std::cout.flush();
+
+        refresh++;
+        if (options.iterations && refresh >= options.iterations) break;
+        ClockSleep(options.intervalMs);
+    }
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Trigger start - Bulk reads and writes of trigger-start configuration, and a
+// report sizing what idle auto-start services would save by starting on a trigger
+//=============================================================================
+
+/**
+ * Start type and triggers of one service
+ */
+struct ServiceTriggerState {
+    CommandResult result;
+    DWORD startType = SERVICE_NO_CHANGE;
+    bool delayedAutoStart = false;
+    std::vector<ServiceTrigger> triggers;
+};
+
+/**
+ * Reads the start type and triggers of one service
+ *
+ * @param scManager Open service control manager handle
+ * @param serviceName The service
+ * @return The state, with the failing stage if it could not be read
+ */
+ServiceTriggerState ReadServiceTriggerState(SC_HANDLE scManager, const std::wstring& serviceName) {
+    ULONGLONG startTime = ClockNow();
+    ServiceTriggerState state;
+
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_QUERY_CONFIG);
+    if (!service) {
+        state.result = CommandFailure(ScmStage::OpenService, startTime);
+        return state;
+    }
+    DWORD bytesNeeded = 0;
+    Scm().QueryServiceConfigW(service, NULL, 0, &bytesNeeded);
+    std::vector<BYTE> buffer(bytesNeeded);
+    LPQUERY_SERVICE_CONFIGW config = (LPQUERY_SERVICE_CONFIGW)buffer.data();
+    if (!bytesNeeded || !Scm().QueryServiceConfigW(service, config, bytesNeeded, &bytesNeeded) ||
+        !ReadServiceTriggers(service, state.triggers)) {
+        state.result = CommandFailure(ScmStage::QueryConfig, startTime);
+        Scm().CloseServiceHandle(service);
+        return state;
+    }
+    state.startType = config->dwStartType;
+    SERVICE_DELAYED_AUTO_START_INFO delayed = { FALSE };
+    if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, (LPBYTE)&delayed, sizeof(delayed), &bytesNeeded)) {
+        state.delayedAutoStart = delayed.fDelayedAutostart != FALSE;
+    }
+    Scm().CloseServiceHandle(service);
+    state.result = CommandSuccess(startTime);
+    return state;
+}
+
+/**
+ * Returns a start type as qtriggerinfo shows it, e.g. "DEMAND (TRIGGER START)"
+ */
+std::string FormatTriggerStartType(const ServiceTriggerState& state) {
+    std::string text = GetServiceStartTypeString(state.startType);
+    if (state.startType == SERVICE_AUTO_START && state.delayedAutoStart) text += " (DELAYED)";
+    if (!state.triggers.empty()) text += " (TRIGGER START)";
+    return text;
+}
+
+/**
+ * Shows the triggers of many services, read in parallel
+ *
+ * @param serviceNames The services
+ * @param listAll Also list services without triggers (otherwise only counted)
+ * @param concurrency Services read at once
+ * @return Result with the error code and failing stage of the first failure, if any
+ */
+CommandResult QueryServiceTriggers(const std::vector<std::wstring>& serviceNames, bool listAll, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    std::vector<ServiceTriggerState> states(serviceNames.size());
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        states[i] = ReadServiceTriggerState(scManager, serviceNames[i]);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    std::string out;
+    CommandResult firstFailure;
+    size_t failed = 0, withTriggers = 0, autoWith = 0, autoWithout = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        const ServiceTriggerState& state = states[i];
+        if (!state.result.ok()) {
+            std::cerr << WStringToString(serviceNames[i]) << ": " << FormatCommandFailure(state.result) << std::endl;
+            if (failed++ == 0) firstFailure = state.result;
+            continue;
+        }
+        bool autoStart = state.startType == SERVICE_AUTO_START;
+        if (!state.triggers.empty()) {
+            withTriggers++;
+            if (autoStart) autoWith++;
+        }
+        else if (autoStart) autoWithout++;
+        if (state.triggers.empty() && !listAll) continue;
+
+        out += "SERVICE_NAME: " + WStringToString(serviceNames[i]) + "\n";
+        out += "START_TYPE  : " + FormatTriggerStartType(state) + "\n";
+        if (state.triggers.empty()) out += "TRIGGERS    : (none)\n";
+        for (const auto& trigger : state.triggers) out += "TRIGGER     : " + FormatServiceTrigger(trigger) + "\n";
+        out += "\n";
+    }
+    if (serviceNames.size() > 1) {
+        size_t read = serviceNames.size() - failed;
+        out += std::to_string(withTriggers) + " of " + std::to_string(read) + " service(s) have triggers (" +
+            std::to_string(autoWith) + " also auto-start); " + std::to_string(autoWithout) +
+            " auto-start service(s) have none\n";
+    }
+    std::cout << out;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Requested trigger change for the triggerinfo command
+ */
+struct TriggerChange {
+    std::vector<ServiceTrigger> triggers;   // Replaces the current list; empty deletes all triggers
+    std::wstring spec;                      // The triggers as given, for the journal
+    DWORD startType = SERVICE_NO_CHANGE;    // Also set this start type (e.g. demand when converting)
+    bool delayedAutoStart = false;
+};
+
+/**
+ * Replaces the triggers of one service, and optionally its start type
+ *
+ * @param scManager Open service control manager handle
+ * @param serviceName The service
+ * @param change The new triggers and start type
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ApplyServiceTriggers(SC_HANDLE scManager, const std::wstring& serviceName, const TriggerChange& change) {
+    ULONGLONG startTime = ClockNow();
+
+    AuditFields request;
+    request.push_back({ "triggers", WStringToString(change.spec) });
+    if (change.startType != SERVICE_NO_CHANGE) {
+        request.push_back({ "start", change.delayedAutoStart ? "delayed-auto" : GetServiceStartTypeString(change.startType) });
+    }
+
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_CHANGE_CONFIG | SERVICE_QUERY_CONFIG);
+    if (!service) {
+        CommandResult failure = CommandFailure(ScmStage::OpenService, startTime);
+        JournalServiceChange("triggers", serviceName, request, AuditFields(), AuditFields(), failure);
+        return failure;
+    }
+    unsigned auditParts = AuditTriggers | (change.startType != SERVICE_NO_CHANGE ? AuditConfig | AuditDelayedAuto : 0);
+    AuditFields before = CaptureServiceAuditState(service, auditParts);
+
+    std::vector<BYTE> buffer(PackServiceTriggers(change.triggers, NULL, 0));
+    PackServiceTriggers(change.triggers, buffer.data(), buffer.size());
+    CommandResult result = CommandSuccess(startTime);
+    SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { change.delayedAutoStart ? TRUE : FALSE };
+    if (!Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_TRIGGER_INFO, buffer.data())) {
+        result = CommandFailure(ScmStage::ChangeConfig2, startTime);
+    }
+    else if (change.startType != SERVICE_NO_CHANGE && !Scm().ChangeServiceConfigW(service, SERVICE_NO_CHANGE,
+        change.startType, SERVICE_NO_CHANGE, NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        result = CommandFailure(ScmStage::ChangeConfig, startTime);
+    }
+    else if (change.startType != SERVICE_NO_CHANGE &&
+        !Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_DELAYED_AUTO_START_INFO, &delayedInfo)) {
+        result = CommandFailure(ScmStage::ChangeConfig2, startTime);
+    }
+    JournalServiceChange("triggers", serviceName, request, before, CaptureServiceAuditState(service, auditParts), result);
+    Scm().CloseServiceHandle(service);
+    return result;
+}
+
+/**
+ * Sets the triggers of many services in parallel
+ *
+ * @param serviceNames The services
+ * @param change The new triggers and start type
+ * @param concurrency Services changed at once
+ * @return Result with the error code and failing stage of the first failure, if any
+ */
+CommandResult SetServiceTriggers(const std::vector<std::wstring>& serviceNames, const TriggerChange& change, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    std::vector<CommandResult> results(serviceNames.size());
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        results[i] = ApplyServiceTriggers(scManager, serviceNames[i], change);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    std::string summary = change.triggers.empty() ? "triggers deleted" : std::to_string(change.triggers.size()) + " trigger(s) set";
+    if (change.startType != SERVICE_NO_CHANGE) {
+        summary += ", start type " + (change.delayedAutoStart ? std::string("DELAYED-AUTO") : GetServiceStartTypeString(change.startType));
+    }
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        std::string name = WStringToString(serviceNames[i]);
+        if (results[i].ok()) {
+            std::cout << name << ": " << summary << std::endl;
+            continue;
+        }
+        std::cerr << name << ": " << FormatCommandFailure(results[i]) << std::endl;
+        if (failed++ == 0) firstFailure = results[i];
+    }
+    if (serviceNames.size() > 1) {
+        std::cout << serviceNames.size() << " service(s): " << (serviceNames.size() - failed) << " changed, "
+            << failed << " failed (" << (ClockNow() - startTime) << " ms)" << std::endl;
+    }
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Settings for trigger-report
+ */
+struct TriggerReportOptions {
+    std::vector<std::wstring> patterns;     // Services to consider (empty = every service)
+    std::wstring latencyPath;               // Optional file of measured start latencies
+    DWORD defaultLatencyMs = 1000;          // Assumed latency for services without a measurement
+    DWORD intervalMs = 5000;                // CPU sampling interval
+    double idleCpuPercent = 1.0;            // Below this a running service counts as idle
+    size_t top = 20;                        // Rows to print (0 = all)
+};
+
+/**
+ * One auto-start service that could move to trigger start
+ */
+struct TriggerCandidate {
+    size_t service = 0;                     // Index into the service list
+    DWORD pid = 0;
+    double cpuPercent = 0;
+    ULONGLONG memoryBytes = 0;              // Working set freed if it stops running while idle
+    bool memoryKnown = false;
+    size_t sharedWith = 0;                  // Other services in the same process
+    std::string note;
+};
+
+/**
+ * Sizes what moving idle auto-start services to demand start with a trigger would save
+ * Candidates are auto-start (or delayed-auto) Win32 services without triggers that
+ * no other boot service depends on and that used less than the idle threshold of CPU
+ * over the sampling interval. Memory is only counted when every service in the
+ * hosting process is a candidate, since a shared svchost keeps running otherwise;
+ * start work and time to ready come from the same boot model as analyze-boot.
+ *
+ * @param options Selection, thresholds and latency sources
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ReportTriggerCandidates(const TriggerReportOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, false);
+    if (!result.ok()) return result;
+
+    std::map<std::wstring, DWORD> measured;
+    if (!options.latencyPath.empty() && !LoadLatencyFile(options.latencyPath, measured)) {
+        std::cerr << "ERROR: Could not read latency file '" << WStringToString(options.latencyPath) << "'" << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_FILE_NOT_FOUND, startTime);
+    }
+    std::vector<BootNode> nodes;
+    BuildBootGraph(services, measured, options.defaultLatencyMs, nodes);
+
+    // Services something else in the boot set needs are started at boot regardless
+    BootSchedule schedule = ComputeBootSchedule(nodes, SIZE_MAX);
+    std::vector<bool> needed(nodes.size(), false);
+    std::set<std::wstring> neededGroups;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!schedule.inBoot[i] && !nodes[i].delayed) continue;
+        for (size_t dep : nodes[i].dependencies) needed[dep] = true;
+        for (const auto& group : nodes[i].groupDependencies) neededGroups.insert(group);
+    }
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    std::vector<ServiceTriggerState> triggers(services.size());
+    ParallelFor(services.size(), DefaultServiceConcurrency(), [&](size_t i) {
+        if (services[i].startType == SERVICE_AUTO_START) triggers[i] = ReadServiceTriggerState(scManager, services[i].serviceName);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    // Pick the candidates and the processes they run in
+    size_t autoCount = 0, alreadyTriggered = 0, neededCount = 0, unreadable = 0;
+    std::vector<TriggerCandidate> candidates;
+    std::map<DWORD, std::vector<size_t>> processServices;
+    for (size_t i = 0; i < services.size(); i++) {
+        const ServiceConfigInfo& info = services[i];
+        bool running = info.status.dwCurrentState != SERVICE_STOPPED && info.status.dwProcessId;
+        if (running) processServices[info.status.dwProcessId].push_back(i);
+        if (info.startType != SERVICE_AUTO_START || !(info.serviceType & SERVICE_WIN32)) continue;
+        if (!options.patterns.empty()) {
+            bool match = false;
+            for (const auto& pattern : options.patterns) match = match || MatchServicePattern(pattern, info.serviceName);
+            if (!match) continue;
+        }
+        autoCount++;
+        if (!triggers[i].result.ok()) unreadable++;
+        else if (!triggers[i].triggers.empty()) alreadyTriggered++;
+        else if (needed[i] || neededGroups.count(nodes[i].group)) neededCount++;
+        else {
+            TriggerCandidate candidate;
+            candidate.service = i;
+            candidate.pid = running ? info.status.dwProcessId : 0;
+            candidates.push_back(candidate);
+        }
+    }
+
+    // Two samples of the candidates' processes give CPU over the interval
+    std::set<DWORD> pids;
+    for (const auto& candidate : candidates) {
+        if (candidate.pid) pids.insert(candidate.pid);
+    }
+    std::map<DWORD, ProcessSample> first, second;
+    ProcessStats().Sample(pids, first);
+    ULONGLONG sampledAt = ClockNow();
+    if (!pids.empty()) ClockSleep(options.intervalMs);
+    ProcessStats().Sample(pids, second);
+    ULONGLONG elapsedUs = (ClockNow() - sampledAt) * 1000;
+    std::map<DWORD, double> processCpu;
+    for (DWORD pid : pids) {
+        const ProcessSample& a = first[pid];
+        const ProcessSample& b = second[pid];
+        processCpu[pid] = a.ok && b.ok && elapsedUs && b.cpuTimeUs >= a.cpuTimeUs
+            ? 100.0 * (double)(b.cpuTimeUs - a.cpuTimeUs) / (double)elapsedUs : 0.0;
+    }
+
+    size_t busy = 0;
+    std::vector<TriggerCandidate> idle;
+    std::set<size_t> idleServices;
+    for (auto& candidate : candidates) {
+        if (candidate.pid) {
+            candidate.cpuPercent = processCpu[candidate.pid];
+            if (candidate.cpuPercent >= options.idleCpuPercent) {
+                busy++;
+                continue;
+            }
+        }
+        idleServices.insert(candidate.service);
+        idle.push_back(candidate);
+    }
+
+    // A process's memory is freed only if every service it hosts is an idle candidate
+    std::set<DWORD> freedProcesses;
+    ULONGLONG freedBytes = 0;
+    size_t memoryUnknown = 0;
+    for (auto& candidate : idle) {
+        if (!candidate.pid) {
+            candidate.memoryKnown = true;
+            candidate.note = "not running now; saves its boot start";
+            continue;
+        }
+        const std::vector<size_t>& hosted = processServices[candidate.pid];
+        candidate.sharedWith = hosted.size() - 1;
+        size_t blocking = 0;
+        for (size_t other : hosted) {
+            if (!idleServices.count(other)) blocking++;
+        }
+        const ProcessSample& sample = second[candidate.pid];
+        if (blocking) {
+            candidate.memoryKnown = true;
+            candidate.note = "shares PID " + std::to_string(candidate.pid) + " with " + std::to_string(blocking) +
+                " service(s) that keep running";
+            continue;
+        }
+        if (!sample.ok) {
+            memoryUnknown++;
+            candidate.note = "process could not be read";
+            continue;
+        }
+        // Split a shared process evenly so the rows add up to the process total
+        candidate.memoryKnown = true;
+        candidate.memoryBytes = sample.workingSetBytes / hosted.size();
+        if (hosted.size() > 1) candidate.note = "shared process, all " + std::to_string(hosted.size()) + " services idle";
+        if (freedProcesses.insert(candidate.pid).second) freedBytes += sample.workingSetBytes;
+    }
+
+    // Boot model with the idle candidates no longer started at boot
+    std::vector<BootNode> moved = nodes;
+    ULONGLONG startWorkMs = 0;
+    for (const auto& candidate : idle) {
+        moved[candidate.service].autoStart = false;
+        moved[candidate.service].delayed = false;
+        startWorkMs += nodes[candidate.service].latencyMs;
+    }
+    BootSchedule after = ComputeBootSchedule(moved, SIZE_MAX);
+
+    std::sort(idle.begin(), idle.end(), [&](const TriggerCandidate& a, const TriggerCandidate& b) {
+        if (a.memoryBytes != b.memoryBytes) return a.memoryBytes > b.memoryBytes;
+        return nodes[a.service].latencyMs > nodes[b.service].latencyMs;
+    });
+
+    char line[256];
+    std::string out;
+    snprintf(line, sizeof(line), "%-28s %-12s %8s %6s %10s %10s  %s\n", "SERVICE", "START", "PID", "CPU%", "WORKSET", "START WORK", "NOTE");
+    out += line;
+    size_t shown = options.top ? (std::min)(options.top, idle.size()) : idle.size();
+    for (size_t r = 0; r < shown; r++) {
+        const TriggerCandidate& candidate = idle[r];
+        const ServiceConfigInfo& info = services[candidate.service];
+        const BootNode& node = nodes[candidate.service];
+        char memory[32], latency[32];
+        if (candidate.memoryKnown) snprintf(memory, sizeof(memory), "%.1f MB", candidate.memoryBytes / (1024.0 * 1024.0));
+        else snprintf(memory, sizeof(memory), "-");
+        snprintf(latency, sizeof(latency), "%lu ms%s", (unsigned long)node.latencyMs, node.latencyMeasured ? "" : "*");
+        snprintf(line, sizeof(line), "%-28s %-12s %8lu %6.1f %10s %10s  %s\n", WStringToString(info.serviceName).c_str(),
+            info.delayedAutoStart ? "DELAYED-AUTO" : "AUTO", (unsigned long)candidate.pid, candidate.cpuPercent,
+            memory, latency, candidate.note.c_str());
+        out += line;
+    }
+    if (shown < idle.size()) out += "  ... " + std::to_string(idle.size() - shown) + " more (use /top)\n";
+    if (idle.empty()) out += "  (no idle auto-start services without triggers)\n";
+
+    out += "\nAuto-start services : " + std::to_string(autoCount) + " (" + std::to_string(alreadyTriggered) +
+        " already trigger-start, " + std::to_string(neededCount) + " needed by other boot services, " +
+        std::to_string(busy) + " busy";
+    if (unreadable) out += ", " + std::to_string(unreadable) + " unreadable";
+    out += ")\n";
+    snprintf(line, sizeof(line), "Idle candidates     : %zu (under %.1f%% CPU over %.1f s)\n", idle.size(),
+        options.idleCpuPercent, options.intervalMs / 1000.0);
+    out += line;
+    snprintf(line, sizeof(line), "Memory freed        : %.1f MB working set in %zu process(es) that would exit",
+        freedBytes / (1024.0 * 1024.0), freedProcesses.size());
+    out += line;
+    out += memoryUnknown ? " (" + std::to_string(memoryUnknown) + " process(es) unreadable)\n" : std::string("\n");
+    out += "Start work removed  : " + std::to_string(startWorkMs) + " ms\n";
+    out += "Time to ready       : " + std::to_string(schedule.makespanMs) + " ms -> " + std::to_string(after.makespanMs) + " ms\n";
+    if (!idle.empty()) {
+        out += "\nConvert with: scclone triggerinfo <service...> start/<event> /start demand\n";
+    }
+    std::cout << out;
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Shutdown - Preshutdown timeouts in bulk, and a dependency-ordered parallel stop
+// of a host's services that shows where shutdown time goes
+//=============================================================================
+
+/**
+ * Preshutdown settings and status of one service
+ */
+struct PreshutdownState {
+    CommandResult result;
+    DWORD timeoutMs = 0;
+    DWORD state = 0;
+    bool accepts = false;               // Running and accepting SERVICE_CONTROL_PRESHUTDOWN
+};
+
+/**
+ * Reads the preshutdown timeout and status of one service
+ *
+ * @param scManager Open service control manager handle
+ * @param serviceName The service
+ * @return The settings, with the failing stage if they could not be read
+ */
+PreshutdownState ReadPreshutdownState(SC_HANDLE scManager, const std::wstring& serviceName) {
+    ULONGLONG startTime = ClockNow();
+    PreshutdownState state;
+
+    SC_HANDLE service = Scm().OpenServiceW(scManager, serviceName.c_str(), SERVICE_QUERY_CONFIG | SERVICE_QUERY_STATUS);
+    if (!service) {
+        state.result = CommandFailure(ScmStage::OpenService, startTime);
+        return state;
+    }
+    SERVICE_PRESHUTDOWN_INFO info = { 0 };
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded = 0;
+    if (!Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_PRESHUTDOWN_INFO, (LPBYTE)&info, sizeof(info), &bytesNeeded)) {
+        state.result = CommandFailure(ScmStage::QueryConfig, startTime);
+    }
+    else if (!Scm().QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+        state.result = CommandFailure(ScmStage::QueryStatus, startTime);
+    }
+    else {
+        state.timeoutMs = info.dwPreshutdownTimeout;
+        state.state = status.dwCurrentState;
+        state.accepts = status.dwCurrentState != SERVICE_STOPPED && (status.dwControlsAccepted & SERVICE_ACCEPT_PRESHUTDOWN);
+        state.result = CommandSuccess(startTime);
+    }
+    Scm().CloseServiceHandle(service);
+    return state;
+}
+
+/**
+ * Shows the preshutdown timeouts of many services, read in parallel
+ * Only services that accept preshutdown can hold up shutdown with it, so they are
+ * flagged and their timeouts added up as the worst case
+ *
+ * @param serviceNames The services
+ * @param listAll Also list services that do not accept preshutdown
+ * @param concurrency Services read at once
+ * @return Result with the error code and failing stage of the first failure, if any
+ */
+CommandResult QueryPreshutdown(const std::vector<std::wstring>& serviceNames, bool listAll, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    std::vector<PreshutdownState> states(serviceNames.size());
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        states[i] = ReadPreshutdownState(scManager, serviceNames[i]);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    std::string out;
+    char line[256];
+    snprintf(line, sizeof(line), "%-32s %-14s %-12s %10s\n", "SERVICE", "STATE", "PRESHUTDOWN", "TIMEOUT");
+    out += line;
+    CommandResult firstFailure;
+    size_t failed = 0, accepting = 0;
+    ULONGLONG worstCaseMs = 0, longestMs = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        const PreshutdownState& state = states[i];
+        if (!state.result.ok()) {
+            std::cerr << WStringToString(serviceNames[i]) << ": " << FormatCommandFailure(state.result) << std::endl;
+            if (failed++ == 0) firstFailure = state.result;
+            continue;
+        }
+        if (state.accepts) {
+            accepting++;
+            worstCaseMs += state.timeoutMs;
+            longestMs = (std::max)(longestMs, (ULONGLONG)state.timeoutMs);
+        }
+        if (!state.accepts && !listAll) continue;
+        snprintf(line, sizeof(line), "%-32s %-14s %-12s %8.1f s\n", WStringToString(serviceNames[i]).c_str(),
+            GetServiceStateString(state.state).c_str(), state.accepts ? "accepted" : "-", state.timeoutMs / 1000.0);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "\n%zu of %zu service(s) accept preshutdown; timeouts add up to %.1f s, longest %.1f s\n",
+        accepting, serviceNames.size() - failed, worstCaseMs / 1000.0, longestMs / 1000.0);
+    out += line;
+    std::cout << out;
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Sets the preshutdown timeout of many services in parallel
+ *
+ * @param serviceNames The services
+ * @param timeoutMs The new timeout
+ * @param concurrency Services changed at once
+ * @return Result with the error code and failing stage of the first failure, if any
+ */
+CommandResult SetPreshutdown(const std::vector<std::wstring>& serviceNames, DWORD timeoutMs, size_t concurrency) {
+    ULONGLONG startTime = ClockNow();
+
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    AuditFields request;
+    request.push_back({ "timeout_ms", std::to_string(timeoutMs) });
+    std::vector<CommandResult> results(serviceNames.size());
+    std::vector<DWORD> previous(serviceNames.size(), 0);
+    ParallelFor(serviceNames.size(), concurrency, [&](size_t i) {
+        ULONGLONG serviceStart = ClockNow();
+        SC_HANDLE service = Scm().OpenServiceW(scManager, serviceNames[i].c_str(), SERVICE_CHANGE_CONFIG | SERVICE_QUERY_CONFIG);
+        if (!service) {
+            results[i] = CommandFailure(ScmStage::OpenService, serviceStart);
+            JournalServiceChange("preshutdown", serviceNames[i], request, AuditFields(), AuditFields(), results[i]);
+            return;
+        }
+        AuditFields before = CaptureServiceAuditState(service, AuditPreshutdown);
+        SERVICE_PRESHUTDOWN_INFO info = { 0 };
+        DWORD bytesNeeded = 0;
+        if (Scm().QueryServiceConfig2W(service, SERVICE_CONFIG_PRESHUTDOWN_INFO, (LPBYTE)&info, sizeof(info), &bytesNeeded)) {
+            previous[i] = info.dwPreshutdownTimeout;
+        }
+        info.dwPreshutdownTimeout = timeoutMs;
+        results[i] = Scm().ChangeServiceConfig2W(service, SERVICE_CONFIG_PRESHUTDOWN_INFO, &info)
+            ? CommandSuccess(serviceStart) : CommandFailure(ScmStage::ChangeConfig2, serviceStart);
+        JournalServiceChange("preshutdown", serviceNames[i], request, before, CaptureServiceAuditState(service, AuditPreshutdown),
+            results[i]);
+        Scm().CloseServiceHandle(service);
+    });
+    Scm().CloseServiceHandle(scManager);
+
+    CommandResult firstFailure;
+    size_t failed = 0;
+    for (size_t i = 0; i < serviceNames.size(); i++) {
+        std::string name = WStringToString(serviceNames[i]);
+        if (results[i].ok()) {
+            std::cout << name << ": preshutdown timeout " << previous[i] << " ms -> " << timeoutMs << " ms" << std::endl;
+            continue;
+        }
+        std::cerr << name << ": " << FormatCommandFailure(results[i]) << std::endl;
+        if (failed++ == 0) firstFailure = results[i];
+    }
+    if (serviceNames.size() > 1) {
+        std::cout << serviceNames.size() << " service(s): " << (serviceNames.size() - failed) << " changed, "
+            << failed << " failed (" << (ClockNow() - startTime) << " ms)" << std::endl;
+    }
+    return failed ? firstFailure : CommandSuccess(startTime);
+}
+
+/**
+ * Settings for shutdown-plan
+ */
+struct ShutdownOptions {
+    std::vector<std::wstring> patterns;     // Services to stop (empty = every running service)
+    std::vector<std::wstring> excluded;     // Services or patterns to keep running
+    DWORD deadlineMs = 20000;               // Per-service stop deadline
+    size_t concurrency = 0;                 // Stops in flight at once (0 = no limit)
+    bool run = false;                       // Actually stop; otherwise only print the plan
+};
+
+/**
+ * One service in the shutdown plan
+ */
+struct ShutdownStep {
+    size_t service = 0;                     // Index into the service list
+    std::vector<size_t> after;              // Steps that must stop first (running dependents)
+    DWORD deadlineMs = 0;
+    size_t level = 0;                       // Longest chain of dependents ahead of it
+    ULONGLONG startMs = 0;                  // Offset from the start of the run
+    ServiceOpOutcome outcome;
+};
+
+/**
+ * Stops running services in dependency order with as many stops in flight as the
+ * graph allows, and reports where the shutdown time went
+ * A service is stopped once every running service that depends on it (directly or
+ * through its load order group) has stopped. Services given with /exclude, services
+ * with critical error control and services that do not accept STOP are kept
+ * running, and so is everything a kept service depends on. Each stop has a deadline:
+ * the /deadline value, or the preshutdown timeout of services that accept
+ * preshutdown if that is longer. A service that misses its deadline or fails to
+ * stop holds back the services it depends on.
+ *
+ * @param options Selection, deadline and concurrency
+ * @return Result with the error code and failing stage of the first failure, if any
+ */
+CommandResult RunShutdownPlan(const ShutdownOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, false);
+    if (!result.ok()) return result;
+
+    auto matches = [](const std::vector<std::wstring>& patterns, const std::wstring& name) {
+        for (const auto& pattern : patterns) {
+            if (MatchServicePattern(pattern, name)) return true;
+        }
+        return false;
+    };
+    std::map<std::wstring, size_t> index;
+    std::map<std::wstring, std::vector<size_t>> groups;
+    for (size_t i = 0; i < services.size(); i++) {
+        index[ToLowerServiceName(services[i].serviceName)] = i;
+        if (!services[i].loadOrderGroup.empty()) groups[ToLowerServiceName(services[i].loadOrderGroup)].push_back(i);
+    }
+
+    // Running services each running service depends on (group dependencies mean every running member)
+    std::vector<bool> running(services.size(), false);
+    for (size_t i = 0; i < services.size(); i++) {
+        running[i] = services[i].status.dwCurrentState != SERVICE_STOPPED && (services[i].serviceType & SERVICE_WIN32);
+    }
+    std::vector<std::vector<size_t>> dependsOn(services.size());
+    for (size_t i = 0; i < services.size(); i++) {
+        if (!running[i]) continue;
+        for (const auto& dep : services[i].dependencies) {
+            if (!dep.empty() && dep[0] == L'+') {
+                auto members = groups.find(ToLowerServiceName(dep.substr(1)));
+                if (members == groups.end()) continue;
+                for (size_t member : members->second) {
+                    if (running[member] && member != i) dependsOn[i].push_back(member);
+                }
+                continue;
+            }
+            auto target = index.find(ToLowerServiceName(dep));
+            if (target != index.end() && running[target->second]) dependsOn[i].push_back(target->second);
+        }
+    }
+
+    // Decide what stays up; whatever a kept service depends on stays up with it
+    enum KeepReason { Stop, Unselected, Excluded, Critical, CannotStop, Needed };
+    std::vector<KeepReason> keep(services.size(), Unselected);
+    std::vector<size_t> neededBy(services.size(), SIZE_MAX);
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < services.size(); i++) {
+        if (!running[i]) continue;
+        const ServiceConfigInfo& info = services[i];
+        if (!options.patterns.empty() && !matches(options.patterns, info.serviceName)) keep[i] = Unselected;
+        else if (matches(options.excluded, info.serviceName)) keep[i] = Excluded;
+        else if (info.errorControl == SERVICE_ERROR_CRITICAL) keep[i] = Critical;
+        else if (!(info.status.dwControlsAccepted & SERVICE_ACCEPT_STOP)) keep[i] = CannotStop;
+        else keep[i] = Stop;
+        if (keep[i] != Stop) stack.push_back(i);
+    }
+    while (!stack.empty()) {
+        size_t i = stack.back();
+        stack.pop_back();
+        for (size_t dep : dependsOn[i]) {
+            if (keep[dep] != Stop) continue;
+            keep[dep] = Needed;
+            neededBy[dep] = i;
+            stack.push_back(dep);
+        }
+    }
+
+    // Read preshutdown timeouts for the deadlines of services that accept it
+    SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    if (!scManager) {
+        return CommandFailure(ScmStage::OpenManager, startTime);
+    }
+    std::vector<ShutdownStep> steps;
+    std::vector<size_t> stepOf(services.size(), SIZE_MAX);
+    for (size_t i = 0; i < services.size(); i++) {
+        if (!running[i] || keep[i] != Stop) continue;
+        stepOf[i] = steps.size();
+        ShutdownStep step;
+        step.service = i;
+        step.deadlineMs = options.deadlineMs;
+        steps.push_back(step);
+    }
+    ParallelFor(steps.size(), DefaultServiceConcurrency(), [&](size_t s) {
+        const ServiceConfigInfo& info = services[steps[s].service];
+        if (!(info.status.dwControlsAccepted & SERVICE_ACCEPT_PRESHUTDOWN)) return;
+        PreshutdownState preshutdown = ReadPreshutdownState(scManager, info.serviceName);
+        if (preshutdown.result.ok()) steps[s].deadlineMs = (std::max)(steps[s].deadlineMs, preshutdown.timeoutMs);
+    });
+
+    // A service stops after everything running that depends on it
+    std::vector<std::vector<size_t>> prerequisites(steps.size());
+    for (size_t i = 0; i < services.size(); i++) {
+        if (stepOf[i] == SIZE_MAX) continue;
+        for (size_t dep : dependsOn[i]) {
+            if (stepOf[dep] != SIZE_MAX) prerequisites[stepOf[dep]].push_back(stepOf[i]);
+        }
+    }
+    for (size_t s = 0; s < steps.size(); s++) steps[s].after = prerequisites[s];
+
+    // Levels: how many dependents must stop, one after another, before each service
+    std::vector<int> mark(steps.size(), 0);
+    std::function<size_t(size_t)> level = [&](size_t s) -> size_t {
+        if (mark[s] == 2) return steps[s].level;
+        if (mark[s] == 1) return 0;     // Dependency cycle; the SCM would refuse these stops anyway
+        mark[s] = 1;
+        size_t deepest = 0;
+        for (size_t before : steps[s].after) deepest = (std::max)(deepest, level(before) + 1);
+        steps[s].level = deepest;
+        mark[s] = 2;
+        return deepest;
+    };
+    size_t levels = 0;
+    for (size_t s = 0; s < steps.size(); s++) levels = (std::max)(levels, level(s) + 1);
+
+    size_t keptCounts[Needed + 1] = { 0 };
+    for (size_t i = 0; i < services.size(); i++) {
+        if (running[i]) keptCounts[keep[i]]++;
+    }
+    std::string kept = std::to_string(keptCounts[Excluded]) + " excluded, " + std::to_string(keptCounts[Critical]) +
+        " critical, " + std::to_string(keptCounts[CannotStop]) + " not accepting stop, " + std::to_string(keptCounts[Needed]) +
+        " needed by those";
+    if (keptCounts[Unselected]) kept += ", " + std::to_string(keptCounts[Unselected]) + " not selected";
+
+    if (!options.run) {
+        Scm().CloseServiceHandle(scManager);
+        std::cout << "Shutdown plan: " << steps.size() << " service(s) in " << (steps.empty() ? 0 : levels)
+            << " level(s); kept running: " << kept << std::endl;
+        for (size_t l = 0; l < levels && !steps.empty(); l++) {
+            std::string names;
+            for (const auto& step : steps) {
+                if (step.level == l) names += (names.empty() ? "" : ", ") + WStringToString(services[step.service].serviceName);
+            }
+            std::cout << "  level " << (l + 1) << ": " << names << std::endl;
+        }
+        for (size_t i = 0; i < services.size(); i++) {
+            if (keep[i] != Needed) continue;
+            std::cout << "  kept: " << WStringToString(services[i].serviceName) << " (needed by "
+                << WStringToString(services[neededBy[i]].serviceName) << ")" << std::endl;
+        }
+        std::cout << "Run with /run to stop them and measure each stop." << std::endl;
+        return CommandSuccess(startTime);
+    }
+
+    // Stop everything, each service as soon as its dependents are down
+    ULONGLONG runStart = ClockNow();
+    size_t concurrency = options.concurrency ? options.concurrency : (std::max)(steps.size(), (size_t)1);
+    std::vector<bool> ran = ParallelForOrdered(prerequisites, concurrency, [&](size_t s) {
+        ShutdownStep& step = steps[s];
+        step.startMs = ClockNow() - runStart;
+        step.outcome = RunServiceOp(scManager, services[step.service].serviceName, ServiceOp::Stop, step.deadlineMs);
+        return step.outcome.result.ok();
+    });
+    ULONGLONG totalMs = ClockNow() - runStart;
+    Scm().CloseServiceHandle(scManager);
+
+    // Which dependent each stop waited on (the one that finished last)
+    std::vector<size_t> gatedBy(steps.size(), SIZE_MAX);
+    for (size_t s = 0; s < steps.size(); s++) {
+        for (size_t before : steps[s].after) {
+            if (!ran[before]) continue;
+            ULONGLONG finished = steps[before].startMs + steps[before].outcome.elapsedMs;
+            if (gatedBy[s] == SIZE_MAX || finished > steps[gatedBy[s]].startMs + steps[gatedBy[s]].outcome.elapsedMs) {
+                gatedBy[s] = before;
+            }
+        }
+    }
+
+    std::vector<size_t> order(steps.size());
+    for (size_t s = 0; s < steps.size(); s++) order[s] = s;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (ran[a] != ran[b]) return ran[a] > ran[b];
+        return steps[a].startMs < steps[b].startMs;
+    });
+
+    std::string out;
+    char line[320];
+    snprintf(line, sizeof(line), "%9s %9s %9s  %-32s %s\n", "START", "STOP", "DEADLINE", "SERVICE", "RESULT");
+    out += line;
+    CommandResult firstFailure;
+    size_t stopped = 0, missed = 0, failed = 0, blocked = 0;
+    ULONGLONG workMs = 0;
+    for (size_t s : order) {
+        const ShutdownStep& step = steps[s];
+        std::string name = WStringToString(services[step.service].serviceName);
+        std::string outcome;
+        if (!ran[s]) {
+            blocked++;
+            outcome = "not stopped: a dependent did not stop";
+            snprintf(line, sizeof(line), "%9s %9s %7.0f s  %-32s %s\n", "-", "-", step.deadlineMs / 1000.0, name.c_str(), outcome.c_str());
+            out += line;
+            continue;
+        }
+        workMs += step.outcome.elapsedMs;
+        if (step.outcome.result.ok()) {
+            stopped++;
+            outcome = "stopped";
+        }
+        else if (step.outcome.result.error == ERROR_SERVICE_REQUEST_TIMEOUT) {
+            missed++;
+            outcome = "missed deadline, still " + GetServiceStateString(step.outcome.state);
+        }
+        else {
+            failed++;
+            outcome = FormatCommandFailure(step.outcome.result);
+        }
+        if (!step.outcome.result.ok() && !firstFailure.error) firstFailure = step.outcome.result;
+        if (gatedBy[s] != SIZE_MAX) outcome += " (after " + WStringToString(services[steps[gatedBy[s]].service].serviceName) + ")";
+        snprintf(line, sizeof(line), "%6llu ms %6llu ms %7.0f s  %-32s %s\n", (unsigned long long)step.startMs,
+            (unsigned long long)step.outcome.elapsedMs, step.deadlineMs / 1000.0, name.c_str(), outcome.c_str());
+        out += line;
+    }
+
+    // The chain of stops that set the total time
+    size_t last = SIZE_MAX;
+    for (size_t s = 0; s < steps.size(); s++) {
+        if (ran[s] && (last == SIZE_MAX || steps[s].startMs + steps[s].outcome.elapsedMs > steps[last].startMs + steps[last].outcome.elapsedMs)) last = s;
+    }
+    std::string path;
+    for (size_t s = last; s != SIZE_MAX; s = gatedBy[s]) {
+        std::string hop = WStringToString(services[steps[s].service].serviceName) + " " + std::to_string(steps[s].outcome.elapsedMs) + " ms";
+        path = path.empty() ? hop : hop + " -> " + path;
+    }
+
+    snprintf(line, sizeof(line), "\nStopped %zu of %zu service(s) in %.1f s (stop time added up %.1f s, parallelism %.2f)\n",
+        stopped, steps.size(), totalMs / 1000.0, workMs / 1000.0, totalMs ? (double)workMs / totalMs : 0.0);
+    out += line;
+    if (missed || failed || blocked) {
+        out += "Missed deadline: " + std::to_string(missed) + ", failed: " + std::to_string(failed) +
+            ", held back by a dependent: " + std::to_string(blocked) + "\n";
+    }
+    out += "Kept running: " + kept + "\n";
+    if (!path.empty()) out += "Critical path: " + path + "\n";
+    std::cout << out;
+    return missed || failed || blocked ? firstFailure : CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Service selectors - /where expressions, compiled once and evaluated a column
+// at a time over a structure-of-arrays copy of the service table
+//=============================================================================
+
+/**
+ * Service properties a selector can test
+ */
+enum class SelectorField {
+    Name, Display, Binpath, Account, Group, Depend,     // Text
+    State, Start, Type, Error, Pid, Accepts              // Numbers and flags
+};
+
+static const struct {
+    const wchar_t* name;
+    SelectorField field;
+    bool needsConfig;       // Only available from QueryServiceConfig, not the enumeration
+} SelectorFields[] = {
+    { L"name", SelectorField::Name, false },
+    { L"display", SelectorField::Display, false },
+    { L"binpath", SelectorField::Binpath, true },
+    { L"obj", SelectorField::Account, true },
+    { L"account", SelectorField::Account, true },
+    { L"group", SelectorField::Group, true },
+    { L"depend", SelectorField::Depend, true },
+    { L"state", SelectorField::State, false },
+    { L"start", SelectorField::Start, true },
+    { L"type", SelectorField::Type, false },
+    { L"error", SelectorField::Error, true },
+    { L"pid", SelectorField::Pid, false },
+    { L"accepts", SelectorField::Accepts, false },
+};
+
+enum class SelectorOp { Equal, NotEqual, Match, NoMatch, Less, LessEqual, Greater, GreaterEqual };
+
+// Start type value for delayed-auto, which the SCM reports as auto plus a flag
+const DWORD SelectorDelayedAuto = 0x10000 | SERVICE_AUTO_START;
+
+/**
+ * One comparison in a selector, with its value already converted for the field
+ */
+struct SelectorTest {
+    SelectorField field = SelectorField::Name;
+    SelectorOp op = SelectorOp::Equal;
+    std::wstring text;      // Lowercased, for text fields
+    DWORD number = 0;       // State, start type, error control, pid, or the flag bits tested
+};
+
+/**
+ * A compiled selector: tests and the and/or/not operators that combine them, in postfix order
+ */
+struct ServiceSelector {
+    enum StepKind { Test, And, Or, Not };
+    struct Step {
+        StepKind kind;
+        size_t test;
+    };
+    std::vector<SelectorTest> tests;
+    std::vector<Step> program;
+    bool needsConfig = false;
+};
+
+/**
+ * The service table as parallel columns, one row per service
+ * Text columns are lowercased once here so tests compare without folding case per row
+ */
+struct ServiceTable {
+    size_t rows = 0;
+    std::vector<std::wstring> names;                    // As enumerated, for output
+    std::vector<std::wstring> name, display, binpath, account, group;
+    std::vector<std::vector<std::wstring>> depend;
+    std::vector<DWORD> state, start, type, error, pid, accepts;
+};
+
+/**
+ * Converts a selector value for a numeric or flag field
+ *
+ * @return false if the value is not valid for the field
+ */
+bool ParseSelectorNumber(SelectorField field, const std::wstring& value, DWORD& number) {
+    std::wstring lower = ToLowerServiceName(value);
+    switch (field) {
+    case SelectorField::State:
+        number = ParseServiceStateName(lower);
+        return number != 0;
+    case SelectorField::Start:
+        if (lower == L"boot") number = SERVICE_BOOT_START;
+        else if (lower == L"system") number = SERVICE_SYSTEM_START;
+        else if (lower == L"auto") number = SERVICE_AUTO_START;
+        else if (lower == L"delayed-auto") number = SelectorDelayedAuto;
+        else if (lower == L"demand") number = SERVICE_DEMAND_START;
+        else if (lower == L"disabled") number = SERVICE_DISABLED;
+        else return false;
+        return true;
+    case SelectorField::Type:
+        if (lower == L"own") number = SERVICE_WIN32_OWN_PROCESS;
+        else if (lower == L"share") number = SERVICE_WIN32_SHARE_PROCESS;
+        else if (lower == L"kernel") number = SERVICE_KERNEL_DRIVER;
+        else if (lower == L"filesys") number = SERVICE_FILE_SYSTEM_DRIVER;
+        else if (lower == L"interactive") number = SERVICE_INTERACTIVE_PROCESS;
+        else return false;
+        return true;
+    case SelectorField::Error:
+        if (lower == L"ignore") number = SERVICE_ERROR_IGNORE;
+        else if (lower == L"normal") number = SERVICE_ERROR_NORMAL;
+        else if (lower == L"severe") number = SERVICE_ERROR_SEVERE;
+        else if (lower == L"critical") number = SERVICE_ERROR_CRITICAL;
+        else return false;
+        return true;
+    case SelectorField::Accepts:
+        if (lower == L"stop") number = SERVICE_ACCEPT_STOP;
+        else if (lower == L"pause") number = SERVICE_ACCEPT_PAUSE_CONTINUE;
+        else if (lower == L"shutdown") number = SERVICE_ACCEPT_SHUTDOWN;
+        else if (lower == L"preshutdown") number = SERVICE_ACCEPT_PRESHUTDOWN;
+        else if (lower == L"paramchange") number = SERVICE_ACCEPT_PARAMCHANGE;
+        else return false;
+        return true;
+    case SelectorField::Pid:
+        try {
+            size_t used = 0;
+            number = (DWORD)std::stoul(lower, &used);
+            return used == lower.size();
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    default:
+        return false;
+    }
+}
+
+/**
+ * Compiles a selector expression such as
+ *   state=stopped and start=auto and binpath~"D:\apps\*"
+ * Comparisons are field, operator, value: = and != compare, ~ and !~ match a
+ * wildcard pattern, and pid also takes < <= > >=. Values may be quoted, with \"
+ * and \\ as escapes. Comparisons combine with and, or, not and parentheses;
+ * and binds tighter than or. Text compares ignore case.
+ *
+ * @param text The expression
+ * @param selector Receives the compiled selector
+ * @param error Receives a description of the first problem
+ * @return true if the expression compiled
+ */
+bool CompileServiceSelector(const std::wstring& text, ServiceSelector& selector, std::string& error) {
+    selector = ServiceSelector();
+    size_t pos = 0;
+    auto skipSpace = [&]() {
+        while (pos < text.size() && iswspace(text[pos])) pos++;
+    };
+    auto keyword = [&](const wchar_t* word) {
+        skipSpace();
+        size_t length = wcslen(word);
+        if (ToLowerServiceName(text.substr(pos, length)) != word) return false;
+        if (pos + length < text.size() && (iswalnum(text[pos + length]) || text[pos + length] == L'_')) return false;
+        pos += length;
+        return true;
+    };
+    auto fail = [&](const std::string& message) {
+        if (error.empty()) error = message + " at position " + std::to_string(pos + 1);
+        return false;
+    };
+
+    std::function<bool()> parseOr;
+    auto parseTest = [&]() -> bool {
+        skipSpace();
+        size_t start = pos;
+        while (pos < text.size() && (iswalnum(text[pos]) || text[pos] == L'_' || text[pos] == L'-')) pos++;
+        std::wstring fieldName = ToLowerServiceName(text.substr(start, pos - start));
+        if (fieldName.empty()) return fail("Expected a field name");
+        SelectorTest test;
+        bool found = false;
+        for (const auto& entry : SelectorFields) {
+            if (fieldName != entry.name) continue;
+            test.field = entry.field;
+            selector.needsConfig = selector.needsConfig || entry.needsConfig;
+            found = true;
+        }
+        if (!found) {
+            pos = start;
+            return fail("Unknown field '" + WStringToString(fieldName) + "'");
+        }
+
+        skipSpace();
+        static const struct { const wchar_t* token; SelectorOp op; } ops[] = {
+            { L"!~", SelectorOp::NoMatch }, { L"!=", SelectorOp::NotEqual }, { L"<=", SelectorOp::LessEqual },
+            { L">=", SelectorOp::GreaterEqual }, { L"=", SelectorOp::Equal }, { L"~", SelectorOp::Match },
+            { L"<", SelectorOp::Less }, { L">", SelectorOp::Greater },
+        };
+        found = false;
+        for (const auto& entry : ops) {
+            if (text.compare(pos, wcslen(entry.token), entry.token) != 0) continue;
+            test.op = entry.op;
+            pos += wcslen(entry.token);
+            found = true;
+            break;
+        }
+        if (!found) return fail("Expected = != ~ !~ < <= > or >= after '" + WStringToString(fieldName) + "'");
+
+        // Value: quoted, or a bare word that may hold balanced parentheses like "*(x86)*"
+        skipSpace();
+        std::wstring value;
+        if (pos < text.size() && text[pos] == L'"') {
+            pos++;
+            while (pos < text.size() && text[pos] != L'"') {
+                if (text[pos] == L'\\' && pos + 1 < text.size() && (text[pos + 1] == L'"' || text[pos + 1] == L'\\')) pos++;
+                value += text[pos++];
+            }
+            if (pos >= text.size()) return fail("Unterminated quoted value");
+            pos++;
+        }
+        else {
+            int depth = 0;
+            while (pos < text.size() && !iswspace(text[pos])) {
+                if (text[pos] == L'(') depth++;
+                else if (text[pos] == L')' && depth-- == 0) break;
+                value += text[pos++];
+            }
+            if (value.empty()) return fail("Expected a value for '" + WStringToString(fieldName) + "'");
+        }
+
+        bool textField = test.field <= SelectorField::Depend;
+        bool ordered = test.op >= SelectorOp::Less;
+        bool matching = test.op == SelectorOp::Match || test.op == SelectorOp::NoMatch;
+        if ((ordered && test.field != SelectorField::Pid) || (matching && !textField)) {
+            return fail("'" + WStringToString(fieldName) + (textField ? "' takes =, !=, ~ and !~"
+                : test.field == SelectorField::Pid ? "' takes =, !=, <, <=, > and >=" : "' takes only = and !="));
+        }
+        if (textField) {
+            test.text = ToLowerServiceName(value);
+        }
+        else if (!ParseSelectorNumber(test.field, value, test.number)) {
+            return fail("Invalid " + WStringToString(fieldName) + " value '" + WStringToString(value) + "'");
+        }
+        selector.program.push_back({ ServiceSelector::Test, selector.tests.size() });
+        selector.tests.push_back(test);
+        return true;
+    };
+    std::function<bool()> parseUnary = [&]() -> bool {
+        if (keyword(L"not")) {
+            if (!parseUnary()) return false;
+            selector.program.push_back({ ServiceSelector::Not, 0 });
+            return true;
+        }
+        skipSpace();
+        if (pos < text.size() && text[pos] == L'(') {
+            pos++;
+            if (!parseOr()) return false;
+            skipSpace();
+            if (pos >= text.size() || text[pos] != L')') return fail("Expected ')'");
+            pos++;
+            return true;
+        }
+        return parseTest();
+    };
+    auto parseAnd = [&]() -> bool {
+        if (!parseUnary()) return false;
+        while (keyword(L"and")) {
+            if (!parseUnary()) return false;
+            selector.program.push_back({ ServiceSelector::And, 0 });
+        }
+        return true;
+    };
+    parseOr = [&]() -> bool {
+        if (!parseAnd()) return false;
+        while (keyword(L"or")) {
+            if (!parseAnd()) return false;
+            selector.program.push_back({ ServiceSelector::Or, 0 });
+        }
+        return true;
+    };
+
+    if (!parseOr()) return false;
+    skipSpace();
+    if (pos < text.size()) return fail("Expected 'and', 'or' or the end of the expression");
+    return true;
+}
+
+/**
+ * Reads the service table into columns
+ *
+ * @param table Receives the table
+ * @param withConfig Also read configurations (binpath, account, start type, ...), one call per service
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult ReadServiceTable(ServiceTable& table, bool withConfig) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    if (withConfig) {
+        CommandResult result = ReadServiceConfigs(services, false);
+        if (!result.ok()) return result;
+    }
+    else {
+        std::vector<ServiceStatusEntry> entries;
+        CommandResult result = EnumerateServices(entries);
+        if (!result.ok()) return result;
+        services.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            services[i].serviceName = entries[i].serviceName;
+            services[i].displayName = entries[i].displayName;
+            services[i].status = entries[i].status;
+            services[i].serviceType = entries[i].status.dwServiceType;
+        }
+    }
+
+    size_t rows = services.size();
+    table = ServiceTable();
+    table.rows = rows;
+    for (auto* column : { &table.names, &table.name, &table.display, &table.binpath, &table.account, &table.group }) {
+        column->resize(rows);
+    }
+    table.depend.resize(rows);
+    for (auto* column : { &table.state, &table.start, &table.type, &table.error, &table.pid, &table.accepts }) {
+        column->resize(rows);
+    }
+    for (size_t i = 0; i < rows; i++) {
+        const ServiceConfigInfo& info = services[i];
+        table.names[i] = info.serviceName;
+        table.name[i] = ToLowerServiceName(info.serviceName);
+        table.display[i] = ToLowerServiceName(info.displayName);
+        table.binpath[i] = ToLowerServiceName(info.binaryPath);
+        table.account[i] = ToLowerServiceName(info.account);
+        table.group[i] = ToLowerServiceName(info.loadOrderGroup);
+        for (const auto& dep : info.dependencies) table.depend[i].push_back(ToLowerServiceName(dep));
+        table.state[i] = info.status.dwCurrentState;
+        table.start[i] = info.delayedAutoStart && info.startType == SERVICE_AUTO_START ? SelectorDelayedAuto : info.startType;
+        table.type[i] = info.serviceType;
+        table.error[i] = info.errorControl;
+        table.pid[i] = info.status.dwProcessId;
+        table.accepts[i] = info.status.dwControlsAccepted;
+    }
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Evaluates one test over every row of the table
+ *
+ * @param table The service table
+ * @param test The test
+ * @param mask Receives 1 for each row that passes, 0 otherwise
+ */
+void EvaluateSelectorTest(const ServiceTable& table, const SelectorTest& test, std::vector<uint8_t>& mask) {
+    size_t rows = table.rows;
+    mask.assign(rows, 0);
+    const std::vector<std::wstring>* textColumn = nullptr;
+    switch (test.field) {
+    case SelectorField::Name: textColumn = &table.name; break;
+    case SelectorField::Display: textColumn = &table.display; break;
+    case SelectorField::Binpath: textColumn = &table.binpath; break;
+    case SelectorField::Account: textColumn = &table.account; break;
+    case SelectorField::Group: textColumn = &table.group; break;
+    default: break;
+    }
+    bool negate = test.op == SelectorOp::NotEqual || test.op == SelectorOp::NoMatch;
+    bool match = test.op == SelectorOp::Match || test.op == SelectorOp::NoMatch;
+
+    if (textColumn) {
+        const std::vector<std::wstring>& column = *textColumn;
+        if (match) {
+            for (size_t i = 0; i < rows; i++) mask[i] = MatchServicePattern(test.text, column[i]) != negate;
+        }
+        else {
+            for (size_t i = 0; i < rows; i++) mask[i] = (column[i] == test.text) != negate;
+        }
+        return;
+    }
+    if (test.field == SelectorField::Depend) {
+        // True if any dependency matches; != and !~ mean none does
+        for (size_t i = 0; i < rows; i++) {
+            bool any = false;
+            for (const auto& dep : table.depend[i]) {
+                any = any || (match ? MatchServicePattern(test.text, dep) : dep == test.text);
+            }
+            mask[i] = any != negate;
+        }
+        return;
+    }
+
+    const DWORD value = test.number;
+    switch (test.field) {
+    case SelectorField::Type:
+    case SelectorField::Accepts: {
+        // Flag fields: = means the flag is set
+        const std::vector<DWORD>& column = test.field == SelectorField::Type ? table.type : table.accepts;
+        for (size_t i = 0; i < rows; i++) mask[i] = ((column[i] & value) != 0) != negate;
+        return;
+    }
+    case SelectorField::Start:
+        // start=auto covers delayed-auto too, as sc.exe shows both as AUTO_START
+        if (value == SERVICE_AUTO_START) {
+            for (size_t i = 0; i < rows; i++) mask[i] = ((table.start[i] & 0xFFFF) == SERVICE_AUTO_START) != negate;
+            return;
+        }
+        for (size_t i = 0; i < rows; i++) mask[i] = (table.start[i] == value) != negate;
+        return;
+    default:
+        break;
+    }
+    const std::vector<DWORD>& column = test.field == SelectorField::State ? table.state
+        : test.field == SelectorField::Error ? table.error : table.pid;
+    switch (test.op) {
+    case SelectorOp::Less: for (size_t i = 0; i < rows; i++) mask[i] = column[i] < value; break;
+    case SelectorOp::LessEqual: for (size_t i = 0; i < rows; i++) mask[i] = column[i] <= value; break;
+    case SelectorOp::Greater: for (size_t i = 0; i < rows; i++) mask[i] = column[i] > value; break;
+    case SelectorOp::GreaterEqual: for (size_t i = 0; i < rows; i++) mask[i] = column[i] >= value; break;
+    default: for (size_t i = 0; i < rows; i++) mask[i] = (column[i] == value) != negate; break;
+    }
+}
+
+/**
+ * Runs a compiled selector over the table
+ *
+ * @param selector The compiled selector
+ * @param table The service table
+ * @return 1 for each row the selector accepts, 0 otherwise
+ */
+std::vector<uint8_t> EvaluateServiceSelector(const ServiceSelector& selector, const ServiceTable& table) {
+    std::vector<std::vector<uint8_t>> stack;
+    for (const auto& step : selector.program) {
+        if (step.kind == ServiceSelector::Test) {
+            stack.emplace_back();
+            EvaluateSelectorTest(table, selector.tests[step.test], stack.back());
+            continue;
+        }
+        std::vector<uint8_t>& top = stack.back();
+        if (step.kind == ServiceSelector::Not) {
+            for (auto& bit : top) bit ^= 1;
+            continue;
+        }
+        std::vector<uint8_t> right = std::move(top);
+        stack.pop_back();
+        std::vector<uint8_t>& left = stack.back();
+        if (step.kind == ServiceSelector::And) {
+            for (size_t i = 0; i < left.size(); i++) left[i] &= right[i];
+        }
+        else {
+            for (size_t i = 0; i < left.size(); i++) left[i] |= right[i];
+        }
+    }
+    return stack.empty() ? std::vector<uint8_t>(table.rows, 1) : stack.back();
+}
+
+/**
+ * Expands service names and patterns, keeping only the services a selector accepts
+ * Unlike ResolveServices, plain names are checked against the table too, so a name
+ * that is not installed or does not pass the selector is left out
+ *
+ * @param selector The compiled selector
+ * @param patterns Names and wildcard patterns to select from (empty = every service)
+ * @param names Receives the selected service names, in enumeration order
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult SelectServices(const ServiceSelector& selector, const std::vector<std::wstring>& patterns, std::vector<std::wstring>& names) {
+    ULONGLONG startTime = ClockNow();
+
+    ServiceTable table;
+    CommandResult result = ReadServiceTable(table, selector.needsConfig);
+    if (!result.ok()) return result;
+
+    std::vector<uint8_t> mask = EvaluateServiceSelector(selector, table);
+    for (size_t i = 0; i < table.rows; i++) {
+        if (!mask[i]) continue;
+        bool listed = patterns.empty();
+        for (const auto& pattern : patterns) {
+            listed = listed || MatchServicePattern(pattern, table.names[i]);
+        }
+        if (listed) names.push_back(table.names[i]);
+    }
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Where each command takes its services, for /where
+ */
+static const struct {
+    const wchar_t* command;
+    int firstService;       // Index in argv of the first service argument
+    bool single;            // Takes one service, so the command runs once per selected service
+} SelectorCommands[] = {
+    { L"query", 2, true }, { L"qdescription", 2, true }, { L"start", 2, true }, { L"config", 2, true },
+    { L"stop", 2, false }, { L"delete", 2, false }, { L"failure", 2, false },
+    { L"qtriggerinfo", 2, false }, { L"triggerinfo", 2, false }, { L"trigger-report", 2, false },
+    { L"qpreshutdown", 2, false }, { L"preshutdown", 2, false }, { L"shutdown-plan", 2, false },
+    { L"pause", 2, false }, { L"continue", 2, false }, { L"interrogate", 2, false }, { L"control", 3, false },
+    { L"metrics", 2, false }, { L"monitor", 2, false }, { L"stress", 2, false }, { L"top", 2, false },
+    { L"verify-binaries", 2, false }, { L"wait", 2, false }, { L"rotate-account", 3, false },
+};
+
+/**
+ * Runs a command on the services picked by its /where selector
+ * The expression runs from /where to the next option and is compiled once. Service
+ * names or patterns given on the command line limit the selection; without them it
+ * covers every service. The command line is then rebuilt with the selected names in
+ * place of the service arguments, and commands that take a single service run once
+ * for each, under a SERVICE_NAME header when more than one service matched.
+ *
+ * @param argc Argument count
+ * @param argv Arguments, with /where at whereIdx
+ * @param whereIdx Index of /where
+ * @param runCommand The command dispatcher (wmain)
+ * @return Exit status of the command, or of the first failing run
+ */
+int RunWithServiceSelector(int argc, wchar_t* argv[], int whereIdx, int (*runCommand)(int, wchar_t**)) {
+    std::wstring command = argv[1];
+    int firstService = 0;
+    bool single = false;
+    for (const auto& entry : SelectorCommands) {
+        if (command != entry.command) continue;
+        firstService = entry.firstService;
+        single = entry.single;
+    }
+    if (!firstService) {
+        std::cerr << "ERROR: " << WStringToString(command) << " does not take services, so /where does not apply." << std::endl;
+        return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+    }
+
+    if (whereIdx < firstService) {
+        std::cerr << "ERROR: Usage: " << WStringToString(command) << " <code> [service...] /where <expression>" << std::endl;
+        return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+    }
+
+    // The expression is everything up to the next option, so it can be given unquoted
+    std::wstring expression;
+    int whereEnd = whereIdx + 1;
+    for (; whereEnd < argc; whereEnd++) {
+        std::wstring arg = argv[whereEnd];
+        if (arg[0] == L'/' && arg.find(L'/', 1) == std::wstring::npos) break;
+        expression += (expression.empty() ? L"" : L" ") + arg;
+    }
+    ServiceSelector selector;
+    std::string error;
+    if (expression.empty()) error = "Expected an expression";
+    if (!error.empty() || !CompileServiceSelector(expression, selector, error)) {
+        std::cerr << "ERROR: Invalid /where selector: " << error << std::endl;
+        std::cerr << "ERROR: Usage: /where <field><op><value> [and|or ...], e.g. /where state=stopped and start=auto" << std::endl;
+        return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+    }
+
+    // Split the positional arguments into service arguments and the rest
+    std::vector<std::wstring> patterns, others;
+    int optionIdx = firstService;
+    for (; optionIdx < argc && optionIdx < whereIdx && argv[optionIdx][0] != L'/'; optionIdx++) {
+        std::wstring value = argv[optionIdx];
+        std::wstring lower = ToLowerServiceName(value);
+        bool service = single ? optionIdx == firstService
+            : command != L"triggerinfo" || (lower != L"delete" && lower.compare(0, 6, L"start/") != 0 && lower.compare(0, 5, L"stop/") != 0);
+        (service ? patterns : others).push_back(value);
+    }
+
+    std::vector<std::wstring> names;
+    CommandResult result = SelectServices(selector, patterns, names);
+    if (!result.ok()) return RenderCommandResult(result);
+    if (names.empty()) {
+        std::cout << "No services match /where " << WStringToString(expression) << std::endl;
+        return 0;
+    }
+
+    // Rebuild the command line around the selected names
+    auto buildArgs = [&](const std::vector<std::wstring>& selected) {
+        std::vector<std::wstring> args(argv, argv + firstService);
+        args.insert(args.end(), selected.begin(), selected.end());
+        args.insert(args.end(), others.begin(), others.end());
+        for (int i = optionIdx; i < argc; i++) {
+            if (i < whereIdx || i >= whereEnd) args.push_back(argv[i]);
+        }
+        return args;
+    };
+    auto run = [&](std::vector<std::wstring> args) {
+        std::vector<wchar_t*> pointers;
+        for (auto& arg : args) pointers.push_back(&arg[0]);
+        pointers.push_back(nullptr);
+        return runCommand((int)args.size(), pointers.data());
+    };
+    if (!single) return run(buildArgs(names));
+
+    // Single-service output does not name the service, so each block gets a header
+    int status = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names.size() > 1) {
+            std::cout << (i ? "\n" : "") << "SERVICE_NAME: " << WStringToString(names[i]) << std::endl;
+        }
+        int exitStatus = run(buildArgs({ names[i] }));
+        if (!status) status = exitStatus;
+    }
+    return status;
+}
+
+//=============================================================================
+// Binary verification - SHA-256 of every service executable, with a cache of
+// unchanged files and a diff against an allowlist
+//=============================================================================
+
+/**
+ * Streaming SHA-256 (FIPS 180-4)
+ */
+struct Sha256 {
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char block[64];
+    size_t used = 0;                // Bytes waiting in block
+    unsigned long long length = 0;  // Total bytes hashed
+
+    void Transform(const unsigned char* data) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) | ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    void Update(const unsigned char* data, size_t size) {
+        length += size;
+        if (used) {
+            size_t take = (std::min)(size, sizeof(block) - used);
+            memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            size -= take;
+            if (used < sizeof(block)) return;
+            Transform(block);
+            used = 0;
+        }
+        for (; size >= 64; data += 64, size -= 64) Transform(data);
+        memcpy(block, data, size);
+        used = size;
+    }
+
+    /**
+     * Finishes the hash
+     *
+     * @return The digest as 64 lowercase hex digits
+     */
+    std::string Final() {
+        unsigned long long bits = length * 8;
+        unsigned char pad = 0x80;
+        Update(&pad, 1);
+        pad = 0;
+        while (used != 56) Update(&pad, 1);
+        unsigned char size[8];
+        for (int i = 0; i < 8; i++) size[i] = (unsigned char)(bits >> (56 - 8 * i));
+        Update(size, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint32_t word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4) hex += digits[(word >> shift) & 0xF];
+        }
+        return hex;
+    }
+};
+
+/**
+ * Expands %NAME% environment references; unknown names are left as they are
+ */
+std::wstring ExpandEnvironmentReferences(const std::wstring& text) {
+    std::wstring out;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t open = text.find(L'%', pos);
+        size_t close = open == std::wstring::npos ? open : text.find(L'%', open + 1);
+        if (close == std::wstring::npos) break;
+        std::wstring value = GetEnvironmentString(text.substr(open + 1, close - open - 1).c_str());
+        out += text.substr(pos, open - pos);
+        if (close > open + 1 && !value.empty()) {
+            out += value;
+            pos = close + 1;
+        }
+        else {
+            out += L'%';
+            pos = open + 1;
+        }
+    }
+    return out + text.substr((std::min)(pos, text.size()));
+}
+
+/**
+ * Reads the size and last write time of a file
+ *
+ * @param path The file
+ * @param size Receives the size in bytes
+ * @param modified Receives the last write time, in the platform's own units
+ * @return false if the file does not exist or is not a regular file
+ */
+bool GetFileStamp(const std::wstring& path, unsigned long long& size, unsigned long long& modified) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) return false;
+    size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    modified = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+#else
+    struct stat info;
+    if (stat(WStringToString(path).c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+    size = (unsigned long long)info.st_size;
+    modified = (unsigned long long)info.st_mtim.tv_sec * 1000000000ull + (unsigned long long)info.st_mtim.tv_nsec;
+    return true;
+#endif
+}
+
+/**
+ * Extracts the executable from a service's binary path
+ * Drops the arguments ("svchost.exe -k netsvcs", "app.exe --service"), resolves the
+ * forms the SCM accepts (quoted paths, \??\ and \SystemRoot\ prefixes, paths relative
+ * to the Windows directory, %variables%, a missing .exe), and for unquoted paths with
+ * spaces takes the first space-separated prefix that exists, as CreateProcess does.
+ *
+ * @param binaryPath The binary path as configured
+ * @return The executable path, or an empty string if there is none
+ */
+std::wstring ExtractServiceExecutable(const std::wstring& binaryPath) {
+    std::wstring path = binaryPath;
+    path.erase(0, path.find_first_not_of(L" \t"));
+    if (path.compare(0, 4, L"\\??\\") == 0) path.erase(0, 4);
+
+    auto resolve = [](std::wstring candidate) {
+        if (ToLowerServiceName(candidate.substr(0, 12)) == L"\\systemroot\\") candidate = L"%SystemRoot%" + candidate.substr(11);
+        else if (candidate.size() > 1 && candidate[0] != L'\\' && candidate[0] != L'/' && candidate[1] != L':'
+            && candidate[0] != L'%' && candidate.find(L'\\') != std::wstring::npos) {
+            candidate = L"%SystemRoot%\\" + candidate;    // system32\drivers\x.sys
+        }
+        return ExpandEnvironmentReferences(candidate);
+    };
+    auto exists = [](const std::wstring& candidate) {
+        unsigned long long size, modified;
+        return GetFileStamp(candidate, size, modified);
+    };
+    auto withExtension = [&](const std::wstring& candidate) {
+        if (!exists(candidate) && exists(candidate + L".exe")) return candidate + L".exe";
+        return candidate;
+    };
+
+    if (!path.empty() && path[0] == L'"') {
+        size_t close = path.find(L'"', 1);
+        return withExtension(resolve(path.substr(1, close == std::wstring::npos ? std::wstring::npos : close - 1)));
+    }
+
+    // Unquoted: the first prefix ending at a space that names a file
+    std::wstring fallback;
+    for (size_t end = path.find(L' '); ; end = path.find(L' ', end + 1)) {
+        std::wstring candidate = resolve(path.substr(0, end));
+        if (exists(candidate)) return candidate;
+        if (exists(candidate + L".exe")) return candidate + L".exe";
+        std::wstring lower = ToLowerServiceName(candidate);
+        if (fallback.empty() && lower.size() > 4 && lower.compare(lower.size() - 4, 4, L".exe") == 0) fallback = candidate;
+        if (end == std::wstring::npos) break;
+    }
+    if (!fallback.empty()) return fallback;
+    return resolve(path.substr(0, path.find(L' ')));
+}
+
+/**
+ * Key for comparing file paths; Windows paths ignore case
+ */
+std::wstring GetPathKey(const std::wstring& path) {
+#ifdef _WIN32
+    return ToLowerServiceName(path);
+#else
+    return path;
+#endif
+}
+
+/**
+ * One file in the hash cache
+ */
+struct HashCacheEntry {
+    unsigned long long size = 0;
+    unsigned long long modified = 0;
+    std::string sha256;
+};
+
+/**
+ * Returns the hash cache path
+ * SCCLONE_HASH_CACHE overrides the default, which is scclone-hashes.txt in the state
+ * directory (%ProgramData% on Windows, ~/.scclone elsewhere). A cache anyone else can
+ * write could vouch for a swapped binary, so it must not live in a shared directory.
+ */
+std::wstring GetHashCachePath() {
+    std::wstring path = GetEnvironmentString(L"SCCLONE_HASH_CACHE");
+    if (!path.empty()) return path;
+#ifdef _WIN32
+    return GetStateDirectory() + L"\\scclone-hashes.txt";
+#else
+    return GetStateDirectory() + L"/scclone-hashes.txt";
+#endif
+}
+
+/**
+ * Reads a whole text file
+ *
+ * @return false if the file could not be opened
+ */
+bool ReadTextFile(const std::wstring& path, std::string& content) {
+    FILE* file = OpenFileW(path, L"rb");
+    if (!file) return false;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) content.append(chunk, read);
+    fclose(file);
+    return true;
+}
+
+/**
+ * Returns true if text is a SHA-256 digest in hex
+ */
+bool IsSha256Hex(const std::string& text) {
+    if (text.size() != 64) return false;
+    for (char c : text) {
+        if (!isxdigit((unsigned char)c)) return false;
+    }
+    return true;
+}
+
+/**
+ * Loads the hash cache: one "size mtime sha256 path" line per file
+ * A missing or damaged file just means an empty cache
+ */
+std::map<std::wstring, HashCacheEntry> LoadHashCache(const std::wstring& path) {
+    std::map<std::wstring, HashCacheEntry> cache;
+    FILE* file = OpenStateFile(path, "rb");
+    if (!file) return cache;
+    std::string content;
+    char chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) content.append(chunk, read);
+    fclose(file);
+    std::istringstream lines(content);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        HashCacheEntry entry;
+        std::string file;
+        if (!(fields >> entry.size >> entry.modified >> entry.sha256) || !IsSha256Hex(entry.sha256)) continue;
+        std::getline(fields >> std::ws, file);
+        if (!file.empty() && file.back() == '\r') file.pop_back();
+        if (!file.empty()) cache[StringToWString(file)] = entry;
+    }
+    return cache;
+}
+
+/**
+ * Writes the hash cache, replacing the old file only once the new one is complete
+ * Like the cache itself, the temporary copy is never opened through a symbolic link
+ *
+ * @return false if the file could not be written
+ */
+bool SaveHashCache(const std::wstring& path, const std::map<std::wstring, HashCacheEntry>& cache) {
+    std::string data = "# scclone hash cache: size mtime sha256 path\n";
+    for (const auto& entry : cache) {
+        data += std::to_string(entry.second.size) + " " + std::to_string(entry.second.modified) + " " + entry.second.sha256 +
+            " " + WStringToString(entry.first) + "\n";
+    }
+    std::wstring tempPath = path + L".tmp";
+#ifndef _WIN32
+    unlink(WStringToString(tempPath).c_str());
+#endif
+    FILE* file = OpenStateFile(tempPath, "wb");
+    if (!file) return false;
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = (fclose(file) == 0) && written;
+    if (!written) return false;
+
+#ifdef _WIN32
+    return MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    return rename(WStringToString(tempPath).c_str(), WStringToString(path).c_str()) == 0;
+#endif
+}
+
+/**
+ * Hashes a file with SHA-256, reading it in large chunks
+ *
+ * @param path The file
+ * @param sha256 Receives the digest in hex
+ * @return ERROR_SUCCESS, or the error that stopped the read
+ */
+DWORD HashFileSha256(const std::wstring& path, std::string& sha256) {
+    FILE* file = OpenFileW(path, L"rb");
+    if (!file) return errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED;
+    setvbuf(file, NULL, _IONBF, 0);
+    std::vector<unsigned char> buffer(1 << 20);
+    Sha256 hash;
+    size_t read;
+    while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0) hash.Update(buffer.data(), read);
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed) return ERROR_INVALID_DATA;
+    sha256 = hash.Final();
+    return ERROR_SUCCESS;
+}
+
+/**
+ * Known-good hashes: sha256sum-style lines "<sha256>  <path>"; a line with only a
+ * hash allows that file at any path
+ */
+struct BinaryAllowlist {
+    std::map<std::wstring, std::set<std::string>> byPath;      // Keyed by GetPathKey
+    std::map<std::wstring, std::wstring> spelling;             // Path as written, by key
+    std::set<std::string> anywhere;
+    size_t entries = 0;
+};
+
+/**
+ * Loads an allowlist
+ *
+ * @param path The allowlist file
+ * @param allowlist Receives the entries
+ * @param error Receives a description of the first bad line
+ * @return false if the file could not be read or has a bad line
+ */
+bool LoadBinaryAllowlist(const std::wstring& path, BinaryAllowlist& allowlist, std::string& error) {
+    std::string content;
+    if (!ReadTextFile(path, content)) {
+        error = "Could not read allowlist '" + WStringToString(path) + "'";
+        return false;
+    }
+    std::istringstream lines(content);
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(lines, line)) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        line.erase(0, line.find_first_not_of(" \t"));
+        if (line.empty() || line[0] == '#') continue;
+        std::string sha256 = line.substr(0, line.find_first_of(" \t"));
+        std::transform(sha256.begin(), sha256.end(), sha256.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+        if (!IsSha256Hex(sha256)) {
+            error = "Allowlist line " + std::to_string(lineNumber) + " does not start with a SHA-256 hash";
+            return false;
+        }
+        std::string file = line.size() > 64 ? line.substr(64) : "";
+        file.erase(0, file.find_first_not_of(" \t"));
+        if (!file.empty() && file[0] == '*') file.erase(0, 1);     // sha256sum binary mode marker
+        if (file.empty()) {
+            allowlist.anywhere.insert(sha256);
+        }
+        else {
+            std::wstring wideFile = StringToWString(file);
+            allowlist.byPath[GetPathKey(wideFile)].insert(sha256);
+            allowlist.spelling[GetPathKey(wideFile)] = wideFile;
+        }
+        allowlist.entries++;
+    }
+    return true;
+}
+
+/**
+ * Settings for verify-binaries
+ */
+struct VerifyOptions {
+    std::vector<std::wstring> patterns;     // Services to check (empty = all)
+    std::wstring allowlistPath;             // Diff against this allowlist
+    std::wstring writeAllowlistPath;        // Write the current hashes as an allowlist
+    std::wstring cachePath;                 // Hash cache file
+    bool useCache = true;                   // false = hash every file again
+    bool listAll = false;                   // List every service, not just problems
+    size_t concurrency = 0;                 // Files hashed at once
+};
+
+/**
+ * Hashes the executable of every selected service and checks it against an allowlist
+ * Each distinct executable is hashed once, in parallel, with streaming reads. Files
+ * whose path, size and last write time match the hash cache are not read again.
+ *
+ * @param options Selection, allowlist, cache and concurrency
+ * @return Result with ERROR_INVALID_DATA if a binary is not on the allowlist or
+ *   ERROR_FILE_NOT_FOUND if one is missing or unreadable
+ */
+CommandResult VerifyServiceBinaries(const VerifyOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    BinaryAllowlist allowlist;
+    std::string error;
+    if (!options.allowlistPath.empty() && !LoadBinaryAllowlist(options.allowlistPath, allowlist, error)) {
+        std::cerr << "ERROR: " << error << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_INVALID_DATA, startTime);
+    }
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, false);
+    if (!result.ok()) return result;
+
+    // Which services, and the distinct executables they run
+    struct BinaryFile {
+        std::wstring path;
+        unsigned long long size = 0;
+        unsigned long long modified = 0;
+        std::string sha256;
+        DWORD error = ERROR_SUCCESS;
+        bool cached = false;
+    };
+    std::vector<size_t> selected;
+    std::vector<size_t> fileOf(services.size(), SIZE_MAX);
+    std::vector<BinaryFile> files;
+    std::map<std::wstring, size_t> fileIndex;
+    for (size_t i = 0; i < services.size(); i++) {
+        bool listed = options.patterns.empty();
+        for (const auto& pattern : options.patterns) listed = listed || MatchServicePattern(pattern, services[i].serviceName);
+        if (!listed) continue;
+        selected.push_back(i);
+        if (services[i].binaryPath.empty()) continue;
+        std::wstring executable = ExtractServiceExecutable(services[i].binaryPath);
+        auto inserted = fileIndex.insert({ GetPathKey(executable), files.size() });
+        if (inserted.second) {
+            files.emplace_back();
+            files.back().path = executable;
+        }
+        fileOf[i] = inserted.first->second;
+    }
+
+    // Hash what the cache does not already vouch for
+    std::wstring cachePath = options.cachePath.empty() ? GetHashCachePath() : options.cachePath;
+    std::map<std::wstring, HashCacheEntry> cache;
+    if (options.useCache) cache = LoadHashCache(cachePath);
+    std::atomic<unsigned long long> bytesHashed(0);
+    auto hashBegin = std::chrono::steady_clock::now();
+    size_t concurrency = options.concurrency ? options.concurrency : (std::max)((size_t)std::thread::hardware_concurrency(), (size_t)2);
+    ParallelFor(files.size(), concurrency, [&](size_t f) {
+        BinaryFile& file = files[f];
+        if (!GetFileStamp(file.path, file.size, file.modified)) {
+            file.error = ERROR_FILE_NOT_FOUND;
+            return;
+        }
+        auto hit = cache.find(file.path);
+        if (hit != cache.end() && hit->second.size == file.size && hit->second.modified == file.modified) {
+            file.sha256 = hit->second.sha256;
+            file.cached = true;
+            return;
+        }
+        file.error = HashFileSha256(file.path, file.sha256);
+        if (file.error == ERROR_SUCCESS) bytesHashed += file.size;
+    });
+    double hashSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - hashBegin).count();
+
+    size_t hashed = 0, fromCache = 0, unreadable = 0;
+    for (const auto& file : files) {
+        if (file.error != ERROR_SUCCESS) {
+            unreadable++;
+            continue;
+        }
+        if (file.cached) fromCache++;
+        else hashed++;
+        cache[file.path] = { file.size, file.modified, file.sha256 };
+    }
+    if (options.useCache && hashed && !SaveHashCache(cachePath, cache)) {
+        std::cerr << "Warning: Could not write the hash cache '" << WStringToString(cachePath) << "'" << std::endl;
+    }
+
+    // Diff against the allowlist
+    enum BinaryStatus { Ok, Modified, Unlisted, Missing, Unreadable, NoPath, Hashed };
+    static const char* const statusNames[] = { "ok", "MODIFIED", "UNLISTED", "MISSING", "UNREADABLE", "NO BINPATH", "hashed" };
+    size_t counts[Hashed + 1] = { 0 };
+    std::set<std::wstring> usedPaths;
+    std::string out;
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %-32s %-16s %s\n", "STATUS", "SERVICE", "SHA256", "PATH");
+    out += line;
+    for (size_t i : selected) {
+        BinaryStatus status = Hashed;
+        const BinaryFile* file = fileOf[i] == SIZE_MAX ? nullptr : &files[fileOf[i]];
+        if (!file) status = NoPath;
+        else if (file->error == ERROR_FILE_NOT_FOUND) status = Missing;
+        else if (file->error != ERROR_SUCCESS) status = Unreadable;
+        else if (!options.allowlistPath.empty()) {
+            auto listed = allowlist.byPath.find(GetPathKey(file->path));
+            if (listed != allowlist.byPath.end()) usedPaths.insert(listed->first);
+            if ((listed != allowlist.byPath.end() && listed->second.count(file->sha256)) || allowlist.anywhere.count(file->sha256)) status = Ok;
+            else status = listed != allowlist.byPath.end() ? Modified : Unlisted;
+        }
+        counts[status]++;
+        bool problem = status != Ok && status != Hashed;
+        if (!problem && !options.listAll && !options.allowlistPath.empty()) continue;
+        std::string path = file ? WStringToString(file->path) : WStringToString(services[i].binaryPath);
+        snprintf(line, sizeof(line), "%-10s %-32s %-16s ", statusNames[status], WStringToString(services[i].serviceName).c_str(),
+            file && !file->sha256.empty() ? file->sha256.substr(0, 16).c_str() : "-");
+        out += line + path + "\n";
+    }
+
+    double megabytes = bytesHashed / 1048576.0;
+    std::string rate;
+    if (hashed) {
+        snprintf(line, sizeof(line), " (%.1f MB at %.0f MB/s)", megabytes, hashSeconds > 0 ? megabytes / hashSeconds : 0.0);
+        rate = line;
+    }
+    snprintf(line, sizeof(line), "\n%zu service(s), %zu distinct binaries: %zu hashed", selected.size(), files.size(), hashed);
+    out += line + rate;
+    snprintf(line, sizeof(line), ", %zu from cache, %zu missing or unreadable\n", fromCache, unreadable);
+    out += line;
+    if (!options.allowlistPath.empty()) {
+        size_t unused = 0;
+        for (const auto& entry : allowlist.byPath) unused += usedPaths.count(entry.first) ? 0 : 1;
+        snprintf(line, sizeof(line), "Allowlist: %zu ok, %zu modified, %zu unlisted, %zu missing, %zu unreadable; %zu listed path(s) not used by these services\n",
+            counts[Ok], counts[Modified], counts[Unlisted], counts[Missing], counts[Unreadable], unused);
+        out += line;
+    }
+    std::cout << out;
+
+    if (!options.writeAllowlistPath.empty()) {
+        std::string data = "# scclone verify-binaries allowlist, " + FormatWallClock(WallClockMs()) + "\n";
+        std::map<std::wstring, const BinaryFile*> sorted;
+        for (const auto& file : files) {
+            if (file.error == ERROR_SUCCESS) sorted[GetPathKey(file.path)] = &file;
+        }
+        for (const auto& entry : sorted) data += entry.second->sha256 + "  " + WStringToString(entry.second->path) + "\n";
+        FILE* file = OpenFileW(options.writeAllowlistPath, L"wb");
+        bool written = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+        if (file) written = (fclose(file) == 0) && written;
+        if (!written) {
+            std::cerr << "ERROR: Could not write allowlist '" << WStringToString(options.writeAllowlistPath) << "'" << std::endl;
+            return CommandFailure(ScmStage::Verify, ERROR_WRITE_FAULT, startTime);
+        }
+        std::cout << "Wrote " << sorted.size() << " hash(es) to " << WStringToString(options.writeAllowlistPath) << std::endl;
+    }
+
+    if (counts[Modified] || counts[Unlisted]) return CommandFailure(ScmStage::Verify, ERROR_INVALID_DATA, startTime);
+    if (counts[Missing] || counts[Unreadable]) return CommandFailure(ScmStage::Verify, ERROR_FILE_NOT_FOUND, startTime);
+    return CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Account rotation - Sets a new password on every service that runs as an account,
+// in parallel, then restarts the ones that were running so they pick it up
+//=============================================================================
+
+/**
+ * Settings for rotate-account
+ */
+struct RotateAccountOptions {
+    std::wstring account;               // Services running as this account are rotated
+    std::wstring newAccount;            // Account to move them to; empty keeps the account
+    std::wstring passwordFile;          // The first line is the new password; empty reads stdin
+    std::vector<std::wstring> patterns; // Only rotate these services; empty for all
+    size_t concurrency = 0;             // Services reconfigured at once (0 for the default)
+    size_t restartConcurrency = 4;      // Services restarted at once
+    DWORD timeoutMs = 30000;            // Allowed for each stop and each start
+    bool restart = true;
+};
+
+/**
+ * Returns an account name in the form used to compare accounts: lowercase, without
+ * the ".\" that stands for the local machine
+ */
+std::wstring NormalizeAccountName(const std::wstring& account) {
+    std::wstring lower = ToLowerServiceName(account);
+    if (lower.compare(0, 2, L".\\") == 0) lower.erase(0, 2);
+    return lower;
+}
+
+/**
+ * Returns true for accounts the SCM manages itself, which have no password to set:
+ * LocalSystem, the NT AUTHORITY service accounts, NT SERVICE virtual accounts and
+ * managed service accounts (names ending in $)
+ */
+bool IsBuiltInServiceAccount(const std::wstring& account) {
+    std::wstring lower = NormalizeAccountName(account);
+    return lower.empty() || lower == L"localsystem" || lower.compare(0, 13, L"nt authority\\") == 0 ||
+        lower.compare(0, 11, L"nt service\\") == 0 || lower.back() == L'$';
+}
+
+/**
+ * Reads the new password from the first line of a file, or from stdin
+ * Typing at a console is not echoed. The password never goes through the command
+ * line, so it does not show up in process listings or shell history.
+ *
+ * @param path File to read; empty for stdin
+ * @param password Receives the password
+ * @param error Receives the reason on failure
+ * @return false if no password could be read
+ */
+bool ReadNewPassword(const std::wstring& path, std::wstring& password, std::string& error) {
+    std::string text;
+    if (!path.empty()) {
+        if (!ReadTextFile(path, text)) {
+            error = "Could not read password file '" + WStringToString(path) + "'";
+            return false;
+        }
+        text.erase((std::min)(text.find('\n'), text.size()));
+    }
+    else {
+#ifdef _WIN32
+        HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+        DWORD mode = 0;
+        bool console = GetConsoleMode(input, &mode) != FALSE;
+        if (console) {
+            std::cerr << "New password: " << std::flush;
+            SetConsoleMode(input, mode & ~ENABLE_ECHO_INPUT);
+        }
+        std::getline(std::cin, text);
+        if (console) {
+            SetConsoleMode(input, mode);
+            std::cerr << std::endl;
+        }
+#else
+        termios mode;
+        bool console = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &mode) == 0;
+        if (console) {
+            std::cerr << "New password: " << std::flush;
+            termios quiet = mode;
+            quiet.c_lflag &= ~ECHO;
+            tcsetattr(STDIN_FILENO, TCSANOW, &quiet);
+        }
+        std::getline(std::cin, text);
+        if (console) {
+            tcsetattr(STDIN_FILENO, TCSANOW, &mode);
+            std::cerr << std::endl;
+        }
+#endif
+    }
+    if (!text.empty() && text.back() == '\r') text.pop_back();
+    password = StringToWString(text);
+    std::fill(text.begin(), text.end(), '\0');
+    if (password.empty()) {
+        error = "The new password is empty";
+        return false;
+    }
     return true;
 }
 
+/**
+ * What happened to one service during a rotation
+ */
+struct RotationOutcome {
+    std::wstring serviceName;
+    std::wstring account;               // As the service spells it
+    std::vector<std::wstring> dependencies; // Lowercase service names
+    DWORD stateBefore = 0;
+    DWORD stateAfter = 0;
+    CommandResult config;               // Setting the account and password
+    bool restarted = false;             // Was running, so a restart was attempted
+    ServiceOpOutcome stop, start;
+};
+
+/**
+ * Sets a new password (and optionally a new account) on every service that runs as
+ * an account, then restarts the services that were running so they log on with it
+ * The configuration changes are made in parallel and journaled like config. Only
+ * services whose change succeeded are restarted, a few at a time, so the account's
+ * services do not all go down at once; services that depend on each other restart
+ * together, in dependency order. A service that was stopped stays stopped; it picks
+ * up the password when it is next started.
+ *
+ * @param options Account, services and limits
+ * @param password The new password
+ * @return Success, or the first failure in service order
+ */
+CommandResult RotateServiceAccount(const RotateAccountOptions& options, const std::wstring& password) {
+    ULONGLONG startTime = ClockNow();
+
+    std::vector<ServiceConfigInfo> services;
+    CommandResult result = ReadServiceConfigs(services, false);
+    if (!result.ok()) return result;
+
+    std::wstring account = NormalizeAccountName(options.account);
+    std::vector<RotationOutcome> outcomes;
+    for (const auto& info : services) {
+        if (info.startType == SERVICE_NO_CHANGE || NormalizeAccountName(info.account) != account) continue;
+        if (!options.patterns.empty() && std::none_of(options.patterns.begin(), options.patterns.end(),
+            [&](const std::wstring& pattern) { return MatchServicePattern(pattern, info.serviceName); })) {
+            continue;
+        }
+        RotationOutcome outcome;
+        outcome.serviceName = info.serviceName;
+        outcome.account = info.account;
+        for (const auto& dep : info.dependencies) {
+            if (!dep.empty() && dep[0] != L'+') outcome.dependencies.push_back(ToLowerServiceName(dep));
+        }
+        outcome.stateBefore = outcome.stateAfter = info.status.dwCurrentState;
+        outcomes.push_back(outcome);
+    }
+    if (outcomes.empty()) {
+        std::cout << "No services run as " << WStringToString(options.account) << std::endl;
+        return CommandSuccess(startTime);
+    }
+
+    // Phase 1: every service gets the new credential at once. Without a new account
+    // each service keeps the account as it spells it (.\svc and svc are the same account)
+    size_t concurrency = options.concurrency ? options.concurrency : DefaultServiceConcurrency();
+    ULONGLONG configStart = ClockNow();
+    ParallelFor(outcomes.size(), concurrency, [&](size_t i) {
+        scclone::ServiceConfigChange change;
+        change.account = options.newAccount.empty() ? outcomes[i].account : options.newAccount;
+        change.password = password;
+        outcomes[i].config = scclone::Configure(outcomes[i].serviceName, change);
+        std::fill(change.password->begin(), change.password->end(), L'\0');
+    });
+    ULONGLONG configMs = ClockNow() - configStart;
+
+    // Phase 2: restart what was running, a few at a time. Services that depend on each
+    // other cannot be stopped independently (the SCM refuses to stop a service with
+    // running dependents), so each such group is restarted as a unit: stopped from the
+    // dependents down and started again from the bottom up.
+    std::vector<size_t> restarts;
+    std::map<std::wstring, size_t> restartIndex;
+    for (size_t i = 0; i < outcomes.size(); i++) {
+        if (options.restart && outcomes[i].config.ok() && outcomes[i].stateBefore == SERVICE_RUNNING) {
+            restartIndex[ToLowerServiceName(outcomes[i].serviceName)] = restarts.size();
+            restarts.push_back(i);
+        }
+    }
+    std::vector<size_t> group(restarts.size()), depth(restarts.size(), 0);
+    for (size_t r = 0; r < restarts.size(); r++) group[r] = r;
+    std::function<size_t(size_t)> findGroup = [&](size_t r) { return group[r] == r ? r : group[r] = findGroup(group[r]); };
+    for (size_t r = 0; r < restarts.size(); r++) {
+        for (const auto& dep : outcomes[restarts[r]].dependencies) {
+            auto it = restartIndex.find(dep);
+            if (it != restartIndex.end()) group[findGroup(r)] = findGroup(it->second);
+        }
+    }
+    // Depth above the group's bottom; the SCM rejects cycles, the pass limit is a guard
+    for (size_t pass = 0; pass < restarts.size(); pass++) {
+        bool changed = false;
+        for (size_t r = 0; r < restarts.size(); r++) {
+            for (const auto& dep : outcomes[restarts[r]].dependencies) {
+                auto it = restartIndex.find(dep);
+                if (it != restartIndex.end() && depth[r] < depth[it->second] + 1) {
+                    depth[r] = depth[it->second] + 1;
+                    changed = true;
+                }
+            }
+        }
+        if (!changed) break;
+    }
+    std::map<size_t, std::vector<size_t>> groups;
+    for (size_t r = 0; r < restarts.size(); r++) groups[findGroup(r)].push_back(r);
+    std::vector<std::vector<size_t>> units;
+    for (auto& entry : groups) {
+        std::stable_sort(entry.second.begin(), entry.second.end(), [&](size_t a, size_t b) { return depth[a] < depth[b]; });
+        units.push_back(entry.second);
+    }
+
+    ULONGLONG restartStart = ClockNow();
+    if (!units.empty()) {
+        SC_HANDLE scManager = Scm().OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+        if (!scManager) {
+            return CommandFailure(ScmStage::OpenManager, startTime);
+        }
+        ParallelFor(units.size(), (std::max)((size_t)1, options.restartConcurrency), [&](size_t u) {
+            const std::vector<size_t>& unit = units[u];
+            for (auto r = unit.rbegin(); r != unit.rend(); ++r) {
+                RotationOutcome& outcome = outcomes[restarts[*r]];
+                outcome.restarted = true;
+                outcome.stop = RunServiceOp(scManager, outcome.serviceName, ServiceOp::Stop, options.timeoutMs);
+                outcome.stateAfter = outcome.stop.state;
+            }
+            // Whatever was stopped is started again, even if part of the group would not stop
+            for (size_t r : unit) {
+                RotationOutcome& outcome = outcomes[restarts[r]];
+                if (!outcome.stop.result.ok()) continue;
+                outcome.start = RunServiceOp(scManager, outcome.serviceName, ServiceOp::Start, options.timeoutMs);
+                outcome.stateAfter = outcome.start.state;
+            }
+        });
+        Scm().CloseServiceHandle(scManager);
+    }
+    ULONGLONG restartMs = ClockNow() - restartStart;
+
+    size_t nameWidth = 12;
+    for (const auto& outcome : outcomes) nameWidth = (std::max)(nameWidth, WStringToString(outcome.serviceName).size());
+    std::string out;
+    char line[512];
+    snprintf(line, sizeof(line), "%-*s  %-16s %-10s %-30s %s\n", (int)nameWidth, "SERVICE", "BEFORE", "CONFIG", "RESTART", "AFTER");
+    out += line;
+    CommandResult firstFailure;
+    size_t configured = 0, restarted = 0, runningBefore = 0, runningAfter = 0;
+    std::vector<std::string> failures;
+    for (const auto& outcome : outcomes) {
+        std::string name = WStringToString(outcome.serviceName);
+        std::string config = outcome.config.ok() ? std::to_string(outcome.config.elapsedMs) + " ms" : "FAILED";
+        std::string restart = "-";
+        const CommandResult* failure = outcome.config.ok() ? NULL : &outcome.config;
+        if (outcome.restarted) {
+            restart = "stop " + (outcome.stop.result.ok() ? std::to_string(outcome.stop.elapsedMs) + " ms" : std::string("FAILED"));
+            if (outcome.stop.result.ok()) {
+                restart += ", start " + (outcome.start.result.ok() ? std::to_string(outcome.start.elapsedMs) + " ms" : std::string("FAILED"));
+            }
+            if (!outcome.stop.result.ok()) failure = &outcome.stop.result;
+            else if (!outcome.start.result.ok()) failure = &outcome.start.result;
+            else restarted++;
+        }
+        else if (outcome.stateBefore == SERVICE_RUNNING && outcome.config.ok()) {
+            restart = "not restarted";
+        }
+        if (outcome.config.ok()) configured++;
+        if (outcome.stateBefore == SERVICE_RUNNING) runningBefore++;
+        if (outcome.stateAfter == SERVICE_RUNNING) runningAfter++;
+        if (failure) {
+            failures.push_back(name + ": " + FormatCommandFailure(*failure));
+            if (!firstFailure.error) firstFailure = *failure;
+        }
+        snprintf(line, sizeof(line), "%-*s  %-16s %-10s %-30s %s\n", (int)nameWidth, name.c_str(),
+            GetServiceStateString(outcome.stateBefore).c_str(), config.c_str(), restart.c_str(),
+            GetServiceStateString(outcome.stateAfter).c_str());
+        out += line;
+    }
+
+    snprintf(line, sizeof(line), "\nReconfigured %zu of %zu service(s) in %.1f s (%zu at a time)\n",
+        configured, outcomes.size(), configMs / 1000.0, (std::min)(concurrency, outcomes.size()));
+    out += line;
+    if (!restarts.empty()) {
+        snprintf(line, sizeof(line), "Restarted %zu of %zu running service(s) in %.1f s (%zu group(s), %zu at a time)\n",
+            restarted, restarts.size(), restartMs / 1000.0, units.size(),
+            (std::min)((std::max)((size_t)1, options.restartConcurrency), units.size()));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "Running before: %zu, after: %zu; total %.1f s\n",
+        runningBefore, runningAfter, (ClockNow() - startTime) / 1000.0);
+    out += line;
+    for (const auto& failure : failures) out += "  " + failure + "\n";
+    std::cout << out;
+    return firstFailure.error ? firstFailure : CommandSuccess(startTime);
+}
+
+//=============================================================================
+// Shared status cache - One refresher process keeps every service's status in a
+// memory-mapped file; readers answer "query /cached" from it without calling the SCM
+//=============================================================================
+
+const char StatusCacheMagic[4] = { 'S', 'C', 'S', 'T' };
+const uint32_t StatusCacheVersion = 2;
+
+/**
+ * Header at the start of the cache file (64 bytes)
+ */
+struct StatusCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t slotCount;                         // Hash table size, a power of two
+    uint32_t refresherPid;                      // Process keeping the table current
+    uint32_t intervalMs;                        // Refresher's sweep interval
+    uint32_t serviceCount;                      // Services present after the last sweep
+    std::atomic<uint64_t> generation;           // Bumped by every sweep
+    std::atomic<uint64_t> refreshedAtMs;        // Wall clock time of the last completed sweep
+    uint8_t reserved[24];
+};
+
+/**
+ * One service in the cache (128 bytes), written under a seqlock: the sequence is
+ * odd while the refresher is writing, and readers retry if it changed under them
+ */
+struct StatusCacheSlot {
+    std::atomic<uint32_t> sequence;
+    uint32_t nameHash;                          // 0 = empty slot
+    uint32_t state;                             // 0 = service no longer exists
+    uint32_t pid;
+    uint32_t startType;
+    uint32_t serviceType;
+    uint64_t generation;                        // Sweep that last changed this slot
+    uint64_t changedAtMs;                       // Wall clock time of that change
+    uint64_t nameCheck;                         // 64-bit hash of the full name, for names too long to store
+    uint32_t nameLength;                        // Characters in the full name
+    char name[76];                              // UTF-8, NUL padded; empty if it did not fit
+};
+
+static_assert(sizeof(StatusCacheHeader) == 64, "status cache header layout");
+static_assert(sizeof(StatusCacheSlot) == 128, "status cache slot layout");
+
+/**
+ * Hashes a service name case-insensitively (FNV-1a over the lowercase name)
+ * Never returns 0, which marks an empty slot
+ */
+uint32_t HashServiceName(const std::wstring& name) {
+    uint32_t hash = 2166136261u;
+    for (wchar_t ch : ToLowerServiceName(name)) {
+        hash = (hash ^ (uint32_t)(ch & 0xFFFF)) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Hashes a service name case-insensitively (64-bit FNV-1a over the lowercase name)
+ * Identifies names too long to be stored in a cache slot
+ */
+uint64_t HashServiceName64(const std::wstring& name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (wchar_t ch : ToLowerServiceName(name)) {
+        hash = (hash ^ (uint64_t)(ch & 0xFFFF)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Returns the status cache file path
+ * SCCLONE_CACHE overrides the default, which is scclone-cache.bin in %ProgramData% on
+ * Windows; elsewhere it is in $XDG_RUNTIME_DIR (memory-backed and private to the
+ * user) when that is set, and in the state directory (~/.scclone) otherwise
+ */
+std::wstring GetStatusCachePath() {
+    std::wstring path = GetEnvironmentString(L"SCCLONE_CACHE");
+    if (!path.empty()) return path;
+#ifdef _WIN32
+    return GetStateDirectory() + L"\\scclone-cache.bin";
+#else
+    std::wstring runtime = GetEnvironmentString(L"XDG_RUNTIME_DIR");
+    return (runtime.empty() ? GetStateDirectory() : runtime) + L"/scclone-cache.bin";
+#endif
+}
+
+/**
+ * A file mapped into memory and shared with every other process that maps it
+ */
+class MappedFile {
+public:
+    ~MappedFile() { Close(); }
+
+    /**
+     * Maps a file, creating it at the given size when writable
+     *
+     * @param path File to map
+     * @param size Size to create or map; 0 maps an existing file at its current size
+     * @param writable Map read/write (creating the file if needed) instead of read-only
+     * @return true if the file is mapped
+     */
+    bool Open(const std::wstring& path, size_t size, bool writable) {
+        Close();
+#ifdef _WIN32
+        file_ = CreateFileW(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, writable ? OPEN_ALWAYS : OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_ == INVALID_HANDLE_VALUE) return false;
+        if (!size) {
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file_, &fileSize) || fileSize.QuadPart == 0) { Close(); return false; }
+            size = (size_t)fileSize.QuadPart;
+        }
+        mapping_ = CreateFileMappingW(file_, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+            (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+        if (!mapping_) { Close(); return false; }
+        data_ = MapViewOfFile(mapping_, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+#else
+        std::string utf8Path = WStringToString(path);
+        // Only a regular file, and never through a symbolic link planted under the name
+        int fd = open(utf8Path.c_str(), (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) { close(fd); return false; }
+        if (!size) size = (size_t)info.st_size;
+        if (!size || (writable && (size_t)info.st_size < size && ftruncate(fd, (off_t)size) != 0)) {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        data_ = data == MAP_FAILED ? nullptr : data;
+#endif
+        if (!data_) { Close(); return false; }
+        size_ = size;
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = NULL;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    void* Data() const { return data_; }
+    size_t Size() const { return size_; }
+
+private:
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = NULL;
+#endif
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/**
+ * Status of one service as read from the cache
+ */
+struct CachedServiceStatus {
+    std::wstring serviceName;                   // Empty if the name did not fit in the slot
+    DWORD state = 0;
+    DWORD pid = 0;
+    DWORD startType = 0;
+    DWORD serviceType = 0;
+    unsigned long long generation = 0;
+    unsigned long long changedAtMs = 0;
+};
+
+/**
+ * The status table inside a mapped cache file
+ * The refresher is the only writer; any number of processes can read concurrently
+ */
+class StatusCache {
+public:
+    /**
+     * Maps an existing cache for reading
+     *
+     * @return ERROR_SUCCESS, ERROR_FILE_NOT_FOUND, or ERROR_INVALID_DATA for a file that is not a cache
+     */
+    DWORD OpenForRead(const std::wstring& path) {
+        if (!file_.Open(path, 0, false)) return ERROR_FILE_NOT_FOUND;
+        return Validate() ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+    }
+
+    /**
+     * Maps the cache for the refresher, creating or reformatting it if its table
+     * size differs; an existing table of the right size is reused so readers that
+     * already have it mapped keep working
+     *
+     * @return ERROR_SUCCESS or ERROR_WRITE_FAULT
+     */
+    DWORD OpenForWrite(const std::wstring& path, uint32_t slotCount, uint32_t intervalMs) {
+        size_t size = sizeof(StatusCacheHeader) + (size_t)slotCount * sizeof(StatusCacheSlot);
+        if (!file_.Open(path, size, true)) return ERROR_WRITE_FAULT;
+        if (!Validate() || Header()->slotCount != slotCount) {
+            memset(file_.Data(), 0, size);
+            memcpy(Header()->magic, StatusCacheMagic, sizeof(StatusCacheMagic));
+            Header()->version = StatusCacheVersion;
+            Header()->slotCount = slotCount;
+        }
+        Header()->refresherPid = (uint32_t)GetCurrentProcessId();
+        Header()->intervalMs = intervalMs;
+        return ERROR_SUCCESS;
+    }
+
+    StatusCacheHeader* Header() const { return (StatusCacheHeader*)file_.Data(); }
+
+    /**
+     * Writes one service's status if it changed since the last sweep
+     *
+     * @param slotIndex Receives the service's slot, for RemoveMissing
+     * @return false if the table is full
+     */
+    bool Update(const std::wstring& serviceName, DWORD state, DWORD pid, DWORD startType, DWORD serviceType,
+        unsigned long long generation, unsigned long long now, uint32_t& slotIndex) {
+        uint32_t hash = HashServiceName(serviceName);
+        std::string name = WStringToString(serviceName);
+        StatusCacheSlot* slot = Find(hash, name, true);
+        if (!slot) return false;
+        slotIndex = (uint32_t)(slot - Slots());
+        bool claimed = slot->nameHash != 0;
+        if (claimed && slot->state == state && slot->pid == pid &&
+            slot->startType == startType && slot->serviceType == serviceType) {
+            return true;
+        }
+
+        // Seqlock write: odd sequence, fields, even sequence. The name is written
+        // only when the slot is claimed; it never changes after that.
+        uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        if (!claimed) {
+            slot->nameCheck = HashServiceName64(serviceName);
+            slot->nameLength = (uint32_t)serviceName.size();
+            memset(slot->name, 0, sizeof(slot->name));
+            if (name.size() < sizeof(slot->name)) memcpy(slot->name, name.data(), name.size());
+            slot->nameHash = hash;
+        }
+        slot->state = state;
+        slot->pid = pid;
+        slot->startType = startType;
+        slot->serviceType = serviceType;
+        slot->generation = generation;
+        slot->changedAtMs = now;
+        slot->sequence.store(sequence + 2, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Reads one service's status
+     *
+     * @return false if the service is not in the cache
+     */
+    bool Lookup(const std::wstring& serviceName, CachedServiceStatus& status) const {
+        const StatusCacheSlot* slot = Find(HashServiceName(serviceName), WStringToString(serviceName), false);
+        return slot && ReadSlot(*slot, status) && status.state != 0;
+    }
+
+    /**
+     * Reads every service in the cache, sorted by name
+     */
+    void ReadAll(std::vector<CachedServiceStatus>& services) const {
+        const StatusCacheSlot* slots = Slots();
+        for (uint32_t i = 0; i < Header()->slotCount; i++) {
+            CachedServiceStatus status;
+            if (ReadSlot(slots[i], status) && status.state != 0) services.push_back(status);
+        }
+        std::sort(services.begin(), services.end(), [](const CachedServiceStatus& a, const CachedServiceStatus& b) {
+            return ToLowerServiceName(a.serviceName) < ToLowerServiceName(b.serviceName);
+        });
+    }
+
+    /**
+     * Marks services that were not seen in the latest sweep as gone
+     *
+     * @param present Indexed by slot; true for the slots Update wrote this sweep
+     */
+    void RemoveMissing(const std::vector<bool>& present, unsigned long long generation, unsigned long long now) {
+        StatusCacheSlot* slots = Slots();
+        for (uint32_t i = 0; i < Header()->slotCount; i++) {
+            StatusCacheSlot& slot = slots[i];
+            if (slot.nameHash == 0 || slot.state == 0 || present[i]) continue;
+            // The slot stays claimed so probing past it still finds later entries
+            uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+            slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.state = 0;
+            slot.pid = 0;
+            slot.generation = generation;
+            slot.changedAtMs = now;
+            slot.sequence.store(sequence + 2, std::memory_order_release);
+        }
+    }
+
+private:
+    bool Validate() const {
+        if (file_.Size() < sizeof(StatusCacheHeader)) return false;
+        const StatusCacheHeader* header = Header();
+        return memcmp(header->magic, StatusCacheMagic, sizeof(StatusCacheMagic)) == 0 &&
+            header->version == StatusCacheVersion && header->slotCount &&
+            (header->slotCount & (header->slotCount - 1)) == 0 &&
+            file_.Size() >= sizeof(StatusCacheHeader) + (size_t)header->slotCount * sizeof(StatusCacheSlot);
+    }
+
+    StatusCacheSlot* Slots() const {
+        return (StatusCacheSlot*)((char*)file_.Data() + sizeof(StatusCacheHeader));
+    }
+
+    /**
+     * Linear probe for a name. Stored names are compared in full; a name too long
+     * to store must match the slot's length and 64-bit hash as well as its probe hash.
+     * Only the refresher claims empty slots, so readers never see a slot move
+     */
+    StatusCacheSlot* Find(uint32_t hash, const std::string& name, bool claim) const {
+        StatusCacheSlot* slots = Slots();
+        uint32_t mask = Header()->slotCount - 1;
+        std::wstring lowerName;
+        for (uint32_t probe = 0; probe <= mask; probe++) {
+            StatusCacheSlot& slot = slots[(hash + probe) & mask];
+            if (slot.nameHash == 0) return claim ? &slot : nullptr;
+            if (slot.nameHash != hash) continue;
+            if (lowerName.empty()) lowerName = ToLowerServiceName(StringToWString(name));
+            if (slot.nameLength != lowerName.size()) continue;
+            if (name.size() >= sizeof(slot.name)) {
+                if (slot.nameCheck == HashServiceName64(lowerName)) return &slot;
+                continue;
+            }
+            std::string slotName(slot.name, strnlen(slot.name, sizeof(slot.name)));
+            if (ToLowerServiceName(StringToWString(slotName)) == lowerName) return &slot;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Seqlock read: copy the slot, and retry if a write started or finished meanwhile
+     */
+    static bool ReadSlot(const StatusCacheSlot& slot, CachedServiceStatus& status) {
+        for (int attempt = 0; attempt < 1000; attempt++) {
+            uint32_t before = slot.sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            StatusCacheSlot copy;
+            memcpy((char*)&copy + sizeof(copy.sequence), (const char*)&slot + sizeof(slot.sequence),
+                sizeof(StatusCacheSlot) - sizeof(slot.sequence));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+
+            if (copy.nameHash == 0) return false;
+            status.serviceName = StringToWString(std::string(copy.name, strnlen(copy.name, sizeof(copy.name))));
+            status.state = copy.state;
+            status.pid = copy.pid;
+            status.startType = copy.startType;
+            status.serviceType = copy.serviceType;
+            status.generation = copy.generation;
+            status.changedAtMs = copy.changedAtMs;
+            return true;
+        }
+        return false;
+    }
+
+    MappedFile file_;
+};
+
+/**
+ * Settings for the cache refresher
+ */
+struct StatusCacheOptions {
+    std::wstring path;                  // Cache file
+    DWORD intervalMs = 1000;            // Time between status sweeps
+    DWORD configIntervalMs = 60000;     // Time between start type re-reads
+    uint32_t slots = 4096;              // Hash table size (rounded up to a power of two)
+    DWORD durationMs = 0;               // Stop after this long (0 = run until killed)
+};
+
+/**
+ * Keeps the status cache current
+ * Each sweep is one EnumServicesStatusEx pass; start types need a config read per
+ * service, so they are re-read only on the config interval or for new services.
+ * Only slots whose values changed are rewritten.
+ *
+ * @param options Path, intervals, table size and duration
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult RefreshStatusCache(const StatusCacheOptions& options) {
+    ULONGLONG startTime = ClockNow();
+
+    uint32_t slotCount = 1;
+    while (slotCount < options.slots) slotCount <<= 1;
+    StatusCache cache;
+    if (cache.OpenForWrite(options.path, slotCount, options.intervalMs) != ERROR_SUCCESS) {
+        std::cerr << "ERROR: Could not map cache file '" << WStringToString(options.path) << "'" << std::endl;
+        return CommandFailure(ScmStage::Arguments, ERROR_WRITE_FAULT, startTime);
+    }
+    std::cout << "Caching service status in '" << WStringToString(options.path) << "' every "
+        << options.intervalMs << " ms (" << slotCount << " slots)" << std::endl;
+
+    std::map<std::wstring, std::pair<DWORD, DWORD>> configs;   // Lowercase name -> start type, service type
+    ULONGLONG configsReadAt = 0;
+    bool warnedFull = false;
+
+    while (true) {
+        ULONGLONG sweepStart = ClockNow();
+        std::vector<ServiceStatusEntry> entries;
+        CommandResult result = EnumerateServices(entries);
+        if (!result.ok()) return result;
+
+        bool needConfigs = configs.empty() || sweepStart - configsReadAt >= options.configIntervalMs;
+        for (const auto& entry : entries) {
+            if (!configs.count(ToLowerServiceName(entry.serviceName))) needConfigs = true;
+        }
+        if (needConfigs) {
+            std::vector<ServiceConfigInfo> infos;
+            if (ReadServiceConfigs(infos, false).ok()) {
+                configs.clear();
+                for (const auto& info : infos) {
+                    configs[ToLowerServiceName(info.serviceName)] = std::make_pair(info.startType, info.serviceType);
+                }
+                configsReadAt = sweepStart;
+            }
+        }
+
+        StatusCacheHeader* header = cache.Header();
+        unsigned long long generation = header->generation.load() + 1;
+        unsigned long long now = WallClockMs();
+        std::vector<bool> present(header->slotCount);
+        size_t stored = 0;
+        for (const auto& entry : entries) {
+            auto config = configs.find(ToLowerServiceName(entry.serviceName));
+            DWORD startType = config != configs.end() ? config->second.first : SERVICE_NO_CHANGE;
+            uint32_t slotIndex = 0;
+            if (!cache.Update(entry.serviceName, entry.status.dwCurrentState, entry.status.dwProcessId, startType,
+                entry.status.dwServiceType, generation, now, slotIndex)) {
+                continue;
+            }
+            present[slotIndex] = true;
+            stored++;
+        }
+        cache.RemoveMissing(present, generation, now);
+        if (stored < entries.size() && !warnedFull) {
+            std::cerr << "Warning: Cache table is full; " << (entries.size() - stored) << " service(s) not cached (use /slots)" << std::endl;
+            warnedFull = true;
+        }
+        header->serviceCount = (uint32_t)stored;
+        header->generation.store(generation, std::memory_order_release);
+        header->refreshedAtMs.store(now, std::memory_order_release);
+
+        ULONGLONG elapsed = ClockNow() - startTime;
+        if (options.durationMs && elapsed >= options.durationMs) break;
+
+        ULONGLONG sweepMs = ClockNow() - sweepStart;
+        DWORD waitMs = sweepMs >= options.intervalMs ? 0 : options.intervalMs - (DWORD)sweepMs;
+        if (options.durationMs) waitMs = (DWORD)(std::min)((ULONGLONG)waitMs, options.durationMs - elapsed);
+        ClockSleep(waitMs);
+    }
+    return CommandSuccess(startTime);
+}
+
+/**
+ * Formats how old the cache is, e.g. "1.2 s old (generation 42)"
+ */
+std::string FormatCacheAge(const StatusCacheHeader* header, unsigned long long now) {
+    unsigned long long refreshedAt = header->refreshedAtMs.load(std::memory_order_acquire);
+    char text[96];
+    snprintf(text, sizeof(text), "%.1f s old (generation %llu)",
+        refreshedAt && now > refreshedAt ? (now - refreshedAt) / 1000.0 : 0.0,
+        (unsigned long long)header->generation.load(std::memory_order_acquire));
+    return text;
+}
+
+/**
+ * Answers a query from the status cache instead of the SCM
+ * With maxAgeMs set and the cache older than that (e.g. the refresher has stopped),
+ * the query falls back to the SCM.
+ *
+ * @param serviceName Service to show, or empty for every cached service
+ * @param path Cache file
+ * @param maxAgeMs Oldest acceptable cache; 0 accepts any age
+ * @return Result with the error code and failing stage, if any
+ */
+CommandResult QueryCachedService(const std::wstring& serviceName, const std::wstring& path, DWORD maxAgeMs) {
+    ULONGLONG startTime = ClockNow();
+
+    StatusCache cache;
+    DWORD error = cache.OpenForRead(path);
+    if (error != ERROR_SUCCESS) {
+        std::cerr << "Warning: No status cache at '" << WStringToString(path) << "' (run 'scclone cache'); querying the SCM" << std::endl;
+        return serviceName.empty() ? QueryAllServices() : QueryService(serviceName);
+    }
+
+    const StatusCacheHeader* header = cache.Header();
+    unsigned long long now = WallClockMs();
+    unsigned long long refreshedAt = header->refreshedAtMs.load(std::memory_order_acquire);
+    if (maxAgeMs && (!refreshedAt || now - refreshedAt > maxAgeMs)) {
+        std::cerr << "Warning: Status cache is " << FormatCacheAge(header, now) << "; querying the SCM" << std::endl;
+        return serviceName.empty() ? QueryAllServices() : QueryService(serviceName);
+    }
+
+    std::string output;
+    if (serviceName.empty()) {
+        std::vector<CachedServiceStatus> services;
+        cache.ReadAll(services);
+        for (const auto& status : services) {
+            output += "SERVICE_NAME: " + WStringToString(status.serviceName) + "\n";
+            output += "TYPE        : " + GetServiceTypeString(status.serviceType) + "\n";
+            output += "STATE       : " + GetServiceStateString(status.state) + "\n";
+            output += "PID         : " + std::to_string(status.pid) + "\n\n";
+        }
+    }
+    else {
+        CachedServiceStatus status;
+        if (!cache.Lookup(serviceName, status)) {
+            return CommandFailure(ScmStage::OpenService, ERROR_SERVICE_DOES_NOT_EXIST, startTime);
+        }
+        output += "TYPE        : " + GetServiceTypeString(status.serviceType) + "\n";
+        output += "START_TYPE  : " + GetServiceStartTypeString(status.startType) + "\n";
+        output += "STATE       : " + GetServiceStateString(status.state) + "\n";
+        output += "PID         : " + std::to_string(status.pid) + "\n";
+        output += "CHANGED     : " + FormatWallClock(status.changedAtMs) + "\n";
+    }
+    output += "CACHED      : " + FormatCacheAge(header, now) + ", refresher pid " + std::to_string(header->refresherPid) + "\n";
+    std::cout << output;
+    std::cout.flush();
+    return CommandSuccess(startTime);
+}
+
 
+#ifndef SCCLONE_LIBRARY
 /**
  * Main entry point for the program
  * Parses command line arguments and dispatches to the appropriate command handler
  *
  * @param argc Number of command line arguments
  * @param argv Array of command line argument strings
- * @return 0 on success, 1 on failure
+ * @return 0 on success, otherwise the exit status for the failure (see GetExitStatusForError)
  */
-int main(int argc, char* argv[]) {
+int wmain(int argc, wchar_t* argv[]) {
+#ifdef _WIN32
+    // Wide strings are converted to UTF-8 on output; make the console expect that
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+
     // Need at least a command
     if (argc < 2) {
         PrintUsage();
-        return 1;
+        return GetExitStatusForError(ERROR_INVALID_PARAMETER);
     }
 
     // Get the command (first argument)
-    std::string command = argv[1];
+    std::wstring command = argv[1];
+
+    // A /where selector picks the services; it is expanded into names before dispatch
+    for (int i = 2; i < argc; i++) {
+        if (ToLowerServiceName(argv[i]) == L"/where") return RunWithServiceSelector(argc, argv, i, wmain);
+    }
 
     // Dispatch to appropriate command handler based on command name
-    if (command == "query") {
-        // Query service status
-        if (argc < 3) {
-            std::cerr << "ERROR: Service name required for query command." << std::endl;
-            return 1;
+    if (command == L"query") {
+        // Query service status (every service when no name is given, like sc.exe)
+        std::wstring serviceName = argc >= 3 && argv[2][0] != L'/' ? argv[2] : L"";
+        auto args = ParseArgs(argc, argv, serviceName.empty() ? 2 : 3);
+        if (args.count(L"cached")) {
+            // Answer from the status cache kept by "scclone cache"
+            DWORD maxAgeMs = 0;
+            try {
+                if (args.count(L"max-age")) maxAgeMs = (DWORD)(std::stod(args.at(L"max-age")) * 1000);
+            }
+            catch (const std::exception&) {
+                std::cerr << "ERROR: Invalid max-age value." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            std::wstring path = args.count(L"file") ? args.at(L"file") : GetStatusCachePath();
+            return RenderCommandResult(QueryCachedService(serviceName, path, maxAgeMs));
         }
-        return QueryService(argv[2]) ? 0 : 1;
+        if (serviceName.empty()) {
+            return RenderCommandResult(QueryAllServices());
+        }
+        return RenderCommandResult(QueryService(serviceName));
     }
-    else if (command == "create") {
-        // Create a new service
+    else if (command == L"create") {
+        // Create a new service, or a batch of them from a template
         auto args = ParseArgs(argc, argv, 2);
-        return CreateService(args) ? 0 : 1;
+        if (args.count(L"template")) {
+            size_t count = 0;
+            size_t first = 1;
+            size_t concurrency = DefaultServiceConcurrency();
+            try {
+                count = (size_t)std::stoul(args.at(L"template"));
+                if (args.count(L"first")) first = (size_t)std::stoul(args.at(L"first"));
+                if (args.count(L"parallel")) concurrency = (size_t)(std::max)(1, std::stoi(args.at(L"parallel")));
+            }
+            catch (const std::exception&) {
+                count = 0;
+            }
+            if (count == 0) {
+                std::cerr << "ERROR: Usage: create /template <count> /servicename <name{i}> /binpath <path> "
+                    "[/first <index>] [/parallel N] [other create options]" << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            return RenderCommandResult(CreateServicesFromTemplate(args, count, first, concurrency));
+        }
+        return RenderCommandResult(CreateService(args));
     }
-    else if (command == "qdescription") {
+    else if (command == L"qdescription") {
         // Query service description
         if (argc < 3) {
             std::cerr << "ERROR: Service name required for qdescription command." << std::endl;
-            return 1;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
         }
-        return QueryServiceDescription(argv[2]) ? 0 : 1;
+        return RenderCommandResult(QueryServiceDescription(argv[2]));
     }
-    else if (command == "start") {
+    else if (command == L"start") {
         // Start a service
         if (argc < 3) {
             std::cerr << "ERROR: Service name required for start command." << std::endl;
-            return 1;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+
+        // Everything up to the first /option is passed to the service as an argument
+        std::vector<std::wstring> serviceArgs;
+        int optionIdx = 3;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            serviceArgs.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        scclone::StartOptions options;
+        options.arguments = serviceArgs;
+        ReadinessProbe probe;
+        if (args.count(L"probe") && !ParseReadinessProbe(args.at(L"probe"), probe)) {
+            std::cerr << "ERROR: Invalid probe '" << WStringToString(args.at(L"probe"))
+                << "'. Use tcp:<port>, file:<path> or pipe:<name>." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (args.count(L"probe")) options.probe = args.at(L"probe");
+
+        if (args.count(L"timeout")) {
+            // Seconds are stored as milliseconds in a DWORD, so anything larger would wrap
+            const std::wstring& text = args.at(L"timeout");
+            unsigned long long seconds = 0;
+            size_t used = 0;
+            try {
+                if (text.empty() || !iswdigit(text[0])) throw std::invalid_argument("timeout");
+                seconds = std::stoull(text, &used);
+            }
+            catch (const std::exception&) {
+                used = 0;
+            }
+            if (used != text.size() || seconds > 0xFFFFFFFFull / 1000) {
+                std::cerr << "ERROR: Invalid timeout '" << WStringToString(text)
+                    << "'. Use whole seconds from 0 to " << 0xFFFFFFFFull / 1000 << "." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            options.timeoutMs = static_cast<DWORD>(seconds * 1000);
         }
-        return StartService(argv[2]) ? 0 : 1;
+        return RenderCommandResult(StartService(argv[2], options));
     }
-    else if (command == "stop") {
-        // Stop a service
-        if (argc < 3) {
+    else if (command == L"stop") {
+        // Stop a service, or several services / patterns at once
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        if (patterns.empty()) {
             std::cerr << "ERROR: Service name required for stop command." << std::endl;
-            return 1;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        DWORD timeoutMs = 30000;
+        try {
+            if (args.count(L"timeout")) timeoutMs = (DWORD)(std::stod(args.at(L"timeout")) * 1000);
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Invalid timeout value." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (patterns.size() == 1 && !IsServicePattern(patterns[0])) {
+            return RenderCommandResult(StopService(patterns[0], timeoutMs));
         }
-        return StopService(argv[2]) ? 0 : 1;
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(StopServices(serviceNames, timeoutMs));
     }
-    else if (command == "delete") {
-        // Delete a service
-        if (argc < 3) {
+    else if (command == L"wait") {
+        // Wait for services to reach target states: name[=state] or pattern[=state]
+        std::vector<std::pair<std::wstring, DWORD>> specs;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            std::wstring spec = argv[optionIdx];
+            DWORD state = 0;
+            size_t eq = spec.rfind(L'=');
+            if (eq != std::wstring::npos && eq > 0) {
+                state = ParseServiceStateName(spec.substr(eq + 1));
+                if (!state) {
+                    std::cerr << "ERROR: Unknown state in '" << WStringToString(spec) << "'." << std::endl;
+                    return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+                }
+                spec.resize(eq);
+            }
+            specs.emplace_back(spec, state);
+            optionIdx++;
+        }
+        if (specs.empty()) {
+            std::cerr << "ERROR: Usage: wait <service[=state]...> [/state <state>] [/timeout <sec>]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        DWORD defaultState = SERVICE_RUNNING;
+        if (args.count(L"state")) {
+            defaultState = ParseServiceStateName(args.at(L"state"));
+            if (!defaultState) {
+                std::cerr << "ERROR: Unknown /state value." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+        }
+        DWORD timeoutMs = 30000;
+        try {
+            if (args.count(L"timeout")) timeoutMs = (DWORD)(std::stod(args.at(L"timeout")) * 1000);
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Invalid timeout value." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+
+        // Patterns are expanded one spec at a time so each keeps its state; the first
+        // spec that names a service decides its target
+        std::vector<scclone::WaitTarget> targets;
+        std::set<std::wstring> seen;
+        for (const auto& spec : specs) {
+            std::vector<std::wstring> names;
+            if (IsServicePattern(spec.first)) {
+                CommandResult resolved = ResolveServices({ spec.first }, names);
+                if (!resolved.ok()) return RenderCommandResult(resolved);
+            }
+            else {
+                names.push_back(spec.first);
+            }
+            for (const auto& name : names) {
+                if (!seen.insert(ToLowerServiceName(name)).second) continue;
+                scclone::WaitTarget target;
+                target.serviceName = name;
+                target.state = (scclone::State)(spec.second ? spec.second : defaultState);
+                targets.push_back(target);
+            }
+        }
+        return RenderCommandResult(WaitForServices(targets, timeoutMs));
+    }
+    else if (command == L"delete") {
+        // Delete a service, or several services / patterns at once
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        if (patterns.empty()) {
             std::cerr << "ERROR: Service name required for delete command." << std::endl;
-            return 1;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (patterns.size() == 1 && !IsServicePattern(patterns[0])) {
+            return RenderCommandResult(DeleteService(patterns[0]));
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        size_t concurrency = DefaultServiceConcurrency();
+        if (args.count(L"parallel")) {
+            try {
+                concurrency = (size_t)(std::max)(1, std::stoi(args.at(L"parallel")));
+            }
+            catch (const std::exception&) {
+                std::cerr << "ERROR: Invalid /parallel value." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
         }
-        return DeleteService(argv[2]) ? 0 : 1;
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(DeleteServices(serviceNames, concurrency));
     }
-    else if (command == "config") {
+    else if (command == L"config") {
         // Configure a service
         if (argc < 3) {
             std::cerr << "ERROR: Service name required for config command." << std::endl;
-            return 1;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
         }
         auto args = ParseArgs(argc, argv, 3);
-        return ConfigService(argv[2], args) ? 0 : 1;
+        return RenderCommandResult(ConfigService(argv[2], args));
+    }
+    else if (command == L"failure") {
+        // Set service failure actions: positional names or wildcard patterns select services
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        if (patterns.empty()) {
+            std::cerr << "ERROR: Service name or pattern required for failure command." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        scclone::FailureSettings settings;
+        std::string error;
+        if (!ParseFailureSettings(args, settings, error)) {
+            std::cerr << "ERROR: " << error << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        size_t concurrency = DefaultServiceConcurrency();
+        if (args.count(L"parallel")) {
+            try {
+                concurrency = (std::max)(1, std::stoi(args.at(L"parallel")));
+            }
+            catch (const std::exception&) {
+                std::cerr << "ERROR: Invalid /parallel value." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+        }
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(SetServiceFailureActions(serviceNames, settings, concurrency));
+    }
+    else if (command == L"qtriggerinfo") {
+        // Show trigger-start configuration: names or patterns, or every service with triggers
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        // Services named outright are always listed; pattern matches only if they have triggers
+        bool listAll = args.count(L"all") > 0 || !patterns.empty();
+        for (const auto& pattern : patterns) listAll = listAll && (args.count(L"all") || !IsServicePattern(pattern));
+        if (patterns.empty()) patterns.push_back(L"*");
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(QueryServiceTriggers(serviceNames, listAll, DefaultServiceConcurrency()));
+    }
+    else if (command == L"triggerinfo") {
+        // Set triggers: services or patterns, then start/<event> and stop/<event> triggers (or "delete")
+        std::vector<std::wstring> patterns;
+        TriggerChange change;
+        bool deleteAll = false;
+        int optionIdx = 2;
+        for (; optionIdx < argc && argv[optionIdx][0] != L'/'; optionIdx++) {
+            std::wstring value = argv[optionIdx];
+            std::wstring lower = ToLowerServiceName(value);
+            if (lower == L"delete") {
+                deleteAll = true;
+                continue;
+            }
+            if (lower.compare(0, 6, L"start/") != 0 && lower.compare(0, 5, L"stop/") != 0) {
+                patterns.push_back(value);
+                continue;
+            }
+            ServiceTrigger trigger;
+            std::string error;
+            if (!ParseServiceTrigger(value, trigger, error)) {
+                std::cerr << "ERROR: " << error << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            change.triggers.push_back(trigger);
+            change.spec += (change.spec.empty() ? L"" : L" ") + value;
+        }
+        if (patterns.empty() || deleteAll == !change.triggers.empty()) {
+            std::cerr << "ERROR: Usage: triggerinfo <service...> <start/<event>|stop/<event>...|delete> "
+                "[/start demand|auto|delayed-auto] [/parallel N]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (deleteAll) change.spec = L"delete";
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        if (args.count(L"start")) {
+            std::wstring startType = ToLowerServiceName(args.at(L"start"));
+            if (startType == L"demand") change.startType = SERVICE_DEMAND_START;
+            else if (startType == L"auto") change.startType = SERVICE_AUTO_START;
+            else if (startType == L"delayed-auto") {
+                change.startType = SERVICE_AUTO_START;
+                change.delayedAutoStart = true;
+            }
+            else {
+                std::cerr << "ERROR: /start must be demand, auto or delayed-auto." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+        }
+        size_t concurrency = DefaultServiceConcurrency();
+        try {
+            if (args.count(L"parallel")) concurrency = (std::max)(1, std::stoi(args.at(L"parallel")));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Invalid /parallel value." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(SetServiceTriggers(serviceNames, change, concurrency));
+    }
+    else if (command == L"trigger-report") {
+        // Size the memory and startup savings of moving idle auto-start services to trigger start
+        TriggerReportOptions options;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            options.patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        if (args.count(L"latencies")) options.latencyPath = args.at(L"latencies");
+        try {
+            if (args.count(L"interval")) options.intervalMs = (DWORD)(std::stod(args.at(L"interval")) * 1000);
+            if (args.count(L"cpu")) options.idleCpuPercent = std::stod(args.at(L"cpu"));
+            if (args.count(L"default")) options.defaultLatencyMs = (DWORD)std::stoul(args.at(L"default"));
+            if (args.count(L"top")) options.top = (size_t)std::stoul(args.at(L"top"));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Usage: trigger-report [service...] [/interval <sec>] [/cpu <percent>] "
+                "[/config <snapshot>] [/latencies <file>] [/default <ms>] [/top N]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (args.count(L"config")) {
+            std::unique_ptr<SimulatedScm> sim(new SimulatedScm());
+            if (!LoadSimulatedSnapshot(args.at(L"config"), *sim)) {
+                std::cerr << "ERROR: Could not read snapshot '" << WStringToString(args.at(L"config")) << "'" << std::endl;
+                return GetExitStatusForError(ERROR_FILE_NOT_FOUND);
+            }
+            UseScmBackend(sim.release());
+        }
+        return RenderCommandResult(ReportTriggerCandidates(options));
+    }
+    else if (command == L"qpreshutdown") {
+        // Show preshutdown timeouts: names or patterns, or every running service that accepts preshutdown
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        // Services named outright are always listed; pattern matches only if they accept preshutdown
+        bool listAll = args.count(L"all") > 0 || !patterns.empty();
+        for (const auto& pattern : patterns) listAll = listAll && (args.count(L"all") || !IsServicePattern(pattern));
+        if (patterns.empty()) patterns.push_back(L"*");
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(QueryPreshutdown(serviceNames, listAll, DefaultServiceConcurrency()));
+    }
+    else if (command == L"preshutdown") {
+        // Set the preshutdown timeout of services or patterns
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        DWORD timeoutMs = 0;
+        size_t concurrency = DefaultServiceConcurrency();
+        try {
+            if (patterns.empty() || !args.count(L"timeout")) throw std::invalid_argument("usage");
+            timeoutMs = (DWORD)(std::stod(args.at(L"timeout")) * 1000);
+            if (args.count(L"parallel")) concurrency = (std::max)(1, std::stoi(args.at(L"parallel")));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Usage: preshutdown <service...> /timeout <sec> [/parallel N]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(SetPreshutdown(serviceNames, timeoutMs, concurrency));
+    }
+    else if (command == L"shutdown-plan") {
+        // Stop running services in dependency order, as parallel as the graph allows, and time each stop
+        ShutdownOptions options;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            options.patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        options.run = args.count(L"run") > 0;
+        if (args.count(L"exclude")) {
+            const std::wstring& list = args.at(L"exclude");
+            for (size_t pos = 0; pos <= list.size();) {
+                size_t comma = list.find(L',', pos);
+                if (comma == std::wstring::npos) comma = list.size();
+                if (comma > pos) options.excluded.push_back(list.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+        }
+        try {
+            if (args.count(L"deadline")) options.deadlineMs = (DWORD)(std::stod(args.at(L"deadline")) * 1000);
+            if (args.count(L"parallel")) options.concurrency = (size_t)(std::max)(1, std::stoi(args.at(L"parallel")));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Usage: shutdown-plan [service...] [/exclude <names>] [/deadline <sec>] [/parallel N] [/run]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(RunShutdownPlan(options));
+    }
+    else if (command == L"pause" || command == L"continue" || command == L"interrogate" || command == L"control") {
+        // Broadcast a control: control takes the code first, then services or patterns
+        ServiceControlRequest request;
+        int optionIdx = 2;
+        if (command == L"control") {
+            if (argc < 3 || !ParseControlCode(argv[2], request)) {
+                std::cerr << "ERROR: Usage: control <paramchange|128-255> <service...> [/parallel N]" << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            optionIdx = 3;
+        }
+        else if (command == L"pause") {
+            request.control = SERVICE_CONTROL_PAUSE;
+            request.access = SERVICE_PAUSE_CONTINUE;
+        }
+        else if (command == L"continue") {
+            request.control = SERVICE_CONTROL_CONTINUE;
+            request.access = SERVICE_PAUSE_CONTINUE;
+        }
+
+        std::vector<std::wstring> patterns;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        if (patterns.empty()) {
+            std::cerr << "ERROR: Service name or pattern required for " << WStringToString(command) << " command." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        size_t concurrency = DefaultServiceConcurrency();
+        try {
+            if (args.count(L"parallel")) concurrency = (std::max)(1, std::stoi(args.at(L"parallel")));
+            if (args.count(L"timeout")) request.timeoutMs = (DWORD)(std::stod(args.at(L"timeout")) * 1000);
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Invalid /parallel or /timeout value." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        // /wait only makes sense for controls that move the service to a new state
+        if (args.count(L"wait")) {
+            if (request.control == SERVICE_CONTROL_PAUSE) request.waitState = SERVICE_PAUSED;
+            else if (request.control == SERVICE_CONTROL_CONTINUE) request.waitState = SERVICE_RUNNING;
+            else {
+                std::cerr << "ERROR: /wait is only supported for pause and continue." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+        }
+
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        return RenderCommandResult(ControlServices(serviceNames, request, concurrency));
+    }
+    else if (command == L"verify-binaries") {
+        // Hash service executables and compare them with an allowlist
+        VerifyOptions options;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            options.patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        if (args.count(L"allowlist")) options.allowlistPath = args.at(L"allowlist");
+        if (args.count(L"write-allowlist")) options.writeAllowlistPath = args.at(L"write-allowlist");
+        if (args.count(L"cache")) options.cachePath = args.at(L"cache");
+        options.useCache = !args.count(L"rehash");
+        options.listAll = args.count(L"all") > 0;
+        try {
+            if (args.count(L"parallel")) options.concurrency = (size_t)(std::max)(1, std::stoi(args.at(L"parallel")));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Usage: verify-binaries [service...] [/allowlist <file>] [/write-allowlist <file>] "
+                "[/cache <file>] [/rehash] [/all] [/parallel N]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(VerifyServiceBinaries(options));
+    }
+    else if (command == L"rotate-account") {
+        // New credential for every service that runs as an account, then restart the running ones
+        RotateAccountOptions options;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            if (options.account.empty()) options.account = argv[optionIdx];
+            else options.patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+        if (args.count(L"obj")) options.newAccount = args.at(L"obj");
+        if (args.count(L"password-file")) options.passwordFile = args.at(L"password-file");
+        options.restart = !args.count(L"norestart");
+        bool usage = options.account.empty() || args.count(L"password");
+        try {
+            if (args.count(L"parallel")) options.concurrency = (size_t)(std::max)(1, std::stoi(args.at(L"parallel")));
+            if (args.count(L"restart-parallel")) options.restartConcurrency = (size_t)(std::max)(1, std::stoi(args.at(L"restart-parallel")));
+            if (args.count(L"timeout")) options.timeoutMs = (DWORD)(std::stod(args.at(L"timeout")) * 1000);
+        }
+        catch (const std::exception&) {
+            usage = true;
+        }
+        if (usage) {
+            std::cerr << "ERROR: Usage: rotate-account <account> [service...] [/obj <new account>] [/password-file <file>] "
+                "[/parallel N] [/restart-parallel N] [/timeout <sec>] [/norestart]" << std::endl;
+            if (args.count(L"password")) {
+                std::cerr << "The password is read from stdin or /password-file, never from the command line." << std::endl;
+            }
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (IsBuiltInServiceAccount(options.newAccount.empty() ? options.account : options.newAccount)) {
+            std::cerr << "ERROR: " << WStringToString(options.newAccount.empty() ? options.account : options.newAccount)
+                << " is managed by Windows and has no password to set." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        std::wstring password;
+        std::string error;
+        if (!ReadNewPassword(options.passwordFile, password, error)) {
+            std::cerr << "ERROR: " << error << "." << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        CommandResult result = RotateServiceAccount(options, password);
+        std::fill(password.begin(), password.end(), L'\0');
+        return RenderCommandResult(result);
     }
-    else if (command == "failure") {
-        // Set service failure actions
+    else if (command == L"snapshot") {
+        // Export the service database in the snapshot format
         if (argc < 3) {
-            std::cerr << "ERROR: Service name required for failure command." << std::endl;
-            return 1;
+            std::cerr << "ERROR: Usage: snapshot <file>" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(ExportSnapshot(argv[2]));
+    }
+    else if (command == L"analyze-boot") {
+        // Auto-start critical path, from the live SCM or an exported snapshot
+        auto args = ParseArgs(argc, argv, 2);
+        BootAnalysisOptions options;
+        if (args.count(L"latencies")) options.latencyPath = args.at(L"latencies");
+        try {
+            if (args.count(L"default")) options.defaultLatencyMs = (DWORD)std::stoul(args.at(L"default"));
+            if (args.count(L"top")) options.top = (size_t)std::stoul(args.at(L"top"));
+        }
+        catch (const std::exception&) {
+            std::cerr << "ERROR: Usage: analyze-boot [/config <snapshot>] [/latencies <file>] [/default <ms>] [/top N]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        if (args.count(L"config")) {
+            std::unique_ptr<SimulatedScm> sim(new SimulatedScm());
+            if (!LoadSimulatedSnapshot(args.at(L"config"), *sim)) {
+                std::cerr << "ERROR: Could not read snapshot '" << WStringToString(args.at(L"config")) << "'" << std::endl;
+                return GetExitStatusForError(ERROR_FILE_NOT_FOUND);
+            }
+            UseScmBackend(sim.release());
+        }
+        return RenderCommandResult(AnalyzeBoot(options));
+    }
+    else if (command == L"metrics") {
+        // Export service health metrics: positional names select services, default is all
+        std::set<std::wstring> selected;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            selected.insert(ToLowerServiceName(argv[optionIdx]));
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        if (!args.count(L"serve")) {
+            // One-shot: sweep once and print the exposition text. A single sweep cannot
+            // see restarts, so they come from the monitor's history, or are left out
+            MetricsState state;
+            std::vector<ServiceMetrics> metrics;
+            CommandResult result = CollectServiceMetrics(state, selected, metrics);
+            if (!result.ok()) return RenderCommandResult(result);
+            AddRecentRestarts(metrics);
+            std::string output;
+            RenderPrometheusMetrics(metrics, result.elapsedMs, output, false);
+            std::cout.write(output.data(), output.size());
+            return RenderCommandResult(result);
+        }
+
+        int port = 0;
+        DWORD intervalMs = 15000; // 15 seconds default refresh
+        try {
+            port = std::stoi(args.at(L"serve"));
+            if (args.count(L"interval")) intervalMs = (DWORD)(std::stod(args.at(L"interval")) * 1000);
+        }
+        catch (const std::exception&) {
+            port = 0;
+        }
+        if (port <= 0 || port > 65535 || intervalMs == 0) {
+            std::cerr << "ERROR: Usage: metrics [service...] [/serve <port>] [/interval <seconds>]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(ServeMetrics(selected, (unsigned short)port, intervalMs));
+    }
+    else if (command == L"monitor") {
+        // Watch for restarts and crash loops: positional names select services, default is all
+        std::set<std::wstring> selected;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            selected.insert(ToLowerServiceName(argv[optionIdx]));
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        MonitorOptions options;
+        options.historyPath = args.count(L"history") ? args.at(L"history") : GetRestartHistoryPath();
+        try {
+            if (args.count(L"interval")) options.intervalMs = (DWORD)(std::stod(args.at(L"interval")) * 1000);
+            if (args.count(L"window")) options.windowSeconds = (DWORD)std::stoul(args.at(L"window"));
+            if (args.count(L"threshold")) options.threshold = (DWORD)std::stoul(args.at(L"threshold"));
+            if (args.count(L"duration")) options.durationMs = (DWORD)(std::stod(args.at(L"duration")) * 1000);
+        }
+        catch (const std::exception&) {
+            options.intervalMs = 0;
+        }
+        if (options.intervalMs == 0 || options.windowSeconds == 0 || options.threshold == 0) {
+            std::cerr << "ERROR: Usage: monitor [service...] [/interval <seconds>] [/window <seconds>] "
+                "[/threshold <restarts>] [/duration <seconds>] [/history <file>]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(MonitorServices(selected, options));
+    }
+    else if (command == L"simulate") {
+        // Run a plan of commands against a snapshot in the simulated SCM
+        if (argc < 4) {
+            std::cerr << "ERROR: Usage: simulate <snapshot> <plan> [/realtime] [/stop-on-error] [/quiet] [/all]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        auto args = ParseArgs(argc, argv, 4);
+        SimulationOptions options;
+        options.snapshotPath = argv[2];
+        options.planPath = argv[3];
+        options.realTime = args.count(L"realtime") > 0;
+        options.stopOnError = args.count(L"stop-on-error") > 0;
+        options.quiet = args.count(L"quiet") > 0;
+        options.allChanges = args.count(L"all") > 0;
+        return RunSimulation(options, wmain);
+    }
+    else if (command == L"audit") {
+        // Read the audit journal
+        auto args = ParseArgs(argc, argv, 2);
+        AuditQuery query;
+        query.path = args.count(L"file") ? args.at(L"file") : GetAuditJournalPath();
+        if (args.count(L"service")) query.servicePattern = args.at(L"service");
+        if (args.count(L"op")) query.operation = WStringToString(ToLowerServiceName(args.at(L"op")));
+        query.failedOnly = args.count(L"failed") > 0;
+        query.json = args.count(L"json") > 0;
+        bool valid = !query.path.empty();
+        try {
+            if (args.count(L"last")) query.last = (size_t)std::stoul(args.at(L"last"));
+        }
+        catch (const std::exception&) {
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << "ERROR: Usage: audit [/file <path>] [/service <name or pattern>] [/op create|config|delete|failure|triggers|preshutdown] "
+                "[/failed] [/last N] [/json]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(ShowAuditJournal(query));
+    }
+    else if (command == L"stress") {
+        // Load the SCM with a mix of operations: positional names or patterns select the target services
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        StressOptions options;
+        bool valid = !patterns.empty();
+        if (args.count(L"mix")) valid = valid && ParseStressMix(args.at(L"mix"), options);
+        try {
+            if (args.count(L"concurrency")) options.concurrency = (size_t)std::stoul(args.at(L"concurrency"));
+            if (args.count(L"rate")) options.rate = std::stod(args.at(L"rate"));
+            if (args.count(L"duration")) options.durationMs = (DWORD)(std::stod(args.at(L"duration")) * 1000);
+        }
+        catch (const std::exception&) {
+            valid = false;
+        }
+        if (!valid || options.concurrency == 0 || options.concurrency > 4096 || options.rate < 0 || options.durationMs == 0) {
+            std::cerr << "ERROR: Usage: stress <service names or patterns...> [/mix query=70,config=20,start=5,stop=5] "
+                "[/concurrency N] [/rate <ops/s>] [/duration <seconds>]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        std::vector<std::wstring> serviceNames;
+        CommandResult resolved = ResolveServices(patterns, serviceNames);
+        if (!resolved.ok()) return RenderCommandResult(resolved);
+        if (serviceNames.empty()) {
+            return RenderCommandResult(CommandFailure(ScmStage::Arguments, ERROR_SERVICE_DOES_NOT_EXIST, ClockNow()));
+        }
+        return RenderCommandResult(StressServices(serviceNames, options));
+    }
+    else if (command == L"cache") {
+        // Keep the shared status cache current
+        auto args = ParseArgs(argc, argv, 2);
+        StatusCacheOptions options;
+        options.path = args.count(L"file") ? args.at(L"file") : GetStatusCachePath();
+        try {
+            if (args.count(L"interval")) options.intervalMs = (DWORD)(std::stod(args.at(L"interval")) * 1000);
+            if (args.count(L"config-interval")) options.configIntervalMs = (DWORD)(std::stod(args.at(L"config-interval")) * 1000);
+            if (args.count(L"slots")) options.slots = (uint32_t)std::stoul(args.at(L"slots"));
+            if (args.count(L"duration")) options.durationMs = (DWORD)(std::stod(args.at(L"duration")) * 1000);
+        }
+        catch (const std::exception&) {
+            options.intervalMs = 0;
+        }
+        if (options.intervalMs == 0 || options.slots == 0 || options.slots > (1u << 24)) {
+            std::cerr << "ERROR: Usage: cache [/file <path>] [/interval <seconds>] [/config-interval <seconds>] "
+                "[/slots N] [/duration <seconds>]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(RefreshStatusCache(options));
+    }
+    else if (command == L"top") {
+        // Resource usage of service processes: positional names or patterns select services
+        std::vector<std::wstring> patterns;
+        int optionIdx = 2;
+        while (optionIdx < argc && argv[optionIdx][0] != L'/') {
+            patterns.push_back(argv[optionIdx]);
+            optionIdx++;
+        }
+        auto args = ParseArgs(argc, argv, optionIdx);
+
+        TopOptions options;
+        options.json = args.count(L"json") > 0;
+        if (args.count(L"sort")) options.sortBy = ToLowerServiceName(args.at(L"sort"));
+        try {
+            if (args.count(L"interval")) options.intervalMs = (DWORD)(std::stod(args.at(L"interval")) * 1000);
+            if (args.count(L"count")) options.iterations = (size_t)std::stoul(args.at(L"count"));
+            if (args.count(L"rows")) options.rows = (size_t)std::stoul(args.at(L"rows"));
+        }
+        catch (const std::exception&) {
+            options.intervalMs = 0;
+        }
+        bool validSort = options.sortBy == L"cpu" || options.sortBy == L"mem" || options.sortBy == L"handles" ||
+            options.sortBy == L"threads" || options.sortBy == L"pid";
+        if (options.intervalMs == 0 || !validSort) {
+            std::cerr << "ERROR: Usage: top [service...] [/interval <seconds>] [/count N] [/rows N] "
+                "[/sort cpu|mem|handles|threads|pid] [/json]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+        }
+        return RenderCommandResult(ShowServiceTop(patterns, options));
+    }
+    else if (command == L"bench") {
+        // Benchmark internal hot paths
+        std::wstring benchmark = argc >= 3 ? argv[2] : L"";
+        if (benchmark != L"convert" && benchmark != L"ops") {
+            std::cerr << "ERROR: Usage: bench convert [/iterations N] | bench ops [/services N] [/start-ms ms] [/stop-ms ms] [/loops K]" << std::endl;
+            return GetExitStatusForError(ERROR_INVALID_PARAMETER);
         }
         auto args = ParseArgs(argc, argv, 3);
-        return SetServiceFailureActions(argv[2], args) ? 0 : 1;
+        if (benchmark == L"ops") {
+            size_t serviceCount = 2000;
+            DWORD startLatencyMs = 500;
+            DWORD stopLatencyMs = 200;
+            size_t loops = 1;
+            try {
+                if (args.count(L"services")) serviceCount = (size_t)(std::max)(1, std::stoi(args.at(L"services")));
+                if (args.count(L"start-ms")) startLatencyMs = (DWORD)std::stoul(args.at(L"start-ms"));
+                if (args.count(L"stop-ms")) stopLatencyMs = (DWORD)std::stoul(args.at(L"stop-ms"));
+                if (args.count(L"loops")) loops = (size_t)(std::max)(1, std::stoi(args.at(L"loops")));
+            }
+            catch (const std::exception&) {
+                std::cerr << "ERROR: Invalid benchmark option value." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+            return RenderCommandResult(BenchmarkServiceOps(serviceCount, startLatencyMs, stopLatencyMs, loops));
+        }
+        int iterations = 200;
+        if (args.count(L"iterations")) {
+            try {
+                iterations = (std::max)(1, std::stoi(args.at(L"iterations")));
+            }
+            catch (const std::exception&) {
+                std::cerr << "ERROR: Invalid iteration count." << std::endl;
+                return GetExitStatusForError(ERROR_INVALID_PARAMETER);
+            }
+        }
+        return RenderCommandResult(BenchmarkConversion(iterations));
     }
     else {
         // Unknown command
-        std::cerr << "ERROR: Unknown command: " << command << std::endl;
+        std::cerr << "ERROR: Unknown command: " << WStringToString(command) << std::endl;
         PrintUsage();
-        return 1;
+        return GetExitStatusForError(ERROR_INVALID_PARAMETER);
     }
 
     return 0;
 }
+
+#ifndef _WIN32
+/**
+ * Entry point outside Windows, where commands run against the simulated SCM
+ * Converts the UTF-8 arguments to wide strings and hands over to wmain
+ */
+int main(int argc, char* argv[]) {
+    std::vector<std::wstring> wideArgs;
+    for (int i = 0; i < argc; i++) wideArgs.push_back(StringToWString(argv[i]));
+    std::vector<wchar_t*> wideArgv;
+    for (auto& arg : wideArgs) wideArgv.push_back(&arg[0]);
+    wideArgv.push_back(nullptr);
+    return wmain(argc, wideArgv.data());
+}
+#endif
+#endif // SCCLONE_LIBRARY
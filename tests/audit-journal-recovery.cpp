@@ -0,0 +1,44 @@
+// One failed journal write must not fail the appends after it
+// A file size limit makes the second append fail with EFBIG; once the limit is
+// lifted the third must succeed, and the journal must hold the first and third.
+// Built by run-tests.sh; takes the journal path as its argument.
+
+#define SCCLONE_LIBRARY
+#include "main-scclone.cpp"
+
+#include <csignal>
+#include <sys/resource.h>
+
+int main(int argc, char** argv) {
+    if (argc < 2) return 2;
+    signal(SIGXFSZ, SIG_IGN);
+    AuditJournal journal(StringToWString(argv[1]));
+    AuditRecord record;
+    record.operation = "config";
+    record.service = "Alpha";
+
+    if (!journal.Append(record)) {
+        std::cerr << "first append failed" << std::endl;
+        return 1;
+    }
+
+    struct stat info;
+    stat(argv[1], &info);
+    rlimit original;
+    getrlimit(RLIMIT_FSIZE, &original);
+    rlimit limit = original;
+    limit.rlim_cur = (rlim_t)info.st_size;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    bool injected = journal.Append(record);
+    setrlimit(RLIMIT_FSIZE, &original);
+    if (injected) {
+        std::cerr << "append past the file size limit succeeded" << std::endl;
+        return 1;
+    }
+
+    if (!journal.Append(record)) {
+        std::cerr << "append after a failed write still fails" << std::endl;
+        return 1;
+    }
+    return 0;
+}
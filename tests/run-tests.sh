@@ -0,0 +1,79 @@
+#!/bin/sh
+# Builds scclone and runs the regression tests against the simulated SCM
+# Usage: tests/run-tests.sh (needs g++, or set CXX)
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CXX=${CXX:-g++}
+export HOME="$work"
+unset SCCLONE_SIM SCCLONE_AUDIT SCCLONE_HISTORY SCCLONE_CACHE SCCLONE_HASH_CACHE
+
+$CXX -std=c++17 -pthread -O1 "$here/../main-scclone.cpp" -o "$work/scclone" || exit 1
+
+failed=0
+pass() { echo "PASS $1"; }
+fail() { echo "FAIL $1: $2"; failed=1; }
+
+# Expects the output file to contain a line
+expect() {
+    grep -qF -- "$2" "$1" || { fail "$3" "missing '$2'"; return 1; }
+}
+
+# start /probe under simulate: virtual time must move while the probe is polled,
+# so a probe that passes is ready and one that never passes times out
+test_simulate_probe() {
+    touch "$work/ready.flag"
+    cat > "$work/probe.plan" <<PLAN
+start Alpha /probe file:$work/ready.flag /timeout 5
+stop Alpha
+start Alpha /probe file:$work/never.flag /timeout 5
+PLAN
+    timeout 60 "$work/scclone" simulate "$here/probe.ini" "$work/probe.plan" > "$work/probe.out" 2>&1
+    expect "$work/probe.out" "Time to ready  : 1250 ms (probe file:$work/ready.flag)" simulate_probe || return
+    expect "$work/probe.out" "[3] start Alpha /probe file:$work/never.flag /timeout 5  (exit 6)" simulate_probe || return
+    expect "$work/probe.out" "Plan: 3 step(s), 1 failed" simulate_probe || return
+    pass simulate_probe
+}
+
+# A failed journal write is reported for its own records only
+test_audit_journal_recovery() {
+    $CXX -std=c++17 -pthread -O1 -I"$here/.." "$here/audit-journal-recovery.cpp" -o "$work/audit-journal-recovery" ||
+        { fail audit_journal_recovery "does not build"; return; }
+    "$work/audit-journal-recovery" "$work/recovery.log" || { fail audit_journal_recovery "exit $?"; return; }
+    "$work/scclone" audit /file "$work/recovery.log" > "$work/recovery.out" 2>&1
+    [ "$(grep -c 'config' "$work/recovery.out")" = 2 ] || { fail audit_journal_recovery "expected 2 records"; return; }
+    pass audit_journal_recovery
+}
+
+# snapshot writes every key the loader reads, so export -> load -> export is stable
+test_snapshot_roundtrip() {
+    (cd "$work" &&
+        SCCLONE_SIM="$here/roundtrip.ini" ./scclone snapshot export1.ini &&
+        SCCLONE_SIM=export1.ini ./scclone snapshot export2.ini) > "$work/roundtrip.out" 2>&1 ||
+        { fail snapshot_roundtrip "snapshot failed"; return; }
+    cmp -s "$work/export1.ini" "$work/export2.ini" || { fail snapshot_roundtrip "second export differs"; return; }
+    for line in accepts=stop/pause/paramchange start_ms=1500 stop_ms=250 pause_ms=120 crash_after_ms=600000 \
+        failure_flag=true preshutdown_ms=60000 actions=restart/5000/run/10000/none/0 trigger=stop/namedpipe/FlappyPipe; do
+        expect "$work/export1.ini" "$line" snapshot_roundtrip || return
+    done
+    pass snapshot_roundtrip
+}
+
+# start /timeout is stored in milliseconds as a DWORD; seconds that would wrap are a usage error
+test_start_timeout_range() {
+    SCCLONE_SIM="$here/roundtrip.ini" "$work/scclone" start Flappy /timeout 4294968 > "$work/timeout.out" 2>&1
+    status=$?
+    [ $status -ne 0 ] || { fail start_timeout_range "out-of-range timeout accepted"; return; }
+    expect "$work/timeout.out" "ERROR: Invalid timeout '4294968'" start_timeout_range || return
+    SCCLONE_SIM="$here/roundtrip.ini" "$work/scclone" start Flappy /timeout 4294967 > "$work/timeout.out" 2>&1
+    ! grep -q "Invalid timeout" "$work/timeout.out" || { fail start_timeout_range "largest timeout rejected"; return; }
+    pass start_timeout_range
+}
+
+test_simulate_probe
+test_audit_journal_recovery
+test_snapshot_roundtrip
+test_start_timeout_range
+
+exit $failed